@@ -1,34 +1,167 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "fs.h"
 #include "disk.h"
+#include "aio.h"
+
+#define COPY_CHUNK_SIZE (16 * BLOCK_SIZE) // bytes moved per fs_read call, so whole runs of blocks are read at once
+#define COPY_THREADS 4                    // host files copy_in_tree reads in parallel
+#define COPY_QUEUE_SIZE 64                // files copy_in_tree queues for its readers at most
+#define COPY_PATH_SIZE 1024               // longest path copy_in_tree handles, on either side
 
 char LINE[1024];
 char COMMAND[1024];
 char ARG_1[1024];
 char ARG_2[1024];
+int COPY_FLAGS = FS_O_CREATE; // fs_open flags of the files copy_in and copy_in_tree write
+
+/**
+ * @brief A file copy_in_tree has found and one of its readers will copy.
+ */
+struct copy_job
+{
+    char local_path[COPY_PATH_SIZE];
+    char fs_path[COPY_PATH_SIZE];
+};
+
+/**
+ * @brief The files copy_in_tree has found but not copied yet, shared by the walk and the readers.
+ *
+ * @param jobs Ring of queued files.
+ * @param head Index of the oldest queued file.
+ * @param count Number of queued files.
+ * @param finished Set once the walk is over, so idle readers exit.
+ * @param copied Number of files copied.
+ * @param failed Number of files that could not be copied.
+ */
+struct copy_queue
+{
+    struct copy_job jobs[COPY_QUEUE_SIZE];
+    int head;
+    int count;
+    bool finished;
+    int copied;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+/**
+ * @brief One of the two buffers copy_in moves a file through.
+ *
+ * @param data COPY_CHUNK_SIZE bytes.
+ * @param length Number of bytes read into data, 0 at the end of the file, -1 if the read failed.
+ * @param full Set by the reader once data is filled, cleared by the writer once it has been written.
+ */
+struct copy_buffer
+{
+    char *data;
+    ssize_t length;
+    bool full;
+};
+
+/**
+ * @brief A host file copy_in is streaming into the FS, shared by the writer and its reader thread.
+ *
+ * @param local_fd The host file.
+ * @param buffers The buffers, used in turn.
+ * @param stopped Set by the writer to stop the reader early.
+ */
+struct copy_stream
+{
+    int local_fd;
+    struct copy_buffer buffers[2];
+    bool stopped;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
 
 int copy_in(char *local_path, char *fs_path);
+int copy_in_tree(char *local_dir, char *fs_dir);
 int copy_out(char *fs_path, char *local_path);
 
 
 int main(int argc, char *argv[])
 {
-    // Usage: ./shell <disk> <number-of-blocks>
-    if (argc != 3)
+    // Usage: ./shell <disk> <number-of-blocks> [mmap] [sparse] [uring|threads|sync] [qd=<n>] [compress] [dedup] [checksums]
+    if (argc < 3)
     {
-        printf("Usage: ./shell <disk> <number-of-blocks>\n");
+        printf("Usage: ./shell <disk> <number-of-blocks> [mmap] [sparse] [uring|threads|sync] [qd=<n>] [compress] [dedup] [checksums]\n");
         return -1;
     }
 
+    // Pick the disk backend, how a new image is provisioned, how asynchronous I/O is carried out, whether copied files
+    // are compressed or deduplicated and whether a formatted disk keeps block checksums.
+    int disk_flags = 0;
+    int aio_backend = AIO_BACKEND_AUTO;
+    int queue_depth = AIO_DEFAULT_QUEUE_DEPTH;
+    int format_flags = 0;
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "mmap") == 0)
+        {
+            disk_flags |= DISK_MMAP;
+        }
+        else if (strcmp(argv[i], "sparse") == 0)
+        {
+            disk_flags |= DISK_SPARSE;
+        }
+        else if (strcmp(argv[i], "uring") == 0)
+        {
+            aio_backend = AIO_BACKEND_IO_URING;
+        }
+        else if (strcmp(argv[i], "threads") == 0)
+        {
+            aio_backend = AIO_BACKEND_THREADS;
+        }
+        else if (strcmp(argv[i], "sync") == 0)
+        {
+            aio_backend = AIO_BACKEND_SYNC;
+        }
+        else if (strncmp(argv[i], "qd=", 3) == 0 && atoi(argv[i] + 3) > 0)
+        {
+            queue_depth = atoi(argv[i] + 3);
+        }
+        else if (strcmp(argv[i], "compress") == 0)
+        {
+            COPY_FLAGS |= FS_O_COMPRESS;
+        }
+        else if (strcmp(argv[i], "dedup") == 0)
+        {
+            COPY_FLAGS |= FS_O_DEDUP;
+        }
+        else if (strcmp(argv[i], "checksums") == 0)
+        {
+            format_flags |= FS_FORMAT_CHECKSUMS;
+        }
+        else
+        {
+            printf("Usage: ./shell <disk> <number-of-blocks> [mmap] [sparse] [uring|threads|sync] [qd=<n>] [compress] [dedup] [checksums]\n");
+            return -1;
+        }
+    }
+
     // Initialize the disk.
-    if (disk_init(argv[1], atoi(argv[2])) == -1)
+    if (disk_open(argv[1], atoi(argv[2]), disk_flags) == -1)
     {
         printf("ERROR: Could not initialize disk.\n");
         return -1;
     }
+    if (aio_init(aio_backend, queue_depth) == -1)
+    {
+        printf("ERROR: Could not initialize asynchronous I/O.\n");
+        disk_close();
+        return -1;
+    }
 
     // Print init message.
     printf("Disk Initialized.\n");
@@ -36,6 +169,7 @@ int main(int argc, char *argv[])
     printf("Blocks: %d\n", disk_size());
 
     // Begin shell.
+    int mounted = 0;
     while (1)
     {
         printf("$ ");
@@ -81,7 +215,10 @@ int main(int argc, char *argv[])
             printf("    cat <path>\n");
             printf("    delete <path>\n");
             printf("    copy_in <local_path> <fs_path>\n");
+            printf("    copy_in_tree <local_dir> <fs_dir>\n");
             printf("    copy_out <fs_path> <local_path>\n");
+            printf("    clone <fs_path> <fs_path>\n");
+            printf("    snapshot <fs_path> <fs_path>\n");
         }
         else if (strcmp(COMMAND, "format") == 0)
         {
@@ -93,7 +230,7 @@ int main(int argc, char *argv[])
 
             printf("Formatting disk...\n");
             
-            if (fs_format() == -1)
+            if (fs_format(format_flags) == -1)
             {
                 printf("ERROR: Could not format disk.\n");
                 continue;
@@ -118,6 +255,7 @@ int main(int argc, char *argv[])
                 continue;
             }
 
+            mounted = 1;
             printf("Disk mounted successfully.\n");
         }
         else if (strcmp(COMMAND, "stat") == 0)
@@ -180,6 +318,20 @@ int main(int argc, char *argv[])
                 continue;
             }
         }
+        else if (strcmp(COMMAND, "copy_in_tree") == 0)
+        {
+            if (args != 3)
+            {
+                printf("ERROR: Invalid arguments.\n");
+                continue;
+            }
+
+            if (copy_in_tree(ARG_1, ARG_2))
+            {
+                printf("ERROR: Could not copy directory tree.\n");
+                continue;
+            }
+        }
         else if (strcmp(COMMAND, "copy_out") == 0)
         {
             if (args != 3)
@@ -194,6 +346,34 @@ int main(int argc, char *argv[])
                 continue;
             }
         }
+        else if (strcmp(COMMAND, "clone") == 0)
+        {
+            if (args != 3)
+            {
+                printf("ERROR: Invalid arguments.\n");
+                continue;
+            }
+
+            if (fs_clone(ARG_1, ARG_2) == -1)
+            {
+                printf("ERROR: Could not clone file.\n");
+                continue;
+            }
+        }
+        else if (strcmp(COMMAND, "snapshot") == 0)
+        {
+            if (args != 3)
+            {
+                printf("ERROR: Invalid arguments.\n");
+                continue;
+            }
+
+            if (fs_snapshot(ARG_1, ARG_2) == -1)
+            {
+                printf("ERROR: Could not take snapshot.\n");
+                continue;
+            }
+        }
         else 
         {
             printf("ERROR: Invalid command.\n");
@@ -205,6 +385,12 @@ int main(int argc, char *argv[])
     // Print exit message.
     printf("Exiting...\n");
 
+    // Commit the journal and write everything back before the disk goes away.
+    if (mounted)
+    {
+        fs_unmount();
+    }
+
     // Close the disk.
     if (disk_close() == -1)
     {
@@ -214,55 +400,401 @@ int main(int argc, char *argv[])
     return 0;
 }
 
+/**
+ * Reads a host file into the buffers of a stream one chunk at a time, handing each to the writer once it is full and
+ * waiting while the writer still holds the other one. Runs on its own thread.
+ */
+static void *stream_reader(void *arg)
+{
+    struct copy_stream *stream = arg;
+
+    for (int i = 0;; i ^= 1)
+    {
+        struct copy_buffer *buffer = &stream->buffers[i];
+
+        pthread_mutex_lock(&stream->lock);
+        while (buffer->full && !stream->stopped)
+        {
+            pthread_cond_wait(&stream->changed, &stream->lock);
+        }
+        bool stopped = stream->stopped;
+        pthread_mutex_unlock(&stream->lock);
+        if (stopped)
+        {
+            break;
+        }
+
+        // Fill the whole chunk, so short reads (e.g. from a pipe) do not turn into short writes.
+        ssize_t length = 0;
+        while (length < COPY_CHUNK_SIZE)
+        {
+            ssize_t bytes_read = read(stream->local_fd, buffer->data + length, COPY_CHUNK_SIZE - length);
+            if (bytes_read <= 0)
+            {
+                if (bytes_read == -1)
+                {
+                    length = -1;
+                }
+                break;
+            }
+            length += bytes_read;
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        buffer->length = length;
+        buffer->full = true;
+        pthread_cond_broadcast(&stream->changed);
+        pthread_mutex_unlock(&stream->lock);
+
+        // A short chunk is the last one.
+        if (length < COPY_CHUNK_SIZE)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Copies an open host file into the FS file at fs_path (created if needed) with two buffers: a reader thread fills one
+ * while the other is written, so reading the host file overlaps writing the FS file. Memory use does not depend on the
+ * size of the file.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int stream_in_overlapped(int local_fd, char *fs_path)
+{
+    struct copy_stream stream = {.local_fd = local_fd, .stopped = false};
+    stream.buffers[0].data = malloc(COPY_CHUNK_SIZE);
+    stream.buffers[1].data = malloc(COPY_CHUNK_SIZE);
+    if (stream.buffers[0].data == NULL || stream.buffers[1].data == NULL)
+    {
+        free(stream.buffers[0].data);
+        free(stream.buffers[1].data);
+        return -1;
+    }
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+
+    int fd = fs_open(fs_path, COPY_FLAGS);
+    pthread_t reader;
+    if (fd == -1 || pthread_create(&reader, NULL, stream_reader, &stream) != 0)
+    {
+        if (fd != -1)
+        {
+            fs_close(fd);
+        }
+        pthread_cond_destroy(&stream.changed);
+        pthread_mutex_destroy(&stream.lock);
+        free(stream.buffers[0].data);
+        free(stream.buffers[1].data);
+        return -1;
+    }
+
+    int result = 0;
+    off_t offset = 0;
+    for (int i = 0;; i ^= 1)
+    {
+        struct copy_buffer *buffer = &stream.buffers[i];
+
+        // Wait for the reader to fill the buffer.
+        pthread_mutex_lock(&stream.lock);
+        while (!buffer->full)
+        {
+            pthread_cond_wait(&stream.changed, &stream.lock);
+        }
+        pthread_mutex_unlock(&stream.lock);
+
+        if (buffer->length == -1 ||
+            (buffer->length > 0 && fs_pwrite(fd, buffer->data, buffer->length, offset) != buffer->length))
+        {
+            result = -1;
+            break;
+        }
+        offset += buffer->length;
+        if (buffer->length < COPY_CHUNK_SIZE)
+        {
+            break;
+        }
+
+        // Hand the buffer back to the reader.
+        pthread_mutex_lock(&stream.lock);
+        buffer->full = false;
+        pthread_cond_broadcast(&stream.changed);
+        pthread_mutex_unlock(&stream.lock);
+    }
+
+    // Stop the reader if the copy was cut short.
+    pthread_mutex_lock(&stream.lock);
+    stream.stopped = true;
+    pthread_cond_broadcast(&stream.changed);
+    pthread_mutex_unlock(&stream.lock);
+    pthread_join(reader, NULL);
+
+    if (fs_close(fd) == -1)
+    {
+        result = -1;
+    }
+    pthread_cond_destroy(&stream.changed);
+    pthread_mutex_destroy(&stream.lock);
+    free(stream.buffers[0].data);
+    free(stream.buffers[1].data);
+    return result;
+}
+
 int copy_in(char *local_path, char *fs_path)
 {
     // Open the local file.
-    FILE *local_file = fopen(local_path, "r");
+    int local_fd = open(local_path, O_RDONLY);
 
-    if (local_file == NULL)
+    if (local_fd == -1)
     {
         printf("ERROR: Could not open local file.\n");
         return -1;
     }
 
-    // Get the size of the local file.
-    fseek(local_file, 0, SEEK_END);
-    int local_file_size = ftell(local_file);
-    fseek(local_file, 0, SEEK_SET);
+    // Stream the local file into the FS file.
+    int result = stream_in_overlapped(local_fd, fs_path);
 
-    // Allocate a buffer for the local file.
-    char *local_file_buffer = calloc(local_file_size, sizeof(char));
+    if (result == -1)
+    {
+        printf("ERROR: Could not write local file to FS file.\n");
+    }
 
-    if (local_file_buffer == NULL)
+    // Close the local file.
+    if (close(local_fd) == -1)
     {
-        printf("ERROR: Could not allocate buffer for local file.\n");
+        printf("ERROR: Could not close local file.\n");
         return -1;
     }
-    // Read the local file into the buffer.
-    if ((int)fread(local_file_buffer, sizeof(char), local_file_size, local_file) != local_file_size)
+
+    return result;
+}
+
+/**
+ * Copies an open host file into the FS file at fs_path (created if needed) one chunk at a time.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int stream_in(int local_fd, char *fs_path, char *buffer)
+{
+    int fd = fs_open(fs_path, COPY_FLAGS);
+    if (fd == -1)
     {
-        printf("ERROR: Could not read local file into buffer.\n");
         return -1;
     }
 
-    // Close the local file.
-    if (fclose(local_file) == EOF)
+    off_t offset = 0;
+    while (1)
     {
-        printf("ERROR: Could not close local file.\n");
+        ssize_t bytes_read = read(local_fd, buffer, COPY_CHUNK_SIZE);
+        if (bytes_read == -1)
+        {
+            fs_close(fd);
+            return -1;
+        }
+        if (bytes_read == 0)
+        {
+            break;
+        }
+
+        if (fs_pwrite(fd, buffer, bytes_read, offset) != bytes_read)
+        {
+            fs_close(fd);
+            return -1;
+        }
+        offset += bytes_read;
+    }
+
+    return fs_close(fd);
+}
+
+/**
+ * Takes files off the queue and copies them until the walk is over and the queue is empty. Runs on a reader thread.
+ */
+static void *copy_worker(void *arg)
+{
+    struct copy_queue *queue = arg;
+    char *buffer = malloc(COPY_CHUNK_SIZE);
+
+    pthread_mutex_lock(&queue->lock);
+    while (1)
+    {
+        while (queue->count == 0 && !queue->finished)
+        {
+            pthread_cond_wait(&queue->not_empty, &queue->lock);
+        }
+        if (queue->count == 0)
+        {
+            break;
+        }
+
+        // Take the oldest file and copy it without holding the queue.
+        struct copy_job job = queue->jobs[queue->head];
+        queue->head = (queue->head + 1) % COPY_QUEUE_SIZE;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
+
+        int result = -1;
+        int local_fd = buffer == NULL ? -1 : open(job.local_path, O_RDONLY);
+        if (local_fd != -1)
+        {
+            result = stream_in(local_fd, job.fs_path, buffer);
+            close(local_fd);
+        }
+        if (result == -1)
+        {
+            printf("ERROR: Could not copy %s to %s.\n", job.local_path, job.fs_path);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        if (result == -1)
+        {
+            queue->failed++;
+        }
+        else
+        {
+            queue->copied++;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Queues every regular file below a host directory for the readers, waiting while the queue is full. Directories are
+ * created by the files inside them; empty ones are created here. Other entries (e.g. symbolic links) are skipped.
+ *
+ * @return 0 on success, -1 if part of the tree could not be walked.
+ */
+static int walk_tree(struct copy_queue *queue, char *local_dir, char *fs_dir)
+{
+    DIR *dir = opendir(local_dir);
+    if (dir == NULL)
+    {
+        printf("ERROR: Could not open local directory %s.\n", local_dir);
         return -1;
     }
 
-    // Write the local file buffer to the FS file.
-    if (fs_write(fs_path, local_file_buffer, local_file_size, 0) == -1)
+    int result = 0;
+    bool empty = true;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        // Join the entry name onto both paths, without doubling the slash of the FS root.
+        struct copy_job job;
+        const char *separator = fs_dir[strlen(fs_dir) - 1] == '/' ? "" : "/";
+        if (snprintf(job.local_path, COPY_PATH_SIZE, "%s/%s", local_dir, entry->d_name) >= COPY_PATH_SIZE ||
+            snprintf(job.fs_path, COPY_PATH_SIZE, "%s%s%s", fs_dir, separator, entry->d_name) >= COPY_PATH_SIZE)
+        {
+            printf("ERROR: Path too long: %s/%s.\n", local_dir, entry->d_name);
+            result = -1;
+            continue;
+        }
+
+        struct stat info;
+        if (lstat(job.local_path, &info) == -1)
+        {
+            printf("ERROR: Could not stat local file %s.\n", job.local_path);
+            result = -1;
+            continue;
+        }
+
+        if (S_ISDIR(info.st_mode))
+        {
+            empty = false;
+            if (walk_tree(queue, job.local_path, job.fs_path) == -1)
+            {
+                result = -1;
+            }
+        }
+        else if (S_ISREG(info.st_mode))
+        {
+            empty = false;
+            pthread_mutex_lock(&queue->lock);
+            while (queue->count == COPY_QUEUE_SIZE)
+            {
+                pthread_cond_wait(&queue->not_full, &queue->lock);
+            }
+            queue->jobs[(queue->head + queue->count) % COPY_QUEUE_SIZE] = job;
+            queue->count++;
+            pthread_cond_signal(&queue->not_empty);
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+    closedir(dir);
+
+    // Nothing inside will create the directory, so create it now.
+    if (empty && strcmp(fs_dir, "/") != 0 && fs_create(fs_dir, 1) == -1)
+    {
+        result = -1;
+    }
+    return result;
+}
+
+int copy_in_tree(char *local_dir, char *fs_dir)
+{
+    struct copy_queue *queue = calloc(1, sizeof(struct copy_queue));
+    if (queue == NULL)
     {
-        printf("ERROR: Could not write local file buffer to FS file.\n");
+        printf("ERROR: Could not allocate copy queue.\n");
         return -1;
     }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    // Start the readers. The file system is thread safe, so their writes run side by side and their metadata updates
+    // are batched into the same journal commits.
+    pthread_t threads[COPY_THREADS];
+    int nthreads = 0;
+    while (nthreads < COPY_THREADS && pthread_create(&threads[nthreads], NULL, copy_worker, queue) == 0)
+    {
+        nthreads++;
+    }
 
-    // Free the local file buffer.
-    free(local_file_buffer);
+    int result = -1;
+    if (nthreads == 0)
+    {
+        printf("ERROR: Could not start reader threads.\n");
+    }
+    else
+    {
+        result = walk_tree(queue, local_dir, fs_dir);
+    }
 
-    return 0;
+    // Let the readers drain the queue and exit.
+    pthread_mutex_lock(&queue->lock);
+    queue->finished = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (nthreads > 0)
+    {
+        printf("Copied %d files.\n", queue->copied);
+    }
+    if (queue->failed > 0)
+    {
+        result = -1;
+    }
+
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+    return result;
 }
 
 int copy_out(char *fs_path, char *local_path)
@@ -277,7 +809,7 @@ int copy_out(char *fs_path, char *local_path)
     }
 
     // Create a buffer for the FS file.
-    char *fs_file_buffer = calloc(BLOCK_SIZE, sizeof(char));
+    char *fs_file_buffer = calloc(COPY_CHUNK_SIZE, sizeof(char));
 
     if (fs_file_buffer == NULL)
     {
@@ -285,15 +817,25 @@ int copy_out(char *fs_path, char *local_path)
         return -1;
     }
 
+    // Open the FS file once, so the chunks below do not resolve the path again.
+    int fd = fs_open(fs_path, 0);
+
+    if (fd == -1)
+    {
+        printf("ERROR: Could not read FS file into buffer.\n");
+        return -1;
+    }
+
     off_t offset = 0;
     while (1)
     {
         // Read the FS file into the buffer.
-        int bytes_read = fs_read(fs_path, fs_file_buffer, BLOCK_SIZE, offset);
+        int bytes_read = fs_pread(fd, fs_file_buffer, COPY_CHUNK_SIZE, offset);
 
         if (bytes_read == -1)
         {
             printf("ERROR: Could not read FS file into buffer.\n");
+            fs_close(fd);
             return -1;
         }
 
@@ -301,11 +843,12 @@ int copy_out(char *fs_path, char *local_path)
         if ((int)fwrite(fs_file_buffer, sizeof(char), bytes_read, local_file) != bytes_read)
         {
             printf("ERROR: Could not write buffer to local file.\n");
+            fs_close(fd);
             return -1;
         }
 
-        // If we read less than BLOCK_SIZE bytes, we've reached the end of the file.
-        if (bytes_read < BLOCK_SIZE)
+        // If we read less than a full chunk, we've reached the end of the file.
+        if (bytes_read < COPY_CHUNK_SIZE)
         {
             break;
         }
@@ -314,6 +857,9 @@ int copy_out(char *fs_path, char *local_path)
         offset += bytes_read;
     }
 
+    // Close the FS file.
+    fs_close(fd);
+
     // Close the local file.
     if (fclose(local_file) == EOF)
     {
@@ -0,0 +1,103 @@
+/**
+ * @file checksum_bench.c
+ * @author agent (agent@local)
+ * @brief Measures the throughput of the block checksum kernels (run with `make bench`).
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32c.h"
+#include "disk.h"
+
+#define BENCH_BYTES (1 << 30)           // bytes checksummed by every measurement
+#define BENCH_LARGE_BLOCKS (64 * 256)   // blocks of the buffer that does not fit in the processor caches (64 MB)
+
+/**
+ * Returns the current time in seconds.
+ */
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile uint32_t sink; // keeps the results alive
+
+/**
+ * Runs a checksum over BENCH_BYTES bytes, a block at a time, cycling through nblocks blocks of buf, and prints the
+ * throughput.
+ */
+static void measure(const char *name, uint32_t (*kernel)(uint32_t, const void *, size_t), const uint8_t *buf,
+                    size_t nblocks)
+{
+    size_t rounds = BENCH_BYTES / BLOCK_SIZE;
+    uint32_t crc = 0;
+    double start = now();
+    for (size_t i = 0; i < rounds; i++)
+    {
+        crc ^= kernel(0, buf + (i % nblocks) * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    double elapsed = now() - start;
+    sink = crc;
+
+    printf("    %-28s %8.2f GB/s %8.1f ns/block\n", name, BENCH_BYTES / elapsed / 1e9, elapsed / rounds * 1e9);
+}
+
+/**
+ * Copies a block, the reference the checksums are compared to: every block read into the cache is copied at least once.
+ */
+static uint32_t copy_block(uint32_t crc, const void *data, size_t length)
+{
+    static uint8_t copy[BLOCK_SIZE];
+    memcpy(copy, data, length);
+    return crc ^ copy[crc % length];
+}
+
+int main()
+{
+    if (crc32c(0, "123456789", 9) != 0xE3069283 || crc32c_portable(0, "123456789", 9) != 0xE3069283)
+    {
+        printf("ERROR: The checksum kernels give wrong results.\n");
+        return 1;
+    }
+
+    uint8_t *buf = malloc((size_t)BENCH_LARGE_BLOCKS * BLOCK_SIZE);
+    if (buf == NULL)
+    {
+        printf("ERROR: Out of memory.\n");
+        return 1;
+    }
+    srand(1);
+    for (size_t i = 0; i < (size_t)BENCH_LARGE_BLOCKS * BLOCK_SIZE; i++)
+    {
+        buf[i] = (uint8_t)rand();
+    }
+
+    printf("CRC32C of %d-byte blocks, crc32c() uses the %s implementation.\n", BLOCK_SIZE,
+           crc32c_accelerated() ? "SSE4.2" : "table-driven");
+
+    // One block that stays in the L1 cache: the cost of the kernel alone.
+    printf("Block in cache:\n");
+    measure("crc32c", crc32c, buf, 1);
+    measure("crc32c_portable", crc32c_portable, buf, 1);
+    measure("memcpy (reference)", copy_block, buf, 1);
+
+    // Blocks streamed from memory, as when verifying blocks just read from the disk.
+    printf("Blocks streamed from memory:\n");
+    measure("crc32c", crc32c, buf, BENCH_LARGE_BLOCKS);
+    measure("crc32c_portable", crc32c_portable, buf, BENCH_LARGE_BLOCKS);
+    measure("memcpy (reference)", copy_block, buf, BENCH_LARGE_BLOCKS);
+
+    free(buf);
+    return 0;
+}
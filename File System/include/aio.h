@@ -0,0 +1,142 @@
+/**
+ * @file aio.h
+ * @brief This header file contains the declarations of the asynchronous I/O engine of the virtual disk.
+ *
+ * Requests read or write a run of consecutive disk blocks. They are queued with aio_submit(), handed to the backend in
+ * one go with aio_flush() (or implicitly by any call that waits), and completed by aio_complete(), aio_wait() or
+ * aio_drain(). A request can be used as a future (wait for it with aio_wait()) or carry a callback, which is run on the
+ * thread that reaps its completion, never on an I/O thread.
+ *
+ * Backends:
+ * - io_uring: requests go to the kernel through a submission ring set up with the raw system calls, so up to the queue
+ *   depth are in flight while the caller keeps working.
+ * - threads: a pool of I/O threads issues the requests with preadv/pwritev. Used when io_uring is not available.
+ * - sync: requests are carried out when they are submitted. Used with the mmap backend of the disk, where a block
+ *   transfer is a memory copy.
+ *
+ * The engine starts itself with the best backend and AIO_DEFAULT_QUEUE_DEPTH the first time it is used, unless
+ * aio_init() was called first. The engine is thread safe.
+ */
+
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+
+#define AIO_DEFAULT_QUEUE_DEPTH 64 // requests in flight at most, unless aio_init says otherwise
+#define AIO_MAX_QUEUE_DEPTH 4096   // largest queue depth aio_init accepts
+#define AIO_THREADS 4              // I/O threads of the thread pool backend
+
+#define AIO_READ 0  // the request reads blocks into its buffers
+#define AIO_WRITE 1 // the request writes blocks from its buffers
+
+#define AIO_BACKEND_AUTO 0     // io_uring if the kernel has it, the thread pool otherwise
+#define AIO_BACKEND_IO_URING 1 // io_uring
+#define AIO_BACKEND_THREADS 2  // thread pool
+#define AIO_BACKEND_SYNC 3     // no concurrency, requests complete when submitted
+
+#define AIO_IDLE 0     // the request was never submitted
+#define AIO_QUEUED 1   // the request is queued or in flight
+#define AIO_DONE 2     // the request has completed, see result
+
+/**
+ * @brief A read or write of a run of consecutive disk blocks.
+ *
+ * Set op, start, count, either buf or bufs, and optionally callback and data before submitting the request. The
+ * request and its buffers must stay valid until it has completed.
+ *
+ * @param op AIO_READ or AIO_WRITE.
+ * @param start The first disk block.
+ * @param count The number of blocks.
+ * @param buf A buffer of count * BLOCK_SIZE bytes, used when bufs is NULL.
+ * @param bufs count buffers of BLOCK_SIZE bytes each, or NULL to use buf.
+ * @param callback Called with the request once it has completed, may be NULL. It may submit new requests.
+ * @param data Free for the owner of the request (e.g. for the callback).
+ * @param state AIO_IDLE, AIO_QUEUED or AIO_DONE. Owned by the engine.
+ * @param result The number of bytes transferred, or -1 if the transfer failed. Valid once the request is done.
+ * @param iov The I/O vector of the transfer. Owned by the engine.
+ * @param iov_count The number of entries left in iov. Owned by the engine.
+ * @param done The number of bytes transferred so far. Owned by the engine.
+ * @param next Link used by the queues of the engine.
+ */
+struct aio_request
+{
+    int op;
+    uint32_t start;
+    int count;
+    void *buf;
+    void **bufs;
+    void (*callback)(struct aio_request *request);
+    void *data;
+
+    int state;
+    int result;
+    struct iovec *iov;
+    int iov_count;
+    size_t done;
+    struct aio_request *next;
+};
+
+/**
+ * @brief Starts the engine with the given backend and queue depth, replacing the one in use.
+ *
+ * Requests still in flight are completed first. Asking for io_uring when the kernel does not support it falls back to
+ * the thread pool.
+ *
+ * @param backend One of the AIO_BACKEND_* constants.
+ * @param queue_depth The number of requests in flight at most, between 1 and AIO_MAX_QUEUE_DEPTH.
+ * @return int Returns the backend in use, or -1 on failure.
+ */
+int aio_init(int backend, int queue_depth);
+
+/**
+ * @brief Returns the backend in use (starting the engine if needed).
+ */
+int aio_backend();
+
+/**
+ * @brief Queues a request. If the queue depth is reached, completions are reaped first.
+ *
+ * @param request The request, which must not be in flight.
+ * @return int Returns 0 on success, -1 if the request is invalid.
+ */
+int aio_submit(struct aio_request *request);
+
+/**
+ * @brief Hands every queued request to the backend without waiting for any of them.
+ */
+void aio_flush();
+
+/**
+ * @brief Reaps completed requests, running their callbacks.
+ *
+ * @param min The number of completions to wait for. 0 only reaps what has already completed.
+ * @return int The number of requests reaped.
+ */
+int aio_complete(int min);
+
+/**
+ * @brief Waits until a request has completed. Its callback (if any) runs on whichever thread reaps the completion, and
+ * may still be running when this returns.
+ *
+ * @param request The request.
+ * @return int The number of bytes transferred, or -1 if the transfer failed or the request was never submitted.
+ */
+int aio_wait(struct aio_request *request);
+
+/**
+ * @brief Waits until every request in flight has completed.
+ *
+ * @return int Returns 0 if every request reaped by the call succeeded, -1 otherwise.
+ */
+int aio_drain();
+
+/**
+ * @brief Waits for every request in flight and stops the engine. It starts again the next time it is used.
+ */
+void aio_shutdown();
+
+#endif
@@ -0,0 +1,118 @@
+/**
+ * @file cache.h
+ * @brief This header file contains the declarations of the block buffer cache that sits between the file system and the disk.
+ *
+ * The cache holds a fixed number of blocks in memory and evicts the least recently used one when it is full.
+ * Writes only mark the cached copy dirty; dirty blocks reach the disk when they are evicted, on cache_sync() or when the disk is closed.
+ * A block can be pinned, which keeps it in memory and off the disk until it is released (used by the journal).
+ * When the disk uses the mmap backend the cache steps aside and every call goes straight to the mapping.
+ * Blocks read from the disk are checked against their checksums before they are handed out, and the checksums of the
+ * blocks written through the cache are recorded (see checksum.h). Cache hits are not checked again.
+ * The cache is thread safe. Bulk transfers (cache_readv() and cache_writev()) do their disk I/O outside its lock.
+ *
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+#include "disk.h"
+
+#define CACHE_BLOCKS 256        // number of blocks held in the cache (1 MB)
+#define CACHE_HASH_BUCKETS 509  // number of hash chains used to look blocks up
+
+/**
+ * @brief Reads a block through the cache.
+ *
+ * On a hit the block is copied out of the cache, on a miss it is read from the disk, verified and kept in the cache.
+ *
+ * @param blocknum The block number to read.
+ * @param buf A pointer to the buffer to read the data into.
+ * @return int The number of bytes read, or -1 if an error occurred.
+ */
+int cache_read(uint32_t blocknum, void *buf);
+
+/**
+ * @brief Writes a block through the cache.
+ *
+ * The block is only marked dirty, it is written back to the disk on eviction, cache_sync() or disk_close().
+ *
+ * @param blocknum The block number to write.
+ * @param buf A pointer to the buffer containing the data to write.
+ * @return int The number of bytes written, or -1 if an error occurred.
+ */
+int cache_write(uint32_t blocknum, void *buf);
+
+/**
+ * @brief Writes a block through the cache and pins it (see cache_pin()) in the same step, so another thread cannot
+ * write it back in between.
+ *
+ * @param blocknum The block number to write.
+ * @param buf A pointer to the buffer containing the data to write.
+ * @return int The number of bytes written, or -1 if an error occurred.
+ */
+int cache_write_pinned(uint32_t blocknum, void *buf);
+
+/**
+ * @brief Reads a list of blocks through the cache.
+ *
+ * Cached blocks are copied out of the cache, the others are read with a single disk_readv call and are not kept in the cache,
+ * so bulk file data does not evict metadata. The blocks read from the disk are verified.
+ *
+ * @param blocks The block numbers to read.
+ * @param bufs One BLOCK_SIZE buffer per block.
+ * @param n The number of blocks.
+ * @return int The number of bytes read, or -1 if an error occurred.
+ */
+int cache_readv(const uint32_t *blocks, void **bufs, int n);
+
+/**
+ * @brief Writes a list of blocks straight to the disk with a single disk_writev call.
+ *
+ * Cached copies of the blocks are updated and marked clean.
+ *
+ * @param blocks The block numbers to write.
+ * @param bufs One BLOCK_SIZE buffer per block.
+ * @param n The number of blocks.
+ * @return int The number of bytes written, or -1 if an error occurred.
+ */
+int cache_writev(const uint32_t *blocks, void **bufs, int n);
+
+/**
+ * @brief Writes every dirty block in the cache back to the disk, except the pinned ones.
+ *
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int cache_sync();
+
+/**
+ * @brief Pins or releases a cached block.
+ *
+ * A pinned block is never chosen for eviction and is skipped by cache_sync(), so its contents cannot reach the disk.
+ * Releasing it makes it an ordinary (possibly dirty) cached block again.
+ *
+ * @param blocknum The block number, which must be in the cache.
+ * @param pinned 1 to pin the block, 0 to release it.
+ * @return int Returns 0 on success, -1 if the block is not in the cache.
+ */
+int cache_pin(uint32_t blocknum, int pinned);
+
+/**
+ * @brief Drops every block from the cache without writing dirty blocks back.
+ *
+ * Used when the contents of the disk are about to be rewritten wholesale (e.g. by fs_format) or the disk is closed.
+ */
+void cache_invalidate();
+
+/**
+ * @brief Returns the number of block lookups that were served from the cache.
+ */
+int cache_hits();
+
+/**
+ * @brief Returns the number of block lookups that had to go to the disk.
+ */
+int cache_misses();
+
+#endif
@@ -0,0 +1,93 @@
+/**
+ * @file checksum.h
+ * @brief This header file contains the declarations of the block checksum table, which catches blocks that changed on
+ * the disk behind the file system's back.
+ *
+ * The table holds the CRC32C (see crc32c.h) of every block of the disk, CHECKSUMS_PER_BLOCK per table block, in an
+ * area laid out by fs_format when asked to with FS_FORMAT_CHECKSUMS. The buffer cache keeps it up to date: a block's
+ * checksum is recorded whenever the block is written through the cache, and a block read from the disk is checked
+ * against it before it is handed out. Cached blocks are trusted, so a block is verified once when it enters the cache,
+ * not on every access. With the mmap backend there is no cache in front of the mapping, so the blocks verified since
+ * the table was loaded are remembered instead. A mismatch makes the read fail.
+ *
+ * A checksum of 0 means none was recorded (the block has not been written since the disk was formatted), and such
+ * blocks are not checked. A block whose checksum happens to be 0 is recorded as 1.
+ *
+ * The table lives in memory. Its changed blocks are handed back to the file system with checksum_flush(), which writes
+ * them through the journal together with the metadata whose checksums they hold. File data is not journaled: data
+ * overwritten in place right before a crash can disagree with its checksum afterwards, and is then reported like any
+ * other torn write. The blocks of the table itself are not checksummed.
+ *
+ * With the mmap backend nothing is journaled and every block is overwritten in place, so the table is used where it
+ * lies in the mapping instead and checksum_flush() has nothing to do. checksum_begin_update() clears a block's entry
+ * before the block is overwritten and checksum_update() stores the new one after it, so a process killed at any point
+ * leaves each block either matching its entry or unchecked.
+ *
+ * The table is thread safe and takes no locks, but checksum_init() and checksum_release() must not run alongside any
+ * other call.
+ */
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+
+#include "disk.h"
+
+#define CHECKSUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t)) // checksums held by one block of the table
+
+/**
+ * @brief Sets up the table for the disk, replacing the one in use.
+ *
+ * @param start The first block of the table area.
+ * @param nblocks The number of blocks in the table area.
+ * @param covered The number of disk blocks the table covers, at most nblocks * CHECKSUMS_PER_BLOCK.
+ * @param load 1 to read the table from the disk, 0 to start with an empty one (written out by the next flush, or
+ * cleared right away on a mapped disk).
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int checksum_init(uint32_t start, uint32_t nblocks, uint32_t covered, int load);
+
+/**
+ * @brief Frees the table. Blocks are neither recorded nor verified until checksum_init() is called again.
+ */
+void checksum_release();
+
+/**
+ * @brief Clears the checksum of a block about to be overwritten in place, until checksum_update() records the new one.
+ *
+ * @param blocknum The block number.
+ */
+void checksum_begin_update(uint32_t blocknum);
+
+/**
+ * @brief Records the checksum of a block being written.
+ *
+ * @param blocknum The block number.
+ * @param data The BLOCK_SIZE bytes the block now holds.
+ */
+void checksum_update(uint32_t blocknum, const void *data);
+
+/**
+ * @brief Checks a block read from the disk against its recorded checksum.
+ *
+ * @param blocknum The block number.
+ * @param data The BLOCK_SIZE bytes that were read.
+ * @return int Returns 0 if the block is intact (or has no checksum), -1 if it does not match.
+ */
+int checksum_verify(uint32_t blocknum, const void *data);
+
+/**
+ * @brief Hands every block of the table changed since the last flush to a write function.
+ *
+ * @param write Writes a block of the table, returning -1 on failure (e.g. journal_write).
+ * @return int Returns 0 on success, -1 if a block could not be written (it is handed over again next time).
+ */
+int checksum_flush(int (*write)(uint32_t blocknum, void *buf));
+
+/**
+ * @brief Returns the number of blocks that failed verification since the table was set up.
+ */
+int checksum_failures();
+
+#endif
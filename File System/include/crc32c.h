@@ -0,0 +1,47 @@
+/**
+ * @file crc32c.h
+ * @brief This header file contains the declarations of the CRC32C (Castagnoli) checksum used for disk blocks.
+ *
+ * On x86 processors with SSE4.2 the checksum is computed with the crc32 instruction, which the processor can run three
+ * of at once: inputs of a few kilobytes are cut into three lanes checksummed side by side, and the lane checksums are
+ * combined with precomputed tables. Elsewhere a table-driven implementation (slicing by 8) is used. The instruction is
+ * detected at run time, so no special compiler flags are needed.
+ *
+ * The checksum is the usual one (reflected polynomial 0x82F63B78, inverted before and after), so crc32c(0, "123456789",
+ * 9) is 0xE3069283. Both functions are thread safe.
+ */
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Computes or extends a CRC32C checksum with the fastest implementation available.
+ *
+ * @param crc The checksum of the data before this buffer, 0 to start a new checksum.
+ * @param data The data to checksum.
+ * @param length The number of bytes to checksum.
+ * @return uint32_t The checksum of everything so far.
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief Computes or extends a CRC32C checksum with the table-driven implementation, whatever the processor supports.
+ *
+ * @param crc The checksum of the data before this buffer, 0 to start a new checksum.
+ * @param data The data to checksum.
+ * @param length The number of bytes to checksum.
+ * @return uint32_t The checksum of everything so far.
+ */
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief Returns whether crc32c() uses the crc32 instruction.
+ *
+ * @return int 1 if the SSE4.2 implementation is in use, 0 if the table-driven one is.
+ */
+int crc32c_accelerated();
+
+#endif
@@ -15,15 +15,57 @@
 
 #define BLOCK_SIZE 4096 // 4 KB
 
+// Flags accepted by disk_open
+#define DISK_MMAP 0x1   // map the disk image into memory instead of using pread/pwrite
+#define DISK_SPARSE 0x2 // create a missing image as a sparse file instead of preallocating it
+
 /**
  * @brief Initializes a virtual disk with the given filename and number of blocks.
  *
+ * A missing image is created with its blocks preallocated. Blocks that were never written read as zeros.
+ *
  * @param filename The name of the file to use as the virtual disk.
  * @param nblocks The number of blocks to allocate for the virtual disk.
  * @return int Returns 0 on success, -1 on failure.
  */
 int disk_init(char *filename, int nblocks);
 
+/**
+ * @brief Initializes a virtual disk like disk_init, selecting the backend with flags.
+ *
+ * With DISK_MMAP the whole image is mapped into memory, block reads and writes become copies to and from the mapping
+ * and disk_block_ptr gives direct access to it. Changes are flushed to the file with msync on disk_sync and disk_close.
+ *
+ * @param filename The name of the file to use as the virtual disk.
+ * @param nblocks The number of blocks to allocate for the virtual disk.
+ * @param flags A combination of the DISK_* flags, 0 for the default pread/pwrite backend.
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int disk_open(char *filename, int nblocks, int flags);
+
+/**
+ * @brief Returns whether the disk is served from a memory mapping.
+ *
+ * @return int 1 if the mmap backend is in use, 0 otherwise.
+ */
+int disk_is_mapped();
+
+/**
+ * @brief Returns the file descriptor of the disk image, used by the asynchronous I/O engine.
+ *
+ * @return int The file descriptor, or -1 if the disk is not open.
+ */
+int disk_file();
+
+/**
+ * @brief Adds transfers made outside of this file (by the asynchronous I/O engine) to the disk statistics.
+ *
+ * @param blocks_read The number of blocks read.
+ * @param blocks_written The number of blocks written.
+ * @param calls The number of system calls issued.
+ */
+void disk_record(int blocks_read, int blocks_written, int calls);
+
 /**
  * @brief Returns the size of the disk in number of blocks.
  *
@@ -51,7 +93,82 @@ int disk_read(uint32_t blocknum, void *buf);
 int disk_write(uint32_t blocknum, void *buf);
 
 /**
- * @brief Closes the disk file and frees any allocated memory.
+ * @brief Returns a pointer to a block inside the memory mapping, without copying it.
+ *
+ * Only available with the mmap backend. The pointer stays valid until the disk is closed.
+ *
+ * @param blocknum The block number to access.
+ * @return void* A pointer to the block, or NULL if the block number is invalid or the disk is not mapped.
+ */
+void *disk_block_ptr(uint32_t blocknum);
+
+/**
+ * @brief Reads a list of blocks, each into its own buffer.
+ *
+ * Runs of adjacent block numbers are coalesced into a single preadv call. When there are several runs, they are all put
+ * in flight at once through the asynchronous I/O engine (see aio.h).
+ *
+ * @param blocks The block numbers to read.
+ * @param bufs One BLOCK_SIZE buffer per block.
+ * @param n The number of blocks.
+ * @return int The number of bytes read, or -1 if an error occurred.
+ */
+int disk_readv(const uint32_t *blocks, void **bufs, int n);
+
+/**
+ * @brief Writes a list of blocks, each from its own buffer.
+ *
+ * Runs of adjacent block numbers are coalesced into a single pwritev call. When there are several runs, they are all put
+ * in flight at once through the asynchronous I/O engine (see aio.h).
+ *
+ * @param blocks The block numbers to write.
+ * @param bufs One BLOCK_SIZE buffer per block.
+ * @param n The number of blocks.
+ * @return int The number of bytes written, or -1 if an error occurred.
+ */
+int disk_writev(const uint32_t *blocks, void **bufs, int n);
+
+/**
+ * @brief Reads n consecutive blocks starting at start into one contiguous buffer.
+ *
+ * @param start The first block to read.
+ * @param n The number of blocks to read.
+ * @param buf A buffer of at least n * BLOCK_SIZE bytes.
+ * @return int The number of bytes read, or -1 if an error occurred.
+ */
+int disk_read_range(uint32_t start, int n, void *buf);
+
+/**
+ * @brief Makes n consecutive blocks starting at start read as zeros.
+ *
+ * Holes are punched into the image where the host file system supports it, so the cost does not depend on n.
+ * Otherwise zeros are written. The caller is responsible for dropping cached copies of the blocks.
+ *
+ * @param start The first block to zero.
+ * @param n The number of blocks to zero.
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int disk_zero_range(uint32_t start, int n);
+
+/**
+ * @brief Writes n consecutive blocks starting at start from one contiguous buffer.
+ *
+ * @param start The first block to write.
+ * @param n The number of blocks to write.
+ * @param buf A buffer of at least n * BLOCK_SIZE bytes.
+ * @return int The number of bytes written, or -1 if an error occurred.
+ */
+int disk_write_range(uint32_t start, int n, void *buf);
+
+/**
+ * @brief Flushes all written blocks to the disk file (msync for the mmap backend, fsync otherwise).
+ *
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int disk_sync();
+
+/**
+ * @brief Writes back the blocks still dirty in the buffer cache, then closes the disk file and frees any allocated memory.
  *
  * @return int Returns 0 on success, -1 on failure.
  */
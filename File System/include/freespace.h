@@ -0,0 +1,82 @@
+/**
+ * @file freespace.h
+ * @brief This header file contains the declarations of the free-space index of the block allocator.
+ *
+ * The index keeps every run of free blocks (a free extent) in a tree ordered by the first block of the run, where every
+ * node also records the longest run below it. That makes the tree searchable both by position and by size: finding the
+ * first run of at least N blocks at or after block X, the run holding X or the longest run all take logarithmic time,
+ * and freeing a run merges it with its neighbours.
+ *
+ * The index only lives in memory. The bitmap stays the on-disk record of which blocks are free, and the index is
+ * rebuilt from it with freespace_build() when the file system is mounted. The index is not thread safe, the allocator
+ * serialises calls with its own lock.
+ */
+
+#ifndef FREESPACE_H
+#define FREESPACE_H
+
+#include <stdint.h>
+
+struct free_extent;
+
+/**
+ * @brief An index of free extents.
+ *
+ * @param root The root of the tree, NULL if no block is free.
+ * @param extents The number of free extents.
+ * @param blocks The number of free blocks.
+ * @param seed State of the generator of the node priorities, which keep the tree balanced.
+ */
+struct freespace
+{
+    struct free_extent *root;
+    uint32_t extents;
+    uint32_t blocks;
+    uint32_t seed;
+};
+
+/**
+ * @brief Rebuilds an index from a bitmap, replacing what it held.
+ *
+ * @param space The index.
+ * @param words The bitmap, one bit per block, set for the blocks in use.
+ * @param first The first block that may be handed out. Clear bits before it are ignored.
+ * @param nbits The number of blocks the bitmap tracks.
+ * @return int Returns 0 on success, -1 if the memory for the index could not be allocated.
+ */
+int freespace_build(struct freespace *space, const uint64_t *words, uint32_t first, uint32_t nbits);
+
+/**
+ * @brief Frees the memory of an index, leaving it empty.
+ *
+ * @param space The index.
+ */
+void freespace_release(struct freespace *space);
+
+/**
+ * @brief Takes a run of up to count consecutive blocks out of the index.
+ *
+ * If goal is free the run starts there and grows as far as the free extent holding it allows, so a file keeps growing
+ * in place. Otherwise the run is the start of the first extent of at least count blocks at or after goal, wrapping
+ * around to the start of the disk. If no extent is that long, the longest one is used and the run is shorter.
+ *
+ * @param space The index.
+ * @param goal The block the run should start at or after.
+ * @param count The number of blocks wanted, at least 1.
+ * @param length Receives the number of blocks in the run.
+ * @return uint32_t The first block of the run, or (uint32_t)-1 if no block is free.
+ */
+uint32_t freespace_allocate(struct freespace *space, uint32_t goal, uint32_t count, uint32_t *length);
+
+/**
+ * @brief Puts a run of blocks back into the index, merging it with the free extents on either side.
+ *
+ * @param space The index.
+ * @param start The first block of the run. The blocks must not be in the index already.
+ * @param length The number of blocks in the run.
+ * @return int Returns 0 on success, -1 if the memory for a new extent could not be allocated (the blocks then stay out
+ *             of the index until it is rebuilt).
+ */
+int freespace_free(struct freespace *space, uint32_t start, uint32_t length);
+
+#endif
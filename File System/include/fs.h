@@ -7,6 +7,11 @@
  * - inode: contains information about a file or directory.
  * - directory_entry: contains information about a directory entry.
  * - directory_block: contains an array of directory entries.
+ * - directory_index: contains the hash index of an indexed directory.
+ * - extent: maps a run of logical blocks of a file to a run of disk blocks.
+ * - extent_header: describes a node of an extent tree.
+ * - extent_block: contains a node of an extent tree.
+ * - block_reference: records how a data block is shared and what it holds.
  * - block: contains all possible types of blocks in the file system.
  *
  * This header file also defines the following constants:
@@ -17,6 +22,34 @@
  * - DIRECTORY_ENTRY_SIZE: size of a directory entry in bytes.
  * - DIRECTORY_NAME_SIZE: maximum size of a directory name in bytes.
  * - DIRECTORY_ENTRIES_PER_BLOCK: number of directory entries that can fit in a block.
+ * - BITS_PER_BLOCK: number of inodes or blocks a bitmap block keeps track of.
+ * - BITMAP_WORDS_PER_BLOCK: number of 64-bit words in a bitmap block.
+ * - BLOCKS_PER_GROUP: number of blocks in a block group.
+ * - DIRECTORY_INDEX_MAX_DEPTH: maximum number of hash bits used by an indexed directory.
+ * - DIRECTORY_INDEX_SLOTS: number of slots in the hash index of an indexed directory.
+ * - FS_MAX_OPEN_FILES: number of files that can be open at the same time.
+ * - FS_O_CREATE: fs_open flag to create the file if it does not exist.
+ * - FS_O_COMPRESS: fs_open flag to keep the data of an empty file compressed from then on.
+ * - FS_O_DEDUP: fs_open flag to deduplicate the blocks written to the file from then on.
+ * - FS_FORMAT_CHECKSUMS: fs_format flag to keep a checksum of every block of the disk.
+ * - INODE_FLAG_INDEXED: inode flag marking a directory that uses the indexed format.
+ * - INODE_FLAG_EXTENTS: inode flag marking a file whose blocks are mapped by extents.
+ * - INODE_FLAG_INLINE: inode flag marking a file whose bytes are kept in the inode itself.
+ * - INODE_INLINE_SIZE: number of bytes of a file that fit in its inode.
+ * - INODE_FLAG_COMPRESSED: inode flag marking a file whose data is stored in compressed clusters.
+ * - COMPRESS_CLUSTER_BLOCKS: number of logical blocks of a compressed file that are compressed together.
+ * - COMPRESS_CLUSTER_SIZE: size of a cluster of a compressed file in bytes.
+ * - INODE_FLAG_DEDUP: inode flag marking a file whose whole blocks are shared with identical blocks on the disk.
+ * - INODE_FLAG_READONLY: inode flag marking a file or directory of a snapshot, which cannot be changed.
+ * - REFERENCES_PER_BLOCK: number of entries of the block reference table in a block.
+ * - INODE_EXTENTS: number of extents that fit in an inode.
+ * - EXTENTS_PER_BLOCK: number of extents that fit in an extent tree block.
+ *
+ * Every fs_* function may be called from several threads at once on the mounted file system. Reads of a file share
+ * its lock and run in parallel, writes to a file take it alone, and operations on different files do not wait for
+ * each other except briefly in the block allocator (which locks one block group at a time), the inode table and the
+ * journal. Creating, removing, cloning, formatting, mounting and unmounting wait until every other operation is done. A
+ * descriptor must not be used by two threads at the same time, each thread should open its own.
  *
  * This header file includes the following header files:
  * - stdint.h: defines integer types.
@@ -39,18 +72,70 @@
 #define DIRECTORY_NAME_SIZE 28
 #define DIRECTORY_ENTRIES_PER_BLOCK (BLOCK_SIZE / DIRECTORY_ENTRY_SIZE)
 #define DIRECTORY_DEPTH_LIMIT 10
+#define DIRECTORY_INDEX_MAX_DEPTH 9
+#define DIRECTORY_INDEX_SLOTS (1 << DIRECTORY_INDEX_MAX_DEPTH)
+
+#define FS_MAX_OPEN_FILES 64
+#define FS_O_CREATE 0x1
+#define FS_O_COMPRESS 0x2
+#define FS_O_DEDUP 0x4
+#define FS_FORMAT_CHECKSUMS 0x1
+
+#define INODE_FLAG_INDEXED 0x1
+#define INODE_FLAG_EXTENTS 0x2
+#define INODE_FLAG_INLINE 0x4
+#define INODE_FLAG_COMPRESSED 0x8
+#define INODE_FLAG_DEDUP 0x10
+#define INODE_FLAG_READONLY 0x20
 
-#define FLAGS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define INODE_EXTENTS 4
+#define INODE_INLINE_SIZE ((INODE_DIRECT_POINTERS + 2) * sizeof(uint32_t)) // the pointer area of the inode
+
+#define COMPRESS_CLUSTER_BLOCKS 4
+#define COMPRESS_CLUSTER_SIZE (COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE)
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define BITMAP_WORDS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
+#define BLOCKS_PER_GROUP BITS_PER_BLOCK // one block bitmap block covers a group
+#define REFERENCES_PER_BLOCK (BLOCK_SIZE / sizeof(struct block_reference))
 
 /**
  * @brief The superblock structure contains information about the file system.
  *
  * @param s_blocks_count Total number of blocks in the file system.
  * @param s_inodes_count Total number of inodes in the file system.
- * @param s_inode_bitmap Block number of the inode bitmap.
- * @param s_block_bitmap Block number of the block bitmap.
+ * @param s_block_bitmap Block number of the first block of the block bitmap.
+ * @param s_inode_bitmap Block number of the first block of the inode bitmap.
  * @param s_inode_table_block_start Starting block number of the inode table.
  * @param s_data_blocks_start Starting block number of the data blocks.
+ * @param s_block_bitmap_blocks Number of blocks in the block bitmap.
+ * @param s_inode_bitmap_blocks Number of blocks in the inode bitmap.
+ * @param s_journal_start Block number of the first block of the metadata journal.
+ * @param s_journal_blocks Number of blocks in the metadata journal, 0 if the file system has none.
+ * @param s_groups_count Number of block groups, 0 if the disk is laid out as a single run of metadata.
+ * @param s_blocks_per_group Number of blocks in a block group (BLOCKS_PER_GROUP).
+ * @param s_inodes_per_group Number of inodes in a block group, a multiple of INODES_PER_BLOCK.
+ * @param s_reference_table Block number of the first block of the block reference table, 0 if the file system has none.
+ * @param s_reference_table_blocks Number of blocks in the block reference table.
+ * @param s_checksum_table Block number of the first block of the block checksum table, 0 if the file system has none.
+ * @param s_checksum_table_blocks Number of blocks in the block checksum table.
+ *
+ * The disk is split into block groups of s_blocks_per_group blocks (the last one may be shorter). Every group starts
+ * with a copy of the superblock, its block bitmap, its inode bitmap and its slice of the inode table, in that order,
+ * followed by its data blocks. The block numbers of group 0 are stored in the superblock (s_block_bitmap,
+ * s_inode_bitmap and s_inode_table_block_start); the other groups keep the same offsets from their first block. Group
+ * 0 (whose superblock is the real one) also holds the journal, the block reference table (one block_reference per
+ * block of the disk) and the block checksum table (one CRC32C per block of the disk, see checksum.h) between its inode
+ * table and its data blocks. Inode n belongs to group n / s_inodes_per_group, and files are given data blocks in the
+ * group of their inode.
+ *
+ * Disks formatted before block groups have s_groups_count set to 0. They keep a single block bitmap, inode bitmap and
+ * inode table of s_block_bitmap_blocks, s_inode_bitmap_blocks and s_inodes_count / INODES_PER_BLOCK consecutive blocks,
+ * followed by the journal and the data blocks, and are used as one group.
+ *
+ * Disks formatted before the bitmaps could span several blocks have s_block_bitmap set to 0. They kept one uint32_t flag
+ * per block in block 1 and per inode in block 2, and are converted to the single group layout when mounted.
  */
 struct superblock
 {
@@ -60,24 +145,108 @@ struct superblock
     uint32_t s_inode_bitmap;
     uint32_t s_inode_table_block_start;
     uint32_t s_data_blocks_start;
+    uint32_t s_block_bitmap_blocks;
+    uint32_t s_inode_bitmap_blocks;
+    uint32_t s_journal_start;
+    uint32_t s_journal_blocks;
+    uint32_t s_groups_count;
+    uint32_t s_blocks_per_group;
+    uint32_t s_inodes_per_group;
+    uint32_t s_reference_table;
+    uint32_t s_reference_table_blocks;
+    uint32_t s_checksum_table;
+    uint32_t s_checksum_table_blocks;
+};
+
+/**
+ * @brief The extent structure maps a run of logical blocks of a file to a run of consecutive disk blocks.
+ *
+ * In the index nodes of an extent tree e_physical is the block of the child node and e_length is unused.
+ *
+ * @param e_logical First logical block of the run (in index nodes, the first logical block mapped below the child).
+ * @param e_physical First disk block of the run.
+ * @param e_length Number of blocks in the run.
+ */
+struct extent
+{
+    uint32_t e_logical;
+    uint32_t e_physical;
+    uint32_t e_length;
+};
+
+/**
+ * @brief The extent_header structure describes a node of an extent tree, the root of which is kept in the inode.
+ *
+ * @param eh_entries Number of entries used in the node.
+ * @param eh_depth Number of index levels below this node, 0 for a node holding the extents themselves.
+ */
+struct extent_header
+{
+    uint16_t eh_entries;
+    uint16_t eh_depth;
+};
+
+/**
+ * @brief The block_reference structure is the entry of a data block in the block reference table.
+ *
+ * A data block is shared when several logical blocks of files map to it, through deduplication (see FS_O_DEDUP) or
+ * because a file was cloned (see fs_clone). A shared block is never written in place: the file writing to it gets a
+ * copy of its own first, and freeing it only drops one reference until the last one goes.
+ *
+ * @param r_fingerprint Hash of the contents of the block, recorded when a deduplicated file wrote it and cleared as soon
+ *                      as it is written again in place, 0 if there is none. Only a candidate: the contents are compared
+ *                      before a block is shared.
+ * @param r_shares Number of references to the block beyond the first one, 0 if it is not shared.
+ */
+struct block_reference
+{
+    uint32_t r_fingerprint;
+    uint32_t r_shares;
 };
 
 /**
  * @brief The inode structure contains information about a file or directory.
  *
  * @param i_is_directory Flag indicating whether the inode represents a directory.
+ * @param i_flags Format flags (INODE_FLAG_*). Zero on inodes written before the flags existed.
  * @param i_size Size of the file or directory in bytes.
  * @param i_direct_pointers Array of direct pointers to data blocks.
  * @param i_single_indirect_pointer Pointer to a block containing indirect pointers to data blocks.
  * @param i_double_indirect_pointer Pointer to a block containing indirect pointers to blocks containing indirect pointers to data blocks.
+ * @param i_extent_header Header of the root of the extent tree, used instead of the pointers when INODE_FLAG_EXTENTS is set.
+ * @param i_extents Entries of the root of the extent tree.
+ * @param i_inline_data The bytes of the file, used instead of any mapping when INODE_FLAG_INLINE is set. A file stays
+ *                      inline while it fits in INODE_INLINE_SIZE bytes and no longer uses a data block, and is moved
+ *                      to extents the first time it grows past that.
+ *
+ * A file with INODE_FLAG_COMPRESSED set is extent-mapped in clusters of COMPRESS_CLUSTER_BLOCKS logical blocks, each
+ * compressed on its own (see lz.h). The disk blocks of a cluster are mapped from its first logical block on, and their
+ * number tells how it is stored: none for a cluster in a hole, all of them for a cluster that did not compress, and
+ * fewer for a compressed one, whose first 4 bytes give the length of the compressed data that follows.
+ *
+ * A file or directory with INODE_FLAG_READONLY set belongs to a snapshot (see fs_snapshot): its data cannot be written
+ * and nothing can be created in or removed from it, only the snapshot as a whole can be removed.
  */
 struct inode
 {
     uint64_t i_size;
-    uint32_t i_is_directory;
-    uint32_t i_direct_pointers[INODE_DIRECT_POINTERS];
-    uint32_t i_single_indirect_pointer;
-    uint32_t i_double_indirect_pointer;
+    uint16_t i_is_directory;
+    uint16_t i_flags;
+    union
+    {
+        struct
+        {
+            uint32_t i_direct_pointers[INODE_DIRECT_POINTERS];
+            uint32_t i_single_indirect_pointer;
+            uint32_t i_double_indirect_pointer;
+        };
+        struct
+        {
+            struct extent_header i_extent_header;
+            struct extent i_extents[INODE_EXTENTS];
+        };
+        uint8_t i_inline_data[INODE_INLINE_SIZE];
+    };
 };
 
 /**
@@ -102,40 +271,90 @@ struct directory_block
     struct directory_entry entries[DIRECTORY_ENTRIES_PER_BLOCK];
 };
 
+/**
+ * @brief The directory_index structure is the first block of an indexed directory (one with INODE_FLAG_INDEXED set).
+ *
+ * Indexed directories use extendible hashing: the low d_global_depth bits of the hash of a name pick a slot, and the slot
+ * names the leaf holding the entry. Leaves are directory blocks stored as logical blocks 1 to d_leaf_count of the directory.
+ * A full leaf is split in two on its next hash bit, doubling the slot table when needed, so a lookup always reads the
+ * index block and a single leaf.
+ *
+ * @param d_global_depth Number of hash bits used to pick a slot.
+ * @param d_leaf_count Number of leaves.
+ * @param d_slots Logical block of the leaf for every slot.
+ * @param d_local_depth Number of hash bits shared by every entry of a leaf, indexed by logical block - 1.
+ */
+struct directory_index
+{
+    uint32_t d_global_depth;
+    uint32_t d_leaf_count;
+    uint32_t d_slots[DIRECTORY_INDEX_SLOTS];
+    uint8_t d_local_depth[DIRECTORY_INDEX_SLOTS];
+};
+
+/**
+ * @brief The extent_block structure contains a node of an extent tree below the root.
+ *
+ * @param header Header of the node.
+ * @param extents Entries of the node, sorted by logical block.
+ */
+struct extent_block
+{
+    struct extent_header header;
+    struct extent extents[EXTENTS_PER_BLOCK];
+};
+
 /**
  * @brief The block union contains all possible types of blocks in the file system.
  *
  * @param superblock Superblock structure.
  * @param inodes Array of inodes.
- * @param bitmap Array of bitmap blocks.
+ * @param bitmap Bitmap block, one bit per inode or block.
  * @param directory_block Directory block structure.
+ * @param directory_index Directory index structure.
+ * @param extent_block Extent tree node structure.
  * @param data Array of data blocks.
  * @param pointers Array of indirect pointers.
  */
 union block
 {
-    struct superblock superblock;                         // Superblock
-    struct inode inodes[INODES_PER_BLOCK];                // Inode block
-    uint32_t bitmap[FLAGS_PER_BLOCK];       // Bitmap block (inode or data)
-    struct directory_block directory_block;               // Directory block
-    uint8_t data[BLOCK_SIZE];                             // Data block
-    uint32_t pointers[INODE_INDIRECT_POINTERS_PER_BLOCK]; // Indirect pointer block
+    struct superblock superblock;                            // Superblock
+    struct inode inodes[INODES_PER_BLOCK];                   // Inode block
+    uint64_t bitmap[BITMAP_WORDS_PER_BLOCK];                 // Bitmap block (inode or data)
+    struct directory_block directory_block;                  // Directory block
+    struct directory_index directory_index;                  // Directory index block
+    struct extent_block extent_block;                        // Extent tree block
+    struct block_reference references[REFERENCES_PER_BLOCK]; // Block reference table block
+    uint8_t data[BLOCK_SIZE];                                // Data block
+    uint32_t pointers[INODE_INDIRECT_POINTERS_PER_BLOCK];    // Indirect pointer block
 };
 
 /**
  * @brief Formats the file system.
  *
+ * Only the metadata blocks are written, data blocks are left as they are and are initialised when they are allocated.
+ * A disk opened with DISK_MMAP is formatted without a journal (see journal.h).
+ *
+ * @param flags FS_FORMAT_CHECKSUMS to lay out a checksum table (see checksum.h), 0 otherwise. With it every block read
+ *              from the disk is verified, which catches corruption at the price of a CRC32C per block read and written.
  * @return 0 on success, -1 on failure.
  */
-int fs_format();
+int fs_format(int flags);
 
 /**
- * @brief Mounts the file system.
+ * @brief Mounts the file system. A disk with a journal cannot be mounted when opened with DISK_MMAP.
  *
  * @return 0 on success, -1 on failure.
  */
 int fs_mount();
 
+/**
+ * @brief Unmounts the file system.
+ *
+ * Open files are closed, the journal is committed and every cached block is written back, so the disk can be closed.
+ */
+void fs_unmount();
+
 /**
  * @brief Create a file or directory at the specified absolute path.
  *
@@ -160,6 +379,35 @@ int fs_create(char *path, int is_directory);
  */
 int fs_remove(char *path);
 
+/**
+ * @brief Copies a file or directory tree to a new path without copying its data.
+ *
+ * The copy of a file maps the same data blocks as the original, each of which takes one more reference in the block
+ * reference table, so the cost is that of the metadata rather than of the data. The first write to a shared block by
+ * either file gives that file a copy of the block of its own (copy on write). Directories are copied entry by entry.
+ * The copy is writable even if the original is part of a snapshot, so a snapshot can be branched from. Files of a file
+ * system formatted before the block reference table existed cannot be cloned. Data held back by open descriptors of
+ * the original is written out first.
+ *
+ * @param src_path The path of the file or directory to clone.
+ * @param dst_path The path of the copy, which must not exist yet. Missing directories leading to it are created.
+ * @return 0 on success, -1 on failure (nothing of the copy is left).
+ */
+int fs_clone(char *src_path, char *dst_path);
+
+/**
+ * @brief Takes a read-only snapshot of a file or directory tree, like fs_clone.
+ *
+ * Every file and directory of the snapshot is marked read-only: writes to its files fail, and nothing can be created
+ * in or removed from its directories. The snapshot as a whole can be removed with fs_remove, and cloned with fs_clone
+ * to get a writable copy of it. A snapshot taken inside the tree it is a snapshot of leaves itself out.
+ *
+ * @param src_path The path of the file or directory to snapshot.
+ * @param dst_path The path of the snapshot, which must not exist yet. Missing directories leading to it are created.
+ * @return 0 on success, -1 on failure (nothing of the snapshot is left).
+ */
+int fs_snapshot(char *src_path, char *dst_path);
+
 /**
  * @brief Reads data from a file at the specified path and stores it in the buffer pointed to by buf.
  * 
@@ -189,6 +437,68 @@ int fs_read(char *path, void *buf, size_t count, off_t offset);
  */
 int fs_write(char *path, void *buf, size_t count, off_t offset);
 
+/**
+ * @brief Opens the file at the specified path and returns a descriptor for it.
+ *
+ * The path is resolved once: reads and writes through the descriptor go straight to the inode, which stays in memory
+ * until the descriptor is closed, and reuse the block mapping of the previous call when they continue where it ended.
+ * An open file cannot be removed.
+ *
+ * @param path The path of the file to open.
+ * @param flags FS_O_CREATE to create the file (and the directories leading to it) if it does not exist, 0 otherwise.
+ *              Adding FS_O_COMPRESS to an open of an empty file makes it a compressed file: from then on its data is
+ *              compressed when it is written and decompressed when it is read, which fs_read and fs_write do as well.
+ *              Adding FS_O_DEDUP makes the file deduplicated: from then on every whole block written to it that is
+ *              identical to a block already on the disk shares that block instead of taking a new one. Neither flag
+ *              has an effect on a file system formatted before it existed.
+ *
+ * @return A file descriptor on success, -1 on failure.
+ */
+int fs_open(char *path, int flags);
+
+/**
+ * @brief Reads data from an open file, like fs_read.
+ *
+ * Reads that continue where the previous one ended are detected, and the blocks that follow are read ahead through the
+ * asynchronous I/O engine (see aio.h) in a window that doubles (up to 64 blocks) while the pattern holds, so later
+ * reads are served from memory. Any other read drops the window.
+ *
+ * @param fd The file descriptor returned by fs_open.
+ * @param buf The buffer to store the read data.
+ * @param count The number of bytes to read.
+ * @param offset The offset from the beginning of the file to start reading from.
+ *
+ * @return On success, the number of bytes read is returned. On error, -1 is returned.
+ */
+int fs_pread(int fd, void *buf, size_t count, off_t offset);
+
+/**
+ * @brief Writes data to an open file, like fs_write.
+ *
+ * Small writes are held back in memory (delayed allocation): consecutive writes are gathered per descriptor and disk
+ * blocks are only allocated when the data is flushed, so the whole batch gets one contiguous run and partially written
+ * blocks are filled in memory instead of being read back from the disk. Pending data is flushed when the batch is full,
+ * when a write does not continue it, before the file is read and when the descriptor is closed. Errors that happen at
+ * that point (e.g. the disk is full) are reported by the call that triggered the flush.
+ *
+ * @param fd The file descriptor returned by fs_open.
+ * @param buf The buffer containing the data to be written.
+ * @param count The number of bytes to be written.
+ * @param offset The offset from the beginning of the file to start writing to.
+ *
+ * @return On success, the number of bytes written is returned. On error, -1 is returned.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, off_t offset);
+
+/**
+ * @brief Closes a file descriptor returned by fs_open, writing out the data still held back for it.
+ *
+ * @param fd The file descriptor to close.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int fs_close(int fd);
+
 /**
  * @brief Lists all files and directories in the directory at the specified path.
  * 
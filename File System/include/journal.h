@@ -0,0 +1,202 @@
+/**
+ * @file journal.h
+ * @brief This header file contains the declarations of the write-ahead metadata journal.
+ *
+ * Metadata blocks are written with journal_write() instead of cache_write(). They join the running transaction and stay
+ * pinned in the buffer cache, so they cannot reach their home location before the transaction is committed. Operations
+ * mark their end with journal_end_operation(), and the transaction is committed once enough operations have been
+ * batched in it (group commit): the blocks are appended to the journal region in a single sequential write followed by
+ * a single sync. After that the blocks are ordinary dirty cache blocks and are written home lazily (checkpointing).
+ * When the journal fills up, everything is written home and the journal starts over.
+ *
+ * The journal region starts with a header block, followed by the log. Each transaction is logged as a descriptor block
+ * listing the home block numbers, the blocks themselves and a commit block holding a checksum of the transaction, so a
+ * transaction that was only partly written is recognised and ignored by journal_mount().
+ *
+ * File data is not journaled. It is written straight to the disk before the metadata that points at it is committed.
+ * A block that held logged metadata and is reused for data is revoked (see journal_claim()), so replay does not restore
+ * the old metadata over the data. With the mmap backend the kernel may write any block back at any time, before the
+ * transaction writing it is committed, so disks formatted on a mapped disk have no journal and a disk with one cannot
+ * be mounted mapped (see fs_format() and fs_mount()).
+ *
+ * The journal is thread safe. Every operation brackets its metadata writes with journal_begin_operation() and
+ * journal_end_operation(), and reserves credits (blocks of the transaction) when it begins. A transaction is never
+ * committed while an operation in it is half done: one that would not fit waits for the running transaction to be
+ * committed by the last operation in it to end. An operation too large for one transaction is split by its caller into
+ * steps that each leave the file system consistent, ended and begun again with journal_restart().
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include "disk.h"
+
+#define JOURNAL_HEADER_MAGIC 0x4A484452     // "JHDR"
+#define JOURNAL_DESCRIPTOR_MAGIC 0x4A445343 // "JDSC"
+#define JOURNAL_COMMIT_MAGIC 0x4A434D54     // "JCMT"
+
+#define JOURNAL_MIN_BLOCKS 128                // smallest journal region fs_format reserves
+#define JOURNAL_MAX_BLOCKS 8192               // largest journal region fs_format reserves (32 MB)
+#define JOURNAL_MAX_TRANSACTION_BLOCKS 120    // blocks logged and revoked in one transaction
+#define JOURNAL_MAX_CREDITS 80                // credits the operations of one transaction can reserve
+#define JOURNAL_GROUP_OPERATIONS 16           // operations batched into one commit
+
+/**
+ * @brief The first block of the journal region.
+ *
+ * @param j_magic JOURNAL_HEADER_MAGIC.
+ * @param j_sequence Sequence number of the first transaction in the log.
+ * @param j_blocks Number of blocks in the journal region, header included.
+ */
+struct journal_header
+{
+    uint32_t j_magic;
+    uint32_t j_sequence;
+    uint32_t j_blocks;
+};
+
+/**
+ * @brief The block that starts a transaction in the log.
+ *
+ * @param d_magic JOURNAL_DESCRIPTOR_MAGIC.
+ * @param d_sequence Sequence number of the transaction.
+ * @param d_count Number of blocks logged after the descriptor.
+ * @param d_revoked Number of blocks revoked by the transaction, whose copies logged by earlier transactions are not
+ *                  replayed.
+ * @param d_blocks Home block number of every logged block, followed by the revoked block numbers.
+ */
+struct journal_descriptor
+{
+    uint32_t d_magic;
+    uint32_t d_sequence;
+    uint32_t d_count;
+    uint32_t d_revoked;
+    uint32_t d_blocks[JOURNAL_MAX_TRANSACTION_BLOCKS];
+};
+
+/**
+ * @brief The block that ends a transaction in the log.
+ *
+ * @param c_magic JOURNAL_COMMIT_MAGIC.
+ * @param c_sequence Sequence number of the transaction.
+ * @param c_checksum Checksum of the descriptor and the logged blocks.
+ */
+struct journal_commit
+{
+    uint32_t c_magic;
+    uint32_t c_sequence;
+    uint32_t c_checksum;
+};
+
+/**
+ * @brief Initialises an empty journal in the given region. The region must read as zeros.
+ *
+ * @param start The first block of the region.
+ * @param nblocks The number of blocks in the region, 0 if the file system has no journal.
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int journal_format(uint32_t start, uint32_t nblocks);
+
+/**
+ * @brief Opens the journal in the given region and replays every transaction that was committed but not checkpointed.
+ *
+ * @param start The first block of the region.
+ * @param nblocks The number of blocks in the region, 0 if the file system has no journal.
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int journal_mount(uint32_t start, uint32_t nblocks);
+
+/**
+ * @brief Writes a metadata block as part of the running transaction.
+ *
+ * A block new to the transaction uses one of the credits of the operation of the calling thread. An operation that
+ * has used up its credits takes a free block of the transaction if there is one. Outside any operation the transaction
+ * is committed first if it is full.
+ *
+ * @param blocknum The block number to write.
+ * @param buf A pointer to the buffer containing the data to write.
+ * @return int The number of bytes written, or -1 if an error occurred (the transaction is full).
+ */
+int journal_write(uint32_t blocknum, void *buf);
+
+/**
+ * @brief Marks the start of a file system operation on the calling thread and reserves credits for it.
+ *
+ * If the running transaction cannot take the credits, no more operations join it and the call waits until it is
+ * committed. The operations of one thread do not nest, an operation begun inside another is part of it and only adds
+ * what credits are free.
+ *
+ * @param credits The most blocks the operation writes, at most JOURNAL_MAX_CREDITS count.
+ * @return int Returns 0 on success, -1 if a commit failed (the operation is not begun).
+ */
+int journal_begin_operation(int credits);
+
+/**
+ * @brief Marks the end of the operation of the calling thread and gives back the credits it did not use. The running
+ * transaction is committed when it is waited for, or enough operations have been batched in it, and no other operation
+ * is in progress.
+ *
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int journal_end_operation();
+
+/**
+ * @brief Adds credits to the operation of the calling thread, if the running transaction has room for them. Never waits.
+ *
+ * @param credits The number of credits to add.
+ * @return int Returns 0 on success, -1 if there is no room.
+ */
+int journal_extend(int credits);
+
+/**
+ * @brief Ends the operation of the calling thread and begins it again with the given credits, without counting it
+ * towards a group commit. The transaction may be committed in between, so the caller must have written everything the
+ * operation changed so far and left the file system consistent.
+ *
+ * @param credits The most blocks the next step of the operation writes.
+ * @return int Returns 0 on success, -1 on failure (the operation is ended).
+ */
+int journal_restart(int credits);
+
+/**
+ * @brief Returns the credits the operation of the calling thread has left, or INT_MAX if the journal is not used.
+ */
+int journal_credits();
+
+/**
+ * @brief Declares that a run of blocks was freed, or is about to be written outside the journal (as file data).
+ *
+ * A block in the running transaction leaves it, and a block logged as metadata since the last checkpoint is revoked by
+ * the running transaction, so replay does not overwrite the data with the old copy. Each revoked block uses a credit
+ * the way journal_write() does. A block revoked when it was freed costs nothing when it is claimed for data.
+ *
+ * @param start The first block of the run.
+ * @param length The number of blocks in the run.
+ * @return int Returns 0 on success, -1 on failure (the transaction is full).
+ */
+int journal_claim(uint32_t start, uint32_t length);
+
+/**
+ * @brief Commits the running transaction now, waiting for the operations in progress to end first. Must not be called
+ * inside an operation.
+ *
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int journal_commit();
+
+/**
+ * @brief Commits the running transaction, writes every cached block home and empties the journal. Waits for the
+ * operations in progress like journal_commit().
+ *
+ * @return int Returns 0 on success, -1 on failure.
+ */
+int journal_checkpoint();
+
+/**
+ * @brief Returns the number of transactions committed so far.
+ */
+int journal_commits();
+
+#endif
@@ -0,0 +1,41 @@
+/**
+ * @file lz.h
+ * @brief This header file contains the declarations of the byte-oriented LZ compressor used for compressed files.
+ *
+ * The compressed format is the LZ4 block format: a series of sequences, each made of a token byte (the number of
+ * literals in its high nibble, the length of the match minus 4 in its low nibble, 15 meaning more length bytes follow),
+ * the literals, and a 2-byte little-endian offset back into the output for the match. The last sequence only has
+ * literals. There is no frame or checksum, callers record the compressed length themselves.
+ *
+ * Both functions are pure and thread safe. Decompression checks every length and offset against the buffers, so a
+ * corrupted input fails instead of reading or writing out of bounds.
+ */
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+/**
+ * @brief Compresses a buffer.
+ *
+ * @param src The data to compress.
+ * @param length The number of bytes to compress.
+ * @param dst Receives the compressed data.
+ * @param capacity The size of dst.
+ * @return size_t The size of the compressed data, or 0 if it does not fit in capacity bytes.
+ */
+size_t lz_compress(const void *src, size_t length, void *dst, size_t capacity);
+
+/**
+ * @brief Decompresses a buffer compressed by lz_compress.
+ *
+ * @param src The compressed data.
+ * @param length The size of the compressed data.
+ * @param dst Receives the decompressed data.
+ * @param capacity The size of dst.
+ * @return int The number of bytes decompressed, or -1 if the data is corrupted or does not fit in capacity bytes.
+ */
+int lz_decompress(const void *src, size_t length, void *dst, size_t capacity);
+
+#endif
@@ -0,0 +1,114 @@
+/**
+ * @file prefetch.h
+ * @brief This header file contains the declarations of the read-ahead of sequentially read files.
+ *
+ * Every open file has a prefetch stream. Each read is reported to it with prefetch_access(): while reads keep starting
+ * where the previous one ended (or in its last block), the window the stream reads ahead doubles from
+ * PREFETCH_MIN_BLOCKS up to PREFETCH_MAX_BLOCKS, and any other read drops what was read ahead. A stream has
+ * PREFETCH_WINDOWS windows, so one is consumed while the next one is read. Windows are read through the asynchronous
+ * I/O engine (see aio.h), so the reads overlap with whatever the reader does in the meantime, and are checked against
+ * the block checksums (see checksum.h) the first time they are used.
+ *
+ * The stream only knows logical blocks and the disk blocks it was told they live in: the caller maps the blocks with
+ * prefetch_next() and prefetch_start(), and drops the windows with prefetch_drop() before the file is written, as they
+ * would no longer match the disk. The mmap backend has its blocks in memory already, so nothing is read ahead there.
+ *
+ * A stream is not thread safe, it belongs to one descriptor, which is only used by one thread at a time.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "aio.h"
+#include "disk.h"
+
+#define PREFETCH_MIN_BLOCKS 4  // first window once reads look sequential
+#define PREFETCH_MAX_BLOCKS 64 // largest window, it doubles up to this while reads stay sequential
+#define PREFETCH_WINDOWS 2     // windows per stream, one is consumed while the next one is read
+
+/**
+ * @brief Blocks of a file read ahead of the reader.
+ *
+ * @param start The first logical block of the window.
+ * @param count The number of blocks in the window, 0 if it is empty.
+ * @param request The read of the window, which may still be in progress.
+ * @param verified Flag indicating whether the blocks read were checked against their checksums.
+ * @param data PREFETCH_MAX_BLOCKS blocks of room for the contents.
+ */
+struct prefetch_window
+{
+    uint32_t start;
+    uint32_t count;
+    struct aio_request request;
+    int verified;
+    uint8_t *data;
+};
+
+/**
+ * @brief The read-ahead state of an open file. All zeros is a stream that has seen no read yet.
+ *
+ * @param next The logical block a sequential read would start at next.
+ * @param blocks The size of the next window, 0 while reads do not look sequential.
+ * @param windows PREFETCH_WINDOWS windows (allocated when reads first look sequential), NULL if there are none.
+ */
+struct prefetch_stream
+{
+    uint32_t next;
+    uint32_t blocks;
+    struct prefetch_window *windows;
+};
+
+/**
+ * @brief Reports a read of a range of logical blocks, growing the window if it continues the previous one and dropping
+ * the windows otherwise.
+ *
+ * @param stream The stream of the file.
+ * @param first The first logical block read.
+ * @param last The last logical block read.
+ */
+void prefetch_access(struct prefetch_stream *stream, uint32_t first, uint32_t last);
+
+/**
+ * @brief Copies the data at offset out of the windows, waiting for windows still being read. A window that could not
+ * be read or does not match its checksums is dropped.
+ *
+ * @param stream The stream of the file.
+ * @param buf The buffer to copy to.
+ * @param count The number of bytes wanted.
+ * @param offset The offset in the file of the first byte wanted.
+ * @return size_t The number of bytes copied, from offset on. 0 if offset is not in a window.
+ */
+size_t prefetch_copy(struct prefetch_stream *stream, void *buf, size_t count, off_t offset);
+
+/**
+ * @brief Returns where the next window should start, if reads look sequential and a window is free for it. A window is
+ * free once the reader has moved past it. The windows already ahead of the reader are skipped.
+ *
+ * @param stream The stream of the file.
+ * @param start Receives the logical block the next window starts at.
+ * @return uint32_t The most blocks the window may hold, 0 if no window should be read now.
+ */
+uint32_t prefetch_next(struct prefetch_stream *stream, uint32_t *start);
+
+/**
+ * @brief Starts reading a window returned by prefetch_next() into a free window of the stream.
+ *
+ * @param stream The stream of the file.
+ * @param start The first logical block of the window, as returned by prefetch_next().
+ * @param physical The disk block of the first logical block. The others follow it.
+ * @param count The number of blocks, at most what prefetch_next() returned.
+ */
+void prefetch_start(struct prefetch_stream *stream, uint32_t start, uint32_t physical, uint32_t count);
+
+/**
+ * @brief Empties the windows of a stream, waiting for reads still in progress.
+ *
+ * @param stream The stream of the file.
+ * @param release 1 to free the windows as well (when the file is closed), 0 to keep them for later reads.
+ */
+void prefetch_drop(struct prefetch_stream *stream, int release);
+
+#endif
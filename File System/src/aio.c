@@ -0,0 +1,694 @@
+/**
+ * @file aio.c
+ * @author agent (agent@local)
+ * @brief Asynchronous block I/O engine with io_uring, thread pool and synchronous backends.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The kernel headers define a BLOCK_SIZE of their own, the one of the virtual disk is used here.
+#undef BLOCK_SIZE
+
+#include "aio.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;   // protects everything below
+static pthread_cond_t completed = PTHREAD_COND_INITIALIZER; // signalled when requests complete
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;      // signalled when the I/O threads have work
+static int backend = -1;                                    // backend in use, -1 until the engine is started
+static int queue_depth = 0;                                 // requests in flight at most
+static int inflight = 0;                                    // requests submitted and not reaped yet
+static struct aio_request *pending_head = NULL;             // requests not handed to the backend yet
+static struct aio_request *pending_tail = NULL;
+static struct aio_request *finished_head = NULL;            // requests completed by the backend, not reaped yet
+static struct aio_request *finished_tail = NULL;
+
+// io_uring backend
+static int ring_fd = -1;                   // the ring, -1 if it is not set up
+static void *sq_ring = MAP_FAILED;         // submission ring (also the completion ring with IORING_FEAT_SINGLE_MMAP)
+static size_t sq_ring_size = 0;
+static void *cq_ring = MAP_FAILED;         // completion ring
+static size_t cq_ring_size = 0;
+static struct io_uring_sqe *sqes = MAP_FAILED; // submission queue entries
+static size_t sqes_size = 0;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries = 0;
+static int reaping = 0;                    // whether a thread is waiting in io_uring_enter for completions
+static int in_kernel = 0;                  // requests placed in the submission ring whose completion is not reaped
+
+// thread pool backend
+static pthread_t threads[AIO_THREADS];
+static int nthreads = 0;
+static int stopping = 0;                   // tells the I/O threads to exit
+static struct aio_request *work_head = NULL; // requests waiting for an I/O thread
+static struct aio_request *work_tail = NULL;
+
+/**
+ * Appends a request to a queue.
+ */
+static void enqueue(struct aio_request **head, struct aio_request **tail, struct aio_request *request)
+{
+    request->next = NULL;
+    if (*tail != NULL)
+        (*tail)->next = request;
+    else
+        *head = request;
+    *tail = request;
+}
+
+/**
+ * Takes the first request off a queue, NULL if it is empty.
+ */
+static struct aio_request *dequeue(struct aio_request **head, struct aio_request **tail)
+{
+    struct aio_request *request = *head;
+    if (request != NULL)
+    {
+        *head = request->next;
+        if (*head == NULL)
+            *tail = NULL;
+        request->next = NULL;
+    }
+    return request;
+}
+
+/**
+ * Moves the I/O vector of a request past bytes that have been transferred.
+ */
+static void advance(struct aio_request *request, size_t bytes)
+{
+    request->done += bytes;
+    while (request->iov_count > 0 && bytes >= request->iov->iov_len)
+    {
+        bytes -= request->iov->iov_len;
+        request->iov++;
+        request->iov_count--;
+    }
+    if (request->iov_count > 0)
+    {
+        request->iov->iov_base = (uint8_t *)request->iov->iov_base + bytes;
+        request->iov->iov_len -= bytes;
+    }
+}
+
+/**
+ * Carries out a request on the calling thread, resuming short transfers.
+ *
+ * @return The number of bytes transferred, or -1 on failure.
+ */
+static int transfer(struct aio_request *request)
+{
+    size_t total = (size_t)request->count * BLOCK_SIZE;
+
+    // With the mmap backend every block is a copy to or from the mapping.
+    if (disk_is_mapped())
+    {
+        for (int i = 0; i < request->iov_count; i++)
+        {
+            uint8_t *block = disk_block_ptr(request->start + i);
+            if (block == NULL)
+                return -1;
+            if (request->op == AIO_WRITE)
+                memcpy(block, request->iov[i].iov_base, BLOCK_SIZE);
+            else
+                memcpy(request->iov[i].iov_base, block, BLOCK_SIZE);
+        }
+        disk_record(request->op == AIO_READ ? request->count : 0, request->op == AIO_WRITE ? request->count : 0, 0);
+        return total;
+    }
+
+    while (request->done < total)
+    {
+        off_t position = (off_t)request->start * BLOCK_SIZE + request->done;
+        int count = request->iov_count < IOV_MAX ? request->iov_count : IOV_MAX;
+        ssize_t done = (request->op == AIO_WRITE) ? pwritev(disk_file(), request->iov, count, position)
+                                                   : preadv(disk_file(), request->iov, count, position);
+        disk_record(0, 0, 1);
+        if (done <= 0)
+        {
+            if (done == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        advance(request, done);
+    }
+
+    disk_record(request->op == AIO_READ ? request->count : 0, request->op == AIO_WRITE ? request->count : 0, 0);
+    return total;
+}
+
+/**
+ * Hands a request completed by the backend over for reaping. Must be called with the lock held.
+ */
+static void finish(struct aio_request *request, int result)
+{
+    request->result = result;
+    enqueue(&finished_head, &finished_tail, request);
+}
+
+/**
+ * An I/O thread of the thread pool backend: carries out requests until the pool is stopped.
+ */
+static void *io_thread(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    while (1)
+    {
+        while (work_head == NULL && !stopping)
+        {
+            pthread_cond_wait(&work, &lock);
+        }
+        if (work_head == NULL)
+        {
+            break;
+        }
+
+        struct aio_request *request = dequeue(&work_head, &work_tail);
+        pthread_mutex_unlock(&lock);
+        int result = transfer(request);
+        pthread_mutex_lock(&lock);
+
+        finish(request, result);
+        pthread_cond_broadcast(&completed);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+/**
+ * Sets up an io_uring with room for the queue depth.
+ *
+ * @return 0 on success, -1 if io_uring is not available.
+ */
+static int ring_setup()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+
+    ring_fd = syscall(__NR_io_uring_setup, queue_depth, &params);
+    if (ring_fd < 0)
+    {
+        ring_fd = -1;
+        return -1;
+    }
+
+    // The rings are shared with the kernel through mappings of the ring file.
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_ring_size > sq_ring_size)
+            sq_ring_size = cq_ring_size;
+        cq_ring_size = 0;
+    }
+
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = (cq_ring_size == 0) ? sq_ring
+                                  : mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                                         IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    sq_head = (unsigned *)((uint8_t *)sq_ring + params.sq_off.head);
+    sq_tail = (unsigned *)((uint8_t *)sq_ring + params.sq_off.tail);
+    sq_mask = (unsigned *)((uint8_t *)sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned *)((uint8_t *)sq_ring + params.sq_off.array);
+    cq_head = (unsigned *)((uint8_t *)cq_ring + params.cq_off.head);
+    cq_tail = (unsigned *)((uint8_t *)cq_ring + params.cq_off.tail);
+    cq_mask = (unsigned *)((uint8_t *)cq_ring + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)((uint8_t *)cq_ring + params.cq_off.cqes);
+    sq_entries = params.sq_entries;
+
+    // Never more requests in flight than the submission ring holds.
+    if ((unsigned)queue_depth > sq_entries)
+        queue_depth = sq_entries;
+    return 0;
+}
+
+/**
+ * Tears the io_uring down.
+ */
+static void ring_teardown()
+{
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+    if (ring_fd != -1)
+        close(ring_fd);
+
+    sqes = MAP_FAILED;
+    cq_ring = MAP_FAILED;
+    sq_ring = MAP_FAILED;
+    ring_fd = -1;
+    in_kernel = 0;
+}
+
+/**
+ * Collects the completions the kernel has posted. A short transfer is queued again for the rest. Must be called with the
+ * lock held.
+ */
+static void ring_reap()
+{
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        struct aio_request *request = (struct aio_request *)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+        head++;
+        in_kernel--;
+
+        size_t total = (size_t)request->count * BLOCK_SIZE;
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            enqueue(&pending_head, &pending_tail, request);
+        }
+        else if (res <= 0)
+        {
+            finish(request, -1);
+        }
+        else
+        {
+            advance(request, res);
+            disk_record(0, 0, 1);
+            if (request->done < total)
+            {
+                enqueue(&pending_head, &pending_tail, request);
+            }
+            else
+            {
+                disk_record(request->op == AIO_READ ? request->count : 0, request->op == AIO_WRITE ? request->count : 0, 0);
+                finish(request, total);
+            }
+        }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Hands the pending requests to the backend. Must be called with the lock held.
+ */
+static void flush_pending()
+{
+    if (backend == AIO_BACKEND_THREADS)
+    {
+        if (pending_head != NULL)
+        {
+            while (pending_head != NULL)
+            {
+                enqueue(&work_head, &work_tail, dequeue(&pending_head, &pending_tail));
+            }
+            pthread_cond_broadcast(&work);
+        }
+        return;
+    }
+    if (backend != AIO_BACKEND_IO_URING)
+    {
+        return;
+    }
+
+    // Fill the submission ring, then tell the kernel about everything it has not consumed yet in a single call.
+    unsigned tail = *sq_tail;
+    while (pending_head != NULL && tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) < sq_entries)
+    {
+        struct aio_request *request = dequeue(&pending_head, &pending_tail);
+        unsigned index = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = (request->op == AIO_WRITE) ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = disk_file();
+        sqe->addr = (uintptr_t)request->iov;
+        sqe->len = request->iov_count < IOV_MAX ? request->iov_count : IOV_MAX;
+        sqe->off = (uint64_t)request->start * BLOCK_SIZE + request->done;
+        sqe->user_data = (uintptr_t)request;
+        sq_array[index] = index;
+        tail++;
+        in_kernel++;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    while (to_submit > 0)
+    {
+        int submitted = syscall(__NR_io_uring_enter, ring_fd, to_submit, 0, 0, NULL, 0);
+        if (submitted < 0)
+        {
+            // Busy means completions have to be reaped first, the rest is left in the ring for the next call.
+            if (errno != EINTR)
+                break;
+            continue;
+        }
+        to_submit = tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (submitted == 0)
+            break;
+    }
+}
+
+/**
+ * Waits until at least one more request has completed. Must be called with the lock held, which is released meanwhile.
+ */
+static void wait_completion()
+{
+    flush_pending();
+
+    if (backend == AIO_BACKEND_IO_URING && !reaping)
+    {
+        // Nothing can complete if the kernel holds no request, the caller reaps and tries again.
+        if (in_kernel == 0)
+        {
+            return;
+        }
+
+        // One thread waits in the kernel, the others wait for it to post what it reaped.
+        reaping = 1;
+        pthread_mutex_unlock(&lock);
+        syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        pthread_mutex_lock(&lock);
+        reaping = 0;
+        ring_reap();
+        flush_pending();
+        pthread_cond_broadcast(&completed);
+        return;
+    }
+    pthread_cond_wait(&completed, &lock);
+}
+
+/**
+ * Marks the finished requests done, except those with a callback: they are returned as a list and marked done when
+ * their callback is run, once the lock is released. Must be called with the lock held.
+ *
+ * @param failed Set to 1 if one of them failed.
+ * @return The number of requests reaped.
+ */
+static int reap(struct aio_request **reaped_head, struct aio_request **reaped_tail, int *failed)
+{
+    if (backend == AIO_BACKEND_IO_URING)
+    {
+        ring_reap();
+        flush_pending();
+    }
+
+    int reaped = 0;
+    struct aio_request *request;
+    while ((request = dequeue(&finished_head, &finished_tail)) != NULL)
+    {
+        // The vector has moved past the entries that were transferred in full, one per block.
+        free(request->iov - (request->count - request->iov_count));
+        request->iov = NULL;
+        if (request->result == -1)
+            *failed = 1;
+        inflight--;
+        reaped++;
+
+        // Once a request is done its owner (possibly waiting on another thread) may reuse or free it at any time.
+        if (request->callback != NULL)
+            enqueue(reaped_head, reaped_tail, request);
+        else
+            request->state = AIO_DONE;
+    }
+    return reaped;
+}
+
+/**
+ * Returns non-zero if a request is in a list of reaped requests.
+ */
+static int listed(const struct aio_request *list, const struct aio_request *request)
+{
+    for (; list != NULL; list = list->next)
+    {
+        if (list == request)
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Marks reaped requests done and runs their callbacks. Must be called without the lock.
+ */
+static void run_callbacks(struct aio_request *request)
+{
+    while (request != NULL)
+    {
+        struct aio_request *next = request->next;
+        pthread_mutex_lock(&lock);
+        request->state = AIO_DONE;
+        pthread_cond_broadcast(&completed);
+        pthread_mutex_unlock(&lock);
+
+        request->callback(request);
+        request = next;
+    }
+}
+
+/**
+ * Starts the engine. Must be called with the lock held.
+ */
+static void start(int requested, int depth)
+{
+    queue_depth = depth;
+    stopping = 0;
+
+    // Block transfers of a mapped disk are memory copies, there is nothing to overlap.
+    if (disk_is_mapped() || requested == AIO_BACKEND_SYNC)
+    {
+        backend = AIO_BACKEND_SYNC;
+        return;
+    }
+
+    if (requested == AIO_BACKEND_AUTO || requested == AIO_BACKEND_IO_URING)
+    {
+        if (ring_setup() == 0)
+        {
+            backend = AIO_BACKEND_IO_URING;
+            return;
+        }
+        ring_teardown();
+    }
+
+    nthreads = 0;
+    while (nthreads < AIO_THREADS && pthread_create(&threads[nthreads], NULL, io_thread, NULL) == 0)
+    {
+        nthreads++;
+    }
+    backend = (nthreads > 0) ? AIO_BACKEND_THREADS : AIO_BACKEND_SYNC;
+}
+
+/**
+ * Starts the engine with the defaults if it is not running. Must be called with the lock held.
+ */
+static void ensure_started()
+{
+    if (backend == -1)
+    {
+        start(AIO_BACKEND_AUTO, AIO_DEFAULT_QUEUE_DEPTH);
+    }
+}
+
+int aio_init(int requested, int depth)
+{
+    if (requested < AIO_BACKEND_AUTO || requested > AIO_BACKEND_SYNC || depth < 1 || depth > AIO_MAX_QUEUE_DEPTH)
+    {
+        printf("ERROR: Invalid asynchronous I/O settings.\n");
+        return -1;
+    }
+
+    aio_shutdown();
+
+    pthread_mutex_lock(&lock);
+    start(requested, depth);
+    int result = backend;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int aio_backend()
+{
+    pthread_mutex_lock(&lock);
+    ensure_started();
+    int result = backend;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int aio_submit(struct aio_request *request)
+{
+    if (request->count <= 0 || (request->op != AIO_READ && request->op != AIO_WRITE) ||
+        (request->buf == NULL && request->bufs == NULL) || request->start >= (uint32_t)disk_size() ||
+        (uint32_t)request->count > (uint32_t)disk_size() - request->start)
+    {
+        printf("ERROR: Invalid asynchronous I/O request.\n");
+        return -1;
+    }
+
+    struct iovec *iov = malloc(request->count * sizeof(struct iovec));
+    if (iov == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < request->count; i++)
+    {
+        iov[i].iov_base = (request->bufs != NULL) ? request->bufs[i] : (uint8_t *)request->buf + (size_t)i * BLOCK_SIZE;
+        iov[i].iov_len = BLOCK_SIZE;
+    }
+
+    struct aio_request *reaped_head = NULL, *reaped_tail = NULL;
+    int failed = 0;
+
+    pthread_mutex_lock(&lock);
+    ensure_started();
+
+    // Make room first if the queue is as deep as allowed.
+    while (inflight >= queue_depth)
+    {
+        if (reap(&reaped_head, &reaped_tail, &failed) == 0)
+            wait_completion();
+    }
+
+    request->iov = iov;
+    request->iov_count = request->count;
+    request->done = 0;
+    request->result = 0;
+    request->state = AIO_QUEUED;
+    inflight++;
+
+    if (backend == AIO_BACKEND_SYNC)
+        finish(request, transfer(request));
+    else
+        enqueue(&pending_head, &pending_tail, request);
+    pthread_mutex_unlock(&lock);
+
+    run_callbacks(reaped_head);
+    return 0;
+}
+
+void aio_flush()
+{
+    pthread_mutex_lock(&lock);
+    ensure_started();
+    flush_pending();
+    pthread_mutex_unlock(&lock);
+}
+
+int aio_complete(int min)
+{
+    struct aio_request *reaped_head = NULL, *reaped_tail = NULL;
+    int failed = 0;
+
+    pthread_mutex_lock(&lock);
+    ensure_started();
+    flush_pending();
+    int reaped = reap(&reaped_head, &reaped_tail, &failed);
+    while (reaped < min && inflight > 0)
+    {
+        wait_completion();
+        reaped += reap(&reaped_head, &reaped_tail, &failed);
+    }
+    pthread_mutex_unlock(&lock);
+
+    run_callbacks(reaped_head);
+    return reaped;
+}
+
+int aio_wait(struct aio_request *request)
+{
+    struct aio_request *reaped_head = NULL, *reaped_tail = NULL;
+    int failed = 0;
+
+    pthread_mutex_lock(&lock);
+    if (request->state == AIO_QUEUED)
+    {
+        flush_pending();
+        reap(&reaped_head, &reaped_tail, &failed);
+        while (request->state == AIO_QUEUED && !listed(reaped_head, request))
+        {
+            wait_completion();
+            reap(&reaped_head, &reaped_tail, &failed);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    // A request with a callback is done once the callback was run, here if this call reaped it.
+    run_callbacks(reaped_head);
+
+    pthread_mutex_lock(&lock);
+    int result = (request->state == AIO_DONE) ? request->result : -1;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int aio_drain()
+{
+    struct aio_request *reaped_head = NULL, *reaped_tail = NULL;
+    int failed = 0;
+
+    pthread_mutex_lock(&lock);
+    if (backend != -1)
+    {
+        flush_pending();
+        reap(&reaped_head, &reaped_tail, &failed);
+        while (inflight > 0)
+        {
+            wait_completion();
+            reap(&reaped_head, &reaped_tail, &failed);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    run_callbacks(reaped_head);
+    return failed ? -1 : 0;
+}
+
+void aio_shutdown()
+{
+    aio_drain();
+
+    pthread_mutex_lock(&lock);
+    if (backend == AIO_BACKEND_THREADS)
+    {
+        stopping = 1;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&lock);
+        for (int i = 0; i < nthreads; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_lock(&lock);
+        nthreads = 0;
+    }
+    else if (backend == AIO_BACKEND_IO_URING)
+    {
+        ring_teardown();
+    }
+    backend = -1;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,555 @@
+/**
+ * @file cache.c
+ * @author agent (agent@local)
+ * @brief Write-back LRU buffer cache between the file system and the disk.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "checksum.h"
+
+/**
+ * @brief A single slot of the buffer cache.
+ *
+ * @param blocknum The disk block held in this slot.
+ * @param valid Flag indicating whether the slot holds a block at all.
+ * @param dirty Flag indicating whether the block has been modified since it was read or written back.
+ * @param pinned Flag indicating whether the block must stay in memory, it is neither evicted nor written back.
+ * @param prev Previous slot in the LRU list (towards the most recently used end).
+ * @param next Next slot in the LRU list (towards the least recently used end).
+ * @param hash_next Next slot in the same hash chain.
+ * @param data The contents of the block.
+ */
+struct cache_entry
+{
+    uint32_t blocknum;
+    int valid;
+    int dirty;
+    int pinned;
+    int prev;
+    int next;
+    int hash_next;
+    uint8_t data[BLOCK_SIZE];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // protects everything below
+static struct cache_entry entries[CACHE_BLOCKS]; // cache slots
+static int buckets[CACHE_HASH_BUCKETS];          // head slot of every hash chain, -1 if empty
+static int lru_head = -1;                        // most recently used slot
+static int lru_tail = -1;                        // least recently used slot
+static int initialized = 0;                      // whether the slots have been linked up yet
+static int hits = 0;                             // number of lookups served from the cache
+static int misses = 0;                           // number of lookups that went to the disk
+
+/**
+ * Links every slot into the LRU list and empties the hash chains.
+ */
+static void cache_init()
+{
+    for (int i = 0; i < CACHE_HASH_BUCKETS; i++)
+    {
+        buckets[i] = -1;
+    }
+
+    for (int i = 0; i < CACHE_BLOCKS; i++)
+    {
+        entries[i].valid = 0;
+        entries[i].dirty = 0;
+        entries[i].pinned = 0;
+        entries[i].hash_next = -1;
+        entries[i].prev = i - 1;
+        entries[i].next = (i + 1 < CACHE_BLOCKS) ? i + 1 : -1;
+    }
+
+    lru_head = 0;
+    lru_tail = CACHE_BLOCKS - 1;
+    initialized = 1;
+}
+
+/**
+ * Unlinks a slot from the LRU list.
+ */
+static void lru_remove(int slot)
+{
+    struct cache_entry *entry = &entries[slot];
+
+    if (entry->prev != -1)
+        entries[entry->prev].next = entry->next;
+    else
+        lru_head = entry->next;
+
+    if (entry->next != -1)
+        entries[entry->next].prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+
+    entry->prev = -1;
+    entry->next = -1;
+}
+
+/**
+ * Moves a slot to the most recently used end of the LRU list.
+ */
+static void lru_touch(int slot)
+{
+    if (lru_head == slot)
+        return;
+
+    lru_remove(slot);
+    entries[slot].next = lru_head;
+    if (lru_head != -1)
+        entries[lru_head].prev = slot;
+    lru_head = slot;
+    if (lru_tail == -1)
+        lru_tail = slot;
+}
+
+/**
+ * Removes a slot from the hash chain of the block it currently holds.
+ */
+static void hash_remove(int slot)
+{
+    int *link = &buckets[entries[slot].blocknum % CACHE_HASH_BUCKETS];
+    while (*link != -1)
+    {
+        if (*link == slot)
+        {
+            *link = entries[slot].hash_next;
+            break;
+        }
+        link = &entries[*link].hash_next;
+    }
+    entries[slot].hash_next = -1;
+}
+
+/**
+ * Returns the slot holding the given block, or -1 if it is not cached.
+ */
+static int cache_lookup(uint32_t blocknum)
+{
+    for (int slot = buckets[blocknum % CACHE_HASH_BUCKETS]; slot != -1; slot = entries[slot].hash_next)
+    {
+        if (entries[slot].blocknum == blocknum)
+            return slot;
+    }
+    return -1;
+}
+
+/**
+ * Takes the least recently used slot that is not pinned, writing its block back first if it is dirty, and assigns it to
+ * the given block.
+ *
+ * @return The slot number, or -1 if every slot is pinned or the dirty victim could not be written back.
+ */
+static int cache_evict(uint32_t blocknum)
+{
+    int slot = lru_tail;
+    while (slot != -1 && entries[slot].pinned)
+    {
+        slot = entries[slot].prev;
+    }
+    if (slot == -1)
+    {
+        printf("ERROR: Every cached block is pinned.\n");
+        return -1;
+    }
+    struct cache_entry *entry = &entries[slot];
+
+    if (entry->valid)
+    {
+        if (entry->dirty && disk_write(entry->blocknum, entry->data) == -1)
+        {
+            return -1;
+        }
+        hash_remove(slot);
+    }
+
+    entry->blocknum = blocknum;
+    entry->valid = 1;
+    entry->dirty = 0;
+    entry->pinned = 0;
+    entry->hash_next = buckets[blocknum % CACHE_HASH_BUCKETS];
+    buckets[blocknum % CACHE_HASH_BUCKETS] = slot;
+
+    return slot;
+}
+
+/**
+ * Drops a slot that could not be filled, so that a later lookup does not see garbage.
+ */
+static void cache_discard(int slot)
+{
+    hash_remove(slot);
+    entries[slot].valid = 0;
+    entries[slot].dirty = 0;
+    entries[slot].pinned = 0;
+
+    // Put it at the LRU end so it is the next one to be reused.
+    lru_remove(slot);
+    entries[slot].prev = lru_tail;
+    if (lru_tail != -1)
+        entries[lru_tail].next = slot;
+    lru_tail = slot;
+    if (lru_head == -1)
+        lru_head = slot;
+}
+
+int cache_read(uint32_t blocknum, void *buf)
+{
+    // A mapped disk already lives in memory, caching it again would only add a copy.
+    if (disk_is_mapped())
+    {
+        return (disk_read(blocknum, buf) == -1 || checksum_verify(blocknum, buf) == -1) ? -1 : BLOCK_SIZE;
+    }
+
+    if (buf == NULL || blocknum >= (uint32_t)disk_size())
+    {
+        // Let the disk report the error.
+        return disk_read(blocknum, buf);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (!initialized)
+        cache_init();
+
+    int slot = cache_lookup(blocknum);
+    if (slot != -1)
+    {
+        hits++;
+    }
+    else
+    {
+        misses++;
+        slot = cache_evict(blocknum);
+        if (slot == -1)
+        {
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+
+        // A block is verified once, as it enters the cache.
+        if (disk_read(blocknum, entries[slot].data) == -1 || checksum_verify(blocknum, entries[slot].data) == -1)
+        {
+            cache_discard(slot);
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+    }
+
+    lru_touch(slot);
+    memcpy(buf, entries[slot].data, BLOCK_SIZE);
+    pthread_mutex_unlock(&lock);
+
+    return BLOCK_SIZE;
+}
+
+/**
+ * Copies a block into the cache and marks it dirty, pinning it as well if asked to.
+ */
+static int cache_store(uint32_t blocknum, void *buf, int pin)
+{
+    // A mapped disk already lives in memory, caching it again would only add a copy.
+    if (disk_is_mapped())
+    {
+        // The block is overwritten in place, so its checksum is cleared first: a crash in between leaves it unchecked
+        // rather than mismatched.
+        checksum_begin_update(blocknum);
+        if (disk_write(blocknum, buf) == -1)
+        {
+            return -1;
+        }
+        checksum_update(blocknum, buf);
+        return BLOCK_SIZE;
+    }
+
+    if (buf == NULL || blocknum >= (uint32_t)disk_size())
+    {
+        // Let the disk report the error.
+        return disk_write(blocknum, buf);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (!initialized)
+        cache_init();
+
+    int slot = cache_lookup(blocknum);
+    if (slot != -1)
+    {
+        hits++;
+    }
+    else
+    {
+        // The whole block is overwritten, so there is no need to read it first.
+        misses++;
+        slot = cache_evict(blocknum);
+        if (slot == -1)
+        {
+            pthread_mutex_unlock(&lock);
+            return -1;
+        }
+    }
+
+    // The checksum is recorded under the lock, so it cannot be swapped with the one of another write to the block.
+    lru_touch(slot);
+    memcpy(entries[slot].data, buf, BLOCK_SIZE);
+    checksum_update(blocknum, buf);
+    entries[slot].dirty = 1;
+    if (pin)
+        entries[slot].pinned = 1;
+    pthread_mutex_unlock(&lock);
+
+    return BLOCK_SIZE;
+}
+
+int cache_write(uint32_t blocknum, void *buf)
+{
+    return cache_store(blocknum, buf, 0);
+}
+
+int cache_write_pinned(uint32_t blocknum, void *buf)
+{
+    return cache_store(blocknum, buf, 1);
+}
+
+/**
+ * Verifies a list of blocks just read from the disk.
+ *
+ * @return 0 if they are all intact, -1 otherwise.
+ */
+static int verify_blocks(const uint32_t *blocks, void **bufs, int n)
+{
+    int result = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (checksum_verify(blocks[i], bufs[i]) == -1)
+        {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+ * Records the checksums of a list of blocks just written to the disk.
+ */
+static void update_blocks(const uint32_t *blocks, void **bufs, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        checksum_update(blocks[i], bufs[i]);
+    }
+}
+
+int cache_readv(const uint32_t *blocks, void **bufs, int n)
+{
+    if (disk_is_mapped())
+    {
+        return (disk_readv(blocks, bufs, n) == -1 || verify_blocks(blocks, bufs, n) == -1) ? -1 : n * BLOCK_SIZE;
+    }
+
+    uint32_t *missed_blocks = malloc(n * sizeof(uint32_t));
+    void **missed_bufs = malloc(n * sizeof(void *));
+    if (missed_blocks == NULL || missed_bufs == NULL)
+    {
+        free(missed_blocks);
+        free(missed_bufs);
+        return -1;
+    }
+
+    // Serve what the cache has (it may be newer than the disk) and collect the rest.
+    pthread_mutex_lock(&lock);
+    if (!initialized)
+        cache_init();
+
+    int nmissed = 0;
+    for (int i = 0; i < n; i++)
+    {
+        int slot = (blocks[i] < (uint32_t)disk_size()) ? cache_lookup(blocks[i]) : -1;
+        if (slot != -1)
+        {
+            hits++;
+            lru_touch(slot);
+            memcpy(bufs[i], entries[slot].data, BLOCK_SIZE);
+        }
+        else
+        {
+            misses++;
+            missed_blocks[nmissed] = blocks[i];
+            missed_bufs[nmissed] = bufs[i];
+            nmissed++;
+        }
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    // Missed blocks are read in one go and not kept, so bulk file data does not push metadata out of the cache. The read
+    // happens outside the lock, so readers of different files do not wait for each other's disk transfers.
+    int result = (nmissed > 0) ? disk_readv(missed_blocks, missed_bufs, nmissed) : 0;
+    if (result != -1)
+    {
+        result = verify_blocks(missed_blocks, missed_bufs, nmissed);
+    }
+
+    free(missed_blocks);
+    free(missed_bufs);
+    return (result == -1) ? -1 : n * BLOCK_SIZE;
+}
+
+int cache_writev(const uint32_t *blocks, void **bufs, int n)
+{
+    if (disk_is_mapped())
+    {
+        for (int i = 0; i < n; i++)
+        {
+            checksum_begin_update(blocks[i]);
+        }
+        if (disk_writev(blocks, bufs, n) == -1)
+        {
+            return -1;
+        }
+        update_blocks(blocks, bufs, n);
+        return n * BLOCK_SIZE;
+    }
+
+    // Cached copies are refreshed and marked clean first, under the lock, so neither a reader nor a write-back of an
+    // older dirty copy can come after the new contents reach the disk.
+    pthread_mutex_lock(&lock);
+    if (!initialized)
+        cache_init();
+
+    for (int i = 0; i < n; i++)
+    {
+        int slot = cache_lookup(blocks[i]);
+        if (slot != -1)
+        {
+            hits++;
+            memcpy(entries[slot].data, bufs[i], BLOCK_SIZE);
+            entries[slot].dirty = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    // The blocks go straight to the disk in as few calls as possible, outside the lock. Their checksums are recorded
+    // once they are there, a reader of the old contents in between would not match the new ones.
+    if (disk_writev(blocks, bufs, n) == -1)
+    {
+        // What the disk holds is unknown now, so the refreshed copies are dropped.
+        pthread_mutex_lock(&lock);
+        for (int i = 0; i < n; i++)
+        {
+            int slot = cache_lookup(blocks[i]);
+            if (slot != -1)
+                cache_discard(slot);
+        }
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    update_blocks(blocks, bufs, n);
+
+    return n * BLOCK_SIZE;
+}
+
+/**
+ * Orders slots by the block they hold, used to write dirty blocks back in disk order.
+ */
+static int compare_slots(const void *a, const void *b)
+{
+    uint32_t block_a = entries[*(const int *)a].blocknum;
+    uint32_t block_b = entries[*(const int *)b].blocknum;
+    return (block_a > block_b) - (block_a < block_b);
+}
+
+int cache_sync()
+{
+    // The lock is held until the blocks are written, so they cannot change or be evicted under the write.
+    pthread_mutex_lock(&lock);
+    if (!initialized)
+    {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    // Collect the dirty slots. Pinned blocks may only reach the disk once they are released.
+    int dirty[CACHE_BLOCKS];
+    int ndirty = 0;
+    for (int i = 0; i < CACHE_BLOCKS; i++)
+    {
+        if (entries[i].valid && entries[i].dirty && !entries[i].pinned)
+        {
+            dirty[ndirty++] = i;
+        }
+    }
+
+    // Write them back in block order, so runs of adjacent blocks go out in single vectored writes.
+    qsort(dirty, ndirty, sizeof(int), compare_slots);
+
+    uint32_t blocks[CACHE_BLOCKS];
+    void *bufs[CACHE_BLOCKS];
+    for (int i = 0; i < ndirty; i++)
+    {
+        blocks[i] = entries[dirty[i]].blocknum;
+        bufs[i] = entries[dirty[i]].data;
+    }
+
+    if (ndirty > 0 && disk_writev(blocks, bufs, ndirty) == -1)
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    for (int i = 0; i < ndirty; i++)
+    {
+        entries[dirty[i]].dirty = 0;
+    }
+
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+int cache_pin(uint32_t blocknum, int pinned)
+{
+    pthread_mutex_lock(&lock);
+    if (!initialized)
+        cache_init();
+
+    int slot = (blocknum < (uint32_t)disk_size()) ? cache_lookup(blocknum) : -1;
+    if (slot != -1)
+    {
+        entries[slot].pinned = pinned;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return (slot == -1) ? -1 : 0;
+}
+
+void cache_invalidate()
+{
+    pthread_mutex_lock(&lock);
+    cache_init();
+    pthread_mutex_unlock(&lock);
+}
+
+int cache_hits()
+{
+    pthread_mutex_lock(&lock);
+    int result = hits;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int cache_misses()
+{
+    pthread_mutex_lock(&lock);
+    int result = misses;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
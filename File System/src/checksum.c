@@ -0,0 +1,198 @@
+/**
+ * @file checksum.c
+ * @author agent (agent@local)
+ * @brief Table of the checksums of every block of the disk.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "crc32c.h"
+
+static uint32_t *sums = NULL;       // recorded checksum of every covered block, 0 if none, NULL if there is no table
+static bool in_place = false;       // whether sums points straight at the table in the mapping of the disk
+static uint8_t *dirty = NULL;       // whether each block of the table changed since the last flush
+static uint64_t *verified = NULL;   // bitmap of the blocks known to match their checksum (used with the mmap backend)
+static uint32_t table_start = 0;    // first block of the table area
+static uint32_t table_blocks = 0;   // number of blocks in the table area
+static uint32_t covered_blocks = 0; // number of disk blocks the table covers
+static int failures = 0;            // number of blocks that failed verification
+
+/**
+ * Returns whether a block has an entry in the table. The blocks of the table itself do not.
+ */
+static bool has_entry(uint32_t blocknum)
+{
+    return sums != NULL && blocknum < covered_blocks &&
+           (blocknum < table_start || blocknum - table_start >= table_blocks);
+}
+
+/**
+ * Returns the checksum recorded for the contents of a block, never 0.
+ */
+static uint32_t block_checksum(const void *data)
+{
+    uint32_t sum = crc32c(0, data, BLOCK_SIZE);
+    return (sum != 0) ? sum : 1;
+}
+
+int checksum_init(uint32_t start, uint32_t nblocks, uint32_t covered, int load)
+{
+    checksum_release();
+    if ((uint64_t)nblocks * CHECKSUMS_PER_BLOCK < covered)
+    {
+        return -1;
+    }
+
+    // Blocks of a mapped disk are overwritten in place, outside the journal, so their checksums are too: the table is
+    // used right where it lies in the mapping and is never flushed.
+    in_place = disk_is_mapped() && nblocks > 0;
+    sums = in_place ? disk_block_ptr(start) : calloc((size_t)nblocks * CHECKSUMS_PER_BLOCK, sizeof(uint32_t));
+    dirty = calloc(nblocks, sizeof(uint8_t));
+    verified = calloc((covered + 63) / 64, sizeof(uint64_t));
+    if (sums == NULL || dirty == NULL || verified == NULL ||
+        (in_place && disk_block_ptr(start + nblocks - 1) == NULL) ||
+        (!in_place && load && nblocks > 0 && disk_read_range(start, nblocks, sums) == -1))
+    {
+        checksum_release();
+        return -1;
+    }
+
+    if (in_place && !load)
+    {
+        memset(sums, 0, (size_t)nblocks * BLOCK_SIZE);
+    }
+
+    table_start = start;
+    table_blocks = nblocks;
+    covered_blocks = covered;
+    for (uint32_t i = 0; i < nblocks; i++)
+    {
+        dirty[i] = !load && !in_place;
+    }
+    return 0;
+}
+
+void checksum_release()
+{
+    if (!in_place)
+    {
+        free(sums);
+    }
+    free(dirty);
+    free(verified);
+    sums = NULL;
+    in_place = false;
+    dirty = NULL;
+    verified = NULL;
+    table_start = 0;
+    table_blocks = 0;
+    covered_blocks = 0;
+    failures = 0;
+}
+
+void checksum_begin_update(uint32_t blocknum)
+{
+    if (!has_entry(blocknum))
+    {
+        return;
+    }
+
+    // The fence keeps the write of the block from reaching the disk before the cleared entry does.
+    if (__atomic_exchange_n(&sums[blocknum], 0, __ATOMIC_RELAXED) != 0 && !in_place)
+    {
+        __atomic_store_n(&dirty[blocknum / CHECKSUMS_PER_BLOCK], 1, __ATOMIC_RELEASE);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void checksum_update(uint32_t blocknum, const void *data)
+{
+    if (!has_entry(blocknum))
+    {
+        return;
+    }
+
+    // The entry is stored before the table block is marked changed, so a flush that sees the mark sees the entry. A
+    // block rewritten with the same contents leaves the table alone. An entry in the mapping is stored after the block
+    // it covers.
+    uint32_t sum = block_checksum(data);
+    if (__atomic_exchange_n(&sums[blocknum], sum, __ATOMIC_RELEASE) != sum && !in_place)
+    {
+        __atomic_store_n(&dirty[blocknum / CHECKSUMS_PER_BLOCK], 1, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_or(&verified[blocknum / 64], 1ull << (blocknum % 64), __ATOMIC_RELAXED);
+}
+
+int checksum_verify(uint32_t blocknum, const void *data)
+{
+    if (!has_entry(blocknum))
+    {
+        return 0;
+    }
+
+    uint32_t expected = __atomic_load_n(&sums[blocknum], __ATOMIC_RELAXED);
+    if (expected == 0)
+    {
+        return 0;
+    }
+
+    // Reads from a mapping are not cached, so the blocks already verified are remembered instead.
+    uint64_t bit = 1ull << (blocknum % 64);
+    bool mapped = disk_is_mapped();
+    if (mapped && (__atomic_load_n(&verified[blocknum / 64], __ATOMIC_RELAXED) & bit))
+    {
+        return 0;
+    }
+
+    if (block_checksum(data) != expected)
+    {
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+        printf("ERROR: Checksum mismatch on block %u.\n", blocknum);
+        return -1;
+    }
+
+    if (mapped)
+    {
+        __atomic_fetch_or(&verified[blocknum / 64], bit, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+int checksum_flush(int (*write)(uint32_t blocknum, void *buf))
+{
+    int result = 0;
+    for (uint32_t i = 0; i < table_blocks; i++)
+    {
+        if (!__atomic_exchange_n(&dirty[i], 0, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        // The block is copied out first: writing it may record checksums of other blocks in the meantime.
+        uint32_t block[CHECKSUMS_PER_BLOCK];
+        for (uint32_t j = 0; j < CHECKSUMS_PER_BLOCK; j++)
+        {
+            block[j] = __atomic_load_n(&sums[(size_t)i * CHECKSUMS_PER_BLOCK + j], __ATOMIC_RELAXED);
+        }
+        if (write(table_start + i, block) == -1)
+        {
+            __atomic_store_n(&dirty[i], 1, __ATOMIC_RELAXED);
+            result = -1;
+        }
+    }
+    return result;
+}
+
+int checksum_failures()
+{
+    return __atomic_load_n(&failures, __ATOMIC_RELAXED);
+}
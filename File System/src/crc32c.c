@@ -0,0 +1,191 @@
+/**
+ * @file crc32c.c
+ * @author agent (agent@local)
+ * @brief CRC32C checksum, with the SSE4.2 crc32 instruction where the processor has it.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+#define CRC32C_POLYNOMIAL 0x82F63B78u // Castagnoli polynomial, bit-reflected
+#define CRC32C_LANE 1360              // bytes per lane of the three-lane kernel (a third of a block, in 8-byte words)
+
+static pthread_once_t once = PTHREAD_ONCE_INIT; // runs crc32c_init once
+static uint32_t table[8][256];                  // slicing-by-8 tables, table[0] is the byte-at-a-time table
+static uint32_t shift_table[4][256];            // moves a checksum past CRC32C_LANE zero bytes, one table per byte
+static int accelerated = 0;                     // whether the crc32 instruction is used
+
+/**
+ * Reads 8 bytes, unaligned, as a little-endian word.
+ */
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+#endif
+    return value;
+}
+
+/**
+ * Moves a raw checksum (not inverted) past CRC32C_LANE zero bytes, which is what appending a lane to the data it was
+ * computed over does to it.
+ */
+static uint32_t shift(uint32_t crc)
+{
+    return shift_table[0][crc & 0xff] ^ shift_table[1][(crc >> 8) & 0xff] ^ shift_table[2][(crc >> 16) & 0xff] ^
+           shift_table[3][crc >> 24];
+}
+
+/**
+ * Fills the tables and picks the implementation.
+ */
+static void crc32c_init()
+{
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        table[0][b] = crc;
+    }
+    for (int t = 1; t < 8; t++)
+    {
+        for (uint32_t b = 0; b < 256; b++)
+        {
+            table[t][b] = (table[t - 1][b] >> 8) ^ table[0][table[t - 1][b] & 0xff];
+        }
+    }
+
+    // Running over zero bytes is linear in the checksum, so it is known from what it does to each of the 32 bits.
+    uint32_t bits[32];
+    for (int i = 0; i < 32; i++)
+    {
+        uint32_t crc = 1u << i;
+        for (int n = 0; n < CRC32C_LANE; n++)
+        {
+            crc = (crc >> 8) ^ table[0][crc & 0xff];
+        }
+        bits[i] = crc;
+    }
+    for (int t = 0; t < 4; t++)
+    {
+        for (uint32_t b = 0; b < 256; b++)
+        {
+            uint32_t shifted = 0;
+            for (int i = 0; i < 8; i++)
+            {
+                if (b & (1u << i))
+                    shifted ^= bits[t * 8 + i];
+            }
+            shift_table[t][b] = shifted;
+        }
+    }
+
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    accelerated = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+/**
+ * Runs a raw checksum (not inverted) over a buffer, 8 bytes at a time through the slicing tables.
+ */
+static uint32_t portable_update(uint32_t crc, const uint8_t *p, size_t length)
+{
+    while (length >= 8)
+    {
+        uint64_t word = read64(p) ^ crc;
+        crc = table[7][word & 0xff] ^ table[6][(word >> 8) & 0xff] ^ table[5][(word >> 16) & 0xff] ^
+              table[4][(word >> 24) & 0xff] ^ table[3][(word >> 32) & 0xff] ^ table[2][(word >> 40) & 0xff] ^
+              table[1][(word >> 48) & 0xff] ^ table[0][word >> 56];
+        p += 8;
+        length -= 8;
+    }
+    while (length > 0)
+    {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+        length--;
+    }
+    return crc;
+}
+
+#ifdef __x86_64__
+/**
+ * Runs a raw checksum (not inverted) over a buffer with the crc32 instruction.
+ *
+ * Each instruction has to wait for the previous one, but the processor starts a new one every cycle, so three
+ * independent lanes are run side by side. The checksum of the first lane is moved past the other two with the shift
+ * tables and the three are combined with XOR, the checksum being linear.
+ */
+__attribute__((target("sse4.2"))) static uint32_t hardware_update(uint32_t crc, const uint8_t *p, size_t length)
+{
+    while (length >= 3 * CRC32C_LANE)
+    {
+        uint64_t a = crc, b = 0, c = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8)
+        {
+            a = _mm_crc32_u64(a, read64(p + i));
+            b = _mm_crc32_u64(b, read64(p + CRC32C_LANE + i));
+            c = _mm_crc32_u64(c, read64(p + 2 * CRC32C_LANE + i));
+        }
+        crc = shift(shift((uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c;
+        p += 3 * CRC32C_LANE;
+        length -= 3 * CRC32C_LANE;
+    }
+
+    uint64_t wide = crc;
+    while (length >= 8)
+    {
+        wide = _mm_crc32_u64(wide, read64(p));
+        p += 8;
+        length -= 8;
+    }
+    crc = (uint32_t)wide;
+    while (length > 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        length--;
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&once, crc32c_init);
+#ifdef __x86_64__
+    if (accelerated)
+    {
+        return ~hardware_update(~crc, data, length);
+    }
+#endif
+    return ~portable_update(~crc, data, length);
+}
+
+uint32_t crc32c_portable(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&once, crc32c_init);
+    return ~portable_update(~crc, data, length);
+}
+
+int crc32c_accelerated()
+{
+    pthread_once(&once, crc32c_init);
+    return accelerated;
+}
@@ -1,53 +1,178 @@
 /**
  * @file disk.c
  * @author Sooms (24100180@lums.edu.pk)
- * @brief 
+ * @brief
  * @version 0.1
  * @date 2023-11-14
- * 
+ *
  * @copyright Copyright (c) 2023
- * 
+ *
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include "aio.h"
+#include "cache.h"
 #include "disk.h"
 
-static FILE *disk;               // disk file pointer
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static int disk = -1;                 // disk file descriptor
 static uint32_t number_of_blocks = 0; // number of blocks in the disk
-static int reads = 0;            // number of reads from the disk
-static int writes = 0;           // number of writes to the disk
+static int reads = 0;                 // number of reads from the disk
+static int writes = 0;                // number of writes to the disk
+static int syscalls = 0;              // number of read/write system calls issued
+static uint8_t *mapping = NULL;       // start of the disk image in memory, NULL unless the mmap backend is used
+
+/**
+ * Adds to one of the statistics counters. Blocks may be read from the read-ahead thread, so this is done atomically.
+ */
+static void add_stat(int *counter, int n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Maps the opened disk file into memory.
+ *
+ * @return Returns 0 on success, -1 on failure.
+ */
+static int disk_map(int nblocks)
+{
+    size_t length = (size_t)nblocks * BLOCK_SIZE;
+
+    void *addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, disk, 0);
+    if (addr == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    mapping = addr;
+    return 0;
+}
+
+/**
+ * Writes zero blocks over [start, start + n) of the opened disk file. Used when the file system underneath the image can
+ * neither preallocate nor punch holes.
+ *
+ * @return Returns 0 on success, -1 on failure.
+ */
+static int disk_write_zeros(uint32_t start, uint32_t n)
+{
+    // Zero a handful of blocks per call instead of one.
+    const uint32_t chunk_blocks = 64;
+    char *zeros = calloc(chunk_blocks, BLOCK_SIZE);
+    if (zeros == NULL)
+    {
+        return -1;
+    }
+
+    while (n > 0)
+    {
+        uint32_t batch = n < chunk_blocks ? n : chunk_blocks;
+        add_stat(&syscalls, 1);
+        if (pwrite(disk, zeros, (size_t)batch * BLOCK_SIZE, (off_t)start * BLOCK_SIZE) != (ssize_t)batch * BLOCK_SIZE)
+        {
+            free(zeros);
+            return -1;
+        }
+        start += batch;
+        n -= batch;
+    }
+
+    free(zeros);
+    return 0;
+}
+
+/**
+ * Gives a newly created disk file its full size.
+ *
+ * With DISK_SPARSE only the file size is set, so the image takes no space until blocks are written. Otherwise the blocks
+ * are preallocated with fallocate, falling back to writing zeros where that is not supported.
+ *
+ * @return Returns 0 on success, -1 on failure.
+ */
+static int disk_provision(int nblocks, int flags)
+{
+    off_t length = (off_t)nblocks * BLOCK_SIZE;
+
+    if (flags & DISK_SPARSE)
+    {
+        return ftruncate(disk, length);
+    }
+
+    if (fallocate(disk, 0, 0, length) == 0)
+    {
+        return 0;
+    }
+
+    return disk_write_zeros(0, nblocks);
+}
 
 int disk_init(char *filename, int nblocks)
 {
-    // Open the file in read mode.
-    disk = fopen(filename, "r+");
+    return disk_open(filename, nblocks, 0);
+}
+
+int disk_open(char *filename, int nblocks, int flags)
+{
+    // Open the file for reading and writing.
+    disk = open(filename, O_RDWR);
 
     // If the file does not exist, create it.
-    if (disk == NULL)
+    if (disk == -1)
     {
-        // Open the file in write mode.
-        disk = fopen(filename, "w+");
+        // Create the file.
+        disk = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
 
         // If the file could not be created, return -1.
-        if (disk == NULL)
+        if (disk == -1)
         {
             return -1;
         }
 
-        // Create a block of zeros.
-        char *block = calloc(BLOCK_SIZE, sizeof(char));
-
-        // Write the blocks to the disk.
-        for (int i = 0; i < nblocks; i++)
+        // Size the new image without writing any data: a sparse image only sets the file size, otherwise the blocks are
+        // preallocated. Either way unwritten blocks read as zeros.
+        if (disk_provision(nblocks, flags) == -1)
         {
-            fwrite(block, BLOCK_SIZE, 1, disk);
+            close(disk);
+            disk = -1;
+            return -1;
         }
+    }
+    else
+    {
+        // An existing image smaller than the disk is grown with zeros, so every block can be read (and mapped, touching a
+        // page past the end of the file raises SIGBUS).
+        struct stat st;
+        if (fstat(disk, &st) == -1 || (st.st_size < (off_t)nblocks * BLOCK_SIZE && ftruncate(disk, (off_t)nblocks * BLOCK_SIZE) == -1))
+        {
+            close(disk);
+            disk = -1;
+            return -1;
+        }
+    }
 
-        // Free the block.
-        free(block);
+    // Map the disk if asked to.
+    if ((flags & DISK_MMAP) && disk_map(nblocks) == -1)
+    {
+        printf("ERROR: Could not map disk into memory.\n");
+        close(disk);
+        disk = -1;
+        return -1;
     }
 
     // Set the number of blocks.
@@ -63,12 +188,29 @@ int disk_size()
     return number_of_blocks;
 }
 
+int disk_is_mapped()
+{
+    return mapping != NULL;
+}
+
+int disk_file()
+{
+    return disk;
+}
+
+void disk_record(int blocks_read, int blocks_written, int calls)
+{
+    add_stat(&reads, blocks_read);
+    add_stat(&writes, blocks_written);
+    add_stat(&syscalls, calls);
+}
+
 /**
  * Checks if the given block number and buffer are valid.
- * 
+ *
  * @param blocknum The block number to be checked.
  * @param buf The buffer to be checked.
- * 
+ *
  * @return Returns 0 if both the block number and buffer are valid, otherwise returns a non-zero value.
  */
 static int sanity_check(uint32_t blocknum, const void *buf)
@@ -96,21 +238,24 @@ int disk_read(uint32_t blocknum, void *buf)
         return -1;
     }
 
-    // Seek to the block.
-    fseek(disk, blocknum * BLOCK_SIZE, SEEK_SET);
-
-    // Read the block.
-    int blocks_read = fread(buf, BLOCK_SIZE, 1, disk);
+    // With the mmap backend the block is a plain copy out of the mapping.
+    if (mapping != NULL)
+    {
+        memcpy(buf, mapping + (size_t)blocknum * BLOCK_SIZE, BLOCK_SIZE);
+        add_stat(&reads, 1);
+        return BLOCK_SIZE;
+    }
 
-    // If the number of blocks read is not 1, return -1.
-    if (blocks_read != 1)
+    // Read the block at its position.
+    add_stat(&syscalls, 1);
+    if (pread(disk, buf, BLOCK_SIZE, (off_t)blocknum * BLOCK_SIZE) != BLOCK_SIZE)
     {
         printf("ERROR: Could not read block %d.\n", blocknum);
         return -1;
     }
 
     // Increment the number of reads.
-    reads++;
+    add_stat(&reads, 1);
 
     // Return the number of bytes read.
     return BLOCK_SIZE;
@@ -124,37 +269,364 @@ int disk_write(uint32_t blocknum, void *buf)
         return -1;
     }
 
-    // Seek to the block.
-    fseek(disk, blocknum * BLOCK_SIZE, SEEK_SET);
-
-    // Write the block.
-    int blocks_written = fwrite(buf, BLOCK_SIZE, 1, disk);
+    // With the mmap backend the block is a plain copy into the mapping, msync makes it durable.
+    if (mapping != NULL)
+    {
+        memcpy(mapping + (size_t)blocknum * BLOCK_SIZE, buf, BLOCK_SIZE);
+        add_stat(&writes, 1);
+        return BLOCK_SIZE;
+    }
 
-    // If the number of blocks written is not 1, return -1.
-    if (blocks_written != 1)
+    // Write the block at its position.
+    add_stat(&syscalls, 1);
+    if (pwrite(disk, buf, BLOCK_SIZE, (off_t)blocknum * BLOCK_SIZE) != BLOCK_SIZE)
     {
         printf("ERROR: Could not write block %d.\n", blocknum);
         return -1;
     }
 
     // Increment the number of writes.
-    writes++;
+    add_stat(&writes, 1);
 
     // Return the number of bytes written.
     return BLOCK_SIZE;
 }
 
+/**
+ * Transfers a run of consecutive blocks with as few preadv/pwritev calls as possible.
+ *
+ * @param start The first block of the run.
+ * @param bufs One buffer per block of the run.
+ * @param n The number of blocks in the run.
+ * @param write 1 to write the buffers to the disk, 0 to read into them.
+ *
+ * @return Returns 0 on success, -1 on failure.
+ */
+static int disk_transfer_run(uint32_t start, void *const *bufs, int n, int write)
+{
+    struct iovec iov[IOV_MAX];
+
+    while (n > 0)
+    {
+        int batch = n < IOV_MAX ? n : IOV_MAX;
+        for (int i = 0; i < batch; i++)
+        {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = BLOCK_SIZE;
+        }
+
+        // A short transfer is resumed from where it stopped.
+        off_t position = (off_t)start * BLOCK_SIZE;
+        size_t remaining = (size_t)batch * BLOCK_SIZE;
+        struct iovec *next = iov;
+        int count = batch;
+        while (remaining > 0)
+        {
+            add_stat(&syscalls, 1);
+            ssize_t done = write ? pwritev(disk, next, count, position) : preadv(disk, next, count, position);
+            if (done <= 0)
+            {
+                if (done == -1 && errno == EINTR)
+                    continue;
+                return -1;
+            }
+
+            position += done;
+            remaining -= done;
+            while (count > 0 && (size_t)done >= next->iov_len)
+            {
+                done -= next->iov_len;
+                next++;
+                count--;
+            }
+            if (count > 0)
+            {
+                next->iov_base = (uint8_t *)next->iov_base + done;
+                next->iov_len -= done;
+            }
+        }
+
+        start += batch;
+        bufs += batch;
+        n -= batch;
+    }
+
+    return 0;
+}
+
+/**
+ * Transfers a list of blocks made of several runs of adjacent block numbers, with every run in flight at once in the
+ * asynchronous engine.
+ *
+ * @return Returns 0 on success, -1 on failure.
+ */
+static int disk_transfer_async(const uint32_t *blocks, void *const *bufs, int n, int nruns, int write)
+{
+    struct aio_request *requests = calloc(nruns, sizeof(struct aio_request));
+    if (requests == NULL)
+    {
+        return -1;
+    }
+
+    int submitted = 0;
+    int result = 0;
+    for (int i = 0; i < n && result == 0; submitted++)
+    {
+        int run = 1;
+        while (i + run < n && blocks[i + run] == blocks[i] + run)
+        {
+            run++;
+        }
+
+        struct aio_request *request = &requests[submitted];
+        request->op = write ? AIO_WRITE : AIO_READ;
+        request->start = blocks[i];
+        request->count = run;
+        request->bufs = (void **)bufs + i;
+        result = aio_submit(request);
+        i += run;
+    }
+    aio_flush();
+
+    // Every submitted request is waited for, even after a failure, as they still use the caller's buffers.
+    for (int i = 0; i < submitted; i++)
+    {
+        if (aio_wait(&requests[i]) == -1)
+        {
+            printf("ERROR: Could not %s blocks %d-%d.\n", write ? "write" : "read", requests[i].start,
+                   requests[i].start + requests[i].count - 1);
+            result = -1;
+        }
+    }
+
+    free(requests);
+    return result;
+}
+
+/**
+ * Transfers a list of blocks, coalescing runs of adjacent block numbers into single vectored calls.
+ *
+ * @return Returns 0 on success, -1 on failure.
+ */
+static int disk_transfer(const uint32_t *blocks, void *const *bufs, int n, int write)
+{
+    int nruns = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (sanity_check(blocks[i], bufs[i]) != 0)
+        {
+            return -1;
+        }
+        if (i == 0 || blocks[i] != blocks[i - 1] + 1)
+        {
+            nruns++;
+        }
+    }
+
+    // Scattered blocks of a file-backed disk are better served by many requests in flight than by one run at a time.
+    if (mapping == NULL && nruns > 1)
+    {
+        return (disk_transfer_async(blocks, bufs, n, nruns, write) == -1) ? -1 : n * BLOCK_SIZE;
+    }
+
+    int i = 0;
+    while (i < n)
+    {
+        // Find the end of the run of adjacent blocks starting at i.
+        int run = 1;
+        while (i + run < n && blocks[i + run] == blocks[i] + run)
+        {
+            run++;
+        }
+
+        if (mapping != NULL)
+        {
+            for (int j = 0; j < run; j++)
+            {
+                uint8_t *block = mapping + (size_t)(blocks[i] + j) * BLOCK_SIZE;
+                if (write)
+                    memcpy(block, bufs[i + j], BLOCK_SIZE);
+                else
+                    memcpy(bufs[i + j], block, BLOCK_SIZE);
+            }
+        }
+        else if (disk_transfer_run(blocks[i], bufs + i, run, write) == -1)
+        {
+            printf("ERROR: Could not %s blocks %d-%d.\n", write ? "write" : "read", blocks[i], blocks[i] + run - 1);
+            return -1;
+        }
+
+        if (write)
+            add_stat(&writes, run);
+        else
+            add_stat(&reads, run);
+
+        i += run;
+    }
+
+    return n * BLOCK_SIZE;
+}
+
+int disk_readv(const uint32_t *blocks, void **bufs, int n)
+{
+    return disk_transfer(blocks, bufs, n, 0);
+}
+
+int disk_writev(const uint32_t *blocks, void **bufs, int n)
+{
+    return disk_transfer(blocks, bufs, n, 1);
+}
+
+/**
+ * Transfers n consecutive blocks to or from one contiguous buffer.
+ *
+ * @return The number of bytes transferred, or -1 if an error occurred.
+ */
+static int disk_transfer_range(uint32_t start, int n, void *buf, int write)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+
+    void **bufs = malloc(n * sizeof(void *));
+    uint32_t *blocks = malloc(n * sizeof(uint32_t));
+    if (bufs == NULL || blocks == NULL)
+    {
+        free(bufs);
+        free(blocks);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        blocks[i] = start + i;
+        bufs[i] = (uint8_t *)buf + (size_t)i * BLOCK_SIZE;
+    }
+
+    int result = disk_transfer(blocks, bufs, n, write);
+
+    free(bufs);
+    free(blocks);
+    return result;
+}
+
+int disk_read_range(uint32_t start, int n, void *buf)
+{
+    return disk_transfer_range(start, n, buf, 0);
+}
+
+int disk_write_range(uint32_t start, int n, void *buf)
+{
+    return disk_transfer_range(start, n, buf, 1);
+}
+
+int disk_zero_range(uint32_t start, int n)
+{
+    if (n <= 0)
+    {
+        return 0;
+    }
+
+    if (start >= number_of_blocks || n > (int)(number_of_blocks - start))
+    {
+        printf("ERROR: Block number must be less than %d.\n", number_of_blocks);
+        return -1;
+    }
+
+    // Punching a hole zeroes the range in the file (and in the mapping) without writing it.
+    if (fallocate(disk, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)start * BLOCK_SIZE, (off_t)n * BLOCK_SIZE) == 0)
+    {
+        return 0;
+    }
+
+    if (mapping != NULL)
+    {
+        memset(mapping + (size_t)start * BLOCK_SIZE, 0, (size_t)n * BLOCK_SIZE);
+        add_stat(&writes, n);
+        return 0;
+    }
+
+    if (disk_write_zeros(start, n) == -1)
+    {
+        printf("ERROR: Could not zero blocks %d-%d.\n", start, start + n - 1);
+        return -1;
+    }
+    add_stat(&writes, n);
+
+    return 0;
+}
+
+void *disk_block_ptr(uint32_t blocknum)
+{
+    if (mapping == NULL || blocknum >= number_of_blocks)
+    {
+        return NULL;
+    }
+
+    // Count it as a read, the caller is about to look at the block.
+    add_stat(&reads, 1);
+
+    return mapping + (size_t)blocknum * BLOCK_SIZE;
+}
+
+int disk_sync()
+{
+    if (disk == -1)
+    {
+        printf("ERROR: Disk is not open.\n");
+        return -1;
+    }
+
+    if (mapping != NULL)
+    {
+        if (msync(mapping, (size_t)number_of_blocks * BLOCK_SIZE, MS_SYNC) == -1)
+        {
+            printf("ERROR: Could not sync disk.\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (fsync(disk) == -1)
+    {
+        printf("ERROR: Could not sync disk.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
 int disk_close()
 {
     // If the disk is not open, return -1.
-    if (disk == NULL)
+    if (disk == -1)
     {
         printf("ERROR: Disk is not open.\n");
         return -1;
     }
 
-    // If the disk could not be flushed, return -1.
-    else if (fclose(disk) != 0)
+    // Write back the blocks still dirty in the cache, and let every asynchronous request finish.
+    if (cache_sync() == -1)
+    {
+        printf("ERROR: Could not write back cached blocks.\n");
+        return -1;
+    }
+    aio_shutdown();
+
+    // Flush and drop the mapping.
+    if (mapping != NULL)
+    {
+        if (disk_sync() == -1 || munmap(mapping, (size_t)number_of_blocks * BLOCK_SIZE) == -1)
+        {
+            printf("ERROR: Could not unmap disk.\n");
+            return -1;
+        }
+        mapping = NULL;
+    }
+
+    // If the disk could not be closed, return -1.
+    if (close(disk) != 0)
     {
         printf("ERROR: Could not close disk.\n");
         return -1;
@@ -163,11 +635,15 @@ int disk_close()
     // Print the number of reads and writes.
     printf("Reads (Blocks): %d\n", reads);
     printf("Writes (Blocks): %d\n", writes);
+    printf("I/O System Calls: %d\n", syscalls);
+    printf("Cache Hits (Blocks): %d\n", cache_hits());
+    printf("Cache Misses (Blocks): %d\n", cache_misses());
     printf("Disk closed.\n");
 
-    // Clear the disk pointer.
-    disk = NULL;
+    // Clear the disk descriptor and forget the cached blocks of this disk.
+    disk = -1;
+    cache_invalidate();
 
     // Return 0.
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,405 @@
+/**
+ * @file freespace.c
+ * @author agent (agent@local)
+ * @brief In-memory index of the free extents of a block group.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "freespace.h"
+
+/**
+ * @brief A run of free blocks, and a node of the tree of the index.
+ *
+ * The tree is a treap: ordered by start like a binary search tree, and by priority like a heap, which keeps it
+ * balanced on average whatever the order of the updates.
+ *
+ * @param start The first block of the run.
+ * @param length The number of blocks in the run.
+ * @param longest The length of the longest run in the subtree of the node.
+ * @param priority Random priority, never lower than the priorities of the children.
+ * @param left The runs before this one.
+ * @param right The runs after this one.
+ */
+struct free_extent
+{
+    uint32_t start;
+    uint32_t length;
+    uint32_t longest;
+    uint32_t priority;
+    struct free_extent *left;
+    struct free_extent *right;
+};
+
+/**
+ * Returns the next priority of the index (xorshift).
+ */
+static uint32_t next_priority(struct freespace *space)
+{
+    if (space->seed == 0)
+    {
+        space->seed = 2463534242u;
+    }
+    space->seed ^= space->seed << 13;
+    space->seed ^= space->seed >> 17;
+    space->seed ^= space->seed << 5;
+    return space->seed;
+}
+
+/**
+ * Recomputes the longest run below a node from its children.
+ */
+static void update(struct free_extent *node)
+{
+    node->longest = node->length;
+    if (node->left != NULL && node->left->longest > node->longest)
+    {
+        node->longest = node->left->longest;
+    }
+    if (node->right != NULL && node->right->longest > node->longest)
+    {
+        node->longest = node->right->longest;
+    }
+}
+
+/**
+ * Splits a tree into the runs that start before key and the others.
+ */
+static void split(struct free_extent *node, uint32_t key, struct free_extent **left, struct free_extent **right)
+{
+    if (node == NULL)
+    {
+        *left = NULL;
+        *right = NULL;
+        return;
+    }
+
+    if (node->start < key)
+    {
+        split(node->right, key, &node->right, right);
+        *left = node;
+    }
+    else
+    {
+        split(node->left, key, left, &node->left);
+        *right = node;
+    }
+    update(node);
+}
+
+/**
+ * Joins two trees, every run of the first one starting before every run of the second one.
+ */
+static struct free_extent *merge(struct free_extent *left, struct free_extent *right)
+{
+    if (left == NULL)
+    {
+        return right;
+    }
+    if (right == NULL)
+    {
+        return left;
+    }
+
+    if (left->priority > right->priority)
+    {
+        left->right = merge(left->right, right);
+        update(left);
+        return left;
+    }
+    right->left = merge(left, right->left);
+    update(right);
+    return right;
+}
+
+/**
+ * Adds a node to the tree. No run may start at the same block.
+ */
+static void insert(struct freespace *space, struct free_extent *node)
+{
+    node->priority = next_priority(space);
+    node->left = NULL;
+    node->right = NULL;
+    node->longest = node->length;
+
+    struct free_extent *left, *right;
+    split(space->root, node->start, &left, &right);
+    space->root = merge(merge(left, node), right);
+    space->extents++;
+}
+
+/**
+ * Takes the run that starts at the given block out of the tree.
+ *
+ * @return The node of the run, or NULL if no run starts there.
+ */
+static struct free_extent *erase(struct freespace *space, uint32_t start)
+{
+    struct free_extent *left, *middle, *right;
+    split(space->root, start, &left, &right);
+    split(right, start + 1, &middle, &right);
+    space->root = merge(left, right);
+    if (middle != NULL)
+    {
+        space->extents--;
+    }
+    return middle;
+}
+
+/**
+ * Returns the run starting last at or before the given block, NULL if there is none.
+ */
+static struct free_extent *find_at_or_before(struct free_extent *node, uint32_t block)
+{
+    struct free_extent *found = NULL;
+    while (node != NULL)
+    {
+        if (node->start <= block)
+        {
+            found = node;
+            node = node->right;
+        }
+        else
+        {
+            node = node->left;
+        }
+    }
+    return found;
+}
+
+/**
+ * Returns the first run of at least count blocks starting at or after goal, NULL if there is none. Subtrees without a
+ * run that long are skipped.
+ */
+static struct free_extent *find_fit(struct free_extent *node, uint32_t goal, uint32_t count)
+{
+    if (node == NULL || node->longest < count)
+    {
+        return NULL;
+    }
+
+    if (node->start < goal)
+    {
+        return find_fit(node->right, goal, count);
+    }
+
+    struct free_extent *found = find_fit(node->left, goal, count);
+    if (found != NULL)
+    {
+        return found;
+    }
+    if (node->length >= count)
+    {
+        return node;
+    }
+    return find_fit(node->right, goal, count);
+}
+
+/**
+ * Returns the longest run, the first one if several are as long.
+ */
+static struct free_extent *find_longest(struct free_extent *node)
+{
+    while (1)
+    {
+        if (node->left != NULL && node->left->longest == node->longest)
+        {
+            node = node->left;
+        }
+        else if (node->length == node->longest)
+        {
+            return node;
+        }
+        else
+        {
+            node = node->right;
+        }
+    }
+}
+
+/**
+ * Takes count blocks from start out of the run of a node, putting what is left on either side back into the tree.
+ */
+static void carve(struct freespace *space, struct free_extent *node, uint32_t start, uint32_t count)
+{
+    node = erase(space, node->start);
+    uint32_t end = node->start + node->length;
+
+    if (start > node->start)
+    {
+        node->length = start - node->start;
+        insert(space, node);
+        // If there is no memory for the part after the run, it stays out of the index until it is rebuilt.
+        node = (start + count < end) ? malloc(sizeof(struct free_extent)) : NULL;
+    }
+    if (node != NULL && start + count < end)
+    {
+        node->start = start + count;
+        node->length = end - node->start;
+        insert(space, node);
+        node = NULL;
+    }
+    free(node);
+
+    space->blocks -= count;
+}
+
+/**
+ * Frees every node of a subtree.
+ */
+static void release_tree(struct free_extent *node)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+    release_tree(node->left);
+    release_tree(node->right);
+    free(node);
+}
+
+int freespace_build(struct freespace *space, const uint64_t *words, uint32_t first, uint32_t nbits)
+{
+    freespace_release(space);
+
+    // Walk the bitmap a word at a time, adding every run of clear bits.
+    uint32_t bit = first;
+    uint32_t run_start = 0;
+    bool in_run = false;
+    while (bit < nbits)
+    {
+        uint32_t offset = bit % 64;
+        uint64_t shifted = words[bit / 64] >> offset;
+        bool used = shifted & 1;
+        uint64_t changes = used ? ~shifted : shifted;
+        uint32_t same = (changes != 0) ? (uint32_t)__builtin_ctzll(changes) : 64 - offset;
+        if (same > 64 - offset)
+        {
+            same = 64 - offset;
+        }
+        if (same > nbits - bit)
+        {
+            same = nbits - bit;
+        }
+
+        if (!used && !in_run)
+        {
+            run_start = bit;
+            in_run = true;
+        }
+        bit += same;
+
+        if (in_run && (used || bit == nbits))
+        {
+            uint32_t run_end = used ? bit - same : bit;
+            struct free_extent *node = malloc(sizeof(struct free_extent));
+            if (node == NULL)
+            {
+                freespace_release(space);
+                return -1;
+            }
+            node->start = run_start;
+            node->length = run_end - run_start;
+            insert(space, node);
+            space->blocks += node->length;
+            in_run = false;
+        }
+    }
+
+    return 0;
+}
+
+void freespace_release(struct freespace *space)
+{
+    release_tree(space->root);
+    space->root = NULL;
+    space->extents = 0;
+    space->blocks = 0;
+}
+
+uint32_t freespace_allocate(struct freespace *space, uint32_t goal, uint32_t count, uint32_t *length)
+{
+    *length = 0;
+    if (space->root == NULL || count == 0)
+    {
+        return -1;
+    }
+
+    // Grow in place if the goal is free.
+    struct free_extent *node = find_at_or_before(space->root, goal);
+    if (node != NULL && goal < node->start + node->length)
+    {
+        uint32_t end = node->start + node->length;
+        *length = (end - goal < count) ? end - goal : count;
+        carve(space, node, goal, *length);
+        return goal;
+    }
+
+    // Otherwise take the first run long enough after the goal, then from the start, then the longest one.
+    node = find_fit(space->root, goal, count);
+    if (node == NULL)
+    {
+        node = find_fit(space->root, 0, count);
+    }
+    if (node == NULL)
+    {
+        node = find_longest(space->root);
+    }
+
+    uint32_t start = node->start;
+    *length = (node->length < count) ? node->length : count;
+    carve(space, node, start, *length);
+    return start;
+}
+
+int freespace_free(struct freespace *space, uint32_t start, uint32_t length)
+{
+    if (length == 0)
+    {
+        return 0;
+    }
+    uint32_t end = start + length;
+
+    // Merge with the run that ends where this one starts, and with the one that starts where it ends.
+    struct free_extent *node = NULL;
+    struct free_extent *before = find_at_or_before(space->root, start);
+    if (before != NULL && before->start + before->length == start)
+    {
+        start = before->start;
+        node = erase(space, before->start);
+    }
+    struct free_extent *after = find_at_or_before(space->root, end);
+    if (after != NULL && after->start == end)
+    {
+        end = after->start + after->length;
+        struct free_extent *erased = erase(space, after->start);
+        if (node == NULL)
+        {
+            node = erased;
+        }
+        else
+        {
+            free(erased);
+        }
+    }
+
+    if (node == NULL)
+    {
+        node = malloc(sizeof(struct free_extent));
+        if (node == NULL)
+        {
+            return -1;
+        }
+    }
+    node->start = start;
+    node->length = end - start;
+    insert(space, node);
+    space->blocks += length;
+    return 0;
+}
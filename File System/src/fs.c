@@ -9,883 +9,5283 @@
  *
  */
 
-#include <math.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include "aio.h"
+#include "cache.h"
+#include "checksum.h"
+#include "crc32c.h"
+#include "freespace.h"
 #include "fs.h"
+#include "journal.h"
 #include "log.h"
+#include "lz.h"
+#include "prefetch.h"
+
+#define TRANSFER_BATCH 64 // whole file blocks moved per vectored disk call
+#define WRITE_BUFFER_SIZE (256 * BLOCK_SIZE) // file data held back per open file before blocks are allocated for it
+
+#define INODE_CACHE_SIZE 128        // number of inodes kept in core
+#define INODE_CACHE_HASH_BUCKETS 61 // number of hash chains used to look cached inodes up
+#define DENTRY_CACHE_SIZE 1024        // number of directory lookups kept in core
+#define DENTRY_CACHE_HASH_BUCKETS 509 // number of hash chains used to look cached lookups up
+#define EXTENT_MAX_DEPTH 5 // levels of an extent tree, counting the root in the inode
+#define LEGACY_FLAGS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t)) // flags in a bitmap block of the single-block layout
+#define FINGERPRINT_PROBES 4 // slots of the fingerprint index a fingerprint may sit in
+
+// Journal credits of the parts of an operation. Every metadata block written may also change its checksum table block.
+#define CREDITS_INODE 2                       // writing an inode back
+#define CREDITS_EXTENT (4 * EXTENT_MAX_DEPTH) // changing an extent or a path of indirect blocks, splitting every level
+#define CREDITS_BLOCK 5 // a file block: the bitmap, reference and checksum blocks of a new block, the reference block of
+                        // a shared one it replaces and a revoke
+#define CREDITS_CREATE (3 * CREDITS_INODE + 2 * CREDITS_BLOCK + CREDITS_EXTENT) // adding or removing an entry and inode
+#define CREDITS_WRITE (CREDITS_INODE + CREDITS_EXTENT + 4 * CREDITS_BLOCK) // a write to begin with, see write_inode_steps
+
+/**
+ * @brief An inode held in core by the inode cache.
+ *
+ * @param inode The inode itself. Must stay the first member, handles given out by get_inode point here.
+ * @param inode_number The number of the inode.
+ * @param refcount Number of references handed out by get_inode and not yet released with put_inode.
+ * @param state What the slot holds, see enum inode_slot_state.
+ * @param dirty Flag indicating whether the inode was changed since it was written to the inode table.
+ * @param free_prev Previous slot in the free list (the slots no reference is held to), -1 at its head.
+ * @param free_next Next slot in the free list, -1 at its tail.
+ * @param hash_next Next slot in the same hash chain.
+ * @param lock Taken shared by reads of the file and exclusive by writes, see inode_lock. It belongs to the slot, so it
+ *             is never reinitialised while the slot is reused.
+ */
+struct cached_inode
+{
+    struct inode inode;
+    uint32_t inode_number;
+    int refcount;
+    int state;
+    int dirty;
+    int free_prev;
+    int free_next;
+    int hash_next;
+    pthread_rwlock_t lock;
+};
+
+/**
+ * @brief States of a slot of the inode cache. The inode table is read and written with INODE_CACHE_LOCK released, and a
+ * thread finding a slot LOADING or EVICTING waits on INODE_CACHE_COND until the I/O is done.
+ */
+enum inode_slot_state
+{
+    INODE_SLOT_EMPTY,    // holds no inode
+    INODE_SLOT_LOADING,  // being read from the inode table, the inode is not there yet
+    INODE_SLOT_VALID,    // holds the inode
+    INODE_SLOT_WRITING,  // holds the inode, a copy of which is being written to the inode table
+    INODE_SLOT_EVICTING, // being written to the inode table before the slot is reused for another inode
+};
+
+/**
+ * @brief A cached directory lookup: what a directory holds under a name.
+ *
+ * @param parent_inode_number The inode number of the directory.
+ * @param inode_number The inode the name refers to, 0 for a negative entry (the directory has no such name).
+ * @param name The name looked up.
+ * @param valid Flag indicating whether the slot holds an entry at all.
+ * @param referenced Flag set on every use, cleared by the clock hand when it looks for a slot to reuse.
+ * @param hash_next Next slot in the same hash chain.
+ */
+struct dentry
+{
+    uint32_t parent_inode_number;
+    uint32_t inode_number;
+    char name[DIRECTORY_NAME_SIZE];
+    int valid;
+    int referenced;
+    int hash_next;
+};
+
+/**
+ * @brief The in-core copy of the block or inode bitmap.
+ *
+ * Each bitmap block is a group of group_bits consecutive bits, summarised by its number of clear bits so that full
+ * groups are skipped when searching. Bits of a bitmap block past group_bits are kept set. A bit is changed under the
+ * lock of the block group it belongs to (see group_of_block and group_of_inode).
+ *
+ * @param words The bits, as many 64-bit words as the bitmap blocks hold.
+ * @param group_free Number of clear bits in every group.
+ * @param group_hint The next free hint of every group: the bits of the group before it are all set, so a search of the
+ *                   group starts there.
+ * @param dirty Flag for every group indicating whether it changed since it was last written through the cache.
+ * @param start_block The first block of the bitmap on the disk.
+ * @param stride The distance between the blocks of consecutive groups on the disk.
+ * @param nblocks The number of blocks (groups) in the bitmap.
+ * @param group_bits The number of inodes or blocks a group tracks.
+ * @param nbits The number of inodes or blocks tracked.
+ * @param free_count The number of clear bits, updated atomically.
+ */
+struct bitmap
+{
+    uint64_t *words;
+    uint32_t *group_free;
+    uint32_t *group_hint;
+    uint8_t *dirty;
+    uint32_t start_block;
+    uint32_t stride;
+    uint32_t nblocks;
+    uint32_t group_bits;
+    uint32_t nbits;
+    uint32_t free_count;
+};
+
+/**
+ * @brief The in-core state of a block group.
+ *
+ * @param lock Guards the bits of the group in both bitmaps and its free extents.
+ * @param space The free data blocks of the group.
+ */
+struct block_group
+{
+    pthread_mutex_t lock;
+    struct freespace space;
+};
+
+/**
+ * @brief The in-core copy of the block reference table. An entry is changed under the lock of the block group of its
+ *        block, and so is the dirty flag of the table block holding it (table blocks never straddle two groups).
+ *
+ * @param entries One entry per block tracked by the block bitmap, NULL if the file system has no table.
+ * @param dirty Flag for every table block indicating whether it changed since it was last written through the cache.
+ * @param start_block The first block of the table on the disk.
+ * @param nblocks The number of blocks in the table.
+ * @param shares The sum of the shares of every block, updated atomically.
+ */
+struct reference_table
+{
+    struct block_reference *entries;
+    uint8_t *dirty;
+    uint32_t start_block;
+    uint32_t nblocks;
+    uint32_t shares;
+};
+
+/**
+ * @brief A slot of the fingerprint index, which finds the blocks that may hold given contents.
+ *
+ * @param fingerprint The fingerprint of the block when it was indexed, 0 for an empty slot.
+ * @param block The block.
+ */
+struct fingerprint_slot
+{
+    uint32_t fingerprint;
+    uint32_t block;
+};
+
+/**
+ * @brief An indirect block of a pointer-mapped file, loaded for the duration of a read or write.
+ *
+ * @param block_num The block loaded, 0 if none.
+ * @param dirty Flag indicating whether the pointers were changed since the block was loaded.
+ * @param data The contents of the block.
+ */
+struct loaded_block
+{
+    uint32_t block_num;
+    bool dirty;
+    union block data;
+};
+
+/**
+ * @brief The indirect blocks of a pointer-mapped file a read or write is working through. Each is read once when the
+ *        operation first needs it and written back once, by pointer_map_finish or when another block takes its place.
+ *
+ * @param single The single indirect block.
+ * @param double_root The double indirect block.
+ * @param double_child The block of pointers below the double indirect block in use.
+ */
+struct pointer_map
+{
+    struct loaded_block single;
+    struct loaded_block double_root;
+    struct loaded_block double_child;
+};
+
+/**
+ * @brief A run of logical blocks of a file mapped to consecutive disk blocks (or to a hole when physical is 0).
+ *
+ * @param start The first logical block.
+ * @param length The number of blocks, 0 if the run is empty.
+ * @param physical The disk block of the first logical block, 0 for a hole.
+ */
+struct block_run
+{
+    uint32_t start;
+    uint32_t length;
+    uint32_t physical;
+};
+
+/**
+ * @brief An entry of the file descriptor table.
+ *
+ * @param in_use Flag indicating whether the descriptor is open.
+ * @param inode A reference to the inode of the file, held until the descriptor is closed.
+ * @param run The last run of blocks mapped by a read or write, reused by the next one when it falls inside. Only runs
+ *            of allocated blocks are kept, those do not change while the file is open.
+ * @param pending Data written through the descriptor that has not been given disk blocks yet (WRITE_BUFFER_SIZE bytes,
+ *                allocated on the first buffered write).
+ * @param pending_offset The file offset of the first pending byte.
+ * @param pending_length The number of pending bytes.
+ * @param readahead The read-ahead state of the descriptor.
+ */
+struct open_file
+{
+    int in_use;
+    struct inode *inode;
+    struct block_run run;
+    uint8_t *pending;
+    off_t pending_offset;
+    size_t pending_length;
+    struct prefetch_stream readahead;
+};
 
 static int MOUNT_FLAG = 0;
 static union block SUPERBLOCK;
-static union block BLOCK_BITMAP;
-static union block INODE_BITMAP;
+static struct bitmap BLOCK_BITMAP;
+static struct bitmap INODE_BITMAP;
+static struct block_group *GROUPS = NULL;
+static uint32_t GROUPS_COUNT = 0;
+static struct reference_table REFERENCES;
+static struct fingerprint_slot *FINGERPRINTS = NULL;
+static uint32_t FINGERPRINTS_MASK = 0;
+static struct cached_inode INODE_CACHE[INODE_CACHE_SIZE];
+static int INODE_CACHE_BUCKETS[INODE_CACHE_HASH_BUCKETS];
+static int INODE_CACHE_FREE_HEAD = -1; // next slot to reuse: empty slots, then the least recently released inode
+static int INODE_CACHE_FREE_TAIL = -1;
+static struct dentry DENTRY_CACHE[DENTRY_CACHE_SIZE];
+static int DENTRY_CACHE_BUCKETS[DENTRY_CACHE_HASH_BUCKETS];
+static int DENTRY_CACHE_HAND = 0;
+static struct open_file OPEN_FILES[FS_MAX_OPEN_FILES];
+
+// Locks, always taken in this order:
+// - NAMESPACE_LOCK: shared by operations on open files, lookups and listings, exclusive for everything that changes
+//   directories or the mount state.
+// - the lock of an inode (see inode_lock): shared by reads of the file, exclusive by writes.
+// - OPEN_FILES_LOCK: the descriptor table, never held across I/O.
+// - DENTRY_CACHE_LOCK, INODE_CACHE_LOCK, INODE_TABLE_LOCK and the lock of a block group (its part of the bitmaps,
+//   of the block reference table and its free extents, one group at a time) guard their structures.
+// - FINGERPRINTS_LOCK: the fingerprint index, never held while taking another lock.
+// The journal, the buffer cache and the disk lock themselves and come last.
+static pthread_rwlock_t NAMESPACE_LOCK = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t OPEN_FILES_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t DENTRY_CACHE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t INODE_CACHE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t INODE_CACHE_COND = PTHREAD_COND_INITIALIZER; // signalled when the I/O of a slot ends
+static pthread_mutex_t INODE_TABLE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t FINGERPRINTS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t INODE_LOCKS_ONCE = PTHREAD_ONCE_INIT;
 
 const char *get_name_from_path(const char *path);
-uint32_t allocate_inode();
-uint32_t allocate_data_block();
+uint32_t allocate_inode(uint32_t parent_inode_number, int is_directory);
+uint32_t allocate_data_block(uint32_t goal);
+uint32_t allocate_data_blocks(uint32_t goal, uint32_t count, uint32_t *length);
 int write_inode_to_disk(uint32_t inode_number, struct inode *inode);
 struct inode *find_parent_directory(const char *path);
 struct inode *get_inode(uint32_t inode_number);
+void put_inode(struct inode *inode);
+void mark_inode_dirty(struct inode *inode);
 int add_directory_entry(struct inode *parent_dir_inode, uint32_t inode_number, const char *name);
+static void free_data_block(uint32_t block_num);
+static void free_inode(uint32_t inode_number);
+static int bitmap_init(struct bitmap *bitmap, uint32_t start_block, uint32_t stride, uint32_t nblocks,
+                       uint32_t group_bits, uint32_t nbits, bool load);
+static void bitmap_release(struct bitmap *bitmap);
+static uint64_t *bitmap_word(const struct bitmap *bitmap, uint32_t bit);
+static void bitmap_update(struct bitmap *bitmap, uint32_t bit, bool set);
+static uint32_t bitmap_allocate_range(struct bitmap *bitmap, uint32_t first, uint32_t end);
+static int groups_init(uint32_t count);
+static void groups_release();
+static uint32_t group_of_block(uint32_t block_num);
+static uint32_t group_of_inode(uint32_t inode_number);
+static uint32_t inode_table_block(uint32_t inode_number);
+static uint32_t inode_goal(const struct inode *inode);
+static int sync_bitmaps();
+static int references_init(uint32_t start_block, uint32_t nblocks, bool load);
+static void references_release();
+static int references_sync();
+static struct block_reference *block_reference(uint32_t block_num);
+static uint32_t block_fingerprint(const void *data);
+static void remember_fingerprint(uint32_t block_num, uint32_t fingerprint);
+static void record_fingerprint(uint32_t block_num, uint32_t fingerprint);
+static uint32_t find_duplicate(uint32_t fingerprint, const void *data);
+static bool prepare_block_write(uint32_t block_num);
+static void share_blocks(uint32_t start_block, uint32_t length);
+static int remap_block(struct inode *inode, uint32_t index, uint32_t block_num);
+static void forget_inode_runs(const struct inode *inode);
+static int upgrade_legacy_bitmaps();
+static void free_inode_blocks(struct inode *inode);
+static void invalidate_inode_cache();
+static struct inode *load_inode(uint32_t inode_number);
+static int writeback_inode(struct cached_inode *entry);
+static uint32_t find_directory_entry(const struct inode *dir_inode, const char *name);
+static uint32_t directory_block_count(const struct inode *dir_inode);
+static uint32_t directory_block_number(const struct inode *dir_inode, uint32_t index);
+static struct inode *lookup_path(const char *path);
+static struct inode *resolve_path(const char *path, bool parent_only, bool create_missing, char *last_name);
+static uint32_t inode_number_of(const struct inode *inode);
+static void dentry_store(uint32_t parent_inode_number, const char *name, uint32_t inode_number);
+static void invalidate_dentry_cache();
+static uint32_t lookup_dentry(const struct inode *dir_inode, const char *name);
+static int remove_entry(struct inode *parent_dir_inode, const char *name);
+static uint32_t create_inode(struct inode *parent_dir_inode, const char *name, int is_directory);
+static uint32_t clone_inode(struct inode *source, struct inode *parent_dir_inode, const char *name, bool read_only,
+                            uint32_t *top);
+static int clone_file_data(struct inode *source, struct inode *copy);
+static uint32_t extent_map(const struct inode *inode, uint32_t index, uint32_t max, uint32_t *physical);
+static void extent_free_node(const struct extent_header *header, const struct extent *entries);
+static int extent_remove(struct inode *inode, uint32_t logical, uint32_t length);
+static int flush_indirect(struct loaded_block *loaded);
+static uint32_t pointer_map_block(struct inode *inode, struct pointer_map *map, uint32_t index, bool allocate, bool *fresh);
+static uint32_t file_map(const struct inode *inode, struct pointer_map *map, uint32_t index, uint32_t max, uint32_t *physical);
+static uint32_t file_map_allocate(struct inode *inode, struct pointer_map *map, uint32_t index, uint32_t max,
+                                  uint32_t *physical, bool *fresh);
+static int read_inode_data(struct inode *inode, struct block_run *run, void *buf, size_t count, off_t offset);
+static int write_inode_data(struct inode *inode, struct block_run *run, void *buf, size_t count, off_t offset);
+static int inline_to_extents(struct inode *inode, struct block_run *run);
+static int read_compressed_data(const struct inode *inode, void *buf, size_t count, off_t offset);
+static int write_compressed_data(struct inode *inode, struct pointer_map *map, const void *buf, size_t count,
+                                 off_t offset);
+static int write_dedup_data(struct inode *inode, struct pointer_map *map, struct block_run *run, void *buf, size_t count,
+                            off_t offset);
+static int write_inode_blocks(struct inode *inode, struct pointer_map *map, struct block_run *run, void *buf, size_t count,
+                              off_t offset);
+static int sync_inode(struct inode *inode);
+static int sync_all_inodes();
+static bool has_credits(int credits);
+static int operation_step(struct inode *inode, int credits);
+static int write_inode_steps(struct inode *inode, struct block_run *run, void *buf, size_t count, off_t offset);
+static int free_extent_steps(struct inode *inode);
+static int run_credits(uint32_t physical, uint32_t length);
+static uint32_t run_step(struct inode *inode, uint32_t physical, uint32_t length);
+static int flush_all_files();
+static bool inode_is_open(uint32_t inode_number);
+static void close_all_files();
+static int flush_open_file(struct open_file *file, bool keep_tail);
+static int flush_inode_files(const struct inode *inode, const struct open_file *except);
+static bool inode_has_pending(const struct inode *inode);
+static void readahead_schedule(struct open_file *file);
+static void drop_inode_readahead(const struct inode *inode);
+static pthread_rwlock_t *inode_lock(const struct inode *inode);
+static int format_disk(int flags);
+static int mount_disk();
+static void unmount_disk();
+static int create_path(char *path, int is_directory);
+static int remove_path(char *path);
+static int clone_path(char *src_path, char *dst_path, bool read_only);
+static int open_path(char *path, int flags);
+static int apply_open_flags(struct inode *inode, int flags);
+static int pread_file(struct open_file *file, void *buf, size_t count, off_t offset);
+static int pwrite_file(struct open_file *file, void *buf, size_t count, off_t offset);
+static int close_file(struct open_file *file);
 
-void fs_unmount()
+/**
+ * Returns the contents of a block for reading. With the mmap backend this is a pointer straight into the mapping,
+ * otherwise the block is read through the cache into scratch.
+ *
+ * @return A pointer to the block, or NULL if it could not be read.
+ */
+static const union block *read_block(uint32_t blocknum, union block *scratch)
 {
-    if (MOUNT_FLAG == 0)
+    const union block *mapped = disk_block_ptr(blocknum);
+    if (mapped != NULL)
     {
-        printf("Error: Disk is not mounted.\n");
-        return;
+        return (checksum_verify(blocknum, mapped) == 0) ? mapped : NULL;
     }
 
-    // SET MOUNT FLAG TO 0
-    MOUNT_FLAG = 0;
+    if (cache_read(blocknum, scratch) == -1)
+    {
+        return NULL;
+    }
+    return scratch;
 }
-int fs_format()
+
+/**
+ * Makes an indirect block the one held in a slot of a pointer map, writing back the block it replaces.
+ *
+ * @param fresh If true the block was just allocated and starts out empty instead of being read.
+ * @return 0 on success, -1 on failure.
+ */
+static int load_indirect(struct loaded_block *loaded, uint32_t block_num, bool fresh)
 {
-    if (MOUNT_FLAG == 1)
+    if (loaded->block_num == block_num && !fresh)
+    {
+        return 0;
+    }
+    if (flush_indirect(loaded) == -1)
     {
-        printf("Error: Disk is already mounted.\n");
         return -1;
     }
-    memset(&SUPERBLOCK, 0, sizeof(union block));
-    memset(&BLOCK_BITMAP, 0, sizeof(union block));
-    memset(&INODE_BITMAP, 0, sizeof(union block));
 
-    union block zero_block;
-    memset(zero_block.data, 0, sizeof(union block));
+    if (fresh)
+    {
+        memset(&loaded->data, 0, sizeof(union block));
+    }
+    else if (cache_read(block_num, &loaded->data) == -1)
+    {
+        loaded->block_num = 0;
+        return -1;
+    }
+    loaded->block_num = block_num;
+    loaded->dirty = fresh;
+    return 0;
+}
 
-    for (int i = 0; i < disk_size(); i++)
+/**
+ * Writes an indirect block held in a pointer map back through the cache if it was changed.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int flush_indirect(struct loaded_block *loaded)
+{
+    if (loaded->block_num != 0 && loaded->dirty && journal_write(loaded->block_num, &loaded->data) == -1)
     {
-        if (disk_write(i, &zero_block) == -1)
-        {
+        return -1;
+    }
+    loaded->dirty = false;
+    return 0;
+}
+
+/**
+ * Empties a pointer map, to be used for a new read or write.
+ */
+static void pointer_map_init(struct pointer_map *map)
+{
+    map->single.block_num = 0;
+    map->single.dirty = false;
+    map->double_root.block_num = 0;
+    map->double_root.dirty = false;
+    map->double_child.block_num = 0;
+    map->double_child.dirty = false;
+}
+
+/**
+ * Writes back the indirect blocks a read or write changed.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int pointer_map_finish(struct pointer_map *map)
+{
+    int result = 0;
+    if (flush_indirect(&map->single) == -1)
+        result = -1;
+    if (flush_indirect(&map->double_root) == -1)
+        result = -1;
+    if (flush_indirect(&map->double_child) == -1)
+        result = -1;
+    return result;
+}
+
+/**
+ * Loads the indirect block a pointer refers to into a slot of a pointer map, allocating it first if the pointer is
+ * empty and allocate is set.
+ *
+ * @param parent The loaded block holding the pointer, NULL if the pointer is in the inode.
+ * @return 1 if the block is loaded, 0 if there is none (and allocate is not set), -1 on failure.
+ */
+static int pointer_map_load(struct inode *inode, uint32_t *pointer, struct loaded_block *parent, struct loaded_block *target,
+                            bool allocate)
+{
+    bool fresh = false;
+    if (*pointer == 0)
+    {
+        if (!allocate)
+            return 0;
+
+        uint32_t block_num = allocate_data_block(inode_goal(inode));
+        if (block_num == (uint32_t)-1)
             return -1;
+        *pointer = block_num;
+        fresh = true;
+        if (parent != NULL)
+            parent->dirty = true;
+        else
+            mark_inode_dirty(inode);
+    }
+
+    return (load_indirect(target, *pointer, fresh) == -1) ? -1 : 1;
+}
+
+/**
+ * Maps a logical block of a pointer-mapped file through its direct, single indirect and double indirect pointers,
+ * allocating the block (and the indirect blocks on the way) if allocate is set. Indirect blocks stay loaded in the map,
+ * so walking through a file reads each of them once.
+ *
+ * @param fresh Set to true if the block was just allocated.
+ * @return The block number, 0 if it is in a hole (and allocate is not set), or (uint32_t)-1 on failure.
+ */
+static uint32_t pointer_map_block(struct inode *inode, struct pointer_map *map, uint32_t index, bool allocate, bool *fresh)
+{
+    *fresh = false;
+
+    uint32_t *slot;
+    struct loaded_block *owner = NULL;
+    int loaded = 1;
+    if (index < INODE_DIRECT_POINTERS)
+    {
+        slot = &inode->i_direct_pointers[index];
+    }
+    else if (index - INODE_DIRECT_POINTERS < INODE_INDIRECT_POINTERS_PER_BLOCK)
+    {
+        index -= INODE_DIRECT_POINTERS;
+        loaded = pointer_map_load(inode, &inode->i_single_indirect_pointer, NULL, &map->single, allocate);
+        owner = &map->single;
+        slot = &map->single.data.pointers[index];
+    }
+    else if ((uint64_t)index - INODE_DIRECT_POINTERS - INODE_INDIRECT_POINTERS_PER_BLOCK <
+             (uint64_t)INODE_INDIRECT_POINTERS_PER_BLOCK * INODE_INDIRECT_POINTERS_PER_BLOCK)
+    {
+        index -= INODE_DIRECT_POINTERS + INODE_INDIRECT_POINTERS_PER_BLOCK;
+        loaded = pointer_map_load(inode, &inode->i_double_indirect_pointer, NULL, &map->double_root, allocate);
+        if (loaded == 1)
+        {
+            loaded = pointer_map_load(inode, &map->double_root.data.pointers[index / INODE_INDIRECT_POINTERS_PER_BLOCK],
+                                      &map->double_root, &map->double_child, allocate);
         }
+        owner = &map->double_child;
+        slot = &map->double_child.data.pointers[index % INODE_INDIRECT_POINTERS_PER_BLOCK];
+    }
+    else
+    {
+        // Past the double indirect range.
+        return allocate ? (uint32_t)-1 : 0;
     }
 
-    SUPERBLOCK.superblock.s_blocks_count = disk_size();
-    SUPERBLOCK.superblock.s_inodes_count = disk_size();
-    SUPERBLOCK.superblock.s_inode_table_block_start = 3;
-    SUPERBLOCK.superblock.s_data_blocks_start = 3 + ceil((double)SUPERBLOCK.superblock.s_inodes_count / (double)INODES_PER_BLOCK);
+    if (loaded != 1)
+    {
+        return (loaded == 0) ? 0 : (uint32_t)-1;
+    }
+
+    if (*slot == 0 && allocate)
+    {
+        uint32_t block_num = allocate_data_block(inode_goal(inode));
+        if (block_num == (uint32_t)-1)
+            return -1;
+        *slot = block_num;
+        *fresh = true;
+        if (owner != NULL)
+            owner->dirty = true;
+        else
+            mark_inode_dirty(inode);
+    }
+    return *slot;
+}
+
+/**
+ * Returns the data block holding the given logical block of a file.
+ *
+ * @return The block number, or 0 if that part of the file has no block.
+ */
+static uint32_t file_block_number(const struct inode *inode, uint32_t index)
+{
+    uint32_t physical;
+    struct pointer_map map;
+    pointer_map_init(&map);
+    return (file_map(inode, &map, index, 1, &physical) == 0) ? 0 : physical;
+}
 
-    if (disk_write(0, &SUPERBLOCK) == -1)
+/**
+ * Returns the data block holding the given logical block of a file, allocating it (and the indirect blocks) if it has none.
+ *
+ * @param fresh Set to true if the block was just allocated, so its old contents do not matter.
+ * @return The block number, or (uint32_t)-1 if no block could be allocated.
+ */
+static uint32_t file_block_allocate(struct inode *inode, uint32_t index, bool *fresh)
+{
+    uint32_t physical;
+    struct pointer_map map;
+    pointer_map_init(&map);
+    uint32_t length = file_map_allocate(inode, &map, index, 1, &physical, fresh);
+    if (pointer_map_finish(&map) == -1 || length == 0)
     {
         return -1;
     }
+    return physical;
+}
+
+/**
+ * @brief One level of the path from the root of an extent tree down to a leaf.
+ *
+ * @param block The block holding the node, 0 for the root in the inode.
+ * @param node A copy of the node, unused for the root.
+ * @param header The header of the node.
+ * @param entries The entries of the node.
+ * @param position The entry followed to the next level, or in a leaf the last extent starting at or before the block
+ *                 looked up (-1 if there is none).
+ */
+struct extent_path
+{
+    uint32_t block;
+    union block node;
+    struct extent_header *header;
+    struct extent *entries;
+    int position;
+};
 
-    for (int i = 0; i < disk_size(); i++)
+/**
+ * Returns the last of the sorted entries starting at or before the given logical block, or -1 if there is none.
+ */
+static int extent_search(const struct extent *entries, int count, uint32_t logical)
+{
+    int low = 0;
+    int high = count - 1;
+    int found = -1;
+    while (low <= high)
     {
-        INODE_BITMAP.bitmap[i] = 0;
+        int middle = (low + high) / 2;
+        if (entries[middle].e_logical <= logical)
+        {
+            found = middle;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
     }
-    INODE_BITMAP.bitmap[0] = 1;
+    return found;
+}
 
-    if (disk_write(2, &INODE_BITMAP) == -1)
+/**
+ * Maps logical blocks of an extent-mapped file.
+ *
+ * @param max The most blocks the caller is interested in.
+ * @param physical Receives the disk block of the first logical block, or 0 if it is in a hole.
+ * @return The number of blocks (at most max) from index that map to consecutive disk blocks from *physical, or that
+ *         are all in the hole. 0 if the tree could not be read.
+ */
+static uint32_t extent_map(const struct inode *inode, uint32_t index, uint32_t max, uint32_t *physical)
+{
+    const struct extent_header *header = &inode->i_extent_header;
+    const struct extent *entries = inode->i_extents;
+    uint64_t bound = (uint64_t)index + max;
+    union block scratch;
+
+    *physical = 0;
+    while (header->eh_depth > 0)
     {
-        return -1;
+        int i = extent_search(entries, header->eh_entries, index);
+        if (i == -1)
+        {
+            // Before the first child, the hole lasts until that child starts.
+            if (header->eh_entries > 0 && entries[0].e_logical < bound)
+                bound = entries[0].e_logical;
+            return bound - index;
+        }
+
+        // Nothing below this child maps blocks past the start of the next one.
+        if (i + 1 < header->eh_entries && entries[i + 1].e_logical < bound)
+            bound = entries[i + 1].e_logical;
+
+        const union block *node = read_block(entries[i].e_physical, &scratch);
+        if (node == NULL)
+            return 0;
+        header = &node->extent_block.header;
+        entries = node->extent_block.extents;
     }
 
-    for (int i = 0; i < disk_size(); i++)
+    int i = extent_search(entries, header->eh_entries, index);
+    if (i != -1 && index < (uint64_t)entries[i].e_logical + entries[i].e_length)
     {
-        BLOCK_BITMAP.bitmap[i] = 0;
+        uint64_t end = (uint64_t)entries[i].e_logical + entries[i].e_length;
+        *physical = entries[i].e_physical + (index - entries[i].e_logical);
+        return ((end < bound) ? end : bound) - index;
     }
-    for (unsigned int i = 0; i < SUPERBLOCK.superblock.s_data_blocks_start + 1; i++)
+
+    if (i + 1 < header->eh_entries && entries[i + 1].e_logical < bound)
+        bound = entries[i + 1].e_logical;
+    return bound - index;
+}
+
+/**
+ * Returns the number of entries a node of an extent tree has room for.
+ */
+static int extent_capacity(const struct extent_path *level)
+{
+    return (level->block == 0) ? INODE_EXTENTS : (int)EXTENTS_PER_BLOCK;
+}
+
+/**
+ * Writes a changed node of an extent tree back: through the cache, or by marking the inode dirty for the root.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int extent_write_node(struct inode *inode, struct extent_path *level)
+{
+    if (level->block == 0)
     {
-        BLOCK_BITMAP.bitmap[i] = 1;
+        mark_inode_dirty(inode);
+        return 0;
     }
+    return (journal_write(level->block, &level->node) == -1) ? -1 : 0;
+}
+
+/**
+ * Walks an extent tree from the root to the leaf where the given logical block belongs, copying every node into path.
+ *
+ * @return The level of the leaf in path, or -1 on failure.
+ */
+static int extent_descend(struct inode *inode, uint32_t logical, struct extent_path *path)
+{
+    path[0].block = 0;
+    path[0].header = &inode->i_extent_header;
+    path[0].entries = inode->i_extents;
 
-    if (disk_write(1, &BLOCK_BITMAP) == -1)
+    for (int level = 0;; ++level)
     {
-        return -1;
+        struct extent_path *node = &path[level];
+        node->position = extent_search(node->entries, node->header->eh_entries, logical);
+        if (node->header->eh_depth == 0)
+        {
+            return level;
+        }
+        if (level + 1 == EXTENT_MAX_DEPTH || node->header->eh_entries == 0)
+        {
+            printf("Error: Corrupted extent tree.\n");
+            return -1;
+        }
+
+        // Blocks before the first child go below it, and its key moves down to cover them.
+        if (node->position == -1)
+        {
+            node->position = 0;
+            node->entries[0].e_logical = logical;
+            if (extent_write_node(inode, node) == -1)
+                return -1;
+        }
+
+        struct extent_path *child = &path[level + 1];
+        child->block = node->entries[node->position].e_physical;
+        if (cache_read(child->block, &child->node) == -1)
+        {
+            return -1;
+        }
+        child->header = &child->node.extent_block.header;
+        child->entries = child->node.extent_block.extents;
     }
+}
 
-    union block inodes;
-    for (int i = 0; i < INODES_PER_BLOCK; i++)
+/**
+ * Makes room in a full node of an extent tree, by splitting it in two or, for the root, by moving its entries to a new
+ * block one level down. The path is out of date afterwards.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int extent_make_room(struct inode *inode, struct extent_path *path, int level)
+{
+    struct extent_path *node = &path[level];
+
+    if (level == 0)
     {
-        memset(&inodes.inodes[i], 0, sizeof(struct inode));
-        for (int j = 0; j < INODE_DIRECT_POINTERS; j++)
+        if (inode->i_extent_header.eh_depth + 1 >= EXTENT_MAX_DEPTH)
         {
-            inodes.inodes[i].i_direct_pointers[j] = 0;
+            printf("Error: File has too many extents.\n");
+            return -1;
         }
+
+        uint32_t block_num = allocate_data_block(inode_goal(inode));
+        if (block_num == (uint32_t)-1)
+            return -1;
+
+        union block child;
+        memset(&child, 0, sizeof(union block));
+        child.extent_block.header = inode->i_extent_header;
+        memcpy(child.extent_block.extents, inode->i_extents, inode->i_extent_header.eh_entries * sizeof(struct extent));
+        if (journal_write(block_num, &child) == -1)
+            return -1;
+
+        inode->i_extent_header.eh_depth++;
+        inode->i_extent_header.eh_entries = 1;
+        inode->i_extents[0].e_logical = child.extent_block.extents[0].e_logical;
+        inode->i_extents[0].e_physical = block_num;
+        inode->i_extents[0].e_length = 0;
+        mark_inode_dirty(inode);
+        return 0;
     }
-    if (disk_write(3, &inodes) == -1)
+
+    // The new half needs an entry in the parent, so the parent has to have room first.
+    struct extent_path *parent = &path[level - 1];
+    if (parent->header->eh_entries == extent_capacity(parent))
     {
+        return extent_make_room(inode, path, level - 1);
+    }
+
+    uint32_t block_num = allocate_data_block(inode_goal(inode));
+    if (block_num == (uint32_t)-1)
+        return -1;
+
+    union block sibling;
+    memset(&sibling, 0, sizeof(union block));
+    int keep = node->header->eh_entries / 2;
+    int moved = node->header->eh_entries - keep;
+    sibling.extent_block.header.eh_depth = node->header->eh_depth;
+    sibling.extent_block.header.eh_entries = moved;
+    memcpy(sibling.extent_block.extents, &node->entries[keep], moved * sizeof(struct extent));
+    node->header->eh_entries = keep;
+    if (journal_write(block_num, &sibling) == -1 || extent_write_node(inode, node) == -1)
         return -1;
+
+    int position = parent->position + 1;
+    memmove(&parent->entries[position + 1], &parent->entries[position],
+            (parent->header->eh_entries - position) * sizeof(struct extent));
+    parent->entries[position].e_logical = sibling.extent_block.extents[0].e_logical;
+    parent->entries[position].e_physical = block_num;
+    parent->entries[position].e_length = 0;
+    parent->header->eh_entries++;
+    return extent_write_node(inode, parent);
+}
+
+/**
+ * Maps a hole of an extent-mapped file to a run of disk blocks. The run is merged into the extent before it when it
+ * continues that extent on the disk as well.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int extent_insert(struct inode *inode, uint32_t logical, uint32_t physical, uint32_t length)
+{
+    struct extent_path path[EXTENT_MAX_DEPTH];
+
+    while (true)
+    {
+        int leaf = extent_descend(inode, logical, path);
+        if (leaf == -1)
+        {
+            return -1;
+        }
+
+        struct extent_path *node = &path[leaf];
+        int position = node->position;
+        if (position != -1)
+        {
+            struct extent *previous = &node->entries[position];
+            if ((uint64_t)previous->e_logical + previous->e_length == logical &&
+                (uint64_t)previous->e_physical + previous->e_length == physical)
+            {
+                previous->e_length += length;
+                return extent_write_node(inode, node);
+            }
+        }
+
+        if (node->header->eh_entries < extent_capacity(node))
+        {
+            memmove(&node->entries[position + 2], &node->entries[position + 1],
+                    (node->header->eh_entries - position - 1) * sizeof(struct extent));
+            node->entries[position + 1].e_logical = logical;
+            node->entries[position + 1].e_physical = physical;
+            node->entries[position + 1].e_length = length;
+            node->header->eh_entries++;
+            return extent_write_node(inode, node);
+        }
+
+        // The leaf is full, make room and walk down again.
+        if (extent_make_room(inode, path, leaf) == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Unmaps a range of logical blocks of an extent-mapped file and frees their disk blocks. Holes in the range are
+ * skipped, and an extent reaching past the range on both sides is split in two.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int extent_remove(struct inode *inode, uint32_t logical, uint32_t length)
+{
+    struct extent_path path[EXTENT_MAX_DEPTH];
+    uint64_t end = (uint64_t)logical + length;
+
+    while (logical < end)
+    {
+        uint32_t physical;
+        uint32_t run = extent_map(inode, logical, end - logical, &physical);
+        if (run == 0)
+        {
+            return -1;
+        }
+        if (physical == 0)
+        {
+            logical += run;
+            continue;
+        }
+
+        int leaf = extent_descend(inode, logical, path);
+        if (leaf == -1)
+        {
+            return -1;
+        }
+        struct extent_path *node = &path[leaf];
+        struct extent *found = &node->entries[node->position];
+        struct extent tail = *found;
+        uint32_t cut_end = logical + run;
+        tail.e_physical += cut_end - tail.e_logical;
+        tail.e_length -= cut_end - tail.e_logical;
+        tail.e_logical = cut_end;
+
+        // Keep what comes before the range in place, or else what comes after it, or drop the extent.
+        found->e_length = logical - found->e_logical;
+        if (found->e_length == 0 && tail.e_length > 0)
+        {
+            *found = tail;
+            tail.e_length = 0;
+        }
+        else if (found->e_length == 0)
+        {
+            memmove(found, found + 1, (node->header->eh_entries - node->position - 1) * sizeof(struct extent));
+            node->header->eh_entries--;
+        }
+        if (extent_write_node(inode, node) == -1)
+        {
+            return -1;
+        }
+
+        for (uint32_t i = 0; i < run; ++i)
+        {
+            free_data_block(physical + i);
+        }
+        if (tail.e_length > 0 && extent_insert(inode, tail.e_logical, tail.e_physical, tail.e_length) == -1)
+        {
+            return -1;
+        }
+        logical = cut_end;
+    }
+    return 0;
+}
+
+/**
+ * Frees every block mapped below a node of an extent tree, and the blocks of the nodes below it.
+ */
+static void extent_free_node(const struct extent_header *header, const struct extent *entries)
+{
+    for (int i = 0; i < header->eh_entries; ++i)
+    {
+        if (header->eh_depth == 0)
+        {
+            for (uint32_t j = 0; j < entries[i].e_length; ++j)
+            {
+                free_data_block(entries[i].e_physical + j);
+            }
+            continue;
+        }
+
+        union block child;
+        if (cache_read(entries[i].e_physical, &child) == -1)
+        {
+            continue;
+        }
+        extent_free_node(&child.extent_block.header, child.extent_block.extents);
+        free_data_block(entries[i].e_physical);
+    }
+}
+
+/**
+ * Maps logical blocks of a file, as a run of consecutive disk blocks or a hole.
+ *
+ * @param map The indirect blocks loaded so far by the current operation, for pointer-mapped files.
+ * @param max The most blocks the caller is interested in.
+ * @param physical Receives the disk block of the first logical block, or 0 if it is in a hole.
+ * @return The number of blocks (at most max) from index that map to consecutive disk blocks from *physical, or that
+ *         are all in the hole. 0 on failure.
+ */
+static uint32_t file_map(const struct inode *inode, struct pointer_map *map, uint32_t index, uint32_t max, uint32_t *physical)
+{
+    if (inode->i_flags & INODE_FLAG_EXTENTS)
+    {
+        return extent_map(inode, index, max, physical);
+    }
+
+    // Nothing is allocated, so the inode is left as it is.
+    bool fresh;
+    struct inode *pointer_inode = (struct inode *)inode;
+    *physical = pointer_map_block(pointer_inode, map, index, false, &fresh);
+    if (*physical == (uint32_t)-1)
+    {
+        return 0;
+    }
+
+    // Extend the run while the following blocks are next on the disk too (or the hole goes on).
+    uint32_t length = 1;
+    while (length < max)
+    {
+        uint32_t next = pointer_map_block(pointer_inode, map, index + length, false, &fresh);
+        if (next == (uint32_t)-1 || next != ((*physical == 0) ? 0 : *physical + length))
+            break;
+        length++;
+    }
+    return length;
+}
+
+/**
+ * Maps logical blocks of a file like file_map, allocating blocks if they are in a hole. Extent-mapped files get a
+ * contiguous run of up to max blocks, placed right after the block before it when that is free.
+ *
+ * @param fresh Set to true if the blocks were just allocated, so their old contents do not matter.
+ * @return The number of blocks mapped from index, or 0 if no block could be allocated.
+ */
+static uint32_t file_map_allocate(struct inode *inode, struct pointer_map *map, uint32_t index, uint32_t max,
+                                  uint32_t *physical, bool *fresh)
+{
+    if (!(inode->i_flags & INODE_FLAG_EXTENTS))
+    {
+        *physical = pointer_map_block(inode, map, index, true, fresh);
+        return (*physical == (uint32_t)-1) ? 0 : 1;
+    }
+
+    *fresh = false;
+    uint32_t length = extent_map(inode, index, max, physical);
+    if (length == 0 || *physical != 0)
+    {
+        return length;
+    }
+
+    // Continue the previous block of the file, or start in the group of the inode.
+    uint32_t goal = 0;
+    if (index > 0 && extent_map(inode, index - 1, 1, &goal) != 0 && goal != 0)
+    {
+        goal++;
+    }
+    else
+    {
+        goal = inode_goal(inode);
+    }
+
+    uint32_t start = allocate_data_blocks(goal, length, &length);
+    if (start == (uint32_t)-1)
+    {
+        return 0;
+    }
+    if (extent_insert(inode, index, start, length) == -1)
+    {
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            free_data_block(start + i);
+        }
+        return 0;
+    }
+
+    *physical = start;
+    *fresh = true;
+    return length;
+}
+
+
+
+/**
+ * Returns the number of blocks fs_format reserves for the journal on a disk of the given size, 0 if it gets none. A
+ * mapped disk gets none, as the kernel may write any block of the mapping back before its transaction is committed.
+ */
+static uint32_t journal_size(uint32_t blocks_count)
+{
+    // About 1/64 of the disk, bounded so small disks keep most of their space and replay stays quick on large ones.
+    if (blocks_count < 8 * JOURNAL_MIN_BLOCKS || disk_is_mapped())
+    {
+        return 0;
+    }
+    uint32_t blocks = blocks_count / 64;
+    if (blocks < JOURNAL_MIN_BLOCKS)
+        blocks = JOURNAL_MIN_BLOCKS;
+    if (blocks > JOURNAL_MAX_BLOCKS)
+        blocks = JOURNAL_MAX_BLOCKS;
+    return blocks;
+}
+
+void fs_unmount()
+{
+    pthread_rwlock_wrlock(&NAMESPACE_LOCK);
+    unmount_disk();
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+}
+
+/**
+ * Does the work of fs_unmount.
+ */
+static void unmount_disk()
+{
+    if (MOUNT_FLAG == 0)
+    {
+        printf("Error: Disk is not mounted.\n");
+        return;
+    }
+
+    // Open files are closed, so their inodes reach the inode table.
+    close_all_files();
+
+    // Commit what is still in the journal and write back everything the cache holds for this file system.
+    if (sync_bitmaps() == -1 || journal_checkpoint() == -1)
+    {
+        printf("Error: Failed to write back cached blocks.\n");
+    }
+
+    groups_release();
+    references_release();
+    checksum_release();
+
+    // SET MOUNT FLAG TO 0
+    MOUNT_FLAG = 0;
+}
+
+int fs_format(int flags)
+{
+    pthread_rwlock_wrlock(&NAMESPACE_LOCK);
+    int result = format_disk(flags);
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+/**
+ * Does the work of fs_format.
+ */
+static int format_disk(int flags)
+{
+    if (MOUNT_FLAG == 1)
+    {
+        printf("Error: Disk is already mounted.\n");
+        return -1;
+    }
+    memset(&SUPERBLOCK, 0, sizeof(union block));
+
+    // Whatever the caches hold is about to be overwritten, so drop it instead of writing it back. Descriptors still
+    // open refer to inodes that are about to go away.
+    close_all_files();
+    cache_invalidate();
+    invalidate_inode_cache();
+    invalidate_dentry_cache();
+
+    // The disk is split into block groups, with about one inode per block. A last group too short to hold its own
+    // metadata and a data block is left unused.
+    uint32_t blocks_count = disk_size();
+    uint32_t groups_count = (blocks_count + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+    uint32_t inodes_per_group = (blocks_count + groups_count - 1) / groups_count;
+    inodes_per_group = (inodes_per_group + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+    if (inodes_per_group > BITS_PER_BLOCK)
+        inodes_per_group = BITS_PER_BLOCK;
+    uint32_t group_metadata = 3 + inodes_per_group / INODES_PER_BLOCK;
+    if (groups_count > 1 && blocks_count - (groups_count - 1) * BLOCKS_PER_GROUP <= group_metadata)
+        groups_count--;
+
+    SUPERBLOCK.superblock.s_blocks_count = blocks_count;
+    SUPERBLOCK.superblock.s_inodes_count = groups_count * inodes_per_group;
+    SUPERBLOCK.superblock.s_groups_count = groups_count;
+    SUPERBLOCK.superblock.s_blocks_per_group = BLOCKS_PER_GROUP;
+    SUPERBLOCK.superblock.s_inodes_per_group = inodes_per_group;
+    SUPERBLOCK.superblock.s_block_bitmap = 1;
+    SUPERBLOCK.superblock.s_block_bitmap_blocks = groups_count;
+    SUPERBLOCK.superblock.s_inode_bitmap = 2;
+    SUPERBLOCK.superblock.s_inode_bitmap_blocks = groups_count;
+    SUPERBLOCK.superblock.s_inode_table_block_start = 3;
+    SUPERBLOCK.superblock.s_journal_start = group_metadata;
+    SUPERBLOCK.superblock.s_journal_blocks = journal_size(blocks_count);
+    uint32_t tracked_blocks = (blocks_count < groups_count * BLOCKS_PER_GROUP) ? blocks_count : groups_count * BLOCKS_PER_GROUP;
+    SUPERBLOCK.superblock.s_reference_table = SUPERBLOCK.superblock.s_journal_start + SUPERBLOCK.superblock.s_journal_blocks;
+    SUPERBLOCK.superblock.s_reference_table_blocks = (tracked_blocks + REFERENCES_PER_BLOCK - 1) / REFERENCES_PER_BLOCK;
+    SUPERBLOCK.superblock.s_data_blocks_start =
+        SUPERBLOCK.superblock.s_reference_table + SUPERBLOCK.superblock.s_reference_table_blocks;
+    if (flags & FS_FORMAT_CHECKSUMS)
+    {
+        SUPERBLOCK.superblock.s_checksum_table = SUPERBLOCK.superblock.s_data_blocks_start;
+        SUPERBLOCK.superblock.s_checksum_table_blocks = (blocks_count + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+        SUPERBLOCK.superblock.s_data_blocks_start += SUPERBLOCK.superblock.s_checksum_table_blocks;
+    }
+    uint32_t root_block = SUPERBLOCK.superblock.s_data_blocks_start;
+
+    // Only the metadata blocks (and the root directory block) have to read as zeros. Data blocks are always initialised
+    // before they are first read, so they are left alone and formatting costs the same on any disk size. Every group
+    // keeps a copy of the superblock.
+    if (disk_zero_range(0, root_block + 1) == -1)
+    {
+        return -1;
+    }
+
+    // Every block written from here on has its checksum recorded, if the disk keeps checksums.
+    checksum_release();
+    if ((flags & FS_FORMAT_CHECKSUMS) &&
+        checksum_init(SUPERBLOCK.superblock.s_checksum_table, SUPERBLOCK.superblock.s_checksum_table_blocks, blocks_count,
+                      false) == -1)
+    {
+        return -1;
+    }
+    for (uint32_t g = 1; g < groups_count; g++)
+    {
+        if (disk_zero_range(g * BLOCKS_PER_GROUP, group_metadata) == -1 ||
+            cache_write(g * BLOCKS_PER_GROUP, &SUPERBLOCK) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if (cache_write(0, &SUPERBLOCK) == -1 ||
+        journal_format(SUPERBLOCK.superblock.s_journal_start, SUPERBLOCK.superblock.s_journal_blocks) == -1)
+    {
+        return -1;
+    }
+
+    if (groups_init(groups_count) == -1 ||
+        bitmap_init(&BLOCK_BITMAP, SUPERBLOCK.superblock.s_block_bitmap, BLOCKS_PER_GROUP, groups_count, BLOCKS_PER_GROUP,
+                    tracked_blocks, false) == -1 ||
+        bitmap_init(&INODE_BITMAP, SUPERBLOCK.superblock.s_inode_bitmap, BLOCKS_PER_GROUP, groups_count, inodes_per_group,
+                    SUPERBLOCK.superblock.s_inodes_count, false) == -1 ||
+        references_init(SUPERBLOCK.superblock.s_reference_table, SUPERBLOCK.superblock.s_reference_table_blocks,
+                        false) == -1)
+    {
+        return -1;
+    }
+
+    // The metadata blocks of every group, the journal, the reference and checksum tables, the root directory block and
+    // the root inode are in use.
+    for (uint32_t i = 0; i <= root_block; i++)
+    {
+        bitmap_update(&BLOCK_BITMAP, i, true);
+    }
+    for (uint32_t g = 1; g < groups_count; g++)
+    {
+        for (uint32_t i = 0; i < group_metadata; i++)
+        {
+            bitmap_update(&BLOCK_BITMAP, g * BLOCKS_PER_GROUP + i, true);
+        }
+    }
+    bitmap_update(&INODE_BITMAP, 0, true);
+
+    if (sync_bitmaps() == -1)
+    {
+        return -1;
+    }
+
+    union block inodes;
+    for (int i = 0; i < INODES_PER_BLOCK; i++)
+    {
+        memset(&inodes.inodes[i], 0, sizeof(struct inode));
+        for (int j = 0; j < INODE_DIRECT_POINTERS; j++)
+        {
+            inodes.inodes[i].i_direct_pointers[j] = 0;
+        }
+    }
+    if (cache_write(SUPERBLOCK.superblock.s_inode_table_block_start, &inodes) == -1)
+    {
+        return -1;
+    }
+
+    struct directory_block root_dir;
+    memset(&root_dir, 0, sizeof(struct directory_block));
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    {
+        root_dir.entries[i].inode_number = 0;
+        strcpy(root_dir.entries[i].name, "");
+    }
+
+    if (cache_write(SUPERBLOCK.superblock.s_data_blocks_start, &root_dir) == -1)
+    {
+        return -1;
+    }
+
+    struct inode root_inode;
+    memset(&root_inode, 0, sizeof(struct inode));
+    root_inode.i_is_directory = 1;
+    root_inode.i_size = sizeof(struct directory_block);
+    root_inode.i_direct_pointers[0] = SUPERBLOCK.superblock.s_data_blocks_start;
+    if (write_inode_to_disk(0, &root_inode) == -1)
+    {
+        return -1;
+    }
+
+    // The new file system reaches the disk in full, with an empty journal.
+    if (journal_checkpoint() == -1)
+    {
+        return -1;
+    }
+
+    MOUNT_FLAG = 0;
+    LOG_DEBUG("Superblock:\n");
+    LOG_DEBUG("    Blocks: %d\n", SUPERBLOCK.superblock.s_blocks_count);
+    LOG_DEBUG("    Inodes: %d\n", SUPERBLOCK.superblock.s_inodes_count);
+    LOG_DEBUG("    Inode Table Block Start: %d\n", SUPERBLOCK.superblock.s_inode_table_block_start);
+    LOG_DEBUG("    Data Blocks Start: %d\n", SUPERBLOCK.superblock.s_data_blocks_start);
+    return 1;
+}
+
+int fs_mount()
+{
+    pthread_rwlock_wrlock(&NAMESPACE_LOCK);
+    int result = mount_disk();
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+/**
+ * Does the work of fs_mount.
+ */
+static int mount_disk()
+{
+    if (MOUNT_FLAG == 1)
+    {
+        printf("Error: Disk is already mounted.\n");
+        return -1;
+    }
+
+    // Inodes and lookups cached for a previous mount may be stale, and so may descriptors opened on it.
+    close_all_files();
+    invalidate_inode_cache();
+    invalidate_dentry_cache();
+
+    if (cache_read(0, &SUPERBLOCK) == -1)
+    {
+        return -1;
+    }
+
+    // Metadata committed before the disk was last closed is brought up to date before anything reads it. Disks
+    // formatted without a journal have both fields set to 0.
+    struct superblock *superblock = &SUPERBLOCK.superblock;
+    if (superblock->s_journal_blocks != 0 && disk_is_mapped())
+    {
+        printf("Error: A disk with a journal cannot be mounted with the mmap backend.\n");
+        return -1;
+    }
+    if (superblock->s_journal_start + superblock->s_journal_blocks > superblock->s_blocks_count ||
+        journal_mount(superblock->s_journal_start, superblock->s_journal_blocks) == -1)
+    {
+        printf("Error: Failed to replay the journal.\n");
+        return -1;
+    }
+
+    // The checksums are loaded before the rest of the metadata is read, so it is verified too. Disks formatted without
+    // FS_FORMAT_CHECKSUMS have both fields set to 0.
+    if (superblock->s_checksum_table != 0)
+    {
+        if (superblock->s_checksum_table < superblock->s_journal_start + superblock->s_journal_blocks ||
+            superblock->s_checksum_table + superblock->s_checksum_table_blocks > superblock->s_data_blocks_start ||
+            (uint64_t)superblock->s_checksum_table_blocks * CHECKSUMS_PER_BLOCK < superblock->s_blocks_count)
+        {
+            printf("Error: Invalid superblock.\n");
+            return -1;
+        }
+        if (checksum_init(superblock->s_checksum_table, superblock->s_checksum_table_blocks, superblock->s_blocks_count,
+                          true) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        checksum_release();
+    }
+
+    if (groups_init(superblock->s_groups_count ? superblock->s_groups_count : 1) == -1)
+    {
+        return -1;
+    }
+
+    if (superblock->s_block_bitmap == 0)
+    {
+        if (upgrade_legacy_bitmaps() == -1)
+        {
+            return -1;
+        }
+    }
+    else if (superblock->s_groups_count == 0)
+    {
+        if (superblock->s_block_bitmap_blocks == 0 || superblock->s_inode_bitmap_blocks == 0 ||
+            superblock->s_data_blocks_start > superblock->s_blocks_count ||
+            superblock->s_journal_start + superblock->s_journal_blocks > superblock->s_data_blocks_start)
+        {
+            printf("Error: Invalid superblock.\n");
+            return -1;
+        }
+
+        // Bits past the end of the bitmap blocks (only possible on converted disks) cannot be tracked.
+        uint64_t block_bits = (uint64_t)superblock->s_block_bitmap_blocks * BITS_PER_BLOCK;
+        uint64_t inode_bits = (uint64_t)superblock->s_inode_bitmap_blocks * BITS_PER_BLOCK;
+        if (bitmap_init(&BLOCK_BITMAP, superblock->s_block_bitmap, 1, superblock->s_block_bitmap_blocks, BITS_PER_BLOCK,
+                        (superblock->s_blocks_count < block_bits) ? superblock->s_blocks_count : block_bits, true) == -1 ||
+            bitmap_init(&INODE_BITMAP, superblock->s_inode_bitmap, 1, superblock->s_inode_bitmap_blocks, BITS_PER_BLOCK,
+                        (superblock->s_inodes_count < inode_bits) ? superblock->s_inodes_count : inode_bits, true) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        uint32_t groups_count = superblock->s_groups_count;
+        if (superblock->s_blocks_per_group != BLOCKS_PER_GROUP || superblock->s_inodes_per_group == 0 ||
+            superblock->s_inodes_per_group > BITS_PER_BLOCK || superblock->s_inodes_per_group % INODES_PER_BLOCK != 0 ||
+            (uint64_t)(groups_count - 1) * BLOCKS_PER_GROUP >= superblock->s_blocks_count ||
+            superblock->s_inodes_count != groups_count * superblock->s_inodes_per_group ||
+            superblock->s_data_blocks_start > superblock->s_blocks_count ||
+            superblock->s_journal_start + superblock->s_journal_blocks > superblock->s_data_blocks_start)
+        {
+            printf("Error: Invalid superblock.\n");
+            return -1;
+        }
+
+        uint64_t group_blocks = (uint64_t)groups_count * BLOCKS_PER_GROUP;
+        if (bitmap_init(&BLOCK_BITMAP, superblock->s_block_bitmap, BLOCKS_PER_GROUP, groups_count, BLOCKS_PER_GROUP,
+                        (superblock->s_blocks_count < group_blocks) ? superblock->s_blocks_count : group_blocks, true) == -1 ||
+            bitmap_init(&INODE_BITMAP, superblock->s_inode_bitmap, BLOCKS_PER_GROUP, groups_count,
+                        superblock->s_inodes_per_group, superblock->s_inodes_count, true) == -1)
+        {
+            return -1;
+        }
+    }
+
+    // Disks formatted before the block reference table have both fields set to 0.
+    if (superblock->s_reference_table != 0)
+    {
+        if (superblock->s_reference_table < superblock->s_journal_start + superblock->s_journal_blocks ||
+            superblock->s_reference_table + superblock->s_reference_table_blocks > superblock->s_data_blocks_start ||
+            (uint64_t)superblock->s_reference_table_blocks * REFERENCES_PER_BLOCK < BLOCK_BITMAP.nbits)
+        {
+            printf("Error: Invalid superblock.\n");
+            return -1;
+        }
+        if (references_init(superblock->s_reference_table, superblock->s_reference_table_blocks, true) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        references_release();
+    }
+
+    // Index the free data blocks of every group.
+    for (uint32_t g = 0; g < GROUPS_COUNT; g++)
+    {
+        uint32_t first = (g == 0) ? superblock->s_data_blocks_start : g * BLOCKS_PER_GROUP;
+        uint32_t end = (g + 1 < GROUPS_COUNT) ? (g + 1) * BLOCKS_PER_GROUP : BLOCK_BITMAP.nbits;
+        if (freespace_build(&GROUPS[g].space, BLOCK_BITMAP.words, first, end) == -1)
+        {
+            return -1;
+        }
+    }
+
+    MOUNT_FLAG = 1;
+
+    return 0;
+}
+
+int fs_create(char *path, int is_directory)
+{
+    pthread_rwlock_wrlock(&NAMESPACE_LOCK);
+    int result = create_path(path, is_directory);
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+/**
+ * Does the work of fs_create.
+ */
+static int create_path(char *path, int is_directory)
+{
+    if (MOUNT_FLAG == 0)
+    {
+        printf("Error: Disk is not mounted.\n");
+        return -1;
+    }
+
+    // Find the parent, creating the directories that do not exist yet. Those are kept even if the entry cannot be
+    // created, so the operation is ended either way.
+    if (journal_begin_operation(CREDITS_CREATE) == -1)
+    {
+        return -1;
+    }
+    char entry_name[DIRECTORY_NAME_SIZE];
+    struct inode *parent_dir_inode = resolve_path(path, true, true, entry_name);
+    uint32_t new_inode_number = (uint32_t)-1;
+    if (parent_dir_inode == NULL)
+    {
+        printf("Error: Invalid path or directory does not exist.\n");
+    }
+    else if (entry_name[0] == '\0')
+    {
+        printf("Error: Invalid path name.\n");
+    }
+    else
+    {
+        new_inode_number = create_inode(parent_dir_inode, entry_name, is_directory);
+        LOG_DEBUG("New inode number for file/directory: %d\n", new_inode_number);
+        if (new_inode_number == (uint32_t)-1)
+            printf("Error: Failed to create %s.\n", entry_name);
+    }
+    if (parent_dir_inode != NULL)
+        put_inode(parent_dir_inode);
+
+    bool synced = sync_bitmaps() == 0;
+    if (journal_end_operation() == -1 || !synced || new_inode_number == (uint32_t)-1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int fs_remove(char *path)
+{
+    pthread_rwlock_wrlock(&NAMESPACE_LOCK);
+    int result = remove_path(path);
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+/**
+ * Does the work of fs_remove.
+ */
+static int remove_path(char *path)
+{
+    if (MOUNT_FLAG == 0)
+    {
+        printf("Error: Disk is not mounted.\n");
+        return -1;
+    }
+
+    if (journal_begin_operation(CREDITS_CREATE) == -1)
+    {
+        return -1;
+    }
+    char entry_name[DIRECTORY_NAME_SIZE];
+    struct inode *parent_dir_inode = resolve_path(path, true, false, entry_name);
+    int result = -1;
+    if (parent_dir_inode == NULL || entry_name[0] == '\0')
+    {
+        printf("Error: Invalid path or directory does not exist.\n");
+    }
+    else if (parent_dir_inode->i_flags & INODE_FLAG_READONLY)
+    {
+        // A snapshot can go as a whole, but not piece by piece.
+        printf("Error: Cannot remove %s from a read-only directory.\n", entry_name);
+    }
+    else
+    {
+        result = remove_entry(parent_dir_inode, entry_name);
+    }
+    if (parent_dir_inode != NULL)
+        put_inode(parent_dir_inode);
+
+    bool synced = sync_bitmaps() == 0;
+    if (journal_end_operation() == -1 || !synced)
+    {
+        return -1;
+    }
+    return result;
+}
+
+int fs_clone(char *src_path, char *dst_path)
+{
+    pthread_rwlock_wrlock(&NAMESPACE_LOCK);
+    int result = clone_path(src_path, dst_path, false);
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+int fs_snapshot(char *src_path, char *dst_path)
+{
+    pthread_rwlock_wrlock(&NAMESPACE_LOCK);
+    int result = clone_path(src_path, dst_path, true);
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+/**
+ * Does the work of fs_clone and fs_snapshot.
+ *
+ * @param read_only If true, the copy is marked read-only.
+ */
+static int clone_path(char *src_path, char *dst_path, bool read_only)
+{
+    if (MOUNT_FLAG == 0)
+    {
+        printf("Error: Disk is not mounted.\n");
+        return -1;
+    }
+    if (REFERENCES.entries == NULL)
+    {
+        printf("Error: The file system has no block reference table to share blocks with.\n");
+        return -1;
+    }
+
+    struct inode *source = lookup_path(src_path);
+    if (source == NULL)
+    {
+        printf("Error: File not found.\n");
+        return -1;
+    }
+
+    // Data held back by descriptors belongs in the copy. It is written out first, each write is an operation of its own.
+    if (flush_all_files() == -1 || journal_begin_operation(CREDITS_CREATE) == -1)
+    {
+        put_inode(source);
+        return -1;
+    }
+
+    // Find the parent of the copy, creating the directories that do not exist yet.
+    char entry_name[DIRECTORY_NAME_SIZE];
+    struct inode *parent_dir_inode = resolve_path(dst_path, true, true, entry_name);
+    uint32_t copy_number = (uint32_t)-1;
+    if (parent_dir_inode == NULL || entry_name[0] == '\0')
+    {
+        printf("Error: Invalid path or directory does not exist.\n");
+    }
+    else
+    {
+        uint32_t top = 0;
+        copy_number = clone_inode(source, parent_dir_inode, entry_name, read_only, &top);
+    }
+    if (parent_dir_inode != NULL)
+        put_inode(parent_dir_inode);
+    put_inode(source);
+
+    bool synced = sync_bitmaps() == 0;
+    if (journal_end_operation() == -1 || !synced || copy_number == (uint32_t)-1)
+    {
+        printf("Error: Failed to clone %s.\n", src_path);
+        return -1;
+    }
+    return 0;
+}
+
+int fs_open(char *path, int flags)
+{
+    // Creating the file changes the namespace, so only plain opens share the lock.
+    if (flags & FS_O_CREATE)
+        pthread_rwlock_wrlock(&NAMESPACE_LOCK);
+    else
+        pthread_rwlock_rdlock(&NAMESPACE_LOCK);
+
+    int fd = open_path(path, flags);
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return fd;
+}
+
+/**
+ * Does the work of fs_open.
+ */
+static int open_path(char *path, int flags)
+{
+    if (MOUNT_FLAG == 0)
+    {
+        printf("Error: Disk is not mounted.\n");
+        return -1;
+    }
+
+    // Reserve a descriptor. Its inode stays NULL until the file is found, so scans for descriptors of a file skip it.
+    pthread_mutex_lock(&OPEN_FILES_LOCK);
+    int fd = 0;
+    while (fd < FS_MAX_OPEN_FILES && OPEN_FILES[fd].in_use)
+    {
+        fd++;
+    }
+    if (fd < FS_MAX_OPEN_FILES)
+    {
+        OPEN_FILES[fd].in_use = 1;
+        OPEN_FILES[fd].inode = NULL;
+    }
+    pthread_mutex_unlock(&OPEN_FILES_LOCK);
+    if (fd == FS_MAX_OPEN_FILES)
+    {
+        printf("Error: Too many open files.\n");
+        return -1;
+    }
+
+    struct inode *file_inode = lookup_path(path);
+    int result = 0;
+    if (file_inode == NULL && (flags & FS_O_CREATE))
+    {
+        result = create_path(path, 0);
+        file_inode = (result == 0) ? lookup_path(path) : NULL;
+    }
+    if (file_inode == NULL)
+    {
+        if (result == 0)
+            printf("Error: File not found.\n");
+    }
+    else if (file_inode->i_is_directory)
+    {
+        printf("Error: Cannot open a directory.\n");
+        put_inode(file_inode);
+        file_inode = NULL;
+    }
+    else if ((flags & (FS_O_COMPRESS | FS_O_DEDUP)) && apply_open_flags(file_inode, flags) == -1)
+    {
+        put_inode(file_inode);
+        file_inode = NULL;
+    }
+
+    // The reference keeps the inode in the inode cache until the file is closed.
+    pthread_mutex_lock(&OPEN_FILES_LOCK);
+    if (file_inode == NULL)
+    {
+        OPEN_FILES[fd].in_use = 0;
+    }
+    else
+    {
+        OPEN_FILES[fd].inode = file_inode;
+        memset(&OPEN_FILES[fd].run, 0, sizeof(struct block_run));
+        OPEN_FILES[fd].pending = NULL;
+        OPEN_FILES[fd].pending_length = 0;
+        memset(&OPEN_FILES[fd].readahead, 0, sizeof(struct prefetch_stream));
+    }
+    pthread_mutex_unlock(&OPEN_FILES_LOCK);
+    return (file_inode == NULL) ? -1 : fd;
+}
+
+/**
+ * Switches a file to the modes asked for by FS_O_COMPRESS and FS_O_DEDUP. Only an empty file can become compressed, and
+ * only an extent-mapped (or still inline) file that is not compressed can become deduplicated. The file is left as it
+ * is otherwise, when it is read-only, and when the file system has no block reference table to deduplicate with.
+ *
+ * @return 0 on success, -1 if the inode could not be written.
+ */
+static int apply_open_flags(struct inode *inode, int flags)
+{
+    pthread_rwlock_t *lock = inode_lock(inode);
+    pthread_rwlock_wrlock(lock);
+    uint16_t inode_flags = inode->i_flags;
+    if (inode_flags & INODE_FLAG_READONLY)
+    {
+        flags = 0;
+    }
+    if ((flags & FS_O_COMPRESS) && !(inode_flags & INODE_FLAG_DEDUP) && (inode_flags & INODE_FLAG_INLINE) &&
+        inode->i_size == 0 && !inode_has_pending(inode))
+    {
+        inode_flags |= INODE_FLAG_COMPRESSED;
+    }
+    if ((flags & FS_O_DEDUP) && REFERENCES.entries != NULL && !(inode_flags & INODE_FLAG_COMPRESSED) &&
+        (inode_flags & (INODE_FLAG_INLINE | INODE_FLAG_EXTENTS)))
+    {
+        inode_flags |= INODE_FLAG_DEDUP;
+    }
+
+    int result = 0;
+    if (inode_flags != inode->i_flags && journal_begin_operation(CREDITS_INODE) == -1)
+    {
+        result = -1;
+    }
+    else if (inode_flags != inode->i_flags)
+    {
+        inode->i_flags = inode_flags;
+        mark_inode_dirty(inode);
+        bool synced = sync_inode(inode) == 0 && sync_bitmaps() == 0;
+        if (journal_end_operation() == -1 || !synced)
+        {
+            result = -1;
+        }
+    }
+    pthread_rwlock_unlock(lock);
+    return result;
+}
+
+/**
+ * Returns the entry of the file descriptor table for an open descriptor, or NULL if it is not open.
+ */
+static struct open_file *get_open_file(int fd)
+{
+    if (MOUNT_FLAG == 0)
+    {
+        printf("Error: Disk is not mounted.\n");
+        return NULL;
+    }
+    if (fd < 0 || fd >= FS_MAX_OPEN_FILES || !OPEN_FILES[fd].in_use)
+    {
+        printf("Error: Invalid file descriptor.\n");
+        return NULL;
+    }
+    return &OPEN_FILES[fd];
+}
+
+int fs_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    pthread_rwlock_rdlock(&NAMESPACE_LOCK);
+    struct open_file *file = get_open_file(fd);
+    int result = -1;
+    if (file != NULL)
+    {
+        pthread_rwlock_t *lock = inode_lock(file->inode);
+        pthread_rwlock_rdlock(lock);
+        result = 0;
+
+        // Data held back by any descriptor of the file has to be on the disk before it can be read. Writing it out
+        // takes the lock exclusive for a moment.
+        if (inode_has_pending(file->inode))
+        {
+            pthread_rwlock_unlock(lock);
+            pthread_rwlock_wrlock(lock);
+            result = flush_inode_files(file->inode, NULL);
+            pthread_rwlock_unlock(lock);
+            pthread_rwlock_rdlock(lock);
+        }
+
+        if (result == 0)
+        {
+            result = pread_file(file, buf, count, offset);
+        }
+        pthread_rwlock_unlock(lock);
+    }
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+/**
+ * Does the work of fs_pread, with the lock of the inode held shared.
+ */
+static int pread_file(struct open_file *file, void *buf, size_t count, off_t offset)
+{
+    if ((uint64_t)offset >= file->inode->i_size || count == 0)
+    {
+        return 0;
+    }
+    if (offset + count > file->inode->i_size)
+    {
+        count = file->inode->i_size - offset;
+    }
+
+    // What was read ahead is served from memory, the rest from the disk.
+    prefetch_access(&file->readahead, offset / BLOCK_SIZE, (offset + count - 1) / BLOCK_SIZE);
+    size_t done = prefetch_copy(&file->readahead, buf, count, offset);
+    if (done < count)
+    {
+        int bytes_read = read_inode_data(file->inode, &file->run, (uint8_t *)buf + done, count - done, offset + done);
+
+        // A hole may be filled by another descriptor, so only allocated runs are kept.
+        if (bytes_read == -1 || file->run.physical == 0)
+        {
+            file->run.length = 0;
+        }
+        if (bytes_read == -1)
+        {
+            return -1;
+        }
+        done += bytes_read;
+    }
+
+    readahead_schedule(file);
+    return done;
+}
+
+/**
+ * Starts reading the next read-ahead window of a descriptor that reads sequentially, if there is room for it.
+ */
+static void readahead_schedule(struct open_file *file)
+{
+    uint32_t next;
+    uint32_t max = prefetch_next(&file->readahead, &next);
+    if (max == 0)
+    {
+        return;
+    }
+
+    // Only one run of allocated blocks before the end of the file is read ahead, holes read as zeros anyway. An inline
+    // file has no blocks, and the blocks of a compressed file do not hold its logical blocks.
+    if (file->inode->i_flags & (INODE_FLAG_INLINE | INODE_FLAG_COMPRESSED))
+    {
+        return;
+    }
+    uint64_t end_index = (file->inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (next >= end_index)
+    {
+        return;
+    }
+    if (max > end_index - next)
+    {
+        max = end_index - next;
+    }
+    uint32_t physical;
+    struct pointer_map map;
+    pointer_map_init(&map);
+    uint32_t length = file_map(file->inode, &map, next, max, &physical);
+    if (length == 0 || physical == 0)
+    {
+        return;
+    }
+    prefetch_start(&file->readahead, next, physical, length);
+}
+
+/**
+ * Collects the descriptors open on an inode. Descriptors of the inode cannot be closed meanwhile, as closing one takes
+ * the lock of the inode the caller holds.
+ *
+ * @param files Receives the descriptors, room for FS_MAX_OPEN_FILES.
+ * @return The number of descriptors found.
+ */
+static int inode_files(const struct inode *inode, struct open_file **files)
+{
+    int count = 0;
+    pthread_mutex_lock(&OPEN_FILES_LOCK);
+    for (int fd = 0; fd < FS_MAX_OPEN_FILES; ++fd)
+    {
+        if (OPEN_FILES[fd].in_use && OPEN_FILES[fd].inode == inode)
+            files[count++] = &OPEN_FILES[fd];
+    }
+    pthread_mutex_unlock(&OPEN_FILES_LOCK);
+    return count;
+}
+
+/**
+ * Drops the block run kept by every descriptor of an inode. Used when a logical block of the file is mapped to another
+ * disk block, as the runs would no longer match the block map.
+ */
+static void forget_inode_runs(const struct inode *inode)
+{
+    struct open_file *files[FS_MAX_OPEN_FILES];
+    int count = inode_files(inode, files);
+    for (int i = 0; i < count; ++i)
+    {
+        files[i]->run.length = 0;
+    }
+}
+
+/**
+ * Empties the read-ahead windows of every descriptor of an inode. Used before the file is written, as the windows
+ * would no longer match the disk.
+ */
+static void drop_inode_readahead(const struct inode *inode)
+{
+    struct open_file *files[FS_MAX_OPEN_FILES];
+    int count = inode_files(inode, files);
+    for (int i = 0; i < count; ++i)
+    {
+        prefetch_drop(&files[i]->readahead, 0);
+    }
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, off_t offset)
+{
+    pthread_rwlock_rdlock(&NAMESPACE_LOCK);
+    struct open_file *file = get_open_file(fd);
+    int result = -1;
+    if (file != NULL)
+    {
+        pthread_rwlock_t *lock = inode_lock(file->inode);
+        pthread_rwlock_wrlock(lock);
+        result = pwrite_file(file, buf, count, offset);
+        pthread_rwlock_unlock(lock);
+    }
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+/**
+ * Does the work of fs_pwrite, with the lock of the inode held exclusive.
+ */
+static int pwrite_file(struct open_file *file, void *buf, size_t count, off_t offset)
+{
+    if (file->inode->i_flags & INODE_FLAG_READONLY)
+    {
+        printf("Error: The file is read-only.\n");
+        return -1;
+    }
+
+    // Writes through other descriptors of the file come first, so the data lands in the order it was written. Pending
+    // data of this descriptor goes out first as well if the new write does not continue it.
+    if (flush_inode_files(file->inode, file) == -1 ||
+        (file->pending_length > 0 && offset != file->pending_offset + (off_t)file->pending_length &&
+         flush_open_file(file, false) == -1))
+    {
+        return -1;
+    }
+
+    // Writes that would fill the buffer by themselves gain nothing from being copied into it.
+    if (count >= WRITE_BUFFER_SIZE)
+    {
+        if (flush_open_file(file, false) == -1)
+        {
+            return -1;
+        }
+
+        if (journal_begin_operation(CREDITS_WRITE) == -1)
+        {
+            return -1;
+        }
+        drop_inode_readahead(file->inode);
+        int bytes_written = write_inode_steps(file->inode, &file->run, buf, count, offset);
+        if (bytes_written == -1)
+        {
+            file->run.length = 0;
+        }
+
+        // The new size and block map reach the inode table now, not only when the file is closed.
+        bool synced = sync_inode(file->inode) == 0 && sync_bitmaps() == 0;
+        if (journal_end_operation() == -1 || !synced)
+        {
+            return -1;
+        }
+        return bytes_written;
+    }
+
+    if (file->pending == NULL)
+    {
+        file->pending = malloc(WRITE_BUFFER_SIZE);
+        if (file->pending == NULL)
+        {
+            printf("Error: Failed to allocate write buffer.\n");
+            return -1;
+        }
+    }
+
+    // A full buffer is written out up to its last whole block, the partial block stays so the next write can fill it.
+    if (file->pending_length + count > WRITE_BUFFER_SIZE && flush_open_file(file, true) == -1)
+    {
+        return -1;
+    }
+    if (file->pending_length + count > WRITE_BUFFER_SIZE && flush_open_file(file, false) == -1)
+    {
+        return -1;
+    }
+
+    if (file->pending_length == 0)
+    {
+        file->pending_offset = offset;
+    }
+    memcpy(file->pending + file->pending_length, buf, count);
+    file->pending_length += count;
+    return count;
+}
+
+int fs_close(int fd)
+{
+    pthread_rwlock_rdlock(&NAMESPACE_LOCK);
+    struct open_file *file = get_open_file(fd);
+    int result = (file != NULL) ? close_file(file) : -1;
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return result;
+}
+
+/**
+ * Does the work of fs_close.
+ */
+static int close_file(struct open_file *file)
+{
+    pthread_rwlock_t *lock = inode_lock(file->inode);
+    pthread_rwlock_wrlock(lock);
+    int result = flush_open_file(file, false);
+    free(file->pending);
+    file->pending = NULL;
+    prefetch_drop(&file->readahead, 1);
+    pthread_rwlock_unlock(lock);
+
+    // Dropping the last reference writes the inode back if it is still changed.
+    int begun = journal_begin_operation(CREDITS_INODE);
+    put_inode(file->inode);
+    pthread_mutex_lock(&OPEN_FILES_LOCK);
+    file->in_use = 0;
+    file->inode = NULL;
+    pthread_mutex_unlock(&OPEN_FILES_LOCK);
+    return (begun == -1 || journal_end_operation() == -1 || result == -1) ? -1 : 0;
+}
+
+/**
+ * Gives the data held back by a descriptor its disk blocks and writes it out.
+ *
+ * @param keep_tail If true, a partial block at the end of the pending data is kept back.
+ * @return 0 on success, -1 on failure (the pending data is dropped).
+ */
+static int flush_open_file(struct open_file *file, bool keep_tail)
+{
+    // A compressed file is rewritten a cluster at a time, so its partial cluster is kept back instead.
+    size_t length = file->pending_length;
+    if (keep_tail)
+    {
+        size_t unit = (file->inode->i_flags & INODE_FLAG_COMPRESSED) ? COMPRESS_CLUSTER_SIZE : BLOCK_SIZE;
+        length -= (file->pending_offset + length) % unit;
+    }
+    if (length == 0 || length > file->pending_length)
+    {
+        return 0;
+    }
+
+    // The pending blocks are mapped as few steps allow, so they are allocated as one run where the disk allows it.
+    if (journal_begin_operation(CREDITS_WRITE) == -1)
+    {
+        return -1;
+    }
+    drop_inode_readahead(file->inode);
+    int bytes_written = write_inode_steps(file->inode, &file->run, file->pending, length, file->pending_offset);
+    if (bytes_written == -1)
+    {
+        file->run.length = 0;
+        file->pending_length = 0;
+    }
+    else
+    {
+        memmove(file->pending, file->pending + length, file->pending_length - length);
+        file->pending_offset += length;
+        file->pending_length -= length;
+    }
+
+    bool synced = sync_inode(file->inode) == 0 && sync_bitmaps() == 0;
+    if (journal_end_operation() == -1 || !synced)
+    {
+        return -1;
+    }
+    return (bytes_written == -1) ? -1 : 0;
+}
+
+/**
+ * Flushes the data held back by every descriptor of an inode, except one.
+ */
+static int flush_inode_files(const struct inode *inode, const struct open_file *except)
+{
+    struct open_file *files[FS_MAX_OPEN_FILES];
+    int count = inode_files(inode, files);
+    int result = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        if (files[i] != except && files[i]->pending_length > 0 && flush_open_file(files[i], false) == -1)
+        {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+ * Flushes the data held back by every descriptor. Called with NAMESPACE_LOCK held exclusive, before an operation that
+ * reads whole trees of files.
+ */
+static int flush_all_files()
+{
+    int result = 0;
+    for (int fd = 0; fd < FS_MAX_OPEN_FILES; ++fd)
+    {
+        if (OPEN_FILES[fd].in_use && OPEN_FILES[fd].pending_length > 0 && flush_open_file(&OPEN_FILES[fd], false) == -1)
+        {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/**
+ * Returns true if any descriptor of an inode holds back data.
+ */
+static bool inode_has_pending(const struct inode *inode)
+{
+    struct open_file *files[FS_MAX_OPEN_FILES];
+    int count = inode_files(inode, files);
+    for (int i = 0; i < count; ++i)
+    {
+        if (files[i]->pending_length > 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Returns true if a descriptor is open on the given inode.
+ */
+static bool inode_is_open(uint32_t inode_number)
+{
+    for (int fd = 0; fd < FS_MAX_OPEN_FILES; ++fd)
+    {
+        if (OPEN_FILES[fd].in_use && inode_number_of(OPEN_FILES[fd].inode) == inode_number)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Closes every open descriptor. Used when the disk is unmounted, formatted or mounted again.
+ */
+static void close_all_files()
+{
+    for (int fd = 0; fd < FS_MAX_OPEN_FILES; ++fd)
+    {
+        if (OPEN_FILES[fd].in_use)
+        {
+            // Data held back only reaches the disk while the file system it belongs to is mounted.
+            if (MOUNT_FLAG == 1 && flush_open_file(&OPEN_FILES[fd], false) == -1)
+            {
+                printf("Error: Failed to write pending data of descriptor %d.\n", fd);
+            }
+            free(OPEN_FILES[fd].pending);
+            OPEN_FILES[fd].pending = NULL;
+            OPEN_FILES[fd].pending_length = 0;
+            prefetch_drop(&OPEN_FILES[fd].readahead, 1);
+
+            put_inode(OPEN_FILES[fd].inode);
+            OPEN_FILES[fd].in_use = 0;
+            OPEN_FILES[fd].inode = NULL;
+        }
+    }
+}
+
+int fs_read(char *path, void *buf, size_t count, off_t offset)
+{
+    int fd = fs_open(path, 0);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    int bytes_read = fs_pread(fd, buf, count, offset);
+    fs_close(fd);
+    return bytes_read;
+}
+
+int fs_write(char *path, void *buf, size_t count, off_t offset)
+{
+    int fd = fs_open(path, FS_O_CREATE);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    // Data held back by the descriptor only gets its blocks when it is closed, which may fail on a full disk.
+    int bytes_written = fs_pwrite(fd, buf, count, offset);
+    if (fs_close(fd) == -1)
+    {
+        return -1;
+    }
+    return bytes_written;
+}
+
+int fs_list(char *path)
+{
+    pthread_rwlock_rdlock(&NAMESPACE_LOCK);
+    if (MOUNT_FLAG == 0)
+    {
+        printf("Error: Disk is not mounted.\n");
+        pthread_rwlock_unlock(&NAMESPACE_LOCK);
+        return -1;
+    }
+
+    struct inode *dir_inode = lookup_path(path);
+    if (dir_inode == NULL || !dir_inode->i_is_directory)
+    {
+        printf("Error: Directory not found.\n");
+        if (dir_inode != NULL)
+            put_inode(dir_inode);
+        pthread_rwlock_unlock(&NAMESPACE_LOCK);
+        return -1;
+    }
+
+    uint32_t block_count = directory_block_count(dir_inode);
+    for (uint32_t i = 0; i < block_count; ++i)
+    {
+        uint32_t block_num = directory_block_number(dir_inode, i);
+        if (block_num == 0)
+            continue;
+
+        union block scratch;
+        const union block *dir_block = read_block(block_num, &scratch);
+        if (dir_block == NULL)
+            continue;
+
+        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        {
+            const struct directory_entry *entry = &dir_block->directory_block.entries[j];
+            if (entry->inode_number == 0)
+                continue;
+
+            // Hot inodes come out of the inode cache, so listing a directory does not read the inode table again.
+            struct inode *entry_inode = get_inode(entry->inode_number);
+            if (entry_inode == NULL)
+                continue;
+            pthread_rwlock_t *lock = inode_lock(entry_inode);
+            pthread_rwlock_rdlock(lock);
+
+            // Data held back by a descriptor is written out first, so the size takes it in as fs_pread would.
+            if (inode_has_pending(entry_inode))
+            {
+                pthread_rwlock_unlock(lock);
+                pthread_rwlock_wrlock(lock);
+                flush_inode_files(entry_inode, NULL);
+                pthread_rwlock_unlock(lock);
+                pthread_rwlock_rdlock(lock);
+            }
+            printf("%s %lu\n", entry->name, (unsigned long)entry_inode->i_size);
+            pthread_rwlock_unlock(lock);
+            put_inode(entry_inode);
+        }
+    }
+
+    put_inode(dir_inode);
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+    return 0;
+}
+
+void fs_stat()
+{
+    pthread_rwlock_rdlock(&NAMESPACE_LOCK);
+    if (MOUNT_FLAG == 0)
+    {
+        printf("Error: Disk is not mounted.\n");
+        pthread_rwlock_unlock(&NAMESPACE_LOCK);
+        return;
+    }
+
+    printf("Superblock:\n");
+    printf("    Blocks: %d\n", SUPERBLOCK.superblock.s_blocks_count);
+    printf("    Inodes: %d\n", SUPERBLOCK.superblock.s_inodes_count);
+    printf("    Inode Table Block Start: %d\n", SUPERBLOCK.superblock.s_inode_table_block_start);
+    printf("    Data Blocks Start: %d\n", SUPERBLOCK.superblock.s_data_blocks_start);
+    uint32_t extents = 0;
+    for (uint32_t g = 0; g < GROUPS_COUNT; g++)
+    {
+        pthread_mutex_lock(&GROUPS[g].lock);
+        extents += GROUPS[g].space.extents;
+        pthread_mutex_unlock(&GROUPS[g].lock);
+    }
+    printf("    Block Groups: %d\n", GROUPS_COUNT);
+    printf("    Free Blocks: %d\n", __atomic_load_n(&BLOCK_BITMAP.free_count, __ATOMIC_RELAXED));
+    printf("    Free Inodes: %d\n", __atomic_load_n(&INODE_BITMAP.free_count, __ATOMIC_RELAXED));
+    printf("    Free Extents: %d\n", extents);
+    printf("    Shared Blocks: %d\n", __atomic_load_n(&REFERENCES.shares, __ATOMIC_RELAXED));
+    printf("    Journal Blocks: %d\n", SUPERBLOCK.superblock.s_journal_blocks);
+    printf("    Journal Commits: %d\n", journal_commits());
+    if (SUPERBLOCK.superblock.s_checksum_table != 0)
+    {
+        printf("    Checksums: CRC32C (%s)\n", crc32c_accelerated() ? "SSE4.2" : "table");
+        printf("    Checksum Failures: %d\n", checksum_failures());
+    }
+    pthread_rwlock_unlock(&NAMESPACE_LOCK);
+}
+
+// Helper functions
+/**
+ * Picks the group a new directory goes to, spreading directories out: among the groups with at least the average
+ * number of free inodes, the one with the most free blocks.
+ */
+static uint32_t directory_group()
+{
+    uint32_t average = __atomic_load_n(&INODE_BITMAP.free_count, __ATOMIC_RELAXED) / GROUPS_COUNT;
+    uint32_t best = 0;
+    uint32_t best_free_blocks = 0;
+    for (uint32_t g = 0; g < GROUPS_COUNT; g++)
+    {
+        pthread_mutex_lock(&GROUPS[g].lock);
+        uint32_t free_inodes = INODE_BITMAP.group_free[g];
+        uint32_t free_blocks = BLOCK_BITMAP.group_free[g];
+        pthread_mutex_unlock(&GROUPS[g].lock);
+
+        if (free_inodes > 0 && free_inodes >= average && free_blocks > best_free_blocks)
+        {
+            best = g;
+            best_free_blocks = free_blocks;
+        }
+    }
+    return best;
+}
+
+/**
+ * Allocates an inode. Files go to the group of their parent directory, directories are spread out over the groups
+ * (see directory_group). If that group has no free inode, the groups after it are tried in turn.
+ *
+ * @return The inode number, or (uint32_t)-1 if there is no free inode.
+ */
+uint32_t allocate_inode(uint32_t parent_inode_number, int is_directory)
+{
+    uint32_t first = (is_directory && GROUPS_COUNT > 1) ? directory_group() : group_of_inode(parent_inode_number);
+    uint32_t inodes_per_group = (GROUPS_COUNT > 1) ? INODE_BITMAP.group_bits : INODE_BITMAP.nbits;
+
+    for (uint32_t n = 0; n < GROUPS_COUNT; n++)
+    {
+        uint32_t g = (first + n) % GROUPS_COUNT;
+        uint32_t end = (g + 1) * inodes_per_group;
+        pthread_mutex_lock(&GROUPS[g].lock);
+        uint32_t inode_number = bitmap_allocate_range(&INODE_BITMAP, g * inodes_per_group,
+                                                      (end < INODE_BITMAP.nbits) ? end : INODE_BITMAP.nbits);
+        pthread_mutex_unlock(&GROUPS[g].lock);
+        if (inode_number != (uint32_t)-1)
+        {
+            return inode_number;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Allocates a single data block near goal, see allocate_data_blocks.
+ *
+ * @return The block number, or (uint32_t)-1 if the disk is full.
+ */
+uint32_t allocate_data_block(uint32_t goal)
+{
+    uint32_t length;
+    return allocate_data_blocks(goal, 1, &length);
+}
+
+/**
+ * Allocates a run of up to count consecutive data blocks near goal, through the free extent index of the group of
+ * goal: the run starts at goal if that block is free, otherwise it is the first free extent of count blocks after goal
+ * in the group, and only comes out shorter if the group has no free extent that long. Groups without a free block are
+ * skipped. Only the group being searched is locked, so allocations in different groups run in parallel.
+ *
+ * @param goal The block the run should start at, or any block of the group it should come from.
+ * @param length Receives the number of blocks allocated.
+ * @return The first block of the run, or (uint32_t)-1 if the disk is full.
+ */
+uint32_t allocate_data_blocks(uint32_t goal, uint32_t count, uint32_t *length)
+{
+    if (goal < SUPERBLOCK.superblock.s_data_blocks_start || goal >= BLOCK_BITMAP.nbits)
+    {
+        goal = SUPERBLOCK.superblock.s_data_blocks_start;
+    }
+
+    uint32_t first = group_of_block(goal);
+    for (uint32_t n = 0; n < GROUPS_COUNT; n++)
+    {
+        uint32_t g = (first + n) % GROUPS_COUNT;
+        struct block_group *group = &GROUPS[g];
+        pthread_mutex_lock(&group->lock);
+        uint32_t start = freespace_allocate(&group->space, (n == 0) ? goal : g * BLOCKS_PER_GROUP, count, length);
+        for (uint32_t i = 0; start != (uint32_t)-1 && i < *length; ++i)
+        {
+            bitmap_update(&BLOCK_BITMAP, start + i, true);
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (start != (uint32_t)-1)
+        {
+            return start;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Drops a reference to a data block. A shared block loses one share, any other is marked as free again and returned to
+ * the free extent index of its group. A freed block that held metadata is revoked by the operation freeing it, which has
+ * the credit for it, so the write that reuses it for data later has no revoke to pay for.
+ */
+static void free_data_block(uint32_t block_num)
+{
+    if (block_num < SUPERBLOCK.superblock.s_data_blocks_start || block_num >= BLOCK_BITMAP.nbits)
+        return;
+
+    struct block_group *group = &GROUPS[group_of_block(block_num)];
+    bool freed = false;
+    pthread_mutex_lock(&group->lock);
+    if (*bitmap_word(&BLOCK_BITMAP, block_num) & (1ULL << (block_num % 64)))
+    {
+        struct block_reference *reference = block_reference(block_num);
+        if (reference != NULL && reference->r_shares > 0)
+        {
+            reference->r_shares--;
+            __atomic_sub_fetch(&REFERENCES.shares, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            if (reference != NULL)
+                reference->r_fingerprint = 0;
+            bitmap_update(&BLOCK_BITMAP, block_num, false);
+            freespace_free(&group->space, block_num, 1);
+            freed = true;
+        }
+        if (reference != NULL)
+            REFERENCES.dirty[block_num / REFERENCES_PER_BLOCK] = 1;
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    // Should the transaction be full, the block is revoked when it is claimed for data instead.
+    if (freed)
+        journal_claim(block_num, 1);
+}
+
+/**
+ * Marks an inode as free again. The root inode is never freed.
+ */
+static void free_inode(uint32_t inode_number)
+{
+    if (inode_number == 0 || inode_number >= INODE_BITMAP.nbits)
+        return;
+
+    struct block_group *group = &GROUPS[group_of_inode(inode_number)];
+    pthread_mutex_lock(&group->lock);
+    bitmap_update(&INODE_BITMAP, inode_number, false);
+    pthread_mutex_unlock(&group->lock);
+}
+
+/**
+ * Sets up the in-core state of the block groups, with no free extents yet, replacing what was there.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int groups_init(uint32_t count)
+{
+    groups_release();
+
+    GROUPS = calloc(count, sizeof(struct block_group));
+    if (GROUPS == NULL)
+    {
+        return -1;
+    }
+    for (uint32_t g = 0; g < count; g++)
+    {
+        pthread_mutex_init(&GROUPS[g].lock, NULL);
+    }
+    GROUPS_COUNT = count;
+    return 0;
+}
+
+/**
+ * Frees the in-core state of the block groups.
+ */
+static void groups_release()
+{
+    for (uint32_t g = 0; g < GROUPS_COUNT; g++)
+    {
+        freespace_release(&GROUPS[g].space);
+        pthread_mutex_destroy(&GROUPS[g].lock);
+    }
+    free(GROUPS);
+    GROUPS = NULL;
+    GROUPS_COUNT = 0;
+}
+
+/**
+ * Returns the block group a block belongs to. Disks without block groups are one group.
+ */
+static uint32_t group_of_block(uint32_t block_num)
+{
+    return (SUPERBLOCK.superblock.s_groups_count != 0) ? block_num / SUPERBLOCK.superblock.s_blocks_per_group : 0;
+}
+
+/**
+ * Returns the block group an inode belongs to. Disks without block groups are one group.
+ */
+static uint32_t group_of_inode(uint32_t inode_number)
+{
+    return (SUPERBLOCK.superblock.s_groups_count != 0) ? inode_number / SUPERBLOCK.superblock.s_inodes_per_group : 0;
+}
+
+/**
+ * Returns the block of the inode table holding an inode.
+ */
+static uint32_t inode_table_block(uint32_t inode_number)
+{
+    const struct superblock *superblock = &SUPERBLOCK.superblock;
+    if (superblock->s_groups_count == 0)
+    {
+        return superblock->s_inode_table_block_start + inode_number / INODES_PER_BLOCK;
+    }
+    return group_of_inode(inode_number) * superblock->s_blocks_per_group + superblock->s_inode_table_block_start +
+           (inode_number % superblock->s_inodes_per_group) / INODES_PER_BLOCK;
+}
+
+/**
+ * Returns where the search for a new block of a file starts when nothing better is known: the first data block of
+ * the group of its inode, so the data lands next to the inode.
+ */
+static uint32_t inode_goal(const struct inode *inode)
+{
+    uint32_t group = group_of_inode(inode_number_of(inode));
+    return (group == 0) ? SUPERBLOCK.superblock.s_data_blocks_start : group * SUPERBLOCK.superblock.s_blocks_per_group;
+}
+
+/**
+ * Returns the word of an in-core bitmap holding a bit.
+ */
+static uint64_t *bitmap_word(const struct bitmap *bitmap, uint32_t bit)
+{
+    uint32_t group = bit / bitmap->group_bits;
+    return &bitmap->words[(size_t)group * BITMAP_WORDS_PER_BLOCK + (bit % bitmap->group_bits) / 64];
+}
+
+/**
+ * Sets up an in-core bitmap covering the given blocks, either read from the disk or all clear.
+ *
+ * @param start_block The block of the first group of the bitmap on the disk.
+ * @param stride The distance between the blocks of consecutive groups, 1 if the bitmap is stored in one piece.
+ * @param nblocks The number of blocks (groups) in the bitmap.
+ * @param group_bits The number of inodes or blocks a group tracks, a multiple of 64 up to BITS_PER_BLOCK.
+ * @param nbits The number of inodes or blocks tracked. Bits past it are kept set so they are never allocated.
+ * @param load If true the bitmap is read from the disk, otherwise it starts out with every bit clear.
+ * @return 0 on success, -1 on failure.
+ */
+static int bitmap_init(struct bitmap *bitmap, uint32_t start_block, uint32_t stride, uint32_t nblocks,
+                       uint32_t group_bits, uint32_t nbits, bool load)
+{
+    bitmap_release(bitmap);
+
+    bitmap->words = calloc((size_t)nblocks * BITMAP_WORDS_PER_BLOCK, sizeof(uint64_t));
+    bitmap->group_free = calloc(nblocks, sizeof(uint32_t));
+    bitmap->group_hint = calloc(nblocks, sizeof(uint32_t));
+    bitmap->dirty = calloc(nblocks, sizeof(uint8_t));
+    if (bitmap->words == NULL || bitmap->group_free == NULL || bitmap->group_hint == NULL || bitmap->dirty == NULL)
+    {
+        bitmap_release(bitmap);
+        return -1;
+    }
+    bitmap->start_block = start_block;
+    bitmap->stride = stride;
+    bitmap->nblocks = nblocks;
+    bitmap->group_bits = group_bits;
+    bitmap->nbits = nbits;
+
+    for (uint32_t i = 0; load && i < nblocks; ++i)
+    {
+        if (cache_read(start_block + i * stride, &bitmap->words[(size_t)i * BITMAP_WORDS_PER_BLOCK]) == -1)
+        {
+            bitmap_release(bitmap);
+            return -1;
+        }
+    }
+
+    for (uint32_t i = 0; i < nblocks; ++i)
+    {
+        for (uint32_t bit = 0; bit < BITS_PER_BLOCK; ++bit)
+        {
+            if (bit >= group_bits || (uint64_t)i * group_bits + bit >= nbits)
+                bitmap->words[(size_t)i * BITMAP_WORDS_PER_BLOCK + bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+
+    // Summarise every group (bitmap block) by its number of clear bits.
+    bitmap->free_count = 0;
+    for (uint32_t i = 0; i < nblocks; ++i)
+    {
+        uint32_t used = 0;
+        for (uint32_t w = 0; w < BITMAP_WORDS_PER_BLOCK; ++w)
+        {
+            used += __builtin_popcountll(bitmap->words[(size_t)i * BITMAP_WORDS_PER_BLOCK + w]);
+        }
+        bitmap->group_free[i] = BITS_PER_BLOCK - used;
+        bitmap->group_hint[i] = i * group_bits;
+        bitmap->free_count += bitmap->group_free[i];
+        bitmap->dirty[i] = !load;
+    }
+
+    return 0;
+}
+
+/**
+ * Frees the memory of an in-core bitmap.
+ */
+static void bitmap_release(struct bitmap *bitmap)
+{
+    free(bitmap->words);
+    free(bitmap->group_free);
+    free(bitmap->group_hint);
+    free(bitmap->dirty);
+    memset(bitmap, 0, sizeof(struct bitmap));
+}
+
+/**
+ * Sets or clears a bit, keeping the group summary and hint up to date. The caller holds the lock of the block group of
+ * the bit.
+ */
+static void bitmap_update(struct bitmap *bitmap, uint32_t bit, bool set)
+{
+    uint64_t mask = 1ULL << (bit % 64);
+    uint64_t *word = bitmap_word(bitmap, bit);
+    if (((*word & mask) != 0) == set)
+        return;
+
+    uint32_t group = bit / bitmap->group_bits;
+    if (set)
+    {
+        *word |= mask;
+        bitmap->group_free[group]--;
+        if (bitmap->group_hint[group] == bit)
+            bitmap->group_hint[group]++;
+        __atomic_sub_fetch(&bitmap->free_count, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        *word &= ~mask;
+        bitmap->group_free[group]++;
+        if (bitmap->group_hint[group] > bit)
+            bitmap->group_hint[group] = bit;
+        __atomic_add_fetch(&bitmap->free_count, 1, __ATOMIC_RELAXED);
+    }
+    bitmap->dirty[group] = 1;
+}
+
+/**
+ * Finds the first clear bit in [first, end) and sets it. Groups with no clear bit are skipped using their summary, a
+ * group is searched from its next free hint on, and 64 bits at a time. The caller holds the lock of the block group of
+ * the bits.
+ *
+ * @return The bit number, or (uint32_t)-1 if every bit in the range is set.
+ */
+static uint32_t bitmap_allocate_range(struct bitmap *bitmap, uint32_t first, uint32_t end)
+{
+    uint32_t bit = first;
+    uint32_t hinted = UINT32_MAX; // the group searched from its hint on
+    while (bit < end)
+    {
+        uint32_t group = bit / bitmap->group_bits;
+        if (bitmap->group_free[group] == 0)
+        {
+            bit = (group + 1) * bitmap->group_bits;
+            continue;
+        }
+        if (group != hinted && bit <= bitmap->group_hint[group])
+        {
+            bit = bitmap->group_hint[group];
+            hinted = group;
+        }
+
+        uint64_t clear = ~*bitmap_word(bitmap, bit) >> (bit % 64);
+        if (clear != 0)
+        {
+            uint32_t found = bit + __builtin_ctzll(clear);
+            if (found >= end)
+                break;
+
+            // Searched from the hint, every bit up to the one found is set, so the hint moves past it.
+            if (group == hinted)
+                bitmap->group_hint[group] = found;
+            bitmap_update(bitmap, found, true);
+            return found;
+        }
+        bit += 64 - bit % 64;
+    }
+    return -1;
+}
+
+/**
+ * Writes the bitmap blocks changed since the last call through the cache.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int bitmap_sync(struct bitmap *bitmap)
+{
+    for (uint32_t i = 0; i < bitmap->nblocks; ++i)
+    {
+        // Each bitmap block belongs to a block group, except on disks without groups where they all belong to one.
+        struct block_group *group = &GROUPS[(SUPERBLOCK.superblock.s_groups_count != 0) ? i : 0];
+        pthread_mutex_lock(&group->lock);
+        int result = 0;
+        if (bitmap->dirty[i])
+        {
+            result = journal_write(bitmap->start_block + i * bitmap->stride,
+                                   &bitmap->words[(size_t)i * BITMAP_WORDS_PER_BLOCK]);
+            bitmap->dirty[i] = (result == -1);
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (result == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes both bitmaps, the block reference table and the block checksum table back. Called once at the end of every
+ * operation that may allocate or free (or write metadata), so an operation that allocates many blocks writes each
+ * bitmap block once. The checksums go last, as writing the others changes them.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_bitmaps()
+{
+    int result = 0;
+    if (bitmap_sync(&BLOCK_BITMAP) == -1 || bitmap_sync(&INODE_BITMAP) == -1 || references_sync() == -1 ||
+        checksum_flush(journal_write) == -1)
+    {
+        result = -1;
+    }
+    if (result == -1)
+    {
+        printf("Error: Failed to write the bitmaps back.\n");
+    }
+    return result;
+}
+
+/**
+ * Sets up the in-core block reference table and the fingerprint index, either read from the disk or empty, replacing
+ * what was there. The table covers every block tracked by the block bitmap, which has to be set up first.
+ *
+ * @param start_block The first block of the table on the disk.
+ * @param nblocks The number of blocks in the table.
+ * @param load If true the table is read from the disk, otherwise every entry starts out clear.
+ * @return 0 on success, -1 on failure.
+ */
+static int references_init(uint32_t start_block, uint32_t nblocks, bool load)
+{
+    references_release();
+
+    // The index has a slot per block, rounded up to a power of two.
+    uint32_t slots = 1;
+    while (slots < BLOCK_BITMAP.nbits)
+    {
+        slots <<= 1;
+    }
+    REFERENCES.entries = calloc((size_t)nblocks * REFERENCES_PER_BLOCK, sizeof(struct block_reference));
+    REFERENCES.dirty = calloc(nblocks, sizeof(uint8_t));
+    FINGERPRINTS = calloc(slots, sizeof(struct fingerprint_slot));
+    if (REFERENCES.entries == NULL || REFERENCES.dirty == NULL || FINGERPRINTS == NULL)
+    {
+        references_release();
+        return -1;
+    }
+    REFERENCES.start_block = start_block;
+    REFERENCES.nblocks = nblocks;
+    FINGERPRINTS_MASK = slots - 1;
+
+    for (uint32_t i = 0; i < nblocks; ++i)
+    {
+        REFERENCES.dirty[i] = !load;
+        if (load && cache_read(start_block + i, &REFERENCES.entries[(size_t)i * REFERENCES_PER_BLOCK]) == -1)
+        {
+            references_release();
+            return -1;
+        }
+    }
+
+    // Count the shares and index the blocks with a fingerprint.
+    for (uint32_t block_num = 0; load && block_num < BLOCK_BITMAP.nbits; ++block_num)
+    {
+        REFERENCES.shares += REFERENCES.entries[block_num].r_shares;
+        if (REFERENCES.entries[block_num].r_fingerprint != 0)
+        {
+            remember_fingerprint(block_num, REFERENCES.entries[block_num].r_fingerprint);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Frees the in-core block reference table and the fingerprint index.
+ */
+static void references_release()
+{
+    free(REFERENCES.entries);
+    free(REFERENCES.dirty);
+    memset(&REFERENCES, 0, sizeof(struct reference_table));
+    free(FINGERPRINTS);
+    FINGERPRINTS = NULL;
+    FINGERPRINTS_MASK = 0;
+}
+
+/**
+ * Writes the blocks of the reference table changed since the last call through the cache.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int references_sync()
+{
+    for (uint32_t i = 0; i < REFERENCES.nblocks; ++i)
+    {
+        struct block_group *group = &GROUPS[group_of_block(i * REFERENCES_PER_BLOCK)];
+        pthread_mutex_lock(&group->lock);
+        int result = 0;
+        if (REFERENCES.dirty[i])
+        {
+            result = journal_write(REFERENCES.start_block + i, &REFERENCES.entries[(size_t)i * REFERENCES_PER_BLOCK]);
+            REFERENCES.dirty[i] = (result == -1);
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (result == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the entry of a block in the reference table, NULL if the file system has no table. The caller holds the lock
+ * of the block group of the block.
+ */
+static struct block_reference *block_reference(uint32_t block_num)
+{
+    return (REFERENCES.entries != NULL) ? &REFERENCES.entries[block_num] : NULL;
+}
+
+/**
+ * Returns the fingerprint of the contents of a block, never 0. Four lanes of 64-bit multiply and shift mixing, folded
+ * to 32 bits.
+ */
+static uint32_t block_fingerprint(const void *data)
+{
+    const uint8_t *bytes = data;
+    uint64_t lanes[4] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+    for (size_t i = 0; i < BLOCK_SIZE; i += 4 * sizeof(uint64_t))
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            uint64_t word;
+            memcpy(&word, bytes + i + lane * sizeof(uint64_t), sizeof(uint64_t));
+            lanes[lane] = (lanes[lane] ^ word) * 0x9E3779B97F4A7C15ULL;
+            lanes[lane] ^= lanes[lane] >> 29;
+        }
+    }
+    uint64_t hash = lanes[0] ^ (lanes[1] * 31) ^ (lanes[2] * 131) ^ (lanes[3] * 1031);
+    hash ^= hash >> 32;
+    return ((uint32_t)hash != 0) ? (uint32_t)hash : 1;
+}
+
+/**
+ * Adds a block to the fingerprint index, in a slot that is empty or already has the fingerprint, or else in place of
+ * the first candidate slot. The index only gives candidates, so a block forgotten this way costs a missed duplicate.
+ */
+static void remember_fingerprint(uint32_t block_num, uint32_t fingerprint)
+{
+    pthread_mutex_lock(&FINGERPRINTS_LOCK);
+    uint32_t slot = fingerprint & FINGERPRINTS_MASK;
+    for (int i = 0; i < FINGERPRINT_PROBES; i++)
+    {
+        uint32_t probe = (fingerprint + i) & FINGERPRINTS_MASK;
+        if (FINGERPRINTS[probe].fingerprint == 0 || FINGERPRINTS[probe].fingerprint == fingerprint)
+        {
+            slot = probe;
+            break;
+        }
+    }
+    FINGERPRINTS[slot].fingerprint = fingerprint;
+    FINGERPRINTS[slot].block = block_num;
+    pthread_mutex_unlock(&FINGERPRINTS_LOCK);
+}
+
+/**
+ * Records the fingerprint of a block a deduplicated file has just written, in its entry of the reference table and in
+ * the index. A block shared in the meantime keeps the fingerprint it has.
+ */
+static void record_fingerprint(uint32_t block_num, uint32_t fingerprint)
+{
+    if (REFERENCES.entries == NULL || block_num >= BLOCK_BITMAP.nbits)
+    {
+        return;
+    }
+
+    struct block_group *group = &GROUPS[group_of_block(block_num)];
+    pthread_mutex_lock(&group->lock);
+    struct block_reference *reference = block_reference(block_num);
+    bool recorded = reference->r_shares == 0;
+    if (recorded)
+    {
+        reference->r_fingerprint = fingerprint;
+        REFERENCES.dirty[block_num / REFERENCES_PER_BLOCK] = 1;
+    }
+    pthread_mutex_unlock(&group->lock);
+    if (recorded)
+    {
+        remember_fingerprint(block_num, fingerprint);
+    }
+}
+
+/**
+ * Looks for a block on the disk holding the same contents as data, and takes a share of it.
+ *
+ * A candidate from the index is only shared if, under the lock of its block group, it is still in use with the same
+ * fingerprint and its contents are the same. Writers in place clear the fingerprint under that lock before they write
+ * (see prepare_block_write), so the contents cannot change between the comparison and the new share.
+ *
+ * @return The block, now with one more share, or 0 if there is none.
+ */
+static uint32_t find_duplicate(uint32_t fingerprint, const void *data)
+{
+    if (FINGERPRINTS == NULL)
+    {
+        return 0;
+    }
+
+    uint32_t candidates[FINGERPRINT_PROBES];
+    int count = 0;
+    pthread_mutex_lock(&FINGERPRINTS_LOCK);
+    for (int i = 0; i < FINGERPRINT_PROBES; i++)
+    {
+        const struct fingerprint_slot *slot = &FINGERPRINTS[(fingerprint + i) & FINGERPRINTS_MASK];
+        if (slot->fingerprint == fingerprint)
+        {
+            candidates[count++] = slot->block;
+        }
+    }
+    pthread_mutex_unlock(&FINGERPRINTS_LOCK);
+
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t block_num = candidates[i];
+        if (block_num < SUPERBLOCK.superblock.s_data_blocks_start || block_num >= BLOCK_BITMAP.nbits)
+        {
+            continue;
+        }
+
+        struct block_group *group = &GROUPS[group_of_block(block_num)];
+        pthread_mutex_lock(&group->lock);
+        struct block_reference *reference = block_reference(block_num);
+        bool shared = false;
+        if ((*bitmap_word(&BLOCK_BITMAP, block_num) & (1ULL << (block_num % 64))) &&
+            reference->r_fingerprint == fingerprint)
+        {
+            union block scratch;
+            const union block *contents = read_block(block_num, &scratch);
+            if (contents != NULL && memcmp(contents->data, data, BLOCK_SIZE) == 0)
+            {
+                reference->r_shares++;
+                REFERENCES.dirty[block_num / REFERENCES_PER_BLOCK] = 1;
+                __atomic_add_fetch(&REFERENCES.shares, 1, __ATOMIC_RELAXED);
+                shared = true;
+            }
+        }
+        pthread_mutex_unlock(&group->lock);
+        if (shared)
+        {
+            return block_num;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Called before a block of a file is written in place. A block that is not shared forgets its fingerprint, since its
+ * contents are about to change.
+ *
+ * @return true if the block is shared with other files, so the file has to get a copy of its own instead.
+ */
+static bool prepare_block_write(uint32_t block_num)
+{
+    if (REFERENCES.entries == NULL || block_num >= BLOCK_BITMAP.nbits)
+    {
+        return false;
+    }
+
+    struct block_group *group = &GROUPS[group_of_block(block_num)];
+    pthread_mutex_lock(&group->lock);
+    struct block_reference *reference = block_reference(block_num);
+    bool shared = reference->r_shares > 0;
+    if (!shared && reference->r_fingerprint != 0)
+    {
+        reference->r_fingerprint = 0;
+        REFERENCES.dirty[block_num / REFERENCES_PER_BLOCK] = 1;
+    }
+    pthread_mutex_unlock(&group->lock);
+    return shared;
+}
+
+/**
+ * Takes one more share of every block of a run, which a file is about to map as it is (see clone_file_data). The lock
+ * of a block group is taken once for the blocks of the run inside it.
+ */
+static void share_blocks(uint32_t start_block, uint32_t length)
+{
+    uint32_t i = 0;
+    while (i < length)
+    {
+        uint32_t group_number = group_of_block(start_block + i);
+        pthread_mutex_lock(&GROUPS[group_number].lock);
+        for (; i < length && group_of_block(start_block + i) == group_number; i++)
+        {
+            uint32_t block_num = start_block + i;
+            block_reference(block_num)->r_shares++;
+            REFERENCES.dirty[block_num / REFERENCES_PER_BLOCK] = 1;
+        }
+        pthread_mutex_unlock(&GROUPS[group_number].lock);
+    }
+    __atomic_add_fetch(&REFERENCES.shares, length, __ATOMIC_RELAXED);
+}
+
+/**
+ * Converts a disk formatted with single-block bitmaps of one uint32_t flag per object to the current layout. The
+ * old bitmap blocks (1 and 2) are rewritten in place as bit bitmaps, which hold far more than the old ones could.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int upgrade_legacy_bitmaps()
+{
+    union block flags[2];
+    if (cache_read(1, &flags[0]) == -1 || cache_read(2, &flags[1]) == -1)
+    {
+        return -1;
+    }
+
+    struct superblock *superblock = &SUPERBLOCK.superblock;
+    superblock->s_block_bitmap = 1;
+    superblock->s_block_bitmap_blocks = 1;
+    superblock->s_inode_bitmap = 2;
+    superblock->s_inode_bitmap_blocks = 1;
+
+    struct bitmap *bitmaps[2] = {&BLOCK_BITMAP, &INODE_BITMAP};
+    uint32_t counts[2] = {superblock->s_blocks_count, superblock->s_inodes_count};
+    for (int b = 0; b < 2; ++b)
+    {
+        uint32_t nbits = (counts[b] < BITS_PER_BLOCK) ? counts[b] : BITS_PER_BLOCK;
+        if (bitmap_init(bitmaps[b], 1 + b, 1, 1, BITS_PER_BLOCK, nbits, false) == -1)
+        {
+            return -1;
+        }
+        for (uint32_t i = 0; i < LEGACY_FLAGS_PER_BLOCK && i < nbits; ++i)
+        {
+            if (flags[b].pointers[i])
+                bitmap_update(bitmaps[b], i, true);
+        }
+    }
+
+    LOG_DEBUG("Converted the single-block bitmaps to the current layout.\n");
+    return (sync_bitmaps() == -1 || cache_write(0, &SUPERBLOCK) == -1) ? -1 : 0;
+}
+
+/**
+ * Frees a block of a pointer-mapped file and, for an indirect block, everything it points to.
+ *
+ * @param levels The number of indirect levels below the block: 0 for a data block, 1 for a single indirect block...
+ */
+static void free_pointer_block(uint32_t block_num, int levels)
+{
+    if (block_num == 0)
+        return;
+
+    union block pointers;
+    if (levels > 0 && cache_read(block_num, &pointers) != -1)
+    {
+        for (unsigned int i = 0; i < INODE_INDIRECT_POINTERS_PER_BLOCK; ++i)
+        {
+            free_pointer_block(pointers.pointers[i], levels - 1);
+        }
+    }
+    free_data_block(block_num);
+}
+
+/**
+ * Frees every data block of an inode (and its indirect blocks or extent tree) and truncates it to zero bytes.
+ */
+static void free_inode_blocks(struct inode *inode)
+{
+    if (inode->i_flags & INODE_FLAG_INLINE)
+    {
+        memset(inode->i_inline_data, 0, INODE_INLINE_SIZE);
+        inode->i_size = 0;
+        mark_inode_dirty(inode);
+        return;
+    }
+
+    if (inode->i_flags & INODE_FLAG_EXTENTS)
+    {
+        extent_free_node(&inode->i_extent_header, inode->i_extents);
+        memset(&inode->i_extent_header, 0, sizeof(struct extent_header));
+        memset(inode->i_extents, 0, sizeof(inode->i_extents));
+        inode->i_size = 0;
+        mark_inode_dirty(inode);
+        return;
+    }
+
+    for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
+    {
+        free_data_block(inode->i_direct_pointers[i]);
+        inode->i_direct_pointers[i] = 0;
+    }
+
+    free_pointer_block(inode->i_single_indirect_pointer, 1);
+    inode->i_single_indirect_pointer = 0;
+    free_pointer_block(inode->i_double_indirect_pointer, 2);
+    inode->i_double_indirect_pointer = 0;
+
+    inode->i_size = 0;
+    mark_inode_dirty(inode);
+}
+
+/**
+ * Frees the data blocks of an extent-mapped file in steps, see run_step. Between steps the file reads as a hole where
+ * the blocks freed so far were. The extent tree itself is left for free_inode_blocks.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int free_extent_steps(struct inode *inode)
+{
+    uint32_t run = 0;
+    for (uint32_t index = 0; index < UINT32_MAX; index += run)
+    {
+        uint32_t physical;
+        run = extent_map(inode, index, UINT32_MAX - index, &physical);
+        if (run == 0)
+        {
+            return -1;
+        }
+        if (physical == 0)
+        {
+            continue;
+        }
+
+        run = run_step(inode, physical, run);
+        if (run == 0 || extent_remove(inode, index, run) == -1)
+        {
+            return -1;
+        }
+        mark_inode_dirty(inode);
+        if (sync_inode(inode) == -1 || sync_bitmaps() == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the journal credits to free or share a run of blocks: an extent mapping it, the inode, and the bitmap and
+ * reference table blocks it spans together with their checksum table blocks.
+ */
+static int run_credits(uint32_t physical, uint32_t length)
+{
+    uint32_t last = physical + length - 1;
+    int bitmap_blocks = last / BITS_PER_BLOCK - physical / BITS_PER_BLOCK + 1;
+    int reference_blocks = last / REFERENCES_PER_BLOCK - physical / REFERENCES_PER_BLOCK + 1;
+    return CREDITS_INODE + CREDITS_EXTENT + 2 * (bitmap_blocks + reference_blocks);
+}
+
+/**
+ * Shortens a run of blocks to be freed or shared until the operation has the credits for it (see run_credits). If not
+ * even one block fits, the operation goes on in a new step, see operation_step.
+ *
+ * @return The number of blocks of the run to take now, 0 on failure.
+ */
+static uint32_t run_step(struct inode *inode, uint32_t physical, uint32_t length)
+{
+    while (length > 1 && !has_credits(run_credits(physical, length)))
+    {
+        length = (length + 1) / 2;
+    }
+    if (length == 1 && !has_credits(run_credits(physical, 1)) && operation_step(inode, run_credits(physical, 1)) == -1)
+    {
+        return 0;
+    }
+    return length;
+}
+
+int write_inode_to_disk(uint32_t inode_number, struct inode *inode)
+{
+    uint32_t block_number = inode_table_block(inode_number);
+    uint32_t index_within_block = inode_number % INODES_PER_BLOCK;
+
+    // Inodes sharing the block may be written by other threads, so the block is read and written back as one step.
+    pthread_mutex_lock(&INODE_TABLE_LOCK);
+    union block inode_block;
+    if (cache_read(block_number, &inode_block) == -1)
+    {
+        pthread_mutex_unlock(&INODE_TABLE_LOCK);
+        printf("Error: Failed to read inode block from disk.\n");
+        return -1;
+    }
+    inode_block.inodes[index_within_block] = *inode;
+
+    int result = journal_write(block_number, &inode_block);
+    pthread_mutex_unlock(&INODE_TABLE_LOCK);
+    if (result == -1)
+    {
+        printf("Error: Failed to write inode block to disk.\n");
+        return -1;
+    }
+
+    LOG_DEBUG("Wrote inode %d to block %d at index %d.\n", inode_number, block_number, index_within_block);
+    return 0;
+}
+
+struct inode *find_parent_directory(const char *path)
+{
+    return resolve_path(path, true, false, NULL);
+}
+
+/**
+ * Returns the slot of the inode cache holding the given inode, or -1 if it is not cached.
+ */
+static int inode_cache_lookup(uint32_t inode_number)
+{
+    for (int slot = INODE_CACHE_BUCKETS[inode_number % INODE_CACHE_HASH_BUCKETS]; slot != -1; slot = INODE_CACHE[slot].hash_next)
+    {
+        if (INODE_CACHE[slot].inode_number == inode_number)
+            return slot;
+    }
+    return -1;
+}
+
+/**
+ * Takes a slot off the free list.
+ */
+static void inode_free_remove(int slot)
+{
+    struct cached_inode *entry = &INODE_CACHE[slot];
+    if (entry->free_prev != -1)
+        INODE_CACHE[entry->free_prev].free_next = entry->free_next;
+    else
+        INODE_CACHE_FREE_HEAD = entry->free_next;
+    if (entry->free_next != -1)
+        INODE_CACHE[entry->free_next].free_prev = entry->free_prev;
+    else
+        INODE_CACHE_FREE_TAIL = entry->free_prev;
+    entry->free_prev = -1;
+    entry->free_next = -1;
+}
+
+/**
+ * Puts a slot on the free list, at its tail for an inode just released or at its head for an empty slot.
+ */
+static void inode_free_insert(int slot)
+{
+    struct cached_inode *entry = &INODE_CACHE[slot];
+    if (entry->state == INODE_SLOT_EMPTY)
+    {
+        entry->free_prev = -1;
+        entry->free_next = INODE_CACHE_FREE_HEAD;
+        if (INODE_CACHE_FREE_HEAD != -1)
+            INODE_CACHE[INODE_CACHE_FREE_HEAD].free_prev = slot;
+        else
+            INODE_CACHE_FREE_TAIL = slot;
+        INODE_CACHE_FREE_HEAD = slot;
+    }
+    else
+    {
+        entry->free_next = -1;
+        entry->free_prev = INODE_CACHE_FREE_TAIL;
+        if (INODE_CACHE_FREE_TAIL != -1)
+            INODE_CACHE[INODE_CACHE_FREE_TAIL].free_next = slot;
+        else
+            INODE_CACHE_FREE_HEAD = slot;
+        INODE_CACHE_FREE_TAIL = slot;
+    }
+}
+
+/**
+ * Takes a slot out of the hash chain of its inode.
+ */
+static void inode_unhash(int slot)
+{
+    int *link = &INODE_CACHE_BUCKETS[INODE_CACHE[slot].inode_number % INODE_CACHE_HASH_BUCKETS];
+    while (*link != slot)
+    {
+        link = &INODE_CACHE[*link].hash_next;
+    }
+    *link = INODE_CACHE[slot].hash_next;
+    INODE_CACHE[slot].hash_next = -1;
+}
+
+/**
+ * Initialises the lock of every slot of the inode cache, once.
+ */
+static void init_inode_locks()
+{
+    for (int i = 0; i < INODE_CACHE_SIZE; ++i)
+    {
+        pthread_rwlock_init(&INODE_CACHE[i].lock, NULL);
+    }
+}
+
+/**
+ * Returns the lock of an inode handed out by get_inode. Reads of the file take it shared and writes take it exclusive,
+ * so reads of a file run in parallel and reads and writes of different files never wait for each other.
+ */
+static pthread_rwlock_t *inode_lock(const struct inode *inode)
+{
+    return &((struct cached_inode *)inode)->lock;
+}
+
+/**
+ * Drops every inode from the inode cache without writing it back. Used when a disk is formatted or mounted.
+ */
+static void invalidate_inode_cache()
+{
+    pthread_once(&INODE_LOCKS_ONCE, init_inode_locks);
+
+    pthread_mutex_lock(&INODE_CACHE_LOCK);
+    for (int i = 0; i < INODE_CACHE_HASH_BUCKETS; ++i)
+    {
+        INODE_CACHE_BUCKETS[i] = -1;
+    }
+
+    // The locks are left alone, no inode is in use when the cache is dropped. Every slot goes on the free list.
+    INODE_CACHE_FREE_HEAD = -1;
+    INODE_CACHE_FREE_TAIL = -1;
+    for (int i = 0; i < INODE_CACHE_SIZE; ++i)
+    {
+        struct cached_inode *entry = &INODE_CACHE[i];
+        memset(&entry->inode, 0, sizeof(struct inode));
+        entry->inode_number = 0;
+        entry->refcount = 0;
+        entry->state = INODE_SLOT_EMPTY;
+        entry->dirty = 0;
+        entry->hash_next = -1;
+        inode_free_insert(i);
+    }
+    pthread_mutex_unlock(&INODE_CACHE_LOCK);
+}
+
+struct inode *get_inode(uint32_t inode_number)
+{
+    if (inode_number >= SUPERBLOCK.superblock.s_inodes_count)
+    {
+        printf("Error: Invalid inode number %d.\n", inode_number);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&INODE_CACHE_LOCK);
+    struct inode *inode = load_inode(inode_number);
+    pthread_mutex_unlock(&INODE_CACHE_LOCK);
+    return inode;
+}
+
+/**
+ * Does the work of get_inode, with INODE_CACHE_LOCK held. The lock is released while the inode table is read, and while
+ * the inode the slot held before is written back.
+ */
+static struct inode *load_inode(uint32_t inode_number)
+{
+    int slot;
+    while ((slot = inode_cache_lookup(inode_number)) != -1)
+    {
+        struct cached_inode *entry = &INODE_CACHE[slot];
+        if (entry->state == INODE_SLOT_LOADING || entry->state == INODE_SLOT_EVICTING)
+        {
+            // Another thread is reading the inode or writing it back, look again once it is done.
+            pthread_cond_wait(&INODE_CACHE_COND, &INODE_CACHE_LOCK);
+            continue;
+        }
+        if (entry->refcount++ == 0)
+        {
+            inode_free_remove(slot);
+        }
+        return &entry->inode;
+    }
+
+    // Reuse an empty slot, or the least recently released inode.
+    slot = INODE_CACHE_FREE_HEAD;
+    if (slot == -1)
+    {
+        printf("Error: Too many inodes in use.\n");
+        return NULL;
+    }
+    inode_free_remove(slot);
+    struct cached_inode *entry = &INODE_CACHE[slot];
+
+    if (entry->state != INODE_SLOT_EMPTY)
+    {
+        // A thread looking the old inode up waits until it is written back and the slot has left its hash chain.
+        struct inode copy = entry->inode;
+        int dirty = entry->dirty;
+        entry->state = INODE_SLOT_EVICTING;
+        pthread_mutex_unlock(&INODE_CACHE_LOCK);
+        int result = dirty ? write_inode_to_disk(entry->inode_number, &copy) : 0;
+        pthread_mutex_lock(&INODE_CACHE_LOCK);
+        pthread_cond_broadcast(&INODE_CACHE_COND);
+        if (result == -1)
+        {
+            entry->state = INODE_SLOT_VALID;
+            inode_free_insert(slot);
+            return NULL;
+        }
+        inode_unhash(slot);
+    }
+
+    // The slot is hashed under the new inode before it is read, so a second thread looking it up waits for this one.
+    entry->inode_number = inode_number;
+    entry->refcount = 1;
+    entry->state = INODE_SLOT_LOADING;
+    entry->dirty = 0;
+    entry->hash_next = INODE_CACHE_BUCKETS[inode_number % INODE_CACHE_HASH_BUCKETS];
+    INODE_CACHE_BUCKETS[inode_number % INODE_CACHE_HASH_BUCKETS] = slot;
+    pthread_mutex_unlock(&INODE_CACHE_LOCK);
+
+    uint32_t index_within_block = inode_number % INODES_PER_BLOCK;
+    uint32_t inode_block_num = inode_table_block(inode_number);
+    union block inode_block;
+    const union block *block = read_block(inode_block_num, &inode_block);
+    if (block != NULL)
+    {
+        entry->inode = block->inodes[index_within_block];
+        LOG_DEBUG("Inode %d read from block %d at index %d.\n", inode_number, inode_block_num, index_within_block);
+    }
+
+    pthread_mutex_lock(&INODE_CACHE_LOCK);
+    pthread_cond_broadcast(&INODE_CACHE_COND);
+    if (block == NULL)
+    {
+        inode_unhash(slot);
+        entry->refcount = 0;
+        entry->state = INODE_SLOT_EMPTY;
+        inode_free_insert(slot);
+        return NULL;
+    }
+    entry->state = INODE_SLOT_VALID;
+    return &entry->inode;
+}
+
+/**
+ * Writes a changed inode to the (cached) inode table, with INODE_CACHE_LOCK held by the caller along with a reference
+ * to the inode. The lock is released during the write, which works on a copy taken first, and one write of an inode
+ * waits for another to end so they reach the table in order.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int writeback_inode(struct cached_inode *entry)
+{
+    while (entry->state == INODE_SLOT_WRITING)
+    {
+        pthread_cond_wait(&INODE_CACHE_COND, &INODE_CACHE_LOCK);
+    }
+    if (!entry->dirty)
+    {
+        return 0;
+    }
+
+    // A change made during the write marks the inode dirty again.
+    struct inode copy = entry->inode;
+    entry->dirty = 0;
+    entry->state = INODE_SLOT_WRITING;
+    pthread_mutex_unlock(&INODE_CACHE_LOCK);
+    int result = write_inode_to_disk(entry->inode_number, &copy);
+    pthread_mutex_lock(&INODE_CACHE_LOCK);
+    if (result == -1)
+    {
+        entry->dirty = 1;
+    }
+    entry->state = INODE_SLOT_VALID;
+    pthread_cond_broadcast(&INODE_CACHE_COND);
+    return result;
+}
+
+void put_inode(struct inode *inode)
+{
+    struct cached_inode *entry = (struct cached_inode *)inode;
+
+    // Changes reach the (cached) inode table once the last user is done with the inode.
+    pthread_mutex_lock(&INODE_CACHE_LOCK);
+    if (entry->refcount == 1 && entry->dirty)
+    {
+        writeback_inode(entry);
+    }
+
+    if (--entry->refcount == 0)
+    {
+        inode_free_insert(entry - INODE_CACHE);
+    }
+    pthread_mutex_unlock(&INODE_CACHE_LOCK);
+}
+
+void mark_inode_dirty(struct inode *inode)
+{
+    pthread_mutex_lock(&INODE_CACHE_LOCK);
+    ((struct cached_inode *)inode)->dirty = 1;
+    pthread_mutex_unlock(&INODE_CACHE_LOCK);
+}
+
+/**
+ * Writes an inode to the (cached) inode table now if it was changed, instead of waiting for its last reference to go.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_inode(struct inode *inode)
+{
+    pthread_mutex_lock(&INODE_CACHE_LOCK);
+    int result = writeback_inode((struct cached_inode *)inode);
+    pthread_mutex_unlock(&INODE_CACHE_LOCK);
+    return result;
+}
+
+/**
+ * Writes every changed inode of the inode cache to the (cached) inode table. Only called with NAMESPACE_LOCK held
+ * exclusive, when no other thread is changing an inode. Each inode is held while it is written, so its slot is not
+ * reused meanwhile.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_all_inodes()
+{
+    int result = 0;
+    pthread_mutex_lock(&INODE_CACHE_LOCK);
+    for (int i = 0; i < INODE_CACHE_SIZE; ++i)
+    {
+        struct cached_inode *entry = &INODE_CACHE[i];
+        if ((entry->state == INODE_SLOT_VALID || entry->state == INODE_SLOT_WRITING) && entry->dirty)
+        {
+            if (entry->refcount++ == 0)
+                inode_free_remove(i);
+            if (writeback_inode(entry) == -1)
+                result = -1;
+            if (--entry->refcount == 0)
+                inode_free_insert(i);
+        }
+    }
+    pthread_mutex_unlock(&INODE_CACHE_LOCK);
+    return result;
+}
+
+/**
+ * Returns true if the operation of the calling thread has the given journal credits left, or could add what it lacks.
+ */
+static bool has_credits(int credits)
+{
+    int left = journal_credits();
+    return left >= credits || journal_extend(credits - left) == 0;
+}
+
+/**
+ * Ends a step of an operation too large for one transaction, at a point where the file system is consistent, and
+ * makes sure the operation has the credits for the next step, beginning it again if it has to. The inode (or with
+ * NAMESPACE_LOCK held exclusive, every inode) and the bitmaps are written first, so the step is whole in the journal.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int operation_step(struct inode *inode, int credits)
+{
+    int synced = (inode != NULL) ? sync_inode(inode) : sync_all_inodes();
+    if (synced == -1 || sync_bitmaps() == -1)
+    {
+        return -1;
+    }
+    return has_credits(credits) ? 0 : journal_restart(credits);
+}
+
+/**
+ * Returns the number of the inode a handle from get_inode refers to.
+ */
+static uint32_t inode_number_of(const struct inode *inode)
+{
+    return ((const struct cached_inode *)inode)->inode_number;
+}
+
+/**
+ * Hashes a (parent directory, name) pair for the dentry cache.
+ */
+static uint32_t dentry_hash(uint32_t parent_inode_number, const char *name)
+{
+    // FNV-1a over the parent inode number and the name.
+    uint32_t hash = 2166136261u ^ parent_inode_number;
+    hash *= 16777619u;
+    for (const char *c = name; *c != '\0'; c++)
+    {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash % DENTRY_CACHE_HASH_BUCKETS;
+}
+
+/**
+ * Returns the slot of the dentry cache holding the given (parent directory, name) pair, or -1 if it is not cached.
+ */
+static int dentry_find(uint32_t parent_inode_number, const char *name)
+{
+    for (int slot = DENTRY_CACHE_BUCKETS[dentry_hash(parent_inode_number, name)]; slot != -1; slot = DENTRY_CACHE[slot].hash_next)
+    {
+        if (DENTRY_CACHE[slot].parent_inode_number == parent_inode_number &&
+            strncmp(DENTRY_CACHE[slot].name, name, DIRECTORY_NAME_SIZE - 1) == 0)
+            return slot;
+    }
+    return -1;
+}
+
+/**
+ * Unlinks a slot of the dentry cache from its hash chain and marks it free.
+ */
+static void dentry_remove(int slot)
+{
+    struct dentry *dentry = &DENTRY_CACHE[slot];
+    int *link = &DENTRY_CACHE_BUCKETS[dentry_hash(dentry->parent_inode_number, dentry->name)];
+    while (*link != slot)
+    {
+        link = &DENTRY_CACHE[*link].hash_next;
+    }
+    *link = dentry->hash_next;
+    dentry->hash_next = -1;
+    dentry->valid = 0;
+}
+
+/**
+ * Records what a directory holds under a name, replacing what the dentry cache knew about it.
+ *
+ * @param inode_number The inode the name refers to, 0 to record that the directory has no such entry.
+ */
+static void dentry_store(uint32_t parent_inode_number, const char *name, uint32_t inode_number)
+{
+    int slot = dentry_find(parent_inode_number, name);
+    if (slot == -1)
+    {
+        // Pick a slot with the clock algorithm: entries used since the hand last passed get a second chance.
+        while (DENTRY_CACHE[DENTRY_CACHE_HAND].valid && DENTRY_CACHE[DENTRY_CACHE_HAND].referenced)
+        {
+            DENTRY_CACHE[DENTRY_CACHE_HAND].referenced = 0;
+            DENTRY_CACHE_HAND = (DENTRY_CACHE_HAND + 1) % DENTRY_CACHE_SIZE;
+        }
+        slot = DENTRY_CACHE_HAND;
+        DENTRY_CACHE_HAND = (DENTRY_CACHE_HAND + 1) % DENTRY_CACHE_SIZE;
+
+        if (DENTRY_CACHE[slot].valid)
+            dentry_remove(slot);
+
+        struct dentry *dentry = &DENTRY_CACHE[slot];
+        dentry->parent_inode_number = parent_inode_number;
+        strncpy(dentry->name, name, DIRECTORY_NAME_SIZE - 1);
+        dentry->name[DIRECTORY_NAME_SIZE - 1] = '\0';
+        dentry->valid = 1;
+
+        uint32_t bucket = dentry_hash(parent_inode_number, dentry->name);
+        dentry->hash_next = DENTRY_CACHE_BUCKETS[bucket];
+        DENTRY_CACHE_BUCKETS[bucket] = slot;
+    }
+
+    DENTRY_CACHE[slot].inode_number = inode_number;
+    DENTRY_CACHE[slot].referenced = 1;
+}
+
+/**
+ * Forgets every dentry of a directory. Used when its inode is freed, so the number can be reused by another directory.
+ */
+static void purge_dentries(uint32_t parent_inode_number)
+{
+    for (int i = 0; i < DENTRY_CACHE_SIZE; ++i)
+    {
+        if (DENTRY_CACHE[i].valid && DENTRY_CACHE[i].parent_inode_number == parent_inode_number)
+            dentry_remove(i);
+    }
+}
+
+/**
+ * Drops every entry from the dentry cache. Used when a disk is formatted or mounted.
+ */
+static void invalidate_dentry_cache()
+{
+    for (int i = 0; i < DENTRY_CACHE_HASH_BUCKETS; ++i)
+    {
+        DENTRY_CACHE_BUCKETS[i] = -1;
+    }
+
+    for (int i = 0; i < DENTRY_CACHE_SIZE; ++i)
+    {
+        memset(&DENTRY_CACHE[i], 0, sizeof(struct dentry));
+        DENTRY_CACHE[i].hash_next = -1;
+    }
+    DENTRY_CACHE_HAND = 0;
+}
+
+/**
+ * Looks a name up in a directory, through the dentry cache. Misses scan the directory and are cached, including
+ * names that do not exist.
+ *
+ * @return The inode number of the entry, or 0 if the directory has no such entry.
+ */
+static uint32_t lookup_dentry(const struct inode *dir_inode, const char *name)
+{
+    // Lookups run in parallel with each other, everything else that changes the dentry cache holds NAMESPACE_LOCK
+    // exclusive.
+    uint32_t parent_inode_number = inode_number_of(dir_inode);
+    pthread_mutex_lock(&DENTRY_CACHE_LOCK);
+    int slot = dentry_find(parent_inode_number, name);
+    uint32_t inode_number;
+    if (slot != -1)
+    {
+        DENTRY_CACHE[slot].referenced = 1;
+        inode_number = DENTRY_CACHE[slot].inode_number;
+    }
+    else
+    {
+        inode_number = find_directory_entry(dir_inode, name);
+        dentry_store(parent_inode_number, name, inode_number);
+    }
+    pthread_mutex_unlock(&DENTRY_CACHE_LOCK);
+    return inode_number;
+}
+
+/**
+ * Returns the number of blocks holding the entries of a directory, see directory_block_number.
+ */
+static uint32_t directory_block_count(const struct inode *dir_inode)
+{
+    if (!(dir_inode->i_flags & INODE_FLAG_INDEXED))
+    {
+        return INODE_DIRECT_POINTERS;
+    }
+
+    uint32_t root_num = file_block_number(dir_inode, 0);
+    union block scratch;
+    const union block *root = (root_num != 0) ? read_block(root_num, &scratch) : NULL;
+    return (root != NULL) ? root->directory_index.d_leaf_count : 0;
+}
+
+/**
+ * Returns the block holding the given block of entries of a directory: the direct blocks of a linear directory,
+ * or the leaves of an indexed one.
+ *
+ * @return The block number, or 0 if there is no such block.
+ */
+static uint32_t directory_block_number(const struct inode *dir_inode, uint32_t index)
+{
+    if (!(dir_inode->i_flags & INODE_FLAG_INDEXED))
+    {
+        return (index < INODE_DIRECT_POINTERS) ? dir_inode->i_direct_pointers[index] : 0;
+    }
+    return file_block_number(dir_inode, index + 1);
+}
+
+/**
+ * Returns the position of the entry with the given name in a directory block, or -1 if it holds no such entry.
+ */
+static int directory_block_find(const union block *dir_block, const char *name)
+{
+    for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+    {
+        const struct directory_entry *entry = &dir_block->directory_block.entries[j];
+        if (entry->inode_number != 0 && strncmp(entry->name, name, DIRECTORY_NAME_SIZE - 1) == 0)
+        {
+            return j;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Hashes a name for indexed directories. The hash decides which leaf an entry is stored in, so it must never change.
+ */
+static uint32_t directory_hash(const char *name)
+{
+    // FNV-1a over the part of the name that is stored.
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < DIRECTORY_NAME_SIZE - 1 && name[i] != '\0'; ++i)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Returns the leaf of an indexed directory that an entry with the given name belongs in.
+ *
+ * @return The block number of the leaf, or 0 if the index could not be read.
+ */
+static uint32_t index_leaf_block(const struct inode *dir_inode, const char *name)
+{
+    uint32_t root_num = file_block_number(dir_inode, 0);
+    if (root_num == 0)
+    {
+        return 0;
+    }
+
+    union block scratch;
+    const union block *root = read_block(root_num, &scratch);
+    if (root == NULL)
+    {
+        return 0;
+    }
+
+    const struct directory_index *index = &root->directory_index;
+    uint32_t slot = directory_hash(name) & ((1u << index->d_global_depth) - 1);
+    return file_block_number(dir_inode, index->d_slots[slot]);
+}
+
+/**
+ * Adds an entry to an indexed directory, splitting its leaf as many times as needed to make room.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int index_add_entry(struct inode *dir_inode, uint32_t inode_number, const char *name)
+{
+    uint32_t root_num = file_block_number(dir_inode, 0);
+    union block root;
+    if (root_num == 0 || cache_read(root_num, &root) == -1)
+    {
+        return -1;
+    }
+    struct directory_index *index = &root.directory_index;
+    uint32_t hash = directory_hash(name);
+
+    while (true)
+    {
+        uint32_t leaf = index->d_slots[hash & ((1u << index->d_global_depth) - 1)];
+        uint32_t leaf_num = file_block_number(dir_inode, leaf);
+        union block leaf_block;
+        if (leaf_num == 0 || cache_read(leaf_num, &leaf_block) == -1)
+        {
+            return -1;
+        }
+
+        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        {
+            struct directory_entry *entry = &leaf_block.directory_block.entries[j];
+            if (entry->inode_number == 0)
+            {
+                entry->inode_number = inode_number;
+                strncpy(entry->name, name, DIRECTORY_NAME_SIZE - 1);
+                entry->name[DIRECTORY_NAME_SIZE - 1] = '\0';
+                return (journal_write(leaf_num, &leaf_block) == -1) ? -1 : 0;
+            }
+        }
+
+        // The leaf is full, split it on the next hash bit.
+        uint32_t depth = index->d_local_depth[leaf - 1];
+        if (depth == DIRECTORY_INDEX_MAX_DEPTH)
+        {
+            printf("Error: Directory is full.\n");
+            return -1;
+        }
+        if (depth == index->d_global_depth)
+        {
+            // Double the slot table, the new half points at the same leaves as the old one.
+            uint32_t half = 1u << index->d_global_depth;
+            memcpy(&index->d_slots[half], index->d_slots, half * sizeof(uint32_t));
+            index->d_global_depth++;
+        }
+
+        uint32_t new_leaf = index->d_leaf_count + 1;
+        bool fresh;
+        uint32_t new_leaf_num = file_block_allocate(dir_inode, new_leaf, &fresh);
+        if (new_leaf_num == (uint32_t)-1)
+        {
+            return -1;
+        }
+        dir_inode->i_size = (uint64_t)(new_leaf + 1) * BLOCK_SIZE;
+        mark_inode_dirty(dir_inode);
+
+        // Entries with the next hash bit set move to the new leaf.
+        union block new_leaf_block;
+        memset(&new_leaf_block, 0, sizeof(union block));
+        int moved = 0;
+        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        {
+            struct directory_entry *entry = &leaf_block.directory_block.entries[j];
+            if (entry->inode_number != 0 && (directory_hash(entry->name) >> depth) & 1)
+            {
+                new_leaf_block.directory_block.entries[moved++] = *entry;
+                memset(entry, 0, sizeof(struct directory_entry));
+            }
+        }
+
+        index->d_leaf_count = new_leaf;
+        index->d_local_depth[leaf - 1] = depth + 1;
+        index->d_local_depth[new_leaf - 1] = depth + 1;
+        for (uint32_t slot = 0; slot < (1u << index->d_global_depth); ++slot)
+        {
+            if (index->d_slots[slot] == leaf && (slot >> depth) & 1)
+                index->d_slots[slot] = new_leaf;
+        }
+
+        if (journal_write(leaf_num, &leaf_block) == -1 || journal_write(new_leaf_num, &new_leaf_block) == -1 ||
+            journal_write(root_num, &root) == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Switches a linear directory to the indexed format and moves its entries over.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int convert_to_index(struct inode *dir_inode)
+{
+    struct directory_entry *entries = malloc(INODE_DIRECT_POINTERS * sizeof(struct directory_block));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+
+    // Take the new blocks before the old ones are given up, so a full disk leaves the directory as it was.
+    uint32_t root_num = allocate_data_block(inode_goal(dir_inode));
+    uint32_t leaf_num = (root_num != (uint32_t)-1) ? allocate_data_block(root_num + 1) : (uint32_t)-1;
+    if (leaf_num == (uint32_t)-1)
+    {
+        free_data_block(root_num);
+        free(entries);
+        return -1;
+    }
+
+    int count = 0;
+    for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
+    {
+        if (dir_inode->i_direct_pointers[i] == 0)
+            continue;
+
+        union block scratch;
+        const union block *dir_block = read_block(dir_inode->i_direct_pointers[i], &scratch);
+        for (int j = 0; dir_block != NULL && j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        {
+            if (dir_block->directory_block.entries[j].inode_number != 0)
+                entries[count++] = dir_block->directory_block.entries[j];
+        }
+    }
+    free_inode_blocks(dir_inode);
+
+    union block block;
+    memset(&block, 0, sizeof(union block));
+    int result = journal_write(leaf_num, &block);
+    block.directory_index.d_global_depth = 0;
+    block.directory_index.d_leaf_count = 1;
+    block.directory_index.d_slots[0] = 1;
+    block.directory_index.d_local_depth[0] = 0;
+    if (result == -1 || journal_write(root_num, &block) == -1)
+    {
+        free(entries);
+        return -1;
+    }
+
+    dir_inode->i_direct_pointers[0] = root_num;
+    dir_inode->i_direct_pointers[1] = leaf_num;
+    dir_inode->i_size = 2 * BLOCK_SIZE;
+    dir_inode->i_flags |= INODE_FLAG_INDEXED;
+    mark_inode_dirty(dir_inode);
+
+    for (int k = 0; k < count; ++k)
+    {
+        if (index_add_entry(dir_inode, entries[k].inode_number, entries[k].name) == -1)
+        {
+            free(entries);
+            return -1;
+        }
+    }
+
+    free(entries);
+    return 0;
+}
+
+/**
+ * Looks a name up in a directory.
+ *
+ * @return The inode number of the entry, or 0 if the directory has no such entry.
+ */
+static uint32_t find_directory_entry(const struct inode *dir_inode, const char *name)
+{
+    // An indexed directory can only hold the name in one leaf.
+    bool indexed = dir_inode->i_flags & INODE_FLAG_INDEXED;
+    uint32_t block_count = indexed ? 1 : directory_block_count(dir_inode);
+
+    for (uint32_t i = 0; i < block_count; ++i)
+    {
+        uint32_t block_num = indexed ? index_leaf_block(dir_inode, name) : directory_block_number(dir_inode, i);
+        if (block_num == 0)
+            continue;
+
+        union block scratch;
+        const union block *dir_block = read_block(block_num, &scratch);
+        if (dir_block == NULL)
+            continue;
+
+        int j = directory_block_find(dir_block, name);
+        if (j != -1)
+        {
+            return dir_block->directory_block.entries[j].inode_number;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns a reference to the inode at the given path, or NULL if there is none. Release it with put_inode.
+ */
+static struct inode *lookup_path(const char *path)
+{
+    return resolve_path(path, false, false, NULL);
+}
+
+/**
+ * Walks an absolute path from the root directory, looking every component up through the dentry cache.
+ *
+ * Empty components (repeated or trailing slashes) are skipped and names are cut to DIRECTORY_NAME_SIZE - 1 characters,
+ * the same way add_directory_entry stores them.
+ *
+ * @param path The path to resolve.
+ * @param parent_only If true, stop at the directory holding the last component instead of the component itself.
+ * @param create_missing If true, directories along the way that do not exist are created.
+ * @param last_name If not NULL, receives the last component of the path (empty for the root directory).
+ *
+ * @return A reference to the inode, to be released with put_inode, or NULL if the path does not resolve.
+ */
+static struct inode *resolve_path(const char *path, bool parent_only, bool create_missing, char *last_name)
+{
+    if (last_name != NULL)
+        last_name[0] = '\0';
+
+    struct inode *current_inode = get_inode(0);
+    const char *cursor = path;
+    while (current_inode != NULL)
+    {
+        // Cut the next component out of the path.
+        while (*cursor == '/')
+            cursor++;
+        if (*cursor == '\0')
+            break;
+
+        size_t length = strcspn(cursor, "/");
+        char name[DIRECTORY_NAME_SIZE];
+        size_t kept = length < DIRECTORY_NAME_SIZE - 1 ? length : DIRECTORY_NAME_SIZE - 1;
+        memcpy(name, cursor, kept);
+        name[kept] = '\0';
+        cursor += length;
+
+        bool is_last = (cursor[strspn(cursor, "/")] == '\0');
+        if (is_last && last_name != NULL)
+            strcpy(last_name, name);
+        if (is_last && parent_only)
+            break;
+
+        if (!current_inode->i_is_directory)
+        {
+            put_inode(current_inode);
+            return NULL;
+        }
+
+        uint32_t inode_number = lookup_dentry(current_inode, name);
+        if (inode_number == 0 && create_missing)
+        {
+            LOG_DEBUG("Directory %s not found, creating it.\n", name);
+            inode_number = create_inode(current_inode, name, 1);
+            if (inode_number == (uint32_t)-1)
+                inode_number = 0;
+        }
+
+        put_inode(current_inode);
+        if (inode_number == 0)
+            return NULL;
+        current_inode = get_inode(inode_number);
+    }
+
+    if (parent_only && current_inode != NULL && !current_inode->i_is_directory)
+    {
+        put_inode(current_inode);
+        return NULL;
+    }
+
+    return current_inode;
+}
+
+/**
+ * Creates an empty file or directory and links it into a directory.
+ *
+ * @return The new inode number, or (uint32_t)-1 on failure.
+ */
+static uint32_t create_inode(struct inode *parent_dir_inode, const char *name, int is_directory)
+{
+    if (parent_dir_inode->i_flags & INODE_FLAG_READONLY)
+    {
+        printf("Error: Cannot create %s in a read-only directory.\n", name);
+        return -1;
+    }
+    if (lookup_dentry(parent_dir_inode, name) != 0)
+    {
+        printf("Error: %s already exists.\n", name);
+        return -1;
+    }
+
+    // Every entry created is a step of its own, so creating a long path or copying a tree never outgrows the journal.
+    if (operation_step(NULL, CREDITS_CREATE) == -1)
+    {
+        return -1;
+    }
+
+    uint32_t new_inode_number = allocate_inode(inode_number_of(parent_dir_inode), is_directory);
+    if (new_inode_number == (uint32_t)-1)
+    {
+        printf("Error: No free inode available.\n");
+        return -1;
+    }
+
+    struct inode *new_inode = get_inode(new_inode_number);
+    if (new_inode == NULL)
+    {
+        return -1;
+    }
+    memset(new_inode, 0, sizeof(struct inode));
+    new_inode->i_is_directory = is_directory;
+    if (!is_directory)
+    {
+        // A file starts with its bytes in the inode, and is mapped by extents once it outgrows it, so large files take
+        // a few contiguous runs of blocks.
+        new_inode->i_flags = INODE_FLAG_INLINE;
+    }
+    mark_inode_dirty(new_inode);
+
+    if (is_directory)
+    {
+        uint32_t new_block_number = allocate_data_block(inode_goal(new_inode));
+        if (new_block_number == (uint32_t)-1)
+        {
+            printf("Error: No free data block available.\n");
+            put_inode(new_inode);
+            return -1;
+        }
+
+        // The block may hold stale data from a removed file (or from before a format), so start from an empty one.
+        union block new_dir_block;
+        memset(&new_dir_block, 0, sizeof(union block));
+        if (journal_write(new_block_number, &new_dir_block) == -1)
+        {
+            printf("Error: Failed to write new directory block to disk.\n");
+            put_inode(new_inode);
+            return -1;
+        }
+        new_inode->i_direct_pointers[0] = new_block_number;
+        new_inode->i_size = BLOCK_SIZE;
+    }
+
+    if (add_directory_entry(parent_dir_inode, new_inode_number, name) == -1)
+    {
+        printf("Error: Failed to add directory entry.\n");
+        free_inode_blocks(new_inode);
+        put_inode(new_inode);
+        free_inode(new_inode_number);
+        return -1;
+    }
+
+    put_inode(new_inode);
+    return new_inode_number;
+}
+
+int add_directory_entry(struct inode *parent_dir_inode, uint32_t inode_number, const char *name)
+{
+    if (parent_dir_inode->i_flags & INODE_FLAG_INDEXED)
+    {
+        if (index_add_entry(parent_dir_inode, inode_number, name) == -1)
+        {
+            return -1;
+        }
+        dentry_store(inode_number_of(parent_dir_inode), name, inode_number);
+        return 0;
+    }
+
+    for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
+    {
+        uint32_t block_num = parent_dir_inode->i_direct_pointers[i];
+        union block dir_block;
+
+        if (block_num == 0 && i > 0)
+        {
+            // The directory outgrew its first block, index it instead of making every lookup scan more blocks.
+            if (convert_to_index(parent_dir_inode) == -1)
+            {
+                return -1;
+            }
+            return add_directory_entry(parent_dir_inode, inode_number, name);
+        }
+        else if (block_num == 0)
+        {
+            block_num = allocate_data_block(inode_goal(parent_dir_inode));
+            if (block_num == (uint32_t)-1)
+                return -1;
+            parent_dir_inode->i_direct_pointers[i] = block_num;
+            if (parent_dir_inode->i_size < (uint64_t)(i + 1) * BLOCK_SIZE)
+                parent_dir_inode->i_size = (uint64_t)(i + 1) * BLOCK_SIZE;
+            mark_inode_dirty(parent_dir_inode);
+            memset(dir_block.data, 0, BLOCK_SIZE);
+        }
+        else
+        {
+            cache_read(block_num, &dir_block);
+        }
+
+        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        {
+            if (dir_block.directory_block.entries[j].inode_number == 0)
+            {
+                dir_block.directory_block.entries[j].inode_number = inode_number;
+                strncpy(dir_block.directory_block.entries[j].name, name, DIRECTORY_NAME_SIZE - 1);
+                dir_block.directory_block.entries[j].name[DIRECTORY_NAME_SIZE - 1] = '\0';
+                if (journal_write(block_num, &dir_block) == -1)
+                {
+                    return -1;
+                }
+                dentry_store(inode_number_of(parent_dir_inode), name, inode_number);
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Clears the entry with the given name from a directory.
+ *
+ * @return 0 on success, -1 if there is no such entry.
+ */
+static int remove_directory_entry(struct inode *parent_dir_inode, const char *name)
+{
+    // An indexed directory can only hold the name in one leaf.
+    bool indexed = parent_dir_inode->i_flags & INODE_FLAG_INDEXED;
+    uint32_t block_count = indexed ? 1 : directory_block_count(parent_dir_inode);
+
+    for (uint32_t i = 0; i < block_count; ++i)
+    {
+        uint32_t block_num = indexed ? index_leaf_block(parent_dir_inode, name) : directory_block_number(parent_dir_inode, i);
+        if (block_num == 0)
+            continue;
+
+        union block dir_block;
+        if (cache_read(block_num, &dir_block) == -1)
+            continue;
+
+        int j = directory_block_find(&dir_block, name);
+        if (j != -1)
+        {
+            memset(&dir_block.directory_block.entries[j], 0, sizeof(struct directory_entry));
+            if (journal_write(block_num, &dir_block) == -1)
+                return -1;
+            dentry_store(inode_number_of(parent_dir_inode), name, 0);
+            return 0;
+        }
     }
+    return -1;
+}
 
-    struct directory_block root_dir;
-    memset(&root_dir, 0, sizeof(struct directory_block));
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+/**
+ * Removes an entry from a directory, removing everything below it first if it is a directory, and frees its inode.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int remove_entry(struct inode *parent_dir_inode, const char *name)
+{
+    uint32_t inode_number = lookup_dentry(parent_dir_inode, name);
+    if (inode_number == 0)
     {
-        root_dir.entries[i].inode_number = 0;
-        strcpy(root_dir.entries[i].name, "");
+        printf("Error: Entry not found in parent directory.\n");
+        return -1;
     }
 
-    if (disk_write(SUPERBLOCK.superblock.s_data_blocks_start, &root_dir) == -1)
+    // The blocks of an open file cannot go away under its descriptors.
+    if (inode_is_open(inode_number))
     {
+        printf("Error: %s is open.\n", name);
         return -1;
     }
 
-    int inode_block_number = SUPERBLOCK.superblock.s_inode_table_block_start;
-    struct inode root_inode;
-    memset(&root_inode, 0, sizeof(struct inode));
-    root_inode.i_is_directory = 1;
-    root_inode.i_size = sizeof(struct directory_block);
-    root_inode.i_direct_pointers[0] = SUPERBLOCK.superblock.s_data_blocks_start;
-    if (write_inode_to_disk(0, &root_inode) == -1)
+    struct inode *inode = get_inode(inode_number);
+    if (inode == NULL)
     {
         return -1;
     }
-    static union block zero_block1;
-    for (long unsigned int i = 0; i < disk_size() / FLAGS_PER_BLOCK; i++)
+
+    if (inode->i_is_directory)
     {
-        zero_block1.bitmap[i] = 0;
-    }
-    zero_block1.bitmap[0] = 1;
-    disk_write(2, &zero_block1);
+        // A directory is only removed once everything in it is. Each removal rewrites the directory block, so it is
+        // read again for every entry.
+        int failed = 0;
+        uint32_t block_count = directory_block_count(inode);
+        for (uint32_t i = 0; i < block_count; ++i)
+        {
+            uint32_t block_num = directory_block_number(inode, i);
+            for (int j = 0; block_num != 0 && j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+            {
+                union block scratch;
+                const union block *dir_block = read_block(block_num, &scratch);
+                if (dir_block == NULL)
+                    break;
 
-    MOUNT_FLAG = 0;
-    LOG_DEBUG("Superblock:\n");
-    LOG_DEBUG("    Blocks: %d\n", SUPERBLOCK.superblock.s_blocks_count);
-    LOG_DEBUG("    Inodes: %d\n", SUPERBLOCK.superblock.s_inodes_count);
-    LOG_DEBUG("    Inode Table Block Start: %d\n", SUPERBLOCK.superblock.s_inode_table_block_start);
-    LOG_DEBUG("    Data Blocks Start: %d\n", SUPERBLOCK.superblock.s_data_blocks_start);
-    return 1;
-}
+                const struct directory_entry *entry = &dir_block->directory_block.entries[j];
+                if (entry->inode_number == 0)
+                    continue;
 
-int fs_mount()
-{
-    if (MOUNT_FLAG == 1)
-    {
-        printf("Error: Disk is already mounted.\n");
-        return -1;
-    }
+                char child_name[DIRECTORY_NAME_SIZE];
+                strncpy(child_name, entry->name, DIRECTORY_NAME_SIZE - 1);
+                child_name[DIRECTORY_NAME_SIZE - 1] = '\0';
+                if (remove_entry(inode, child_name) == -1)
+                    failed = 1;
+            }
+        }
 
-    if (disk_read(0, &SUPERBLOCK) == -1)
+        if (failed)
+        {
+            put_inode(inode);
+            return -1;
+        }
+    }
+    else if ((inode->i_flags & INODE_FLAG_EXTENTS) && free_extent_steps(inode) == -1)
     {
+        put_inode(inode);
         return -1;
     }
 
-    if (disk_read(1, &BLOCK_BITMAP) == -1)
+    // What is left is small: the directory blocks, the empty extent tree or the blocks of a file mapped by pointers,
+    // whose frees only touch the bitmap blocks.
+    if (operation_step(NULL, CREDITS_CREATE) == -1)
     {
+        put_inode(inode);
         return -1;
     }
+    free_inode_blocks(inode);
+    put_inode(inode);
 
-    if (disk_read(2, &INODE_BITMAP) == -1)
+    if (remove_directory_entry(parent_dir_inode, name) == -1)
     {
         return -1;
     }
+    purge_dentries(inode_number);
 
-    MOUNT_FLAG = 1;
+    free_inode(inode_number);
 
     return 0;
 }
 
-int fs_create(char *path, int is_directory)
+/**
+ * Copies a file or directory tree into a directory under the given name, see fs_clone. The files share their data
+ * blocks with the source, and the directories are filled in entry by entry and only marked read-only once they are.
+ *
+ * @param read_only If true, every inode of the copy is marked read-only.
+ * @param top The inode number of the top of the copy, 0 before it is created. A directory copied into itself skips
+ *            the entry of the copy.
+ * @return The inode number of the copy, or (uint32_t)-1 on failure (nothing of the copy is left).
+ */
+static uint32_t clone_inode(struct inode *source, struct inode *parent_dir_inode, const char *name, bool read_only,
+                            uint32_t *top)
 {
-    if (MOUNT_FLAG == 0)
+    uint32_t copy_number = create_inode(parent_dir_inode, name, source->i_is_directory);
+    if (copy_number == (uint32_t)-1)
     {
-        printf("Error: Disk is not mounted.\n");
         return -1;
     }
+    if (*top == 0)
+    {
+        *top = copy_number;
+    }
 
-    char *path_copy = strdup(path);
-    const char slash[] = "/";
-    char *token = strtok(path_copy, slash);
-    struct inode *current_dir_inode = get_inode(0);
-
-    char *next_token = strtok(NULL, slash);
-    char *prev_token = NULL;
-    while (next_token)
+    struct inode *copy = get_inode(copy_number);
+    int failed = (copy == NULL);
+    if (!failed && source->i_is_directory)
     {
-        bool found = false;
-        for (int i = 0; i < INODE_DIRECT_POINTERS && !found; ++i)
+        // Entries are read again one by one, the directory may be the one the copy is being added to.
+        uint32_t block_count = directory_block_count(source);
+        for (uint32_t i = 0; !failed && i < block_count; ++i)
         {
-            LOG_DEBUG("i: %d\n", i);
-            uint32_t block_num = current_dir_inode->i_direct_pointers[i];
-            LOG_DEBUG("Block number: %d\n", block_num);
-            if (block_num == 0)
-                continue;
-
-            union block dir_block;
-            disk_read(block_num, &dir_block);
-
-            for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+            uint32_t block_num = directory_block_number(source, i);
+            for (int j = 0; !failed && block_num != 0 && j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
             {
-                struct directory_entry *entry = &dir_block.directory_block.entries[j];
-                if (entry->inode_number != 0 && strcmp(entry->name, token) == 0)
+                union block scratch;
+                const union block *dir_block = read_block(block_num, &scratch);
+                if (dir_block == NULL)
                 {
-                    current_dir_inode = get_inode(entry->inode_number);
-                    found = true;
+                    failed = 1;
                     break;
                 }
-            }
-        }
-
-        if (!found)
-        {
-            LOG_DEBUG("Directory not found.\n");
-            uint32_t new_inode_number = allocate_inode();
-            LOG_DEBUG("New inode number: %d\n", new_inode_number);
-            if (new_inode_number == (uint32_t)-1)
-            {
-                free(path_copy);
-                return -1;
-            }
 
-            struct inode new_inode;
-            memset(&new_inode, 0, sizeof(new_inode));
-            new_inode.i_size = 4096;
-            new_inode.i_is_directory = 1;
+                const struct directory_entry *entry = &dir_block->directory_block.entries[j];
+                if (entry->inode_number == 0 || entry->inode_number == *top)
+                    continue;
 
-            uint32_t new_block_number = allocate_data_block();
-            LOG_DEBUG("New block number: %d\n", new_block_number);
-            if (new_block_number == (uint32_t)-1)
-            {
-                free(path_copy);
-                return -1;
-            }
-            new_inode.i_direct_pointers[0] = new_block_number;
-            if (add_directory_entry(current_dir_inode, new_inode_number, token) == -1)
-            {
-                free(path_copy);
-                return -1;
-            }
-            if (write_inode_to_disk(new_inode_number, &new_inode) == -1)
-            {
-                free(path_copy);
-                return -1;
+                char child_name[DIRECTORY_NAME_SIZE];
+                strncpy(child_name, entry->name, DIRECTORY_NAME_SIZE - 1);
+                child_name[DIRECTORY_NAME_SIZE - 1] = '\0';
+                struct inode *child = get_inode(entry->inode_number);
+                if (child == NULL || clone_inode(child, copy, child_name, read_only, top) == (uint32_t)-1)
+                    failed = 1;
+                if (child != NULL)
+                    put_inode(child);
             }
-            current_dir_inode = get_inode(new_inode_number);
-        }
-        prev_token = token;
-        token = next_token;
-        next_token = strtok(NULL, slash);
-        if (next_token == NULL)
-        {
-            break;
         }
     }
-    uint32_t new_inode_number = allocate_inode();
-    LOG_DEBUG("New inode number for file/directory: %d\n", new_inode_number);
-    if (new_inode_number == (uint32_t)-1)
+    else if (!failed)
     {
-        printf("Error: No free inode available.\n");
-        return -1;
+        pthread_rwlock_t *lock = inode_lock(source);
+        pthread_rwlock_wrlock(lock);
+        failed = clone_file_data(source, copy) == -1;
+        pthread_rwlock_unlock(lock);
     }
 
-    struct inode new_inode;
-    if (is_directory)
+    if (!failed)
     {
-        new_inode.i_size = 4096;
+        if (read_only)
+            copy->i_flags |= INODE_FLAG_READONLY;
+        else
+            copy->i_flags &= ~INODE_FLAG_READONLY;
+        mark_inode_dirty(copy);
+        failed = sync_inode(copy) == -1;
     }
-    else
+    if (copy != NULL)
     {
-        new_inode.i_size = 0;
+        put_inode(copy);
     }
-    new_inode.i_is_directory = is_directory;
-    memset(new_inode.i_direct_pointers, 0, sizeof(new_inode.i_direct_pointers));
-    new_inode.i_single_indirect_pointer = 0;
-    new_inode.i_double_indirect_pointer = 0;
-    LOG_DEBUG("New inode size: %d\n", new_inode.i_size);
 
-    if (is_directory)
+    // The copy is taken apart the way it would be removed, which gives the shares it took back.
+    if (failed)
     {
-        uint32_t new_block_number = allocate_data_block();
-        if (new_block_number == (uint32_t)-1)
-        {
-            printf("Error: No free data block available.\n");
-            return -1;
-        }
-        new_inode.i_direct_pointers[0] = new_block_number;
-        union block new_dir_block;
-        memset(&new_dir_block, 0, sizeof(union block));
-        disk_read(new_block_number, &new_dir_block);
-        union block INODES1;
-        disk_read(3, &INODES1);
-        if (disk_write(new_block_number, &new_dir_block) == -1)
-        {
-            printf("Error: Failed to write new directory block to disk.\n");
-            return -1;
-        }
+        remove_entry(parent_dir_inode, name);
+        return -1;
     }
-    const char *entry_name = get_name_from_path(path);
-    if (entry_name == NULL)
+    return copy_number;
+}
+
+/**
+ * Gives a new, empty file the contents of another. An extent-mapped file gets the same mapping, every block of which
+ * takes one more share, so no data is copied until one of the files writes to a block (see write_inode_blocks and
+ * write_cluster). Inline bytes are copied with the inode.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int clone_file_data(struct inode *source, struct inode *copy)
+{
+    // Files mapped by block pointers are only found on disks from before the block reference table.
+    if (!(source->i_flags & (INODE_FLAG_INLINE | INODE_FLAG_EXTENTS)))
     {
-        printf("Error: Invalid path name.\n");
+        printf("Error: Cannot clone a file mapped by block pointers.\n");
         return -1;
     }
 
-    struct inode *parent_dir_inode = current_dir_inode;
-    if (add_directory_entry(parent_dir_inode, new_inode_number, entry_name) == -1)
+    mark_inode_dirty(copy);
+    copy->i_flags = source->i_flags;
+    memset(copy->i_inline_data, 0, INODE_INLINE_SIZE);
+    if (source->i_flags & INODE_FLAG_INLINE)
     {
-        printf("Error: Failed to add directory entry.\n");
-        return -1;
+        memcpy(copy->i_inline_data, source->i_inline_data, INODE_INLINE_SIZE);
     }
 
-    if (write_inode_to_disk(new_inode_number, &new_inode) == -1)
+    // Runs are looked up until the hole that lasts to the end of the file, so blocks mapped past the size (the whole
+    // last cluster of a compressed file) come along.
+    uint32_t run = 0;
+    for (uint32_t index = 0; (source->i_flags & INODE_FLAG_EXTENTS) && index < UINT32_MAX; index += run)
     {
-        printf("Error: Failed to write new inode to disk.\n");
-        return -1;
+        uint32_t physical;
+        run = extent_map(source, index, UINT32_MAX - index, &physical);
+        if (run == 0)
+        {
+            return -1;
+        }
+        if (physical == 0)
+        {
+            continue;
+        }
+
+        // A long run is shared in steps. The reference table is written after each, so the credits left are known.
+        run = run_step(NULL, physical, run);
+        if (run == 0)
+        {
+            return -1;
+        }
+        share_blocks(physical, run);
+        if (extent_insert(copy, index, physical, run) == -1)
+        {
+            for (uint32_t i = 0; i < run; i++)
+            {
+                free_data_block(physical + i);
+            }
+            return -1;
+        }
+        if (sync_bitmaps() == -1)
+        {
+            return -1;
+        }
     }
+    copy->i_size = source->i_size;
     return 0;
 }
 
-int fs_remove(char *path)
+/**
+ * Reads file data from an inode. See fs_read.
+ */
+static int read_inode_data(struct inode *inode, struct block_run *run, void *buf, size_t count, off_t offset)
 {
-    if (MOUNT_FLAG == 0)
+    // Nothing can be read past the end of the file.
+    if ((uint64_t)offset >= inode->i_size)
     {
-        printf("Error: Disk is not mounted.\n");
-        return -1;
+        return 0;
     }
-    const char *entry_name = get_name_from_path(path);
-    struct inode *parent_dir_inode = find_parent_directory(path);
-    if (parent_dir_inode == NULL || entry_name == NULL || strlen(entry_name) == 0)
+    if (offset + count > inode->i_size)
     {
-        printf("Error: Invalid path or directory does not exist.\n");
-        return -1;
+        count = inode->i_size - offset;
     }
 
-    bool found = false;
-    uint32_t block_num;
-    int entry_index;
-    uint32_t inode_number_to_remove;
-    for (int i = 0; i < INODE_DIRECT_POINTERS && !found; ++i)
+    // An inline file is read from the inode itself.
+    if (inode->i_flags & INODE_FLAG_INLINE)
     {
-        block_num = parent_dir_inode->i_direct_pointers[i];
-        if (block_num == 0)
-            continue;
+        memcpy(buf, inode->i_inline_data + offset, count);
+        return count;
+    }
+    if (inode->i_flags & INODE_FLAG_COMPRESSED)
+    {
+        run->length = 0;
+        return read_compressed_data(inode, buf, count, offset);
+    }
 
-        union block dir_block;
-        disk_read(block_num, &dir_block);
+    // Whole blocks are batched and read straight into the caller's buffer, partial blocks go through a scratch block.
+    // Blocks are mapped a run at a time.
+    uint32_t blocks[TRANSFER_BATCH];
+    void *bufs[TRANSFER_BATCH];
+    int nblocks = 0;
+    uint32_t last_index = (offset + count - 1) / BLOCK_SIZE;
+    struct pointer_map map;
+    pointer_map_init(&map);
+    size_t done = 0;
+    while (done < count)
+    {
+        uint32_t index = (offset + done) / BLOCK_SIZE;
+        size_t within = (offset + done) % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - within;
+        if (chunk > count - done)
+        {
+            chunk = count - done;
+        }
+        uint8_t *dest = (uint8_t *)buf + done;
 
-        for (entry_index = 0; entry_index < DIRECTORY_ENTRIES_PER_BLOCK; ++entry_index)
+        if (index < run->start || index - run->start >= run->length)
         {
-            struct directory_entry *entry = &dir_block.directory_block.entries[entry_index];
-            inode_number_to_remove = entry->inode_number;
-            if (inode_number_to_remove != 0 && strcmp(entry->name, entry_name) == 0)
+            run->start = index;
+            run->length = file_map(inode, &map, index, last_index - index + 1, &run->physical);
+            if (run->length == 0)
             {
-                found = true;
-                break;
+                return -1;
             }
         }
-    }
+        uint32_t block_num = (run->physical != 0) ? run->physical + (index - run->start) : 0;
 
-    if (!found)
-    {
-        printf("Error: Entry not found in parent directory.\n");
-        return -1;
-    }
-    struct inode *inode_to_remove = get_inode(inode_number_to_remove);
-    if (inode_to_remove->i_is_directory)
-    {
-        union block dir_block;
-        disk_read(inode_to_remove->i_direct_pointers[0], &dir_block);
-        for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i)
+        if (block_num == 0)
         {
-            if (strcmp(dir_block.directory_block.entries[i].name, "") != 0)
+            // A hole reads as zeros.
+            memset(dest, 0, chunk);
+        }
+        else if (chunk == BLOCK_SIZE)
+        {
+            blocks[nblocks] = block_num;
+            bufs[nblocks] = dest;
+            nblocks++;
+            if (nblocks == TRANSFER_BATCH)
             {
-                char temp_path[100];
-                strcpy(temp_path, path);
-                strcat(temp_path, "/");
-                strcat(temp_path, dir_block.directory_block.entries[i].name);
-                fs_remove(temp_path);
+                if (cache_readv(blocks, bufs, nblocks) == -1)
+                {
+                    return -1;
+                }
+                nblocks = 0;
             }
         }
-        BLOCK_BITMAP.bitmap[inode_to_remove->i_direct_pointers[0]] = 0;
-        disk_write(1, &BLOCK_BITMAP);
-    }
-    else
-    {
-        for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
+        else
         {
-            uint32_t block_num = inode_to_remove->i_direct_pointers[i];
-            if (block_num == 0)
-                continue;
-
-            BLOCK_BITMAP.bitmap[block_num] = 0;
-            disk_write(1, &BLOCK_BITMAP);
+            union block scratch;
+            const union block *file_block = read_block(block_num, &scratch);
+            if (file_block == NULL)
+            {
+                return -1;
+            }
+            memcpy(dest, file_block->data + within, chunk);
         }
+
+        done += chunk;
     }
-    union block dir_block;
-    disk_read(block_num, &dir_block);
-    memset(&dir_block.directory_block.entries[entry_index], 0, sizeof(struct directory_entry));
-    disk_write(block_num, &dir_block);
 
-    INODE_BITMAP.bitmap[dir_block.directory_block.entries[entry_index].inode_number] = 0;
-    disk_write(2, &INODE_BITMAP);
+    if (nblocks > 0 && cache_readv(blocks, bufs, nblocks) == -1)
+    {
+        return -1;
+    }
 
-    return 0;
+    return count;
 }
 
-int fs_read(char *path, void *buf, size_t count, off_t offset)
+/**
+ * Returns the journal credits a write of the given number of file blocks takes at most, see CREDITS_BLOCK. No table
+ * takes more blocks than it has, however many file blocks are written, and the blocks written need no revokes as they
+ * were revoked when freed (see free_data_block).
+ */
+static int write_credits(uint32_t nblocks)
 {
-    if (MOUNT_FLAG == 0)
-    {
-        printf("Error: Disk is not mounted.\n");
-        return -1;
-    }
-    struct inode *parent_dir_inode = find_parent_directory(path);
-    struct inode *file_inode = NULL;
-    uint32_t file_block_num;
-    for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
+    uint32_t bitmap_blocks = (nblocks < BLOCK_BITMAP.nblocks) ? nblocks : BLOCK_BITMAP.nblocks;
+    uint32_t reference_blocks = (2 * nblocks < REFERENCES.nblocks) ? 2 * nblocks : REFERENCES.nblocks;
+    uint32_t checksum_blocks = SUPERBLOCK.superblock.s_checksum_table_blocks;
+    if (nblocks < checksum_blocks)
+        checksum_blocks = nblocks;
+    return CREDITS_INODE + CREDITS_EXTENT * (1 + nblocks / EXTENTS_PER_BLOCK) + bitmap_blocks + reference_blocks +
+           checksum_blocks;
+}
+
+/**
+ * Writes file data like write_inode_data, in steps of as many blocks as the credits the operation has or can add cover.
+ * The inode and the bitmaps are written after each step, so every step leaves the file system consistent, and the
+ * operation goes on in a new one (see operation_step) if not even one block fits.
+ *
+ * @return The number of bytes written, or -1 on failure.
+ */
+static int write_inode_steps(struct inode *inode, struct block_run *run, void *buf, size_t count, off_t offset)
+{
+    // A compressed file is rewritten a cluster at a time, so its steps end at a cluster.
+    size_t unit = (inode->i_flags & INODE_FLAG_COMPRESSED) ? COMPRESS_CLUSTER_SIZE : BLOCK_SIZE;
+    uint32_t unit_blocks = unit / BLOCK_SIZE;
+    size_t done = 0;
+    while (done < count)
     {
-        uint32_t block_num = parent_dir_inode->i_direct_pointers[i];
-        if (block_num == 0)
-            continue;
+        off_t position = offset + done;
+        size_t units = (position % unit + (count - done) + unit - 1) / unit;
+        while (units > 1 && !has_credits(write_credits(units * unit_blocks)))
+        {
+            units = (units + 1) / 2;
+        }
+        if (units == 1 && !has_credits(write_credits(unit_blocks)) &&
+            operation_step(inode, write_credits(unit_blocks)) == -1)
+        {
+            return -1;
+        }
 
-        union block dir_block;
-        disk_read(block_num, &dir_block);
+        size_t length = units * unit - position % unit;
+        if (length > count - done)
+        {
+            length = count - done;
+        }
+        if (write_inode_data(inode, run, (uint8_t *)buf + done, length, position) == -1)
+        {
+            return -1;
+        }
+        done += length;
 
-        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        // What the step changed joins the transaction now, so the credits left are known for the next one.
+        if (sync_inode(inode) == -1 || sync_bitmaps() == -1)
         {
-            struct directory_entry *entry = &dir_block.directory_block.entries[j];
-            if (entry->inode_number != 0 && strcmp(entry->name, get_name_from_path(path)) == 0)
-            {
-                file_inode = get_inode(entry->inode_number);
-                break;
-            }
+            return -1;
         }
-        break;
-    }
-    if (file_inode == NULL)
-    {
-        printf("Error: File not found.\n");
-        return -1;
     }
+    return count;
+}
 
-    if (file_inode->i_is_directory)
-    {
-        printf("Error: Cannot read a directory.\n");
-        return -1;
-    }
+/**
+ * Writes file data to an inode, allocating blocks as needed. See fs_write.
+ */
+static int write_inode_data(struct inode *inode, struct block_run *run, void *buf, size_t count, off_t offset)
+{
+    // The block map changes as blocks are allocated, even if the write fails half way.
+    mark_inode_dirty(inode);
 
-    union block file_block;
-    int num = offset / BLOCK_SIZE;
-    if (num >= INODE_DIRECT_POINTERS)
+    // An inline file keeps its bytes in the inode while they fit. The bytes past the end of the file are always zero, so
+    // a write past the end leaves a gap of zeros.
+    if (inode->i_flags & INODE_FLAG_INLINE)
     {
-        union block indirect_block;
-        memset(&indirect_block, 0, sizeof(union block));
-        disk_read(file_inode->i_single_indirect_pointer, &indirect_block);
-        if (indirect_block.pointers[num - INODE_DIRECT_POINTERS] == 0)
+        if ((uint64_t)offset + count <= INODE_INLINE_SIZE)
         {
-            return -1;
+            memcpy(inode->i_inline_data + offset, buf, count);
+            if (offset + count > inode->i_size)
+            {
+                inode->i_size = offset + count;
+            }
+            return count;
         }
-        disk_read(indirect_block.pointers[num - INODE_DIRECT_POINTERS], &file_block);
-        memcpy(buf, file_block.data, count);
-    }
-    else
-    {
-        if (file_inode->i_direct_pointers[num] == 0)
+        if (inline_to_extents(inode, run) == -1)
         {
             return -1;
         }
-        file_block_num = file_inode->i_direct_pointers[num];
-        disk_read(file_block_num, &file_block);
-        memcpy(buf, file_block.data, count);
     }
-    if (file_inode->i_size < offset + count)
+
+    // Indirect blocks changed by the write are written back once, also when it fails half way.
+    struct pointer_map map;
+    pointer_map_init(&map);
+    int result;
+    if (inode->i_flags & INODE_FLAG_COMPRESSED)
     {
-        int bytes_read = file_inode->i_size - offset;
-        return bytes_read;
+        run->length = 0;
+        result = write_compressed_data(inode, &map, buf, count, offset);
     }
-    else if (file_inode->i_size >= offset + count)
+    else if (inode->i_flags & INODE_FLAG_DEDUP)
     {
-        return count;
+        result = write_dedup_data(inode, &map, run, buf, count, offset);
     }
-
-    return -1;
-}
-
-int fs_write(char *path, void *buf, size_t count, off_t offset)
-{
-    if (MOUNT_FLAG == 0)
+    else
     {
-        printf("Error: Disk is not mounted.\n");
-        return -1;
+        result = write_inode_blocks(inode, &map, run, buf, count, offset);
     }
-
-    struct inode *parent_dir_inode = find_parent_directory(path);
-    struct inode *file_inode = NULL;
-    uint32_t file_inode_number = 0;
-    uint32_t file_block_num;
-    for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
+    if (pointer_map_finish(&map) == -1)
     {
-        uint32_t block_num = parent_dir_inode->i_direct_pointers[i];
-        LOG_DEBUG("Block number: %d\n", block_num);
-        if (block_num == 0)
-            continue;
-
-        union block dir_block;
-        disk_read(block_num, &dir_block);
-
-        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
-        {
-            struct directory_entry *entry = &dir_block.directory_block.entries[j];
-            if (entry->inode_number != 0 && strcmp(entry->name, get_name_from_path(path)) == 0)
-            {
-                file_inode_number = entry->inode_number;
-                file_inode = get_inode(entry->inode_number);
-                file_block_num = file_inode->i_direct_pointers[0];
-                break;
-            }
-        }
+        printf("Error: Failed to write indirect block to disk.\n");
+        return -1;
     }
-    if (file_inode == NULL)
+    return result;
+}
+
+/**
+ * Moves the bytes of an inline file to its first data block, mapping the file by extents from then on. If that fails
+ * the file is left inline as it was.
+ */
+static int inline_to_extents(struct inode *inode, struct block_run *run)
+{
+    uint8_t data[INODE_INLINE_SIZE];
+    uint64_t size = inode->i_size;
+    memcpy(data, inode->i_inline_data, INODE_INLINE_SIZE);
+
+    memset(inode->i_inline_data, 0, INODE_INLINE_SIZE);
+    inode->i_flags = (inode->i_flags & ~INODE_FLAG_INLINE) | INODE_FLAG_EXTENTS;
+    run->length = 0;
+    if (size == 0)
     {
-        fs_create(path, 0);
-        return fs_write(path, buf, count, offset);
+        return 0;
     }
 
-    if (file_inode->i_is_directory)
+    if (write_inode_data(inode, run, data, size, 0) != -1)
     {
-        printf("Error: Cannot write to a directory.\n");
-        return -1;
+        return 0;
     }
 
-    union block file_block;
-    disk_read(file_block_num, &file_block);
-    int no_blocks = (offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    // Give back whatever was allocated and put the bytes back in the inode.
+    free_inode_blocks(inode);
+    inode->i_flags = (inode->i_flags & ~INODE_FLAG_EXTENTS) | INODE_FLAG_INLINE;
+    memcpy(inode->i_inline_data, data, INODE_INLINE_SIZE);
+    inode->i_size = size;
+    run->length = 0;
+    return -1;
+}
 
-    for (int i = 0; i < no_blocks; ++i)
+/**
+ * Does the work of write_inode_data, keeping the indirect blocks it goes through in map.
+ */
+static int write_inode_blocks(struct inode *inode, struct pointer_map *map, struct block_run *run, void *buf, size_t count,
+                              off_t offset)
+{
+    // Whole blocks are batched and written straight from the caller's buffer, partial blocks are read, patched and written back.
+    // Blocks are mapped (and allocated) a run at a time.
+    uint32_t blocks[TRANSFER_BATCH];
+    void *bufs[TRANSFER_BATCH];
+    int nblocks = 0;
+    uint32_t last_index = (offset + count - 1) / BLOCK_SIZE;
+    bool fresh = false;
+    size_t done = 0;
+    while (done < count)
     {
-        if (i < INODE_DIRECT_POINTERS)
+        uint32_t index = (offset + done) / BLOCK_SIZE;
+        size_t within = (offset + done) % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - within;
+        if (chunk > count - done)
+        {
+            chunk = count - done;
+        }
+        uint8_t *src = (uint8_t *)buf + done;
+
+        if (index < run->start || index - run->start >= run->length)
         {
-            uint32_t block_num = 0;
-            if (file_inode->i_direct_pointers[i] == 0)
+            run->start = index;
+            run->length = file_map_allocate(inode, map, index, last_index - index + 1, &run->physical, &fresh);
+            if (run->length == 0)
             {
-                block_num = allocate_data_block();
-                if (block_num == (uint32_t)-1)
-                {
-                    printf("Error: No free data block available.\n");
-                    return -1;
-                }
-                file_inode->i_direct_pointers[i] = block_num;
+                printf("Error: No free data block available.\n");
+                return -1;
             }
-            else
+
+            // Blocks that held journaled metadata must not be restored over the data by a replay.
+            if (fresh && journal_claim(run->physical, run->length) == -1)
             {
-                block_num = file_inode->i_direct_pointers[i];
+                return -1;
             }
+        }
+        uint32_t block_num = run->physical + (index - run->start);
 
-            union block file_block;
-            disk_read(block_num, &file_block);
-            if (count < BLOCK_SIZE)
+        // A block shared with other files gets a copy of its own before it is changed, filled from the shared block
+        // where the write does not cover it.
+        union block file_block;
+        bool loaded = false;
+        if (!fresh && (inode->i_flags & INODE_FLAG_EXTENTS) && prepare_block_write(block_num))
+        {
+            if (chunk < BLOCK_SIZE && cache_read(block_num, &file_block) == -1)
             {
-                memcpy(file_block.data + offset, buf, count);
+                return -1;
             }
-            else
+            loaded = chunk < BLOCK_SIZE;
+
+            // The copy goes after the block before it in the file if that is free, or else near the shared block.
+            uint32_t previous = 0;
+            if (index > 0)
             {
-                memcpy(file_block.data + offset, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+                extent_map(inode, index - 1, 1, &previous);
             }
-            if (disk_write(block_num, &file_block) == -1)
+            uint32_t copy = allocate_data_block((previous != 0) ? previous + 1 : block_num);
+            if (copy == (uint32_t)-1)
             {
-                printf("Error: Failed to write file block to disk.\n");
+                printf("Error: No free data block available.\n");
+                return -1;
+            }
+            if (journal_claim(copy, 1) == -1 || remap_block(inode, index, copy) == -1)
+            {
+                free_data_block(copy);
                 return -1;
             }
+            block_num = copy;
+            run->length = 0;
         }
 
-        else
+        if (chunk == BLOCK_SIZE)
         {
-            if (file_inode->i_single_indirect_pointer == 0)
+            blocks[nblocks] = block_num;
+            bufs[nblocks] = src;
+            nblocks++;
+            if (nblocks == TRANSFER_BATCH)
             {
-                uint32_t block_num = allocate_data_block();
-                if (block_num == (uint32_t)-1)
+                if (cache_writev(blocks, bufs, nblocks) == -1)
                 {
-                    printf("Error: No free data block available.\n");
+                    printf("Error: Failed to write file block to disk.\n");
                     return -1;
                 }
-                file_inode->i_single_indirect_pointer = block_num;
+                nblocks = 0;
             }
+        }
+        else
+        {
+            if (fresh && !loaded)
+            {
+                memset(&file_block, 0, sizeof(union block));
+            }
+            else if (!loaded && cache_read(block_num, &file_block) == -1)
+            {
+                return -1;
+            }
+            memcpy(file_block.data + within, src, chunk);
 
-            union block indirect_block;
-            memset(&indirect_block, 0, sizeof(union block));
-            disk_read(file_inode->i_single_indirect_pointer, &indirect_block);
-
-            union block file_block;
-            memset(&file_block, 0, sizeof(union block));
-            memcpy(file_block.data, buf + i * BLOCK_SIZE, BLOCK_SIZE);
-
-            uint32_t block_num = allocate_data_block();
-            if (block_num == (uint32_t)-1)
+            // File data is not journaled, so it goes straight to the disk before the metadata pointing at it commits.
+            void *block_buf = &file_block;
+            if (cache_writev(&block_num, &block_buf, 1) == -1)
             {
-                printf("Error: No free data block available.\n");
+                printf("Error: Failed to write file block to disk.\n");
                 return -1;
             }
-            indirect_block.pointers[i - INODE_DIRECT_POINTERS] = block_num;
-            disk_write(file_inode->i_single_indirect_pointer, &indirect_block);
-            disk_write(block_num, &file_block);
         }
+
+        done += chunk;
     }
 
-    if (offset + count > file_inode->i_size)
+    if (nblocks > 0 && cache_writev(blocks, bufs, nblocks) == -1)
     {
-        file_inode->i_size = offset + count;
+        printf("Error: Failed to write file block to disk.\n");
+        return -1;
     }
-    if (write_inode_to_disk(file_inode_number, file_inode) == -1)
+
+    if (offset + count > inode->i_size)
     {
-        printf("Error: Failed to write file inode to disk.\n");
-        return -1;
+        inode->i_size = offset + count;
     }
     return count;
 }
 
-int fs_list(char *path)
+/**
+ * Collects the disk blocks of a cluster of a compressed file, which are mapped from its first logical block on.
+ *
+ * @return The number of blocks mapped, 0 for a cluster in a hole, -1 on failure.
+ */
+static int cluster_blocks(const struct inode *inode, uint32_t cluster, uint32_t *blocks)
 {
-    if (MOUNT_FLAG == 0)
+    uint32_t first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    int count = 0;
+    while (count < COMPRESS_CLUSTER_BLOCKS)
     {
-        printf("Error: Disk is not mounted.\n");
-        return -1;
+        uint32_t physical;
+        uint32_t length = extent_map(inode, first + count, COMPRESS_CLUSTER_BLOCKS - count, &physical);
+        if (length == 0)
+        {
+            return -1;
+        }
+        if (physical == 0)
+        {
+            break;
+        }
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            blocks[count++] = physical + i;
+        }
     }
+    return count;
+}
 
-    struct inode *dir_inode = NULL;
-    if (strcmp(path, "/") == 0)
+/**
+ * Reads a cluster of a compressed file into data (COMPRESS_CLUSTER_SIZE bytes), decompressing it.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int read_cluster(const struct inode *inode, uint32_t cluster, uint8_t *data)
+{
+    uint32_t blocks[COMPRESS_CLUSTER_BLOCKS];
+    int count = cluster_blocks(inode, cluster, blocks);
+    if (count == -1)
     {
-        dir_inode = get_inode(0);
+        return -1;
     }
 
-    else
+    // A hole reads as zeros, and a cluster that did not compress is read as it is.
+    if (count == 0)
+    {
+        memset(data, 0, COMPRESS_CLUSTER_SIZE);
+        return 0;
+    }
+    void *bufs[COMPRESS_CLUSTER_BLOCKS];
+    if (count == COMPRESS_CLUSTER_BLOCKS)
     {
-        struct inode *parent_dir_inode = find_parent_directory(path);
-        char *token;
-        char *last_token = "";
-        char *path_copy = strdup(path);
-        token = strtok(path_copy, "/");
-        while (token != NULL)
+        for (int i = 0; i < count; ++i)
         {
-            last_token = token;
-            token = strtok(NULL, "/");
+            bufs[i] = data + (size_t)i * BLOCK_SIZE;
         }
+        return cache_readv(blocks, bufs, count);
+    }
 
-        for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
-        {
-            uint32_t block_num = parent_dir_inode->i_direct_pointers[i];
-            LOG_DEBUG("Block number: %d\n", block_num);
-            if (block_num == 0)
-                continue;
+    uint8_t packed[COMPRESS_CLUSTER_SIZE - BLOCK_SIZE];
+    for (int i = 0; i < count; ++i)
+    {
+        bufs[i] = packed + (size_t)i * BLOCK_SIZE;
+    }
+    if (cache_readv(blocks, bufs, count) == -1)
+    {
+        return -1;
+    }
 
-            union block dir_block;
-            disk_read(block_num, &dir_block);
+    // The compressed length comes first. The bytes of the cluster past the end of the file were not stored.
+    uint32_t packed_length;
+    memcpy(&packed_length, packed, sizeof(uint32_t));
+    int length = -1;
+    if (packed_length <= (size_t)count * BLOCK_SIZE - sizeof(uint32_t))
+    {
+        length = lz_decompress(packed + sizeof(uint32_t), packed_length, data, COMPRESS_CLUSTER_SIZE);
+    }
+    if (length == -1)
+    {
+        printf("Error: Corrupted compressed cluster.\n");
+        return -1;
+    }
+    memset(data + length, 0, COMPRESS_CLUSTER_SIZE - length);
+    return 0;
+}
 
-            for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
-            {
-                struct directory_entry *entry = &dir_block.directory_block.entries[j];
-                if (entry->inode_number != 0 && strcmp(entry->name, last_token) == 0)
-                {
-                    dir_inode = get_inode(entry->inode_number);
-                    break;
-                }
-            }
-            if (dir_inode != NULL)
-                break;
-        }
+/**
+ * Writes a cluster of a compressed file, compressed if that saves at least one block. The blocks it no longer needs
+ * are freed, and the ones shared with other files are not written in place.
+ *
+ * @param data The cluster (COMPRESS_CLUSTER_SIZE bytes, zero past the end of the file).
+ * @param length The number of bytes of the cluster before the end of the file.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_cluster(struct inode *inode, struct pointer_map *map, uint32_t cluster, uint8_t *data, size_t length)
+{
+    uint8_t packed[COMPRESS_CLUSTER_SIZE - BLOCK_SIZE];
+    size_t packed_length = lz_compress(data, length, packed + sizeof(uint32_t), sizeof(packed) - sizeof(uint32_t));
+    uint8_t *source = data;
+    int nblocks = COMPRESS_CLUSTER_BLOCKS;
+    if (packed_length > 0)
+    {
+        uint32_t header = packed_length;
+        memcpy(packed, &header, sizeof(uint32_t));
+        size_t stored = sizeof(uint32_t) + packed_length;
+        nblocks = (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        memset(packed + stored, 0, (size_t)nblocks * BLOCK_SIZE - stored);
+        source = packed;
     }
 
-    if (dir_inode == NULL)
+    // Blocks past the new end of the cluster go, missing ones are allocated.
+    uint32_t first = cluster * COMPRESS_CLUSTER_BLOCKS;
+    uint32_t blocks[COMPRESS_CLUSTER_BLOCKS];
+    int mapped = cluster_blocks(inode, cluster, blocks);
+    if (mapped == -1)
+    {
+        return -1;
+    }
+    if (mapped > nblocks && extent_remove(inode, first + nblocks, mapped - nblocks) == -1)
     {
-        printf("Error: Directory not found.\n");
         return -1;
     }
+    int count = (mapped < nblocks) ? mapped : nblocks;
 
-    for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
+    // The blocks kept that are shared with other files are swapped for blocks of the file's own. They are overwritten
+    // whole, so nothing has to be copied into them.
+    for (int i = 0; i < count; ++i)
     {
-        uint32_t block_num = dir_inode->i_direct_pointers[i];
-        if (block_num == 0)
+        if (!prepare_block_write(blocks[i]))
+        {
             continue;
-
-        union block dir_block;
-        disk_read(block_num, &dir_block);
-        // printf("Directory contents:\n");
-        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        }
+        uint32_t copy = allocate_data_block((i > 0) ? blocks[i - 1] + 1 : blocks[i]);
+        if (copy == (uint32_t)-1)
         {
-            struct directory_entry *entry = &dir_block.directory_block.entries[j];
-            if (entry->inode_number != 0)
-            {
-                printf("%s %d\n", entry->name, get_inode(entry->inode_number)->i_size);
-            }
+            printf("Error: No free data block available.\n");
+            return -1;
+        }
+        if (journal_claim(copy, 1) == -1 || remap_block(inode, first + i, copy) == -1)
+        {
+            free_data_block(copy);
+            return -1;
         }
+        blocks[i] = copy;
     }
+    while (count < nblocks)
+    {
+        uint32_t physical;
+        bool fresh;
+        uint32_t run = file_map_allocate(inode, map, first + count, nblocks - count, &physical, &fresh);
+        if (run == 0)
+        {
+            printf("Error: No free data block available.\n");
+            return -1;
+        }
 
-    return 0;
-}
+        // Blocks that held journaled metadata must not be restored over the data by a replay.
+        if (fresh && journal_claim(physical, run) == -1)
+        {
+            return -1;
+        }
+        for (uint32_t i = 0; i < run; ++i)
+        {
+            blocks[count++] = physical + i;
+        }
+    }
 
-void fs_stat()
-{
-    if (MOUNT_FLAG == 0)
+    void *bufs[COMPRESS_CLUSTER_BLOCKS];
+    for (int i = 0; i < nblocks; ++i)
     {
-        printf("Error: Disk is not mounted.\n");
-        return;
+        bufs[i] = source + (size_t)i * BLOCK_SIZE;
     }
-
-    printf("Superblock:\n");
-    printf("    Blocks: %d\n", SUPERBLOCK.superblock.s_blocks_count);
-    printf("    Inodes: %d\n", SUPERBLOCK.superblock.s_inodes_count);
-    printf("    Inode Table Block Start: %d\n", SUPERBLOCK.superblock.s_inode_table_block_start);
-    printf("    Data Blocks Start: %d\n", SUPERBLOCK.superblock.s_data_blocks_start);
+    if (cache_writev(blocks, bufs, nblocks) == -1)
+    {
+        printf("Error: Failed to write file block to disk.\n");
+        return -1;
+    }
+    return 0;
 }
 
-// Helper functions
-uint32_t allocate_inode()
+/**
+ * Does the work of read_inode_data for a compressed file. Clusters the read covers whole are decompressed straight
+ * into the caller's buffer, the others go through a scratch cluster.
+ */
+static int read_compressed_data(const struct inode *inode, void *buf, size_t count, off_t offset)
 {
-    for (int i = 0; i < INODES_PER_BLOCK; ++i)
+    uint8_t scratch[COMPRESS_CLUSTER_SIZE];
+    size_t done = 0;
+    while (done < count)
     {
-        if (!INODE_BITMAP.bitmap[i])
+        uint32_t cluster = (offset + done) / COMPRESS_CLUSTER_SIZE;
+        size_t within = (offset + done) % COMPRESS_CLUSTER_SIZE;
+        size_t chunk = COMPRESS_CLUSTER_SIZE - within;
+        if (chunk > count - done)
+        {
+            chunk = count - done;
+        }
+        uint8_t *dest = (uint8_t *)buf + done;
+
+        if (chunk == COMPRESS_CLUSTER_SIZE)
+        {
+            if (read_cluster(inode, cluster, dest) == -1)
+            {
+                return -1;
+            }
+        }
+        else
         {
-            INODE_BITMAP.bitmap[i] = 1;
-            if (disk_write(2, &INODE_BITMAP) == -1)
+            if (read_cluster(inode, cluster, scratch) == -1)
             {
                 return -1;
             }
-            return i;
+            memcpy(dest, scratch + within, chunk);
         }
+        done += chunk;
     }
-    return -1;
+    return count;
 }
 
-uint32_t allocate_data_block()
+/**
+ * Does the work of write_inode_blocks for a compressed file, rewriting every cluster the write touches.
+ */
+static int write_compressed_data(struct inode *inode, struct pointer_map *map, const void *buf, size_t count,
+                                 off_t offset)
 {
-    for (int i = 0; i < SUPERBLOCK.superblock.s_blocks_count; ++i)
+    uint64_t size = (offset + count > inode->i_size) ? offset + count : inode->i_size;
+    uint8_t data[COMPRESS_CLUSTER_SIZE];
+    size_t done = 0;
+    while (done < count)
     {
-        if (!BLOCK_BITMAP.bitmap[i])
+        uint32_t cluster = (offset + done) / COMPRESS_CLUSTER_SIZE;
+        uint64_t start = (uint64_t)cluster * COMPRESS_CLUSTER_SIZE;
+        size_t within = (offset + done) % COMPRESS_CLUSTER_SIZE;
+        size_t chunk = COMPRESS_CLUSTER_SIZE - within;
+        if (chunk > count - done)
         {
-            BLOCK_BITMAP.bitmap[i] = 1;
-            if (disk_write(1, &BLOCK_BITMAP) == -1)
+            chunk = count - done;
+        }
+
+        // A cluster written only in part is read first, one past the end of the file is all zeros.
+        if (chunk < COMPRESS_CLUSTER_SIZE && start < inode->i_size)
+        {
+            if (read_cluster(inode, cluster, data) == -1)
             {
                 return -1;
             }
-            return i + SUPERBLOCK.superblock.s_data_blocks_start;
         }
-    }
-    return -1;
-}
+        else
+        {
+            memset(data, 0, COMPRESS_CLUSTER_SIZE);
+        }
+        memcpy(data + within, (const uint8_t *)buf + done, chunk);
 
-int write_inode_to_disk(uint32_t inode_number, struct inode *inode)
-{
-    uint32_t block_number = SUPERBLOCK.superblock.s_inode_table_block_start +
-                            (inode_number / INODES_PER_BLOCK);
-    uint32_t index_within_block = inode_number % INODES_PER_BLOCK;
+        size_t length = (size - start < COMPRESS_CLUSTER_SIZE) ? size - start : COMPRESS_CLUSTER_SIZE;
+        if (write_cluster(inode, map, cluster, data, length) == -1)
+        {
+            return -1;
+        }
 
-    union block inode_block;
-    if (disk_read(block_number, &inode_block) == -1)
-    {
-        printf("Error: Failed to read inode block from disk.\n");
-        return -1;
+        // The file grows a cluster at a time, so a failure later on leaves what was written readable.
+        if (start + length > inode->i_size)
+        {
+            inode->i_size = start + length;
+        }
+        done += chunk;
     }
-    inode_block.inodes[index_within_block] = *inode;
+    return count;
+}
 
-    if (disk_write(block_number, &inode_block) == -1)
+/**
+ * Maps a logical block of an extent-mapped file to another disk block, dropping the reference the file held to the
+ * block it was mapped to before, if any. The runs kept by the descriptors of the file are dropped.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int remap_block(struct inode *inode, uint32_t index, uint32_t block_num)
+{
+    forget_inode_runs(inode);
+    if (extent_remove(inode, index, 1) == -1 || extent_insert(inode, index, block_num, 1) == -1)
     {
-        printf("Error: Failed to write inode block to disk.\n");
         return -1;
     }
-
-    LOG_DEBUG("Wrote inode %d to block %d at index %d.\n", inode_number, block_number, index_within_block);
     return 0;
 }
 
-struct inode *find_parent_directory(const char *path)
+/**
+ * Does the work of write_inode_blocks for a deduplicated file. Every whole block written is looked up by its
+ * fingerprint: one with a duplicate on the disk is mapped to it instead of being written, the others are gathered into
+ * runs written the usual way and have their fingerprints recorded.
+ */
+static int write_dedup_data(struct inode *inode, struct pointer_map *map, struct block_run *run, void *buf, size_t count,
+                            off_t offset)
 {
-    if (strcmp(path, "/") == 0)
+    // The partial block at the start is written the usual way.
+    size_t done = (BLOCK_SIZE - offset % BLOCK_SIZE) % BLOCK_SIZE;
+    if (done > count)
     {
-        LOG_DEBUG("Root directory found.\n");
-        return get_inode(0);
+        done = count;
     }
-
-    char temp_path[strlen(path) + 1];
-    strcpy(temp_path, path);
-
-    char *token = strtok(temp_path, "/");
-    LOG_DEBUG("First token: %s\n", token);
-    struct inode *current_inode = get_inode(0);
-
-    while (token != NULL)
+    if (done > 0 && write_inode_blocks(inode, map, run, buf, done, offset) == -1)
     {
-        char *next_token = strtok(NULL, "/");
-        LOG_DEBUG("Next token: %s\n", next_token);
-        if (next_token == NULL)
-            break;
+        return -1;
+    }
 
-        bool found = false;
-        for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
+    while (done < count)
+    {
+        // Gather whole blocks without a duplicate, up to the next one that has one. What is left at the end is the
+        // partial last block.
+        uint32_t fingerprints[TRANSFER_BATCH];
+        uint32_t full = 0;
+        uint32_t duplicate = 0;
+        while (done + (full + 1) * BLOCK_SIZE <= count && full < TRANSFER_BATCH)
         {
-            uint32_t block_num = current_inode->i_direct_pointers[i];
-            if (block_num == 0)
-                continue;
-
-            union block dir_block;
-            disk_read(block_num, &dir_block);
-
-            for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+            const uint8_t *data = (const uint8_t *)buf + done + (size_t)full * BLOCK_SIZE;
+            fingerprints[full] = block_fingerprint(data);
+            duplicate = find_duplicate(fingerprints[full], data);
+            if (duplicate != 0)
             {
-                struct directory_entry *entry = &dir_block.directory_block.entries[j];
-                if (entry->inode_number != 0 && strcmp(entry->name, token) == 0)
-                {
-                    current_inode = get_inode(entry->inode_number);
-                    found = true;
-                    break;
-                }
-            }
-            if (found)
                 break;
+            }
+            full++;
         }
+        size_t span = (full == 0 && duplicate == 0) ? count - done : (size_t)full * BLOCK_SIZE;
 
-        if (!found)
-            return NULL;
-        token = next_token;
-    }
-    return current_inode;
-}
-
-struct inode *get_inode(uint32_t inode_number)
-{
-    uint32_t block_index = inode_number / INODES_PER_BLOCK;
-    uint32_t index_within_block = inode_number % INODES_PER_BLOCK;
-    uint32_t inode_block_num = SUPERBLOCK.superblock.s_inode_table_block_start + block_index;
-    union block inode_block;
-    disk_read(inode_block_num, &inode_block);
-    struct inode *inode_within_block = &inode_block.inodes[index_within_block];
-    LOG_DEBUG("Block index: %d\n", block_index);
-    LOG_DEBUG("Index within block: %d\n", index_within_block);
-    LOG_DEBUG("Inode block number: %d\n", inode_block_num);
-    LOG_DEBUG("Inode directory? %d\n", inode_within_block->i_is_directory);
-    LOG_DEBUG("Inode size: %d\n", inode_within_block->i_size);
-    return inode_within_block;
-}
-
-int add_directory_entry(struct inode *parent_dir_inode, uint32_t inode_number, const char *name)
-{
-    for (int i = 0; i < INODE_DIRECT_POINTERS; ++i)
-    {
-        uint32_t block_num = parent_dir_inode->i_direct_pointers[i];
-        union block dir_block;
-
-        if (block_num == 0)
+        if (span > 0)
         {
-            block_num = allocate_data_block();
-            if (block_num == -1)
+            if (write_inode_blocks(inode, map, run, (uint8_t *)buf + done, span, offset + done) == -1)
+            {
+                if (duplicate != 0)
+                    free_data_block(duplicate);
                 return -1;
-            parent_dir_inode->i_direct_pointers[i] = block_num;
-            memset(dir_block.data, 0, BLOCK_SIZE);
-        }
-        else
-        {
-            disk_read(block_num, &dir_block);
+            }
+            for (uint32_t i = 0; i < full; i++)
+            {
+                uint32_t physical;
+                if (extent_map(inode, (offset + done) / BLOCK_SIZE + i, 1, &physical) != 0 && physical != 0)
+                {
+                    record_fingerprint(physical, fingerprints[i]);
+                }
+            }
+            done += span;
         }
 
-        for (int j = 0; j < DIRECTORY_ENTRIES_PER_BLOCK; ++j)
+        if (duplicate != 0)
         {
-            if (dir_block.directory_block.entries[j].inode_number == 0)
+            // A block already mapped to the duplicate only gives the new share back.
+            uint32_t index = (offset + done) / BLOCK_SIZE;
+            uint32_t physical;
+            if (extent_map(inode, index, 1, &physical) == 0 ||
+                (physical != duplicate && remap_block(inode, index, duplicate) == -1))
             {
-                dir_block.directory_block.entries[j].inode_number = inode_number;
-                strncpy(dir_block.directory_block.entries[j].name, name, DIRECTORY_NAME_SIZE - 1);
-                dir_block.directory_block.entries[j].name[DIRECTORY_NAME_SIZE - 1] = '\0';
-                if (disk_write(block_num, &dir_block) == -1)
-                {
-                    return -1;
-                }
-                return 0;
+                free_data_block(duplicate);
+                return -1;
+            }
+            if (physical == duplicate)
+            {
+                free_data_block(duplicate);
+            }
+            run->length = 0;
+            done += BLOCK_SIZE;
+            if (offset + done > inode->i_size)
+            {
+                inode->i_size = offset + done;
             }
         }
     }
-    return -1;
+    return count;
 }
 
 const char *get_name_from_path(const char *path)
@@ -0,0 +1,697 @@
+/**
+ * @file journal.c
+ * @author agent (agent@local)
+ * @brief Write-ahead metadata journal with group commit and replay at mount.
+ * @version 0.1
+ * @date 2026-10-17
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+#include "journal.h"
+#include "log.h"
+
+#define LOGGED_SLOTS (2 * JOURNAL_MAX_BLOCKS) // slots of the set of blocks logged since the last checkpoint
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;     // protects everything below
+static pthread_cond_t committed = PTHREAD_COND_INITIALIZER; // signalled when a commit of the running transaction ends
+static uint32_t journal_start = 0;                          // first block of the journal region (the header)
+static uint32_t journal_blocks = 0;                         // blocks in the journal region, 0 if there is no journal
+static uint32_t head = 0;                                   // next free block of the log
+static uint32_t sequence = 0;                               // sequence number of the running transaction
+static uint32_t running[JOURNAL_MAX_TRANSACTION_BLOCKS];    // home blocks written by the running transaction
+static int nrunning = 0;                                    // number of blocks in the running transaction
+static uint32_t revoked[JOURNAL_MAX_TRANSACTION_BLOCKS];    // blocks revoked by the running transaction
+static int nrevoked = 0;                                    // number of blocks revoked by the running transaction
+static int operations = 0;                                  // operations batched in the running transaction
+static int updates = 0;                                     // operations begun and not ended yet
+static int reserved = 0;                                    // credits of the operations in progress not used yet
+static int closing = 0;                                     // set while operations wait for the running transaction to commit
+static uint32_t logged[LOGGED_SLOTS];                       // blocks logged since the last checkpoint plus one, 0 if free
+static uint32_t revoke_sequence[LOGGED_SLOTS];              // during replay, the last transaction revoking the block in logged
+static int nlogged = 0;                                     // number of blocks in the logged set
+static int commits = 0;                                     // number of transactions committed
+static uint8_t log_buffer[JOURNAL_MAX_TRANSACTION_BLOCKS + 2][BLOCK_SIZE]; // descriptor, blocks and commit of a transaction
+
+static _Thread_local int handle_depth = 0;   // operations the calling thread has begun and not ended
+static _Thread_local int handle_credits = 0; // credits the operation of the calling thread has left
+
+/**
+ * Returns non-zero if metadata writes go through the journal.
+ */
+static int journal_active()
+{
+    return journal_blocks != 0;
+}
+
+/**
+ * Hashes a transaction (FNV-1a), used to recognise transactions that were only partly written.
+ */
+static uint32_t journal_checksum(const uint8_t *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Returns the slot of a block in the logged set, or the free slot where it would go.
+ */
+static int logged_slot(uint32_t blocknum)
+{
+    int slot = (int)((blocknum * 2654435761u) % LOGGED_SLOTS);
+    while (logged[slot] != 0 && logged[slot] != blocknum + 1)
+    {
+        slot = (slot + 1) % LOGGED_SLOTS;
+    }
+    return slot;
+}
+
+/**
+ * Returns the index of a block in the running transaction, or -1 if it is not part of it.
+ */
+static int running_index(uint32_t blocknum)
+{
+    for (int i = 0; i < nrunning; i++)
+    {
+        if (running[i] == blocknum)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Returns the index of a block in the blocks revoked by the running transaction, or -1 if it is not revoked.
+ */
+static int revoked_index(uint32_t blocknum)
+{
+    for (int i = 0; i < nrevoked; i++)
+    {
+        if (revoked[i] == blocknum)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Forgets the running transaction and the logged blocks, used when a journal is formatted or mounted.
+ */
+static void journal_reset(uint32_t start, uint32_t nblocks)
+{
+    for (int i = 0; i < nrunning; i++)
+    {
+        cache_pin(running[i], 0);
+    }
+
+    journal_start = start;
+    journal_blocks = nblocks;
+    head = start + 1;
+    sequence = 1;
+    nrunning = 0;
+    nrevoked = 0;
+    operations = 0;
+    updates = 0;
+    reserved = 0;
+    closing = 0;
+    memset(logged, 0, sizeof(logged));
+    nlogged = 0;
+}
+
+/**
+ * Writes the header, recording that the log starts at the running transaction.
+ */
+static int write_header()
+{
+    uint8_t block[BLOCK_SIZE];
+    memset(block, 0, BLOCK_SIZE);
+
+    struct journal_header *header = (struct journal_header *)block;
+    header->j_magic = JOURNAL_HEADER_MAGIC;
+    header->j_sequence = sequence;
+    header->j_blocks = journal_blocks;
+
+    return (disk_write(journal_start, block) == -1) ? -1 : 0;
+}
+
+/**
+ * Writes every committed block home and empties the log. Must only be called when no transaction is running.
+ */
+static int checkpoint()
+{
+    // The home locations have to be on the disk before the log that could restore them is dropped.
+    if (cache_sync() == -1 || disk_sync() == -1)
+    {
+        return -1;
+    }
+
+    head = journal_start + 1;
+    memset(logged, 0, sizeof(logged));
+    nlogged = 0;
+
+    return (write_header() == -1 || disk_sync() == -1) ? -1 : 0;
+}
+
+/**
+ * Reads the transaction at the head of the log into log_buffer and checks that it was completely written.
+ *
+ * @return The number of log blocks the transaction takes, or 0 if the log ends here.
+ */
+static int read_transaction()
+{
+    uint32_t end = journal_start + journal_blocks;
+    if (head + 2 > end || disk_read(head, log_buffer[0]) == -1)
+    {
+        return 0;
+    }
+
+    struct journal_descriptor *descriptor = (struct journal_descriptor *)log_buffer[0];
+    int count = (int)descriptor->d_count;
+    int nrevokes = (int)descriptor->d_revoked;
+    if (descriptor->d_magic != JOURNAL_DESCRIPTOR_MAGIC || descriptor->d_sequence != sequence || count < 0 ||
+        nrevokes < 0 || count + nrevokes == 0 || count + nrevokes > JOURNAL_MAX_TRANSACTION_BLOCKS ||
+        head + count + 2 > end)
+    {
+        return 0;
+    }
+
+    if (disk_read_range(head + 1, count + 1, log_buffer[1]) == -1)
+    {
+        return 0;
+    }
+
+    struct journal_commit *commit = (struct journal_commit *)log_buffer[count + 1];
+    if (commit->c_magic != JOURNAL_COMMIT_MAGIC || commit->c_sequence != sequence ||
+        commit->c_checksum != journal_checksum(log_buffer[0], (size_t)(count + 1) * BLOCK_SIZE))
+    {
+        return 0;
+    }
+
+    // Blocks outside the disk or inside the journal itself would mean the log is damaged.
+    for (int i = 0; i < count + nrevokes; i++)
+    {
+        uint32_t home = descriptor->d_blocks[i];
+        if (home >= (uint32_t)disk_size() || (home >= journal_start && home < end))
+        {
+            return 0;
+        }
+    }
+
+    return count + 2;
+}
+
+int journal_format(uint32_t start, uint32_t nblocks)
+{
+    pthread_mutex_lock(&lock);
+    journal_reset(start, nblocks);
+
+    int result = (journal_blocks == 0) ? 0 : write_header();
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+/**
+ * Does the work of journal_mount.
+ */
+static int mount(uint32_t start, uint32_t nblocks)
+{
+    journal_reset(start, nblocks);
+    if (journal_blocks == 0)
+    {
+        return 0;
+    }
+
+    uint8_t block[BLOCK_SIZE];
+    if (disk_read(journal_start, block) == -1)
+    {
+        return -1;
+    }
+
+    struct journal_header *header = (struct journal_header *)block;
+    if (header->j_magic != JOURNAL_HEADER_MAGIC || header->j_blocks != journal_blocks)
+    {
+        printf("ERROR: Invalid journal header.\n");
+        return -1;
+    }
+    sequence = header->j_sequence;
+
+    // The first pass finds the last transaction revoking each block, stopping at the first one that is missing or
+    // incomplete.
+    uint32_t first = sequence;
+    int length;
+    while ((length = read_transaction()) > 0)
+    {
+        struct journal_descriptor *descriptor = (struct journal_descriptor *)log_buffer[0];
+        for (uint32_t i = 0; i < descriptor->d_revoked; i++)
+        {
+            int slot = logged_slot(descriptor->d_blocks[descriptor->d_count + i]);
+            logged[slot] = descriptor->d_blocks[descriptor->d_count + i] + 1;
+            revoke_sequence[slot] = sequence;
+        }
+        head += length;
+        sequence++;
+    }
+
+    // The second pass applies the committed transactions in order, except the copies of blocks a later one revoked.
+    uint32_t last = sequence;
+    head = journal_start + 1;
+    sequence = first;
+    int replayed = 0;
+    while (sequence != last && (length = read_transaction()) > 0)
+    {
+        struct journal_descriptor *descriptor = (struct journal_descriptor *)log_buffer[0];
+        for (uint32_t i = 0; i < descriptor->d_count; i++)
+        {
+            int slot = logged_slot(descriptor->d_blocks[i]);
+            if (logged[slot] != 0 && revoke_sequence[slot] > sequence)
+            {
+                continue;
+            }
+            if (cache_write(descriptor->d_blocks[i], log_buffer[i + 1]) == -1)
+            {
+                return -1;
+            }
+        }
+
+        head += length;
+        sequence++;
+        replayed++;
+    }
+
+    if (replayed == 0)
+    {
+        head = journal_start + 1;
+        memset(logged, 0, sizeof(logged));
+        return 0;
+    }
+
+    LOG_DEBUG("Replayed %d journal transactions.\n", replayed);
+    return checkpoint();
+}
+
+/**
+ * Does the work of commit.
+ */
+static int write_transaction()
+{
+    // The descriptor, the blocks and the commit block are laid out in one buffer and written with one call.
+    memset(log_buffer[0], 0, BLOCK_SIZE);
+    struct journal_descriptor *descriptor = (struct journal_descriptor *)log_buffer[0];
+    descriptor->d_magic = JOURNAL_DESCRIPTOR_MAGIC;
+    descriptor->d_sequence = sequence;
+    descriptor->d_count = nrunning;
+    descriptor->d_revoked = nrevoked;
+    for (int i = 0; i < nrunning; i++)
+    {
+        descriptor->d_blocks[i] = running[i];
+        if (cache_read(running[i], log_buffer[i + 1]) == -1)
+        {
+            return -1;
+        }
+    }
+    memcpy(&descriptor->d_blocks[nrunning], revoked, nrevoked * sizeof(uint32_t));
+
+    memset(log_buffer[nrunning + 1], 0, BLOCK_SIZE);
+    struct journal_commit *commit = (struct journal_commit *)log_buffer[nrunning + 1];
+    commit->c_magic = JOURNAL_COMMIT_MAGIC;
+    commit->c_sequence = sequence;
+    commit->c_checksum = journal_checksum(log_buffer[0], (size_t)(nrunning + 1) * BLOCK_SIZE);
+
+    // A checkpoint always leaves room for a full transaction, so the log never has to wrap in the middle of one.
+    if (disk_write_range(head, nrunning + 2, log_buffer) == -1 || disk_sync() == -1)
+    {
+        return -1;
+    }
+
+    // The transaction is durable, its blocks may now be written home whenever the cache sees fit.
+    for (int i = 0; i < nrunning; i++)
+    {
+        int slot = logged_slot(running[i]);
+        if (logged[slot] == 0)
+        {
+            logged[slot] = running[i] + 1;
+            nlogged++;
+        }
+        cache_pin(running[i], 0);
+    }
+
+    head += nrunning + 2;
+    sequence++;
+    nrunning = 0;
+    nrevoked = 0;
+    operations = 0;
+    commits++;
+
+    if (head + JOURNAL_MAX_TRANSACTION_BLOCKS + 2 > journal_start + journal_blocks)
+    {
+        return checkpoint();
+    }
+    return 0;
+}
+
+/**
+ * Commits the running transaction. See journal_commit. Must only be called when no operation is in progress.
+ */
+static int commit()
+{
+    int result = 0;
+    if (journal_active() && nrunning + nrevoked > 0)
+    {
+        result = write_transaction();
+    }
+
+    // Operations waiting for room try again, and commit themselves if this commit failed.
+    if (result == 0)
+    {
+        closing = 0;
+    }
+    pthread_cond_broadcast(&committed);
+    return result;
+}
+
+/**
+ * Commits the running transaction and empties the journal. See journal_checkpoint.
+ */
+static int commit_and_checkpoint()
+{
+    if (!journal_active())
+    {
+        return cache_sync();
+    }
+
+    if (commit() == -1)
+    {
+        return -1;
+    }
+
+    // The commit may have checkpointed already.
+    if (head == journal_start + 1)
+    {
+        return cache_sync();
+    }
+    return checkpoint();
+}
+
+/**
+ * Waits until no operation is in progress, or until the running transaction was committed by the last one to end.
+ *
+ * @return True if no operation is in progress, so the caller may commit.
+ */
+static bool wait_for_operations()
+{
+    if (journal_active() && updates > 0)
+    {
+        closing = 1;
+        while (closing && updates > 0)
+        {
+            pthread_cond_wait(&committed, &lock);
+        }
+    }
+    return updates == 0;
+}
+
+/**
+ * Takes a block of the running transaction for a block new to it or a revoked block, charged to the credits of the
+ * operation of the calling thread.
+ *
+ * @return 0 on success, -1 if the transaction is full.
+ */
+static int take_credit()
+{
+    if (handle_credits > 0)
+    {
+        handle_credits--;
+        reserved--;
+        return 0;
+    }
+
+    // An operation that writes more than it reserved takes a block nobody reserved, and a write outside any operation
+    // may commit what the others left.
+    if (nrunning + nrevoked + reserved < JOURNAL_MAX_TRANSACTION_BLOCKS)
+    {
+        return 0;
+    }
+    if (updates == 0 && commit() == 0)
+    {
+        return 0;
+    }
+    printf("Error: The journal transaction is full.\n");
+    return -1;
+}
+
+/**
+ * Reserves credits for the operation of the calling thread, which is not in one, waiting for the running transaction
+ * to be committed if it cannot take them.
+ *
+ * @return 0 on success, -1 if a commit failed.
+ */
+static int start(int credits)
+{
+    if (credits > JOURNAL_MAX_CREDITS)
+    {
+        credits = JOURNAL_MAX_CREDITS;
+    }
+
+    // The last operation to end commits the transaction, or this one if none is in progress.
+    while (journal_active() && (closing || nrunning + nrevoked + reserved + credits > JOURNAL_MAX_CREDITS))
+    {
+        if (updates == 0)
+        {
+            if (commit() == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+        closing = 1;
+        pthread_cond_wait(&committed, &lock);
+    }
+
+    updates++;
+    reserved += credits;
+    handle_credits = credits;
+    handle_depth = 1;
+    return 0;
+}
+
+/**
+ * Ends the operation of the calling thread, giving back the credits it did not use.
+ */
+static void stop()
+{
+    if (handle_depth > 0 && updates > 0)
+    {
+        updates--;
+    }
+    reserved -= handle_credits;
+    handle_credits = 0;
+    handle_depth = 0;
+}
+
+/**
+ * Does the work of journal_extend.
+ */
+static int extend(int credits)
+{
+    if (!journal_active())
+    {
+        return 0;
+    }
+    if (closing || nrunning + nrevoked + reserved + credits > JOURNAL_MAX_CREDITS)
+    {
+        return -1;
+    }
+    reserved += credits;
+    handle_credits += credits;
+    return 0;
+}
+
+int journal_mount(uint32_t start, uint32_t nblocks)
+{
+    pthread_mutex_lock(&lock);
+    int result = mount(start, nblocks);
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_write(uint32_t blocknum, void *buf)
+{
+    pthread_mutex_lock(&lock);
+    if (!journal_active())
+    {
+        pthread_mutex_unlock(&lock);
+        return cache_write(blocknum, buf);
+    }
+
+    // A block written again after it was revoked takes the place of the revoke, the new copy is replayed last.
+    int index = running_index(blocknum);
+    int revoke = (index == -1) ? revoked_index(blocknum) : -1;
+    if (index == -1 && revoke == -1 && take_credit() == -1)
+    {
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+
+    // The block stays in memory until the transaction is committed. A block new to the transaction is pinned as it is
+    // written, so no other thread can write it home in between.
+    int result = (index == -1) ? cache_write_pinned(blocknum, buf) : cache_write(blocknum, buf);
+    if (result != -1 && index == -1)
+    {
+        running[nrunning++] = blocknum;
+        if (revoke != -1)
+        {
+            revoked[revoke] = revoked[--nrevoked];
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_begin_operation(int credits)
+{
+    pthread_mutex_lock(&lock);
+    int result = 0;
+    if (handle_depth > 0)
+    {
+        // An operation begun inside another is part of it.
+        handle_depth++;
+        extend(credits);
+    }
+    else
+    {
+        result = start(credits);
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_end_operation()
+{
+    pthread_mutex_lock(&lock);
+    if (handle_depth > 1)
+    {
+        handle_depth--;
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    stop();
+    if (!journal_active())
+    {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+
+    // Commit once enough operations are batched, or early if the next one would probably not fit, or when operations
+    // wait for room. Operations still in progress on other threads would be committed half done, so the last of them
+    // to end commits instead.
+    int result = 0;
+    operations++;
+    if ((closing || operations >= JOURNAL_GROUP_OPERATIONS || nrunning + nrevoked > JOURNAL_MAX_CREDITS / 2) &&
+        updates == 0)
+    {
+        result = commit();
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_extend(int credits)
+{
+    pthread_mutex_lock(&lock);
+    int result = extend(credits);
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_restart(int credits)
+{
+    pthread_mutex_lock(&lock);
+    int result;
+    if (handle_depth > 1)
+    {
+        // Inside another operation there is no consistent point to commit at, only free room can be had.
+        result = extend(credits - handle_credits);
+    }
+    else
+    {
+        stop();
+        result = start(credits);
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_credits()
+{
+    pthread_mutex_lock(&lock);
+    int result = journal_active() ? handle_credits : INT_MAX;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_claim(uint32_t start, uint32_t length)
+{
+    pthread_mutex_lock(&lock);
+    int result = 0;
+    for (uint32_t i = 0; journal_active() && (nlogged != 0 || nrunning != 0) && i < length; i++)
+    {
+        // The copy in the running transaction is dropped, its block is taken by the revoke if one is needed.
+        uint32_t blocknum = start + i;
+        int index = running_index(blocknum);
+        bool logged_before = logged[logged_slot(blocknum)] != 0;
+        if (index != -1)
+        {
+            cache_pin(blocknum, 0);
+            running[index] = running[--nrunning];
+        }
+        if (logged_before && revoked_index(blocknum) == -1)
+        {
+            if (index == -1 && take_credit() == -1)
+            {
+                result = -1;
+                break;
+            }
+            revoked[nrevoked++] = blocknum;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_commit()
+{
+    pthread_mutex_lock(&lock);
+    int result = wait_for_operations() ? commit() : 0;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_checkpoint()
+{
+    pthread_mutex_lock(&lock);
+    while (!wait_for_operations())
+    {
+    }
+    int result = commit_and_checkpoint();
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+int journal_commits()
+{
+    pthread_mutex_lock(&lock);
+    int result = commits;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
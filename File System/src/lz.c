@@ -0,0 +1,211 @@
+/**
+ * @file lz.c
+ * @author agent (agent@local)
+ * @brief LZ4 block format compressor used for the clusters of compressed files.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4       // shortest match worth a sequence
+#define LZ_LAST_LITERALS 5   // the last bytes of the input are always literals
+#define LZ_MATCH_LIMIT 12    // no match starts in the last bytes of the input
+#define LZ_MAX_OFFSET 65535  // farthest back a match can be
+#define LZ_HASH_BITS 12      // positions remembered by the compressor
+#define LZ_SKIP_TRIGGER 6    // the search speeds up every 2^n bytes without a match
+
+/**
+ * Reads 4 bytes, unaligned.
+ */
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/**
+ * Returns the slot of the hash table for 4 bytes of input.
+ */
+static uint32_t hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Writes a length that did not fit in its nibble of the token, as a run of 255s and the rest.
+ */
+static void write_length(uint8_t *out, size_t *op, size_t length)
+{
+    while (length >= 255)
+    {
+        out[(*op)++] = 255;
+        length -= 255;
+    }
+    out[(*op)++] = (uint8_t)length;
+}
+
+/**
+ * Appends a sequence to the output: the literals, then the match unless match_length is 0 (the last sequence).
+ *
+ * @return false if it does not fit.
+ */
+static bool write_sequence(uint8_t *out, size_t capacity, size_t *op, const uint8_t *literals, size_t literal_length,
+                           size_t offset, size_t match_length)
+{
+    // Token, length bytes and literals, then offset and length bytes of the match.
+    size_t needed = 1 + literal_length / 255 + 1 + literal_length;
+    if (match_length > 0)
+        needed += 2 + (match_length - LZ_MIN_MATCH) / 255 + 1;
+    if (needed > capacity - *op)
+        return false;
+
+    uint8_t *token = &out[(*op)++];
+    *token = (uint8_t)(((literal_length < 15) ? literal_length : 15) << 4);
+    if (literal_length >= 15)
+        write_length(out, op, literal_length - 15);
+    memcpy(out + *op, literals, literal_length);
+    *op += literal_length;
+
+    if (match_length == 0)
+        return true;
+
+    out[(*op)++] = (uint8_t)offset;
+    out[(*op)++] = (uint8_t)(offset >> 8);
+    size_t code = match_length - LZ_MIN_MATCH;
+    *token |= (uint8_t)((code < 15) ? code : 15);
+    if (code >= 15)
+        write_length(out, op, code - 15);
+    return true;
+}
+
+size_t lz_compress(const void *src, size_t length, void *dst, size_t capacity)
+{
+    const uint8_t *in = src;
+    uint8_t *out = dst;
+    size_t op = 0;
+    size_t anchor = 0;
+
+    if (length > LZ_MATCH_LIMIT)
+    {
+        // The table maps the hash of 4 bytes to the last position they were seen at. Stale or colliding entries are
+        // caught by comparing the bytes.
+        uint32_t table[1 << LZ_HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        size_t limit = length - LZ_MATCH_LIMIT;
+        size_t match_end_limit = length - LZ_LAST_LITERALS;
+        size_t pos = 0;
+        while (pos < limit)
+        {
+            uint32_t sequence = read32(in + pos);
+            uint32_t slot = hash(sequence);
+            size_t candidate = table[slot];
+            table[slot] = (uint32_t)pos;
+
+            if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET || read32(in + candidate) != sequence)
+            {
+                // Incompressible data is skipped through faster the longer it goes on.
+                pos += 1 + ((pos - anchor) >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+
+            // Extend the match forwards, then backwards over literals not written yet.
+            size_t match_end = pos + LZ_MIN_MATCH;
+            while (match_end < match_end_limit && in[match_end] == in[candidate + match_end - pos])
+                match_end++;
+            while (pos > anchor && candidate > 0 && in[pos - 1] == in[candidate - 1])
+            {
+                pos--;
+                candidate--;
+            }
+
+            if (!write_sequence(out, capacity, &op, in + anchor, pos - anchor, pos - candidate, match_end - pos))
+                return 0;
+            pos = match_end;
+            anchor = pos;
+        }
+    }
+
+    if (!write_sequence(out, capacity, &op, in + anchor, length - anchor, 0, 0))
+        return 0;
+    return op;
+}
+
+/**
+ * Reads the rest of a length that did not fit in its nibble of the token.
+ *
+ * @return false if the input ends first.
+ */
+static bool read_length(const uint8_t *in, size_t length, size_t *ip, size_t *value)
+{
+    uint8_t byte;
+    do
+    {
+        if (*ip >= length)
+            return false;
+        byte = in[(*ip)++];
+        *value += byte;
+    } while (byte == 255);
+    return true;
+}
+
+int lz_decompress(const void *src, size_t length, void *dst, size_t capacity)
+{
+    const uint8_t *in = src;
+    uint8_t *out = dst;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < length)
+    {
+        uint8_t token = in[ip++];
+
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && !read_length(in, length, &ip, &literal_length))
+            return -1;
+        if (literal_length > length - ip || literal_length > capacity - op)
+            return -1;
+        memcpy(out + op, in + ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+
+        // The last sequence has no match.
+        if (ip == length)
+            break;
+
+        if (length - ip < 2)
+            return -1;
+        size_t offset = in[ip] | ((size_t)in[ip + 1] << 8);
+        ip += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && !read_length(in, length, &ip, &match_length))
+            return -1;
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_length > capacity - op)
+            return -1;
+
+        // The match may overlap the bytes it produces, which repeats them.
+        const uint8_t *match = out + op - offset;
+        if (offset >= match_length)
+        {
+            memcpy(out + op, match, match_length);
+        }
+        else
+        {
+            for (size_t i = 0; i < match_length; i++)
+                out[op + i] = match[i];
+        }
+        op += match_length;
+    }
+
+    return (int)op;
+}
@@ -0,0 +1,192 @@
+/**
+ * @file prefetch.c
+ * @author agent (agent@local)
+ * @brief Read-ahead windows of sequentially read files, read through the asynchronous I/O engine.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "checksum.h"
+#include "prefetch.h"
+
+/**
+ * Returns the window holding a logical block, or NULL if none does.
+ */
+static struct prefetch_window *find_window(struct prefetch_stream *stream, uint32_t index)
+{
+    for (int i = 0; stream->windows != NULL && i < PREFETCH_WINDOWS; i++)
+    {
+        struct prefetch_window *window = &stream->windows[i];
+        if (window->count > 0 && index >= window->start && index - window->start < window->count)
+            return window;
+    }
+    return NULL;
+}
+
+/**
+ * Returns a window the reader has moved past (or an empty one), or NULL if there is none.
+ */
+static struct prefetch_window *free_window(struct prefetch_stream *stream)
+{
+    struct prefetch_window *found = NULL;
+    for (int i = 0; stream->windows != NULL && i < PREFETCH_WINDOWS; i++)
+    {
+        struct prefetch_window *window = &stream->windows[i];
+        if (window->count == 0 || window->start + window->count <= stream->next)
+            found = window;
+    }
+    return found;
+}
+
+/**
+ * Checks the blocks of a window that was read against their checksums.
+ *
+ * @return 0 if they are intact, -1 otherwise.
+ */
+static int verify_window(struct prefetch_window *window)
+{
+    for (uint32_t i = 0; i < window->count; i++)
+    {
+        if (checksum_verify(window->request.start + i, window->data + (size_t)i * BLOCK_SIZE) == -1)
+        {
+            return -1;
+        }
+    }
+    window->verified = 1;
+    return 0;
+}
+
+void prefetch_access(struct prefetch_stream *stream, uint32_t first, uint32_t last)
+{
+    if (!disk_is_mapped() && (first == stream->next || first + 1 == stream->next))
+    {
+        stream->blocks = (stream->blocks == 0) ? PREFETCH_MIN_BLOCKS : stream->blocks * 2;
+        if (stream->blocks > PREFETCH_MAX_BLOCKS)
+            stream->blocks = PREFETCH_MAX_BLOCKS;
+    }
+    else
+    {
+        stream->blocks = 0;
+        prefetch_drop(stream, 0);
+    }
+    stream->next = last + 1;
+}
+
+size_t prefetch_copy(struct prefetch_stream *stream, void *buf, size_t count, off_t offset)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        struct prefetch_window *window = find_window(stream, (offset + done) / BLOCK_SIZE);
+        if (window == NULL)
+        {
+            break;
+        }
+
+        // A window that could not be read or does not match its checksums is dropped, the data is then read the usual
+        // way. The checksums are only checked the first time the window is used.
+        if (aio_wait(&window->request) == -1 || (!window->verified && verify_window(window) == -1))
+        {
+            window->count = 0;
+            break;
+        }
+
+        size_t within = (offset + done) - (off_t)window->start * BLOCK_SIZE;
+        size_t chunk = (size_t)window->count * BLOCK_SIZE - within;
+        if (chunk > count - done)
+        {
+            chunk = count - done;
+        }
+        memcpy((uint8_t *)buf + done, window->data + within, chunk);
+        done += chunk;
+    }
+    return done;
+}
+
+uint32_t prefetch_next(struct prefetch_stream *stream, uint32_t *start)
+{
+    if (stream->blocks == 0)
+    {
+        return 0;
+    }
+    if (stream->windows == NULL)
+    {
+        stream->windows = calloc(PREFETCH_WINDOWS, sizeof(struct prefetch_window));
+        uint8_t *data = malloc((size_t)PREFETCH_WINDOWS * PREFETCH_MAX_BLOCKS * BLOCK_SIZE);
+        if (stream->windows == NULL || data == NULL)
+        {
+            free(stream->windows);
+            free(data);
+            stream->windows = NULL;
+            return 0;
+        }
+        for (int i = 0; i < PREFETCH_WINDOWS; i++)
+        {
+            stream->windows[i].data = data + (size_t)i * PREFETCH_MAX_BLOCKS * BLOCK_SIZE;
+        }
+    }
+
+    if (free_window(stream) == NULL)
+    {
+        return 0;
+    }
+
+    uint32_t next = stream->next;
+    for (struct prefetch_window *window = find_window(stream, next); window != NULL; window = find_window(stream, next))
+    {
+        next = window->start + window->count;
+    }
+    *start = next;
+    return stream->blocks;
+}
+
+void prefetch_start(struct prefetch_stream *stream, uint32_t start, uint32_t physical, uint32_t count)
+{
+    struct prefetch_window *window = free_window(stream);
+    if (window == NULL || count == 0)
+    {
+        return;
+    }
+
+    aio_wait(&window->request);
+    window->start = start;
+    window->count = count;
+    window->verified = 0;
+    window->request.op = AIO_READ;
+    window->request.start = physical;
+    window->request.count = count;
+    window->request.buf = window->data;
+    if (aio_submit(&window->request) == -1)
+    {
+        window->count = 0;
+        return;
+    }
+    aio_flush();
+}
+
+void prefetch_drop(struct prefetch_stream *stream, int release)
+{
+    if (stream->windows == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < PREFETCH_WINDOWS; i++)
+    {
+        aio_wait(&stream->windows[i].request);
+        stream->windows[i].count = 0;
+    }
+
+    if (release)
+    {
+        free(stream->windows[0].data);
+        free(stream->windows);
+        stream->windows = NULL;
+    }
+}
@@ -0,0 +1,255 @@
+/**
+ * @file test_aio.c
+ * @author agent (agent@local)
+ * @brief Tests the asynchronous I/O engine with each of its backends: requests read and written directly, callbacks,
+ * invalid requests, and the file system running on top of it.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "aio.h"
+#include "test.h"
+
+#define IMAGE "build/test_aio.img"
+#define NBLOCKS 4096
+#define RUNS 64
+#define RUN_BLOCKS 8
+#define FILE_SIZE (300 * BLOCK_SIZE)
+
+static char data[RUNS][RUN_BLOCKS * BLOCK_SIZE];
+static char back[RUNS][RUN_BLOCKS * BLOCK_SIZE];
+static char block[BLOCK_SIZE];
+static char file[FILE_SIZE];
+static char out[FILE_SIZE];
+
+static struct aio_request requests[RUNS];
+static int callbacks;
+static int chained;
+
+/**
+ * Fills a buffer with the contents expected in a block of the disk, tagged with a generation.
+ */
+static void fill_block(char *buf, int blocknum, int generation)
+{
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        buf[i] = (char)(blocknum * 3 + i + generation * 11);
+    }
+}
+
+/**
+ * Sets up a request over a run of blocks.
+ */
+static void set_request(struct aio_request *request, int op, uint32_t start, int count, void *buf)
+{
+    memset(request, 0, sizeof(struct aio_request));
+    request->op = op;
+    request->start = start;
+    request->count = count;
+    request->buf = buf;
+}
+
+/**
+ * Counts the completions of the requests it is given to.
+ */
+static void count_callback(struct aio_request *request)
+{
+    CHECK(request->state == AIO_DONE);
+    CHECK(request->result == request->count * BLOCK_SIZE);
+    callbacks++;
+}
+
+/**
+ * Submits the next request of a chain from the completion of the previous one.
+ */
+static void chain_callback(struct aio_request *request)
+{
+    CHECK(request->result == BLOCK_SIZE);
+    chained++;
+    if (chained < RUNS)
+    {
+        struct aio_request *next = &requests[chained];
+        set_request(next, AIO_READ, request->start + 1, 1, back[chained]);
+        next->callback = chain_callback;
+        CHECK(aio_submit(next) == 0);
+    }
+}
+
+/**
+ * Writes and reads runs of blocks with the engine started with the given backend and queue depth.
+ */
+static void test_requests(int flags, int requested, int depth)
+{
+    int backend = aio_init(requested, depth);
+    CHECK(backend == aio_backend());
+    if (flags & DISK_MMAP)
+        CHECK(backend == AIO_BACKEND_SYNC);
+    else if (requested == AIO_BACKEND_THREADS || requested == AIO_BACKEND_SYNC)
+        CHECK(backend == requested);
+    else
+        CHECK(backend == AIO_BACKEND_IO_URING || backend == AIO_BACKEND_THREADS);
+
+    // Writes of runs, every other one from separate block buffers, complete with their callbacks.
+    int generation = requested * 10 + depth;
+    void *bufs[RUNS][RUN_BLOCKS];
+    callbacks = 0;
+    for (int i = 0; i < RUNS; i++)
+    {
+        for (int j = 0; j < RUN_BLOCKS; j++)
+        {
+            fill_block(data[i] + j * BLOCK_SIZE, i * RUN_BLOCKS + j, generation);
+            bufs[i][j] = data[i] + j * BLOCK_SIZE;
+        }
+        set_request(&requests[i], AIO_WRITE, i * RUN_BLOCKS, RUN_BLOCKS, data[i]);
+        if (i % 2 == 1)
+        {
+            requests[i].buf = NULL;
+            requests[i].bufs = bufs[i];
+        }
+        requests[i].callback = count_callback;
+        CHECK(aio_submit(&requests[i]) == 0);
+    }
+    CHECK(aio_drain() == 0);
+    CHECK(callbacks == RUNS);
+    for (int i = 0; i < RUNS; i++)
+    {
+        CHECK(requests[i].state == AIO_DONE);
+        CHECK(aio_wait(&requests[i]) == RUN_BLOCKS * BLOCK_SIZE);
+    }
+    for (int i = 0; i < RUNS * RUN_BLOCKS; i += 37)
+    {
+        CHECK(disk_read(i, block) != -1);
+        CHECK(memcmp(block, data[i / RUN_BLOCKS] + (i % RUN_BLOCKS) * BLOCK_SIZE, BLOCK_SIZE) == 0);
+    }
+
+    // Reads used as futures see the data, in whatever order they are waited for.
+    memset(back, 0, sizeof(back));
+    for (int i = 0; i < RUNS; i++)
+    {
+        set_request(&requests[i], AIO_READ, i * RUN_BLOCKS, RUN_BLOCKS, back[i]);
+        CHECK(aio_submit(&requests[i]) == 0);
+    }
+    aio_flush();
+    for (int i = RUNS - 1; i >= 0; i--)
+    {
+        CHECK(aio_wait(&requests[i]) == RUN_BLOCKS * BLOCK_SIZE);
+        CHECK(memcmp(back[i], data[i], RUN_BLOCKS * BLOCK_SIZE) == 0);
+    }
+    CHECK(aio_complete(0) >= 0);
+
+    // A callback may submit the next request.
+    memset(back, 0, sizeof(back));
+    chained = 0;
+    set_request(&requests[0], AIO_READ, 0, 1, back[0]);
+    requests[0].callback = chain_callback;
+    CHECK(aio_submit(&requests[0]) == 0);
+    while (chained < RUNS)
+    {
+        aio_complete(1);
+    }
+    CHECK(aio_drain() == 0);
+    for (int i = 0; i < RUNS; i++)
+    {
+        CHECK(memcmp(back[i], data[i / RUN_BLOCKS] + (i % RUN_BLOCKS) * BLOCK_SIZE, BLOCK_SIZE) == 0);
+    }
+
+    // Requests that do not fit the disk are refused, and one never submitted has no result.
+    struct aio_request invalid;
+    set_request(&invalid, AIO_READ, NBLOCKS, 1, block);
+    CHECK(aio_submit(&invalid) == -1);
+    set_request(&invalid, AIO_READ, NBLOCKS - 1, 2, block);
+    CHECK(aio_submit(&invalid) == -1);
+    set_request(&invalid, AIO_WRITE, 0, 0, block);
+    CHECK(aio_submit(&invalid) == -1);
+    set_request(&invalid, AIO_READ, 0, 1, NULL);
+    CHECK(aio_submit(&invalid) == -1);
+    set_request(&invalid, 7, 0, 1, block);
+    CHECK(aio_submit(&invalid) == -1);
+    CHECK(aio_wait(&invalid) == -1);
+}
+
+/**
+ * Writes and reads files with the engine started with the given backend under the file system.
+ */
+static void test_file_system(int flags, int requested)
+{
+    CHECK(disk_open(IMAGE, NBLOCKS, flags) != -1);
+    CHECK(aio_init(requested, 8) != -1);
+    CHECK(fs_format(0) != -1);
+    CHECK(fs_mount() != -1);
+    int free_blocks = stat_value("Free Blocks");
+
+    for (int i = 0; i < FILE_SIZE; i++)
+    {
+        file[i] = (char)(i * 5 + requested);
+    }
+    CHECK(fs_create("/d", 1) != -1);
+    CHECK(fs_write("/d/a", file, FILE_SIZE, 0) == FILE_SIZE);
+    int fd = fs_open("/d/b", FS_O_CREATE);
+    CHECK(fd != -1);
+    for (int offset = 0; offset < FILE_SIZE; offset += 3 * BLOCK_SIZE)
+    {
+        CHECK(fs_pwrite(fd, file + offset, 3 * BLOCK_SIZE, offset) == 3 * BLOCK_SIZE);
+    }
+    CHECK(fs_close(fd) != -1);
+
+    // Read back with the engine still in place, then after the disk was opened again.
+    fd = fs_open("/d/a", 0);
+    CHECK(fd != -1);
+    for (int offset = 0; offset < FILE_SIZE; offset += BLOCK_SIZE)
+    {
+        CHECK(fs_pread(fd, out + offset, BLOCK_SIZE, offset) == BLOCK_SIZE);
+    }
+    CHECK(fs_close(fd) != -1);
+    CHECK(memcmp(out, file, FILE_SIZE) == 0);
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(aio_init(requested, 8) != -1);
+    CHECK(fs_read("/d/b", out, FILE_SIZE, 0) == FILE_SIZE);
+    CHECK(memcmp(out, file, FILE_SIZE) == 0);
+
+    CHECK(fs_remove("/d/a") != -1);
+    CHECK(fs_remove("/d/b") != -1);
+    CHECK(fs_remove("/d") != -1);
+    CHECK(stat_value("Free Blocks") == free_blocks);
+    fs_unmount();
+    disk_close();
+    remove(IMAGE);
+}
+
+int main()
+{
+    int backends[] = {0, DISK_MMAP};
+    int requested[] = {AIO_BACKEND_AUTO, AIO_BACKEND_IO_URING, AIO_BACKEND_THREADS, AIO_BACKEND_SYNC};
+    int depths[] = {1, 4, AIO_DEFAULT_QUEUE_DEPTH};
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    {
+        // Settings out of range are refused.
+        remove(IMAGE);
+        CHECK(disk_open(IMAGE, NBLOCKS, backends[i]) != -1);
+        CHECK(aio_init(-1, 8) == -1);
+        CHECK(aio_init(AIO_BACKEND_SYNC + 1, 8) == -1);
+        CHECK(aio_init(AIO_BACKEND_AUTO, 0) == -1);
+        CHECK(aio_init(AIO_BACKEND_AUTO, AIO_MAX_QUEUE_DEPTH + 1) == -1);
+
+        for (size_t j = 0; j < sizeof(requested) / sizeof(requested[0]); j++)
+        {
+            for (size_t k = 0; k < sizeof(depths) / sizeof(depths[0]); k++)
+            {
+                test_requests(backends[i], requested[j], depths[k]);
+            }
+        }
+        disk_close();
+        remove(IMAGE);
+
+        for (size_t j = 0; j < sizeof(requested) / sizeof(requested[0]); j++)
+        {
+            test_file_system(backends[i], requested[j]);
+        }
+    }
+    printf("PASSED\n");
+    return 0;
+}
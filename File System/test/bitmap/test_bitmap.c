@@ -0,0 +1,97 @@
+/**
+ * @file test_bitmap.c
+ * @author agent (agent@local)
+ * @brief Tests that the block and inode bitmaps hand out every block and inode of the disk and keep count of them.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_bitmap.img"
+#define NBLOCKS 8192
+#define FILES 500
+#define CHUNK (64 * BLOCK_SIZE)
+
+static char data[CHUNK];
+
+/**
+ * Creates the files numbered first, first + step, ... below FILES.
+ */
+static void create_files(int first, int step)
+{
+    char path[32];
+    for (int i = first; i < FILES; i += step)
+    {
+        sprintf(path, "/d/f%d", i);
+        CHECK(fs_create(path, 0) != -1);
+    }
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_bitmap(int flags)
+{
+    char path[32];
+    int free_inodes = stat_value("Free Inodes");
+    CHECK(free_inodes > FILES);
+
+    // Many more inodes than one block of the old flag array held. The files are empty, only their directory grows.
+    CHECK(fs_create("/d", 1) != -1);
+    create_files(0, 1);
+    CHECK(stat_value("Free Inodes") == free_inodes - FILES - 1);
+    int free_blocks = stat_value("Free Blocks");
+    CHECK(free_blocks > NBLOCKS / 2);
+
+    // Every data block of the disk can be allocated, and then no more.
+    CHECK(fs_create("/fill", 0) != -1);
+    off_t size = 0;
+    while (stat_value("Free Blocks") > 0)
+    {
+        if (fs_write("/fill", data, CHUNK, size) != CHUNK)
+            break;
+        size += CHUNK;
+    }
+    CHECK(size > (off_t)free_blocks * BLOCK_SIZE / 2);
+    while (fs_write("/fill", data, BLOCK_SIZE, size) == BLOCK_SIZE)
+    {
+        size += BLOCK_SIZE;
+    }
+    CHECK(stat_value("Free Blocks") == 0);
+    CHECK(fs_write("/d/f0", data, BLOCK_SIZE, 0) == -1);
+
+    // The counts are rebuilt from the bitmaps on the disk.
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(stat_value("Free Blocks") == 0);
+    CHECK(stat_value("Free Inodes") == free_inodes - FILES - 2);
+    CHECK(fs_remove("/fill") != -1);
+    CHECK(stat_value("Free Blocks") == free_blocks);
+
+    // Freed inodes are found again, wherever they are in the bitmap.
+    for (int i = 0; i < FILES; i += 3)
+    {
+        sprintf(path, "/d/f%d", i);
+        CHECK(fs_remove(path) != -1);
+    }
+    CHECK(stat_value("Free Inodes") == free_inodes - FILES - 1 + (FILES + 2) / 3);
+    create_files(0, 3);
+    CHECK(stat_value("Free Inodes") == free_inodes - FILES - 1);
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(stat_value("Free Inodes") == free_inodes - FILES - 1);
+
+    CHECK(fs_remove("/d") != -1);
+    CHECK(stat_value("Free Inodes") == free_inodes);
+}
+
+int main()
+{
+    memset(data, 'b', sizeof(data));
+    run_on_backends(IMAGE, NBLOCKS, 0, test_bitmap);
+
+    printf("PASSED\n");
+    return 0;
+}
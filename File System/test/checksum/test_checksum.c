@@ -0,0 +1,161 @@
+/**
+ * @file test_checksum.c
+ * @author agent (agent@local)
+ * @brief Tests that blocks changed behind the file system's back are caught, and that a crash does not look like one.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "test.h"
+
+#define IMAGE "build/test_checksum.img"
+#define NBLOCKS 8192
+#define SIZE (256 * BLOCK_SIZE)
+
+static unsigned char data[SIZE];
+static unsigned char out[SIZE];
+
+/**
+ * Returns the first block of the disk image holding the given contents, or -1 if none does.
+ */
+static long find_block(const unsigned char *contents)
+{
+    unsigned char block[BLOCK_SIZE];
+    int fd = open(IMAGE, O_RDONLY);
+    CHECK(fd != -1);
+    for (long i = 0; pread(fd, block, BLOCK_SIZE, i * BLOCK_SIZE) == BLOCK_SIZE; i++)
+    {
+        if (memcmp(block, contents, BLOCK_SIZE) == 0)
+        {
+            close(fd);
+            return i;
+        }
+    }
+    close(fd);
+    return -1;
+}
+
+/**
+ * Flips a bit of a block of the disk image.
+ */
+static void corrupt_block(long blocknum)
+{
+    unsigned char byte;
+    int fd = open(IMAGE, O_RDWR);
+    CHECK(fd != -1);
+    CHECK(pread(fd, &byte, 1, blocknum * BLOCK_SIZE + 123) == 1);
+    byte ^= 0x40;
+    CHECK(pwrite(fd, &byte, 1, blocknum * BLOCK_SIZE + 123) == 1);
+    close(fd);
+}
+
+/**
+ * Checks that a corrupted block fails its read, leaves the rest of the file readable and is healed by a rewrite.
+ */
+static void test_corruption(int flags)
+{
+    CHECK(disk_open(IMAGE, NBLOCKS, flags) != -1);
+    CHECK(fs_format(FS_FORMAT_CHECKSUMS) != -1);
+    CHECK(fs_mount() != -1);
+    CHECK(fs_write("/a", data, SIZE, 0) == SIZE);
+    CHECK(fs_write("/b", data + BLOCK_SIZE, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE);
+    fs_unmount();
+    disk_close();
+
+    long blocknum = find_block(data + 50 * BLOCK_SIZE);
+    CHECK(blocknum != -1);
+    corrupt_block(blocknum);
+
+    CHECK(disk_open(IMAGE, NBLOCKS, flags) != -1);
+    CHECK(fs_mount() != -1);
+    CHECK(fs_read("/a", out, SIZE, 0) == -1);
+    CHECK(stat_value("Checksum Failures") > 0);
+    CHECK(fs_read("/a", out, 40 * BLOCK_SIZE, 0) == 40 * BLOCK_SIZE);
+    CHECK(memcmp(out, data, 40 * BLOCK_SIZE) == 0);
+    CHECK(fs_read("/b", out, 2 * BLOCK_SIZE, 0) == 2 * BLOCK_SIZE);
+
+    CHECK(fs_write("/a", data + 50 * BLOCK_SIZE, BLOCK_SIZE, 50 * BLOCK_SIZE) == BLOCK_SIZE);
+    CHECK(fs_read("/a", out, SIZE, 0) == SIZE);
+    CHECK(memcmp(out, data, SIZE) == 0);
+    fs_unmount();
+    disk_close();
+}
+
+/**
+ * Checks that a process killed while it creates, writes and removes files on a mapped disk, where blocks are changed
+ * in place, leaves no block at odds with its checksum.
+ */
+static void test_crash(int delay)
+{
+    char path[32];
+    CHECK(disk_open(IMAGE, NBLOCKS, DISK_MMAP) != -1);
+    CHECK(fs_format(FS_FORMAT_CHECKSUMS) != -1);
+    disk_close();
+
+    fflush(stdout);
+    pid_t child = fork();
+    CHECK(child != -1);
+    if (child == 0)
+    {
+        CHECK(disk_open(IMAGE, NBLOCKS, DISK_MMAP) != -1);
+        CHECK(fs_mount() != -1);
+        for (int i = 0;; i++)
+        {
+            sprintf(path, "/f%d", i % 2000);
+            fs_create(path, 0);
+            fs_write(path, data, 3000, 0);
+            if (i % 50 == 49)
+            {
+                for (int j = i - 49; j < i - 25; j++)
+                {
+                    sprintf(path, "/f%d", j % 2000);
+                    fs_remove(path);
+                }
+            }
+        }
+    }
+    usleep(delay * 1000);
+    CHECK(kill(child, SIGKILL) == 0);
+    CHECK(waitpid(child, NULL, 0) == child);
+
+    CHECK(disk_open(IMAGE, NBLOCKS, DISK_MMAP) != -1);
+    CHECK(fs_mount() != -1);
+    for (int i = 0; i < 2000; i++)
+    {
+        sprintf(path, "/f%d", i);
+        fs_read(path, out, 3000, 0);
+    }
+    CHECK(stat_value("Checksum Failures") == 0);
+    fs_unmount();
+    disk_close();
+}
+
+int main()
+{
+    srand(3);
+    for (size_t i = 0; i < SIZE; i++)
+    {
+        data[i] = rand();
+    }
+
+    remove(IMAGE);
+    test_corruption(0);
+    remove(IMAGE);
+    test_corruption(DISK_MMAP);
+    for (int delay = 10; delay <= 160; delay *= 2)
+    {
+        remove(IMAGE);
+        test_crash(delay);
+    }
+    remove(IMAGE);
+
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,201 @@
+/**
+ * @file test_clone.c
+ * @author agent (agent@local)
+ * @brief Tests that clones and snapshots share their blocks, copy them on write and give them all back when removed.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_clone.img"
+#define NBLOCKS 16384
+#define MAX_SIZE (400 * BLOCK_SIZE)
+#define FILES 5
+
+/**
+ * @brief A file of the test and the copy of its contents kept in memory.
+ *
+ * @param name The path of the file below its tree, e.g. "/a" for "/src/a".
+ * @param flags The fs_open flags the file is created with.
+ * @param data The contents of the file.
+ * @param size The size of the file.
+ */
+struct file
+{
+    const char *name;
+    int flags;
+    unsigned char data[MAX_SIZE];
+    size_t size;
+};
+
+static struct file files[FILES] = {
+    {"/a", 0, {0}, 0}, {"/b", FS_O_COMPRESS, {0}, 0}, {"/c", FS_O_DEDUP, {0}, 0}, {"/i", 0, {0}, 0}, {"/sub/d", 0, {0}, 0}};
+static struct file snapshot[FILES];
+static struct file branch[FILES];
+static struct file clone;
+static unsigned char buf[MAX_SIZE];
+static unsigned char out[MAX_SIZE];
+
+/**
+ * Writes bytes to a file and to its copy in memory. The bytes suit the file: compressible for the compressed one,
+ * repeating blocks for the deduplicated one.
+ */
+static void put(struct file *file, const char *root, size_t count, size_t offset, int seed)
+{
+    char path[64];
+    sprintf(path, "%s%s", root, file->name);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (file->flags & FS_O_COMPRESS)
+            buf[i] = (unsigned char)((i / 64 + seed) % 7);
+        else if (file->flags & FS_O_DEDUP)
+            buf[i] = (unsigned char)(((offset + i) / BLOCK_SIZE % 3) * 17 + seed % 2);
+        else
+            buf[i] = (unsigned char)(rand() ^ seed);
+    }
+    CHECK(fs_write(path, buf, count, offset) == (int)count);
+    memcpy(file->data + offset, buf, count);
+    if (offset + count > file->size)
+    {
+        file->size = offset + count;
+    }
+}
+
+/**
+ * Checks a file against its copy in memory.
+ */
+static void check_file(const struct file *file, const char *root)
+{
+    char path[64];
+    sprintf(path, "%s%s", root, file->name);
+    CHECK(fs_read(path, out, MAX_SIZE, 0) == (int)file->size);
+    CHECK(memcmp(out, file->data, file->size) == 0);
+}
+
+/**
+ * Checks that a file clone takes no data blocks until one of the two is written to.
+ */
+static void test_file_clone()
+{
+    int free_blocks = stat_value("Free Blocks");
+    int shared = stat_value("Shared Blocks");
+    int blocks = (files[0].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    CHECK(fs_clone("/src/a", "/a2") != -1);
+    CHECK(stat_value("Free Blocks") == free_blocks);
+    CHECK(stat_value("Shared Blocks") == shared + blocks);
+
+    clone = files[0];
+    clone.name = "/a2";
+    check_file(&clone, "");
+
+    // Writing one block of the clone copies that block only, the source keeps its own.
+    put(&clone, "", BLOCK_SIZE, 10 * BLOCK_SIZE, 1);
+    CHECK(stat_value("Free Blocks") == free_blocks - 1);
+    CHECK(stat_value("Shared Blocks") == shared + blocks - 1);
+    check_file(&files[0], "/src");
+    check_file(&clone, "");
+
+    for (int i = 0; i < 50; i++)
+    {
+        size_t count = rand() % (5 * BLOCK_SIZE) + 1;
+        size_t offset = rand() % (310 * BLOCK_SIZE);
+        put((i % 2) ? &clone : &files[0], (i % 2) ? "" : "/src", count, offset, i);
+    }
+    check_file(&files[0], "/src");
+    check_file(&clone, "");
+}
+
+/**
+ * Checks that a snapshot keeps the tree as it was, cannot be changed and takes only blocks for its directories.
+ */
+static void test_snapshot()
+{
+    int free_blocks = stat_value("Free Blocks");
+    CHECK(fs_snapshot("/src", "/src/snap") != -1);
+    CHECK(free_blocks - stat_value("Free Blocks") <= 4);
+    for (int k = 0; k < FILES; k++)
+    {
+        snapshot[k] = files[k];
+        check_file(&snapshot[k], "/src/snap");
+    }
+    CHECK(fs_read("/src/snap/snap/a", out, 10, 0) == -1);
+
+    CHECK(fs_write("/src/snap/a", out, 10, 0) == -1);
+    CHECK(fs_create("/src/snap/x", 0) == -1);
+    CHECK(fs_remove("/src/snap/a") == -1);
+    CHECK(fs_create("/src/snap/sub/y/z", 0) == -1);
+    CHECK(fs_clone("/src/a", "/src/snap/q") == -1);
+
+    for (int k = 0; k < FILES; k++)
+    {
+        put(&files[k], "/src", 3 * BLOCK_SIZE + 5, BLOCK_SIZE * (k + 1) - 3, 50 + k);
+    }
+    for (int k = 0; k < FILES; k++)
+    {
+        check_file(&snapshot[k], "/src/snap");
+        check_file(&files[k], "/src");
+    }
+
+    // A clone of the snapshot is a writable branch of it.
+    CHECK(fs_clone("/src/snap", "/branch/x") != -1);
+    for (int k = 0; k < FILES; k++)
+    {
+        branch[k] = snapshot[k];
+        put(&branch[k], "/branch/x", 9000, 2000 * k, 90 + k);
+    }
+    CHECK(fs_create("/branch/x/new", 0) != -1);
+    CHECK(fs_read("/src/snap/new", out, 1, 0) == -1);
+}
+
+/**
+ * Runs the tests on a disk opened with the given flags.
+ */
+static void test_clone(int flags)
+{
+    for (int k = 0; k < FILES; k++)
+    {
+        char path[64];
+        sprintf(path, "/src%s", files[k].name);
+        int fd = fs_open(path, FS_O_CREATE | files[k].flags);
+        CHECK(fd != -1);
+        CHECK(fs_close(fd) != -1);
+        memset(files[k].data, 0, MAX_SIZE);
+        files[k].size = 0;
+    }
+    put(&files[0], "/src", 300 * BLOCK_SIZE + 100, 0, 1);
+    put(&files[1], "/src", 100 * BLOCK_SIZE + 7, 0, 2);
+    put(&files[2], "/src", 60 * BLOCK_SIZE, 0, 3);
+    put(&files[3], "/src", 30, 0, 4);
+    put(&files[4], "/src", 20 * BLOCK_SIZE, 5 * BLOCK_SIZE, 5);
+
+    test_file_clone();
+    test_snapshot();
+
+    remount(IMAGE, NBLOCKS, flags);
+    for (int k = 0; k < FILES; k++)
+    {
+        check_file(&snapshot[k], "/src/snap");
+        check_file(&branch[k], "/branch/x");
+        check_file(&files[k], "/src");
+    }
+    check_file(&clone, "");
+
+    // Whatever order they go in, removing the trees gives back every block and leaves nothing shared.
+    CHECK(fs_remove("/src/snap") != -1);
+    CHECK(fs_remove("/a2") != -1);
+    CHECK(fs_remove("/branch") != -1);
+    CHECK(fs_remove("/src") != -1);
+}
+
+int main()
+{
+    srand(7);
+    run_on_backends(IMAGE, NBLOCKS, 0, test_clone);
+
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,180 @@
+/**
+ * @file test_compress.c
+ * @author agent (agent@local)
+ * @brief Tests that compressed files read back what was written and take less space when their data compresses.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_compress.img"
+#define NBLOCKS 8192
+#define MAX_SIZE (1024 * 1024)
+#define DESCRIPTORS 4
+
+static unsigned char model[2][MAX_SIZE];
+static size_t sizes[2];
+static unsigned char buf[300000];
+static unsigned char out[MAX_SIZE + BLOCK_SIZE];
+
+/**
+ * Fills a buffer with random bytes, repeated text or mostly one byte, so clusters compress to different sizes.
+ */
+static void fill(unsigned char *data, size_t count)
+{
+    int kind = rand() % 3;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (kind == 0)
+            data[i] = rand();
+        else if (kind == 1)
+            data[i] = "log line: request ok 200\n"[i % 25];
+        else
+            data[i] = (rand() % 16) ? 'x' : rand();
+    }
+}
+
+/**
+ * Checks that text compresses, that a rewritten cluster and a hole read back right and that incompressible data fits.
+ */
+static void test_space(int flags)
+{
+    int base = stat_value("Free Blocks");
+    for (size_t i = 0; i < MAX_SIZE; i++)
+    {
+        model[0][i] = "2023-11-14 12:00:01 INFO request served in 3ms\n"[i % 47];
+    }
+    int fd = fs_open("/log", FS_O_CREATE | FS_O_COMPRESS);
+    CHECK(fd != -1);
+    CHECK(fs_pwrite(fd, model[0], MAX_SIZE, 0) == MAX_SIZE);
+    CHECK(fs_close(fd) != -1);
+    // Every cluster of the text fits in one block, plus a little for the block map.
+    int used = base - stat_value("Free Blocks");
+    CHECK(used >= MAX_SIZE / COMPRESS_CLUSTER_SIZE && used <= MAX_SIZE / COMPRESS_CLUSTER_SIZE + 2);
+
+    // Part of a cluster in the middle of the file is rewritten, and a write past the end leaves a hole.
+    fd = fs_open("/log", 0);
+    CHECK(fd != -1);
+    memset(model[0] + 5000, '#', 3000);
+    CHECK(fs_pwrite(fd, model[0] + 5000, 3000, 5000) == 3000);
+    CHECK(fs_pwrite(fd, "end", 3, MAX_SIZE + 100) == 3);
+    CHECK(fs_close(fd) != -1);
+
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(fs_read("/log", out, sizeof(out), 0) == MAX_SIZE + 103);
+    CHECK(memcmp(out, model[0], MAX_SIZE) == 0);
+    for (int i = 0; i < 100; i++)
+    {
+        CHECK(out[MAX_SIZE + i] == 0);
+    }
+    CHECK(memcmp(out + MAX_SIZE + 100, "end", 3) == 0);
+    CHECK(fs_remove("/log") != -1);
+    CHECK(stat_value("Free Blocks") == base);
+
+    // Clusters that do not compress are stored as they are.
+    for (size_t i = 0; i < MAX_SIZE; i++)
+    {
+        model[1][i] = rand();
+    }
+    fd = fs_open("/random", FS_O_CREATE | FS_O_COMPRESS);
+    CHECK(fd != -1);
+    CHECK(fs_pwrite(fd, model[1], MAX_SIZE, 0) == MAX_SIZE);
+    CHECK(fs_close(fd) != -1);
+    used = base - stat_value("Free Blocks");
+    CHECK(used >= MAX_SIZE / BLOCK_SIZE && used <= MAX_SIZE / BLOCK_SIZE + 8);
+    CHECK(fs_read("/random", out, sizeof(out), 0) == MAX_SIZE);
+    CHECK(memcmp(out, model[1], MAX_SIZE) == 0);
+    CHECK(fs_remove("/random") != -1);
+    CHECK(stat_value("Free Blocks") == base);
+}
+
+/**
+ * Interleaves reads and writes of two compressed files through two descriptors each, against a copy kept in memory.
+ */
+static void test_interleaved(int flags)
+{
+    int fds[DESCRIPTORS];
+    off_t positions[DESCRIPTORS] = {0};
+    fds[0] = fs_open("/a", FS_O_CREATE | FS_O_COMPRESS);
+    fds[1] = fs_open("/b", FS_O_CREATE | FS_O_COMPRESS);
+    fds[2] = fs_open("/a", 0);
+    fds[3] = fs_open("/b", 0);
+    for (int d = 0; d < DESCRIPTORS; d++)
+    {
+        CHECK(fds[d] != -1);
+    }
+    memset(model, 0, sizeof(model));
+    memset(sizes, 0, sizeof(sizes));
+
+    for (int step = 0; step < 6000; step++)
+    {
+        int d = rand() % DESCRIPTORS;
+        int f = d % 2;
+        size_t count = (rand() % 20 == 0) ? (size_t)rand() % sizeof(buf) : (size_t)rand() % 9000;
+        int choice = rand() % 100;
+        if (choice < 5)
+        {
+            positions[d] = rand() % (sizes[f] + 20000);
+        }
+        if (positions[d] + count > MAX_SIZE)
+        {
+            positions[d] = 0;
+        }
+
+        if (choice < 15)
+        {
+            size_t expected = 0;
+            if ((size_t)positions[d] < sizes[f])
+            {
+                expected = (positions[d] + count > sizes[f]) ? sizes[f] - positions[d] : count;
+            }
+            CHECK(fs_pread(fds[d], out, count, positions[d]) == (int)expected);
+            CHECK(memcmp(out, model[f] + positions[d], expected) == 0);
+            continue;
+        }
+
+        fill(buf, count);
+        CHECK(fs_pwrite(fds[d], buf, count, positions[d]) == (int)count);
+        memcpy(model[f] + positions[d], buf, count);
+        if (positions[d] + count > sizes[f])
+        {
+            sizes[f] = positions[d] + count;
+        }
+        positions[d] += count;
+    }
+    for (int d = 0; d < DESCRIPTORS; d++)
+    {
+        CHECK(fs_close(fds[d]) != -1);
+    }
+
+    remount(IMAGE, NBLOCKS, flags);
+    for (int f = 0; f < 2; f++)
+    {
+        CHECK(fs_read(f ? "/b" : "/a", out, MAX_SIZE, 0) == (int)sizes[f]);
+        CHECK(memcmp(out, model[f], sizes[f]) == 0);
+    }
+    CHECK(fs_remove("/a") != -1);
+    CHECK(fs_remove("/b") != -1);
+}
+
+/**
+ * Runs the tests on a disk opened with the given flags.
+ */
+static void test_compress(int flags)
+{
+    test_space(flags);
+    test_interleaved(flags);
+}
+
+int main()
+{
+    srand(11);
+    run_on_backends(IMAGE, NBLOCKS, 0, test_compress);
+
+    printf("PASSED\n");
+    return 0;
+}
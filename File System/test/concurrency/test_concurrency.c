@@ -0,0 +1,211 @@
+/**
+ * @file test_concurrency.c
+ * @author agent (agent@local)
+ * @brief Tests the file system used by several threads at once: files of their own, more of them than the inode cache
+ * holds, and one file written and read through a descriptor per thread.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <pthread.h>
+
+#include "test.h"
+
+#define IMAGE "build/test_concurrency.img"
+#define NBLOCKS 16384
+#define THREADS 8
+#define FILES 40
+#define FILE_SIZE 6000
+#define ROUNDS 3
+#define SHARED_BLOCKS 32
+
+/**
+ * Fills a buffer with the contents expected in a file of a thread in a round.
+ */
+static void fill_file(char *buf, long thread, int file, int round)
+{
+    for (int i = 0; i < FILE_SIZE; i++)
+    {
+        buf[i] = (char)(thread * 31 + file * 7 + round + i);
+    }
+}
+
+/**
+ * Fills a buffer with the contents expected in a block of the shared file.
+ */
+static void fill_shared(char *buf, int blocknum)
+{
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        buf[i] = (char)(blocknum * 13 + i);
+    }
+}
+
+/**
+ * Creates the files of a thread in a directory of its own and writes them over a few rounds, by path and through
+ * descriptors, reading each one back after it is written.
+ */
+static void *write_files(void *arg)
+{
+    long thread = (long)arg;
+    char path[32];
+    char buf[FILE_SIZE];
+    char out[FILE_SIZE];
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        for (int i = 0; i < FILES; i++)
+        {
+            sprintf(path, "/t%ld/f%d", thread, i);
+            fill_file(buf, thread, i, round);
+            if (round == 0)
+                CHECK(fs_create(path, 0) != -1);
+            if (round == 1)
+            {
+                int fd = fs_open(path, 0);
+                CHECK(fd != -1);
+                CHECK(fs_pwrite(fd, buf, FILE_SIZE, 0) == FILE_SIZE);
+                CHECK(fs_pread(fd, out, FILE_SIZE, 0) == FILE_SIZE);
+                CHECK(fs_close(fd) != -1);
+            }
+            else
+            {
+                CHECK(fs_write(path, buf, FILE_SIZE, 0) == FILE_SIZE);
+                CHECK(fs_read(path, out, FILE_SIZE, 0) == FILE_SIZE);
+            }
+            CHECK(memcmp(out, buf, FILE_SIZE) == 0);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Writes the blocks of the shared file that belong to a thread, every THREADS-th one, reading each one back.
+ */
+static void *write_shared(void *arg)
+{
+    long thread = (long)arg;
+    char buf[BLOCK_SIZE];
+    char out[BLOCK_SIZE];
+
+    int fd = fs_open("/shared/file", 0);
+    CHECK(fd != -1);
+    for (int i = (int)thread; i < THREADS * SHARED_BLOCKS; i += THREADS)
+    {
+        fill_shared(buf, i);
+        CHECK(fs_pwrite(fd, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE);
+        CHECK(fs_pread(fd, out, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE);
+        CHECK(memcmp(out, buf, BLOCK_SIZE) == 0);
+    }
+    CHECK(fs_close(fd) != -1);
+    return NULL;
+}
+
+/**
+ * Reads the shared file sequentially through a descriptor of its own and checks every block.
+ */
+static void *read_shared(void *arg)
+{
+    (void)arg;
+    char buf[BLOCK_SIZE];
+    char out[BLOCK_SIZE];
+
+    int fd = fs_open("/shared/file", 0);
+    CHECK(fd != -1);
+    for (int i = 0; i < THREADS * SHARED_BLOCKS; i++)
+    {
+        fill_shared(buf, i);
+        CHECK(fs_pread(fd, out, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE);
+        CHECK(memcmp(out, buf, BLOCK_SIZE) == 0);
+    }
+    CHECK(fs_close(fd) != -1);
+    return NULL;
+}
+
+/**
+ * Removes the files of a thread and its directory.
+ */
+static void *remove_files(void *arg)
+{
+    long thread = (long)arg;
+    char path[32];
+
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/t%ld/f%d", thread, i);
+        CHECK(fs_remove(path) != -1);
+    }
+    sprintf(path, "/t%ld", thread);
+    CHECK(fs_remove(path) != -1);
+    return NULL;
+}
+
+/**
+ * Runs a function on THREADS threads, each given its number, and waits for them.
+ */
+static void run_threads(void *(*function)(void *))
+{
+    pthread_t threads[THREADS];
+    for (long i = 0; i < THREADS; i++)
+    {
+        CHECK(pthread_create(&threads[i], NULL, function, (void *)i) == 0);
+    }
+    for (int i = 0; i < THREADS; i++)
+    {
+        CHECK(pthread_join(threads[i], NULL) == 0);
+    }
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_concurrency(int flags)
+{
+    char path[32];
+    char buf[FILE_SIZE];
+    char out[FILE_SIZE];
+    int free_inodes = stat_value("Free Inodes");
+
+    // Threads working on files of their own, THREADS * FILES of them, far more than the inode cache holds.
+    for (long i = 0; i < THREADS; i++)
+    {
+        sprintf(path, "/t%ld", i);
+        CHECK(fs_create(path, 1) != -1);
+    }
+    run_threads(write_files);
+
+    // Threads writing interleaved blocks of one file, then reading all of it at once.
+    CHECK(fs_create("/shared", 1) != -1);
+    CHECK(fs_create("/shared/file", 0) != -1);
+    run_threads(write_shared);
+    run_threads(read_shared);
+
+    // Everything written is on the disk.
+    remount(IMAGE, NBLOCKS, flags);
+    for (long i = 0; i < THREADS; i++)
+    {
+        for (int j = 0; j < FILES; j++)
+        {
+            sprintf(path, "/t%ld/f%d", i, j);
+            fill_file(buf, i, j, ROUNDS - 1);
+            CHECK(fs_read(path, out, FILE_SIZE, 0) == FILE_SIZE);
+            CHECK(memcmp(out, buf, FILE_SIZE) == 0);
+        }
+    }
+    run_threads(read_shared);
+
+    run_threads(remove_files);
+    CHECK(fs_remove("/shared/file") != -1);
+    CHECK(fs_remove("/shared") != -1);
+    CHECK(stat_value("Free Inodes") == free_inodes);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_concurrency);
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,213 @@
+/**
+ * @file test_dedup.c
+ * @author agent (agent@local)
+ * @brief Tests that deduplicated files share identical blocks, copy them on write and free them with the last user.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_dedup.img"
+#define NBLOCKS 16384
+#define FILES 3
+#define MAX_SIZE (600 * BLOCK_SIZE)
+
+static unsigned char model[FILES][MAX_SIZE];
+static size_t sizes[FILES];
+static unsigned char buf[200 * BLOCK_SIZE];
+static unsigned char out[MAX_SIZE];
+
+/**
+ * Fills a block with contents that only depend on an identifier, so equal identifiers make identical blocks.
+ */
+static void fill_block(unsigned char *block, int id)
+{
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        block[i] = (unsigned char)(id * 31 + i * (id | 1));
+    }
+}
+
+/**
+ * Writes blocks with the given identifiers at the start of a new deduplicated file.
+ */
+static void write_file(char *path, const int *ids, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        fill_block(buf + i * BLOCK_SIZE, ids[i]);
+    }
+    int fd = fs_open(path, FS_O_CREATE | FS_O_DEDUP);
+    CHECK(fd != -1);
+    CHECK(fs_pwrite(fd, buf, count * BLOCK_SIZE, 0) == count * BLOCK_SIZE);
+    CHECK(fs_close(fd) != -1);
+}
+
+/**
+ * Checks the blocks taken and shared as files with identical blocks are written, overwritten and removed.
+ */
+static void test_shares(int flags)
+{
+    int base = stat_value("Free Blocks");
+    int ids[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+
+    write_file("/a", ids, 8);
+    CHECK(base - stat_value("Free Blocks") == 8);
+    CHECK(stat_value("Shared Blocks") == 0);
+
+    // A second file with the same blocks takes none of its own.
+    write_file("/b", ids, 8);
+    CHECK(base - stat_value("Free Blocks") == 8);
+    CHECK(stat_value("Shared Blocks") == 8);
+
+    // Shared Blocks counts the references beyond the first: a block written again later shares the one written first.
+    write_file("/c", ids + 4, 1);
+    CHECK(fs_write("/c", buf, BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    CHECK(base - stat_value("Free Blocks") == 8);
+    CHECK(stat_value("Shared Blocks") == 10);
+
+    // Overwriting a shared block gives the file a copy of its own and leaves the other files alone.
+    fill_block(buf, 30);
+    CHECK(fs_write("/b", buf, BLOCK_SIZE, 2 * BLOCK_SIZE) == BLOCK_SIZE);
+    CHECK(base - stat_value("Free Blocks") == 9);
+    CHECK(stat_value("Shared Blocks") == 9);
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(fs_read("/a", out, sizeof(buf), 0) == 8 * BLOCK_SIZE);
+    for (int i = 0; i < 8; i++)
+    {
+        fill_block(buf, i);
+        CHECK(memcmp(out + i * BLOCK_SIZE, buf, BLOCK_SIZE) == 0);
+    }
+    CHECK(fs_read("/b", out, sizeof(buf), 0) == 8 * BLOCK_SIZE);
+    fill_block(buf, 30);
+    CHECK(memcmp(out + 2 * BLOCK_SIZE, buf, BLOCK_SIZE) == 0);
+
+    // Removing a file frees only the blocks nobody else uses.
+    CHECK(fs_remove("/a") != -1);
+    CHECK(base - stat_value("Free Blocks") == 8);
+    CHECK(stat_value("Shared Blocks") == 2);
+    CHECK(fs_remove("/b") != -1);
+    CHECK(fs_read("/c", out, sizeof(buf), 0) == 2 * BLOCK_SIZE);
+    fill_block(buf, 4);
+    CHECK(memcmp(out, buf, BLOCK_SIZE) == 0 && memcmp(out + BLOCK_SIZE, buf, BLOCK_SIZE) == 0);
+    CHECK(fs_remove("/c") != -1);
+    CHECK(stat_value("Free Blocks") == base);
+    CHECK(stat_value("Shared Blocks") == 0);
+}
+
+/**
+ * Checks every file against its copy in memory.
+ */
+static void check_files()
+{
+    char path[16];
+    for (int f = 0; f < FILES; f++)
+    {
+        sprintf(path, "/f%d", f);
+        CHECK(fs_read(path, out, MAX_SIZE, 0) == (int)sizes[f]);
+        CHECK(memcmp(out, model[f], sizes[f]) == 0);
+    }
+}
+
+/**
+ * Writes blocks drawn from a few contents at random places of several files through two descriptors each, against a
+ * copy kept in memory.
+ */
+static void test_random(int flags)
+{
+    int base = stat_value("Free Blocks");
+    int fds[2 * FILES];
+    char path[16];
+    memset(model, 0, sizeof(model));
+    memset(sizes, 0, sizeof(sizes));
+    for (int f = 0; f < FILES; f++)
+    {
+        sprintf(path, "/f%d", f);
+        fds[f] = fs_open(path, FS_O_CREATE | FS_O_DEDUP);
+        fds[f + FILES] = fs_open(path, 0);
+        CHECK(fds[f] != -1 && fds[f + FILES] != -1);
+    }
+
+    srand(5);
+    for (int step = 0; step < 4000; step++)
+    {
+        int d = rand() % (2 * FILES);
+        int f = d % FILES;
+        size_t blocks = (rand() % 10 == 0) ? (size_t)rand() % 200 : (size_t)rand() % 6;
+        size_t count = blocks * BLOCK_SIZE + ((rand() % 3 == 0) ? (size_t)rand() % BLOCK_SIZE : 0);
+        size_t offset = (rand() % 2) ? (size_t)(rand() % 500) * BLOCK_SIZE : rand() % (sizes[f] + 1);
+        if (offset + count > MAX_SIZE || count > sizeof(buf))
+        {
+            continue;
+        }
+
+        if (rand() % 100 < 15)
+        {
+            size_t expected = 0;
+            if (offset < sizes[f])
+            {
+                expected = (offset + count > sizes[f]) ? sizes[f] - offset : count;
+            }
+            CHECK(fs_pread(fds[d], out, count, offset) == (int)expected);
+            CHECK(memcmp(out, model[f] + offset, expected) == 0);
+            continue;
+        }
+
+        for (size_t b = 0; b * BLOCK_SIZE < count; b++)
+        {
+            unsigned char block[BLOCK_SIZE];
+            fill_block(block, rand() % 12);
+            memcpy(buf + b * BLOCK_SIZE, block, (count - b * BLOCK_SIZE < BLOCK_SIZE) ? count - b * BLOCK_SIZE : BLOCK_SIZE);
+        }
+        CHECK(fs_pwrite(fds[d], buf, count, offset) == (int)count);
+        memcpy(model[f] + offset, buf, count);
+        if (offset + count > sizes[f])
+        {
+            sizes[f] = offset + count;
+        }
+    }
+    for (int d = 0; d < 2 * FILES; d++)
+    {
+        CHECK(fs_close(fds[d]) != -1);
+    }
+    check_files();
+    remount(IMAGE, NBLOCKS, flags);
+    check_files();
+
+    // Only a dozen different whole blocks were ever written, so most of the blocks of the files are shared.
+    int logical = 0;
+    for (int f = 0; f < FILES; f++)
+    {
+        logical += (sizes[f] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    int used = base - stat_value("Free Blocks");
+    CHECK(used < logical / 2);
+    CHECK(stat_value("Shared Blocks") > logical / 2);
+
+    for (int f = 0; f < FILES; f++)
+    {
+        sprintf(path, "/f%d", f);
+        CHECK(fs_remove(path) != -1);
+    }
+}
+
+/**
+ * Runs the tests on a disk opened with the given flags.
+ */
+static void test_dedup(int flags)
+{
+    test_shares(flags);
+    test_random(flags);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_dedup);
+
+    printf("PASSED\n");
+    return 0;
+}
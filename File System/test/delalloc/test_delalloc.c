@@ -0,0 +1,169 @@
+/**
+ * @file test_delalloc.c
+ * @author agent (agent@local)
+ * @brief Tests that data held back by descriptors is seen by every reader and lands on the disk when it is flushed.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_delalloc.img"
+#define NBLOCKS 8192
+#define MAX_SIZE (3 * 1024 * 1024)
+#define DESCRIPTORS 4
+
+static unsigned char model[2][MAX_SIZE];
+static size_t sizes[2];
+static unsigned char buf[70000];
+static unsigned char out[MAX_SIZE];
+
+/**
+ * Returns the size fs_list prints for a file of the root directory, or -1 if it is not listed.
+ */
+static long listed_size(const char *name)
+{
+    // fs_list prints to the standard output, which is sent to a temporary file while it runs.
+    FILE *capture = tmpfile();
+    CHECK(capture != NULL);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(capture), STDOUT_FILENO);
+    fs_list("/");
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    rewind(capture);
+    char line[256];
+    size_t length = strlen(name);
+    long size = -1;
+    while (fgets(line, sizeof(line), capture) != NULL)
+    {
+        if (strncmp(line, name, length) == 0 && line[length] == ' ')
+            size = atol(line + length + 1);
+    }
+    fclose(capture);
+    return size;
+}
+
+/**
+ * Checks that small writes take no blocks until the descriptor is closed, and are read back through another one.
+ */
+static void test_held_back()
+{
+    int base = stat_value("Free Blocks");
+    int writer = fs_open("/held", FS_O_CREATE);
+    int reader = fs_open("/held", 0);
+    CHECK(writer != -1 && reader != -1);
+
+    memset(buf, 'h', 3 * BLOCK_SIZE);
+    for (int i = 0; i < 3 * BLOCK_SIZE; i += 1000)
+    {
+        int n = (3 * BLOCK_SIZE - i < 1000) ? 3 * BLOCK_SIZE - i : 1000;
+        CHECK(fs_pwrite(writer, buf + i, n, i) == n);
+    }
+    CHECK(stat_value("Free Blocks") == base);
+    CHECK(listed_size("held") == 3 * BLOCK_SIZE);
+    CHECK(fs_pread(reader, out, sizeof(buf), 0) == 3 * BLOCK_SIZE);
+    CHECK(memcmp(out, buf, 3 * BLOCK_SIZE) == 0);
+
+    CHECK(fs_close(writer) != -1);
+    CHECK(fs_close(reader) != -1);
+    CHECK(stat_value("Free Blocks") == base - 3);
+    CHECK(fs_remove("/held") != -1);
+    CHECK(stat_value("Free Blocks") == base);
+}
+
+/**
+ * Interleaves reads and writes of two files through two descriptors each, against a copy kept in memory.
+ */
+static void test_interleaved(int flags)
+{
+    int fds[DESCRIPTORS];
+    off_t positions[DESCRIPTORS] = {0};
+    fds[0] = fs_open("/a", FS_O_CREATE);
+    fds[1] = fs_open("/b", FS_O_CREATE);
+    fds[2] = fs_open("/a", 0);
+    fds[3] = fs_open("/b", 0);
+    for (int d = 0; d < DESCRIPTORS; d++)
+    {
+        CHECK(fds[d] != -1);
+    }
+    memset(model, 0, sizeof(model));
+    memset(sizes, 0, sizeof(sizes));
+
+    srand(7);
+    for (int step = 0; step < 20000; step++)
+    {
+        int d = rand() % DESCRIPTORS;
+        int f = d % 2;
+        size_t count = (rand() % 10 == 0) ? (size_t)rand() % sizeof(buf) : (size_t)rand() % 700;
+        int choice = rand() % 100;
+        if (choice < 3)
+        {
+            positions[d] = rand() % (sizes[f] + 1);
+        }
+        if (positions[d] + count > MAX_SIZE)
+        {
+            positions[d] = 0;
+        }
+
+        if (choice < 8)
+        {
+            size_t expected = 0;
+            if ((size_t)positions[d] < sizes[f])
+            {
+                expected = (positions[d] + count > sizes[f]) ? sizes[f] - positions[d] : count;
+            }
+            CHECK(fs_pread(fds[d], out, count, positions[d]) == (int)expected);
+            CHECK(memcmp(out, model[f] + positions[d], expected) == 0);
+            continue;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            buf[i] = rand();
+        }
+        CHECK(fs_pwrite(fds[d], buf, count, positions[d]) == (int)count);
+        memcpy(model[f] + positions[d], buf, count);
+        if (positions[d] + count > sizes[f])
+        {
+            sizes[f] = positions[d] + count;
+        }
+        positions[d] += count;
+    }
+    for (int d = 0; d < DESCRIPTORS; d++)
+    {
+        CHECK(fs_close(fds[d]) != -1);
+    }
+
+    remount(IMAGE, NBLOCKS, flags);
+    for (int f = 0; f < 2; f++)
+    {
+        CHECK(fs_read(f ? "/b" : "/a", out, MAX_SIZE, 0) == (int)sizes[f]);
+        CHECK(memcmp(out, model[f], sizes[f]) == 0);
+    }
+    CHECK(fs_remove("/a") != -1);
+    CHECK(fs_remove("/b") != -1);
+}
+
+/**
+ * Runs the tests on a disk opened with the given flags.
+ */
+static void test_delalloc(int flags)
+{
+    test_held_back();
+    test_interleaved(flags);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_delalloc);
+
+    printf("PASSED\n");
+    return 0;
+}
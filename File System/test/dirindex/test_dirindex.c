@@ -0,0 +1,122 @@
+/**
+ * @file test_dirindex.c
+ * @author agent (agent@local)
+ * @brief Tests that a directory grown past what the linear format holds is indexed and keeps every entry.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_dirindex.img"
+#define NBLOCKS 8192
+#define FILES (3 * INODE_DIRECT_POINTERS * DIRECTORY_ENTRIES_PER_BLOCK)
+
+/**
+ * Returns the number of files fs_list prints for /big.
+ */
+static int listed_files()
+{
+    // fs_list prints to the standard output, which is sent to a temporary file while it runs.
+    FILE *capture = tmpfile();
+    CHECK(capture != NULL);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(capture), STDOUT_FILENO);
+    CHECK(fs_list("/big") != -1);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    rewind(capture);
+    char line[256];
+    int count = 0;
+    while (fgets(line, sizeof(line), capture) != NULL)
+    {
+        if (strncmp(line, "file-", 5) == 0)
+            count++;
+    }
+    fclose(capture);
+    return count;
+}
+
+/**
+ * Checks that the files whose number is a multiple of step, from first on, are there with their contents, and that
+ * the others are not.
+ */
+static void check_files(int first, int step)
+{
+    char path[64];
+    int out;
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/big/file-%d", i);
+        if (i >= first && (i - first) % step == 0)
+        {
+            CHECK(fs_read(path, &out, sizeof(out), 0) == sizeof(out));
+            CHECK(out == i);
+        }
+        else
+        {
+            CHECK(fs_read(path, &out, sizeof(out), 0) == -1);
+        }
+    }
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_dirindex(int flags)
+{
+    char path[64];
+    CHECK(fs_create("/big", 1) != -1);
+
+    // Three times as many entries as the blocks of a linear directory hold, so the index spreads over many leaves.
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/big/file-%d", i);
+        CHECK(fs_create(path, 0) != -1);
+        CHECK(fs_write(path, &i, sizeof(i), 0) == sizeof(i));
+    }
+    CHECK(fs_create("/big/file-7", 0) == -1);
+    CHECK(listed_files() == FILES);
+    check_files(0, 1);
+
+    // The index is read back from the disk, not from what the cache held.
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(listed_files() == FILES);
+    check_files(0, 1);
+
+    for (int i = 0; i < FILES; i += 2)
+    {
+        sprintf(path, "/big/file-%d", i);
+        CHECK(fs_remove(path) != -1);
+    }
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(listed_files() == FILES / 2);
+    check_files(1, 2);
+
+    // Names removed can be created again, in the leaves they hash to.
+    for (int i = 0; i < FILES; i += 2)
+    {
+        sprintf(path, "/big/file-%d", i);
+        CHECK(fs_create(path, 0) != -1);
+        CHECK(fs_write(path, &i, sizeof(i), 0) == sizeof(i));
+    }
+    remount(IMAGE, NBLOCKS, flags);
+    check_files(0, 1);
+
+    CHECK(fs_remove("/big") != -1);
+    CHECK(fs_read("/big/file-1", path, 1, 0) == -1);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_dirindex);
+
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,120 @@
+/**
+ * @file test_extent.c
+ * @author agent (agent@local)
+ * @brief Tests that files are mapped by extents: contiguous runs take no mapping blocks, holes take no blocks at all,
+ * and fragmented files grow an extent tree.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_extent.img"
+#define NBLOCKS 8192
+#define SEQUENTIAL_BLOCKS 1000
+#define FRAGMENTED_BLOCKS 1500
+
+static unsigned char model[2][FRAGMENTED_BLOCKS * BLOCK_SIZE];
+static unsigned char buf[SEQUENTIAL_BLOCKS * BLOCK_SIZE];
+static unsigned char out[SEQUENTIAL_BLOCKS * BLOCK_SIZE];
+
+/**
+ * Fills a buffer with bytes that depend on a seed.
+ */
+static void fill(unsigned char *data, size_t count, int seed)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        data[i] = (unsigned char)(i * 31 + seed);
+    }
+}
+
+/**
+ * Checks the two fragmented files against their copies in memory.
+ */
+static void check_fragmented()
+{
+    static unsigned char whole[FRAGMENTED_BLOCKS * BLOCK_SIZE];
+    for (int f = 0; f < 2; f++)
+    {
+        CHECK(fs_read(f ? "/b" : "/a", whole, sizeof(whole), 0) == sizeof(whole));
+        CHECK(memcmp(whole, model[f], sizeof(whole)) == 0);
+    }
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_extent(int flags)
+{
+    int base = stat_value("Free Blocks");
+
+    // A file written in one go is one run of blocks, mapped from the inode without any block of its own.
+    fill(buf, sizeof(buf), 1);
+    CHECK(fs_write("/seq", buf, sizeof(buf), 0) == sizeof(buf));
+    CHECK(stat_value("Free Blocks") == base - SEQUENTIAL_BLOCKS);
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(fs_read("/seq", out, sizeof(out), 0) == sizeof(out));
+    CHECK(memcmp(out, buf, sizeof(out)) == 0);
+    CHECK(fs_remove("/seq") != -1);
+    CHECK(stat_value("Free Blocks") == base);
+
+    // Holes take no blocks and read as zeros.
+    CHECK(fs_write("/sparse", buf, BLOCK_SIZE, (off_t)SEQUENTIAL_BLOCKS * BLOCK_SIZE) == BLOCK_SIZE);
+    CHECK(fs_write("/sparse", buf, 10, 3 * BLOCK_SIZE + 5) == 10);
+    CHECK(stat_value("Free Blocks") == base - 2);
+    CHECK(fs_read("/sparse", out, sizeof(out), 0) == (int)sizeof(out));
+    for (int i = 0; i < (int)sizeof(out); i++)
+    {
+        unsigned char expected = (i >= 3 * BLOCK_SIZE + 5 && i < 3 * BLOCK_SIZE + 15) ? buf[i - 3 * BLOCK_SIZE - 5] : 0;
+        CHECK(out[i] == expected);
+    }
+    CHECK(fs_read("/sparse", out, BLOCK_SIZE, (off_t)SEQUENTIAL_BLOCKS * BLOCK_SIZE) == BLOCK_SIZE);
+    CHECK(memcmp(out, buf, BLOCK_SIZE) == 0);
+    CHECK(fs_remove("/sparse") != -1);
+
+    // Two files written a block at a time in turn get a run per block, far more than the inode holds, so each grows
+    // an extent tree.
+    for (int i = 0; i < FRAGMENTED_BLOCKS; i++)
+    {
+        for (int f = 0; f < 2; f++)
+        {
+            unsigned char *block = model[f] + (size_t)i * BLOCK_SIZE;
+            fill(block, BLOCK_SIZE, i * 2 + f);
+            CHECK(fs_write(f ? "/b" : "/a", block, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE);
+        }
+    }
+    CHECK(stat_value("Free Blocks") < base - 2 * FRAGMENTED_BLOCKS);
+    check_fragmented();
+    remount(IMAGE, NBLOCKS, flags);
+    check_fragmented();
+
+    // Overwrites land in the blocks already mapped, anywhere in the tree.
+    int used = stat_value("Free Blocks");
+    srand(9);
+    for (int k = 0; k < 200; k++)
+    {
+        int f = rand() % 2;
+        size_t count = rand() % (3 * BLOCK_SIZE) + 1;
+        size_t offset = rand() % (sizeof(model[f]) - count);
+        fill(model[f] + offset, count, k);
+        CHECK(fs_write(f ? "/b" : "/a", model[f] + offset, count, offset) == (int)count);
+    }
+    CHECK(stat_value("Free Blocks") == used);
+    remount(IMAGE, NBLOCKS, flags);
+    check_fragmented();
+
+    CHECK(fs_remove("/a") != -1);
+    CHECK(fs_remove("/b") != -1);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_extent);
+
+    printf("PASSED\n");
+    return 0;
+}
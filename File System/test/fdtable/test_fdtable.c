@@ -0,0 +1,111 @@
+/**
+ * @file test_fdtable.c
+ * @author agent (agent@local)
+ * @brief Tests the descriptor table of fs_open: its limits, invalid descriptors and files read and written through
+ * several descriptors at once.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_fdtable.img"
+#define NBLOCKS 4096
+
+static char buf[3 * BLOCK_SIZE];
+static char out[3 * BLOCK_SIZE];
+
+/**
+ * Checks that a descriptor is not open.
+ */
+static void check_closed(int fd)
+{
+    CHECK(fs_pread(fd, out, 1, 0) == -1);
+    CHECK(fs_pwrite(fd, buf, 1, 0) == -1);
+    CHECK(fs_close(fd) == -1);
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_fdtable(int flags)
+{
+    char path[32];
+    int fds[FS_MAX_OPEN_FILES];
+
+    // Nothing is opened that is not a file, unless it is created.
+    CHECK(fs_open("/f0", 0) == -1);
+    CHECK(fs_create("/dir", 1) != -1);
+    CHECK(fs_open("/dir", 0) == -1);
+    CHECK(fs_open("/dir", FS_O_CREATE) == -1);
+    check_closed(-1);
+    check_closed(FS_MAX_OPEN_FILES);
+
+    // Every slot of the table can be used, and a closed one is used again.
+    for (int i = 0; i < FS_MAX_OPEN_FILES; i++)
+    {
+        sprintf(path, "/dir/f%d", i);
+        fds[i] = fs_open(path, FS_O_CREATE);
+        CHECK(fds[i] >= 0 && fds[i] < FS_MAX_OPEN_FILES);
+        for (int j = 0; j < i; j++)
+        {
+            CHECK(fds[j] != fds[i]);
+        }
+        sprintf(buf, "file %d", i);
+        CHECK(fs_pwrite(fds[i], buf, strlen(buf) + 1, 0) == (int)strlen(buf) + 1);
+    }
+    CHECK(fs_open("/dir/f0", 0) == -1);
+    CHECK(fs_close(fds[10]) != -1);
+    check_closed(fds[10]);
+    fds[10] = fs_open("/dir/f10", 0);
+    CHECK(fds[10] != -1);
+    for (int i = 0; i < FS_MAX_OPEN_FILES; i++)
+    {
+        sprintf(buf, "file %d", i);
+        CHECK(fs_pread(fds[i], out, sizeof(out), 0) == (int)strlen(buf) + 1);
+        CHECK(strcmp(out, buf) == 0);
+    }
+
+    // An open file stays, its directory with it.
+    CHECK(fs_remove("/dir/f3") == -1);
+    CHECK(fs_remove("/dir") == -1);
+    for (int i = 0; i < FS_MAX_OPEN_FILES; i++)
+    {
+        CHECK(fs_close(fds[i]) != -1);
+    }
+    CHECK(fs_remove("/dir/f3") != -1);
+
+    // Descriptors of one file see each other's writes, whether they are held back or not.
+    int a = fs_open("/shared", FS_O_CREATE);
+    int b = fs_open("/shared", 0);
+    CHECK(a != -1 && b != -1 && a != b);
+    memset(buf, 'a', sizeof(buf));
+    CHECK(fs_pwrite(a, buf, 100, 0) == 100);
+    CHECK(fs_pread(b, out, sizeof(out), 0) == 100);
+    CHECK(memcmp(out, buf, 100) == 0);
+    memset(buf, 'b', sizeof(buf));
+    CHECK(fs_pwrite(b, buf, sizeof(buf), 50) == sizeof(buf));
+    CHECK(fs_pread(a, out, sizeof(out), 0) == sizeof(out));
+    CHECK(memcmp(out, "aaaaaaaaaa", 10) == 0 && out[49] == 'a' && out[50] == 'b' && out[sizeof(out) - 1] == 'b');
+    CHECK(fs_close(a) != -1);
+    CHECK(fs_read("/shared", out, sizeof(out), 50) == sizeof(out));
+    CHECK(memcmp(out, buf, sizeof(out)) == 0);
+
+    // Unmounting closes every descriptor.
+    remount(IMAGE, NBLOCKS, flags);
+    check_closed(b);
+    CHECK(fs_read("/shared", out, 1, 50 + sizeof(buf) - 1) == 1 && out[0] == 'b');
+    CHECK(fs_remove("/shared") != -1);
+    CHECK(fs_remove("/dir") != -1);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_fdtable);
+
+    printf("PASSED\n");
+    return 0;
+}
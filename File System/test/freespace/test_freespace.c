@@ -0,0 +1,270 @@
+/**
+ * @file test_freespace.c
+ * @author agent (agent@local)
+ * @brief Tests the free-space index of the block allocator: allocations and frees checked against a bitmap kept next to
+ * it, and the index of a mounted file system against the one rebuilt from its bitmap.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "freespace.h"
+#include "test.h"
+
+#define IMAGE "build/test_freespace.img"
+#define NBLOCKS 4096
+#define BITS 10000
+#define FIRST 100
+#define WORDS ((BITS + 63) / 64)
+#define FILES 300
+
+static uint64_t words[WORDS];
+
+/**
+ * Returns non-zero if a block is in use in the bitmap.
+ */
+static int in_use(uint32_t block)
+{
+    return (words[block / 64] >> (block % 64)) & 1;
+}
+
+/**
+ * Marks a run of blocks in use or free in the bitmap.
+ */
+static void mark(uint32_t start, uint32_t length, int used)
+{
+    for (uint32_t block = start; block < start + length; block++)
+    {
+        if (used)
+            words[block / 64] |= (uint64_t)1 << (block % 64);
+        else
+            words[block / 64] &= ~((uint64_t)1 << (block % 64));
+    }
+}
+
+/**
+ * Returns the length of the free run of the bitmap starting at a block.
+ */
+static uint32_t run_length(uint32_t start)
+{
+    uint32_t end = start;
+    while (end < BITS && !in_use(end))
+    {
+        end++;
+    }
+    return end - start;
+}
+
+/**
+ * Checks that an index holds as many free blocks and extents as the bitmap, from FIRST on.
+ */
+static void check_counts(const struct freespace *space)
+{
+    uint32_t blocks = 0, extents = 0;
+    for (uint32_t block = FIRST; block < BITS;)
+    {
+        uint32_t length = run_length(block);
+        if (length > 0)
+        {
+            blocks += length;
+            extents++;
+            block += length;
+        }
+        else
+            block++;
+    }
+    CHECK(space->blocks == blocks);
+    CHECK(space->extents == extents);
+}
+
+/**
+ * Finds where the bitmap says a run should be allocated: at the goal if it is free, else at the first free run long
+ * enough at or after the goal, else at the first one long enough from the start, else at a longest one.
+ */
+static uint32_t expected_start(uint32_t goal, uint32_t count, uint32_t *longest)
+{
+    if (goal >= FIRST && goal < BITS && !in_use(goal))
+        return goal;
+
+    uint32_t before = (uint32_t)-1;
+    *longest = 0;
+    for (uint32_t block = FIRST; block < BITS;)
+    {
+        uint32_t length = run_length(block);
+        if (length == 0)
+        {
+            block++;
+            continue;
+        }
+        if (length >= count && block >= goal)
+            return block;
+        if (length >= count && before == (uint32_t)-1)
+            before = block;
+        if (length > *longest)
+            *longest = length;
+        block += length;
+    }
+    return before;
+}
+
+/**
+ * Checks allocations and frees against the bitmap, then an index rebuilt from the bitmap.
+ */
+static void test_index()
+{
+    struct freespace space;
+    memset(&space, 0, sizeof(space));
+
+    // Build from a bitmap with runs of every length, including blocks before FIRST, which are never handed out.
+    srand(19);
+    memset(words, 0, sizeof(words));
+    for (uint32_t block = 0; block < BITS;)
+    {
+        uint32_t length = 1 + rand() % 40;
+        if (block + length > BITS)
+            length = BITS - block;
+        mark(block, length, rand() % 2);
+        block += length;
+    }
+    CHECK(freespace_build(&space, words, FIRST, BITS) == 0);
+    check_counts(&space);
+
+    // Allocations follow the goal, or the first run long enough, and frees merge with their neighbours.
+    uint32_t starts[64], lengths[64];
+    int held = 0;
+    for (int i = 0; i < 4000; i++)
+    {
+        if (held < 64 && (held == 0 || rand() % 3 != 0))
+        {
+            uint32_t goal = rand() % BITS;
+            uint32_t count = 1 + rand() % 24;
+            uint32_t longest, length;
+            uint32_t expected = expected_start(goal, count, &longest);
+            uint32_t start = freespace_allocate(&space, goal, count, &length);
+            CHECK(start != (uint32_t)-1 && start >= FIRST && start + length <= BITS);
+            if (expected == (uint32_t)-1)
+            {
+                // No run is long enough, a longest one is taken whole.
+                CHECK(length == longest);
+                CHECK(run_length(start) == longest);
+            }
+            else
+            {
+                CHECK(start == expected);
+                CHECK(length == (run_length(start) < count ? run_length(start) : count));
+            }
+            for (uint32_t block = start; block < start + length; block++)
+            {
+                CHECK(!in_use(block));
+            }
+            mark(start, length, 1);
+            starts[held] = start;
+            lengths[held++] = length;
+        }
+        else
+        {
+            int victim = rand() % held;
+            CHECK(freespace_free(&space, starts[victim], lengths[victim]) == 0);
+            mark(starts[victim], lengths[victim], 0);
+            starts[victim] = starts[--held];
+            lengths[victim] = lengths[held];
+        }
+        check_counts(&space);
+    }
+
+    // A rebuilt index hands out the same runs as the one that was kept up to date.
+    struct freespace rebuilt;
+    memset(&rebuilt, 0, sizeof(rebuilt));
+    CHECK(freespace_build(&rebuilt, words, FIRST, BITS) == 0);
+    check_counts(&rebuilt);
+    for (uint32_t goal = 0; goal < BITS; goal += 97)
+    {
+        uint32_t length, rebuilt_length;
+        uint32_t start = freespace_allocate(&space, goal, 8, &length);
+        CHECK(freespace_allocate(&rebuilt, goal, 8, &rebuilt_length) == start);
+        CHECK(rebuilt_length == length);
+        if (start != (uint32_t)-1)
+            mark(start, length, 1);
+    }
+    check_counts(&space);
+    check_counts(&rebuilt);
+
+    // Everything freed is one extent again.
+    for (int i = 0; i < held; i++)
+    {
+        mark(starts[i], lengths[i], 0);
+    }
+    freespace_release(&rebuilt);
+    CHECK(rebuilt.root == NULL && rebuilt.blocks == 0 && rebuilt.extents == 0);
+    mark(FIRST, BITS - FIRST, 0);
+    CHECK(freespace_build(&space, words, FIRST, BITS) == 0);
+    CHECK(space.extents == 1 && space.blocks == BITS - FIRST);
+    uint32_t length;
+    CHECK(freespace_allocate(&space, 0, BITS, &length) == FIRST && length == BITS - FIRST);
+    CHECK(space.extents == 0 && space.blocks == 0);
+    CHECK(freespace_allocate(&space, 0, 1, &length) == (uint32_t)-1 && length == 0);
+    freespace_release(&space);
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_freespace(int flags)
+{
+    char path[32];
+    char buf[3 * BLOCK_SIZE];
+    memset(buf, 'f', sizeof(buf));
+
+    // Files of one to three blocks, every other one removed, leave the free space in pieces.
+    int free_blocks = stat_value("Free Blocks");
+    int free_extents = stat_value("Free Extents");
+    CHECK(fs_create("/d", 1) != -1);
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/d/f%d", i);
+        CHECK(fs_write(path, buf, (size_t)(1 + i % 3) * BLOCK_SIZE, 0) == (1 + i % 3) * BLOCK_SIZE);
+    }
+    for (int i = 0; i < FILES; i += 2)
+    {
+        sprintf(path, "/d/f%d", i);
+        CHECK(fs_remove(path) != -1);
+    }
+    int fragmented_blocks = stat_value("Free Blocks");
+    int fragmented_extents = stat_value("Free Extents");
+    CHECK(fragmented_blocks < free_blocks);
+    CHECK(fragmented_extents > free_extents);
+
+    // The index rebuilt from the bitmap when mounting matches the one kept up to date.
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(stat_value("Free Blocks") == fragmented_blocks);
+    CHECK(stat_value("Free Extents") == fragmented_extents);
+
+    // A file too long for the holes does not take them, and removing everything merges the extents back.
+    char *large = malloc(64 * BLOCK_SIZE);
+    CHECK(large != NULL);
+    memset(large, 'l', 64 * BLOCK_SIZE);
+    CHECK(fs_write("/d/large", large, 64 * BLOCK_SIZE, 0) == 64 * BLOCK_SIZE);
+    free(large);
+    CHECK(stat_value("Free Extents") == fragmented_extents);
+    CHECK(fs_remove("/d/large") != -1);
+    for (int i = 1; i < FILES; i += 2)
+    {
+        sprintf(path, "/d/f%d", i);
+        CHECK(fs_remove(path) != -1);
+    }
+    CHECK(fs_remove("/d") != -1);
+    CHECK(stat_value("Free Blocks") == free_blocks);
+    CHECK(stat_value("Free Extents") == free_extents);
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(stat_value("Free Extents") == free_extents);
+}
+
+int main()
+{
+    test_index();
+    run_on_backends(IMAGE, NBLOCKS, 0, test_freespace);
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,180 @@
+/**
+ * @file test_groups.c
+ * @author agent (agent@local)
+ * @brief Tests the layout of a disk in block groups: directories spread over the groups, files kept in the group of
+ * their directory, and the groups read back when mounting.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_groups.img"
+#define GROUPS 4
+#define NBLOCKS (3 * BLOCKS_PER_GROUP + 2000)
+#define FILES 20
+#define FILE_BLOCKS 5
+
+static char buf[FILE_BLOCKS * BLOCK_SIZE];
+static char out[FILE_BLOCKS * BLOCK_SIZE];
+static uint8_t bitmap[BLOCK_SIZE];
+
+/**
+ * Counts the bits set in the bitmap block of each group at the given offset from the start of the group. The file
+ * system must not be mounted, so the bitmaps on the disk are up to date.
+ */
+static void count_bits(uint32_t offset, int *counts)
+{
+    for (int g = 0; g < GROUPS; g++)
+    {
+        CHECK(disk_read(g * BLOCKS_PER_GROUP + offset, bitmap) != -1);
+        counts[g] = 0;
+        for (int i = 0; i < BLOCK_SIZE; i++)
+        {
+            counts[g] += __builtin_popcount(bitmap[i]);
+        }
+    }
+}
+
+/**
+ * Fills a buffer with the contents expected in a file.
+ */
+static void fill_file(char *file, int directory, int index)
+{
+    for (int i = 0; i < FILE_BLOCKS * BLOCK_SIZE; i++)
+    {
+        file[i] = (char)(directory * 17 + index * 5 + i);
+    }
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_groups(int flags)
+{
+    char path[32];
+    int blocks[GROUPS], inodes[GROUPS];
+    int used_blocks[GROUPS], used_inodes[GROUPS];
+
+    remove(IMAGE);
+    CHECK(disk_open(IMAGE, NBLOCKS, flags) != -1);
+    CHECK(fs_format(0) != -1);
+    CHECK(fs_mount() != -1);
+    fs_unmount();
+    count_bits(1, blocks);
+    count_bits(2, inodes);
+    CHECK(fs_mount() != -1);
+    CHECK(stat_value("Block Groups") == GROUPS);
+    CHECK(stat_value("Blocks") == NBLOCKS);
+    int free_blocks = stat_value("Free Blocks");
+    int free_inodes = stat_value("Free Inodes");
+
+    // Every directory goes to a group of its own, and its files with it.
+    for (int d = 0; d < GROUPS; d++)
+    {
+        sprintf(path, "/d%d", d);
+        CHECK(fs_create(path, 1) != -1);
+        for (int i = 0; i < FILES; i++)
+        {
+            sprintf(path, "/d%d/f%d", d, i);
+            fill_file(buf, d, i);
+            CHECK(fs_write(path, buf, sizeof(buf), 0) == (int)sizeof(buf));
+        }
+    }
+    CHECK(stat_value("Free Inodes") == free_inodes - GROUPS * (FILES + 1));
+    int written_blocks = stat_value("Free Blocks");
+    CHECK(written_blocks <= free_blocks - GROUPS * FILES * FILE_BLOCKS);
+
+    fs_unmount();
+    count_bits(1, used_blocks);
+    count_bits(2, used_inodes);
+    for (int g = 0; g < GROUPS; g++)
+    {
+        CHECK(used_inodes[g] - inodes[g] == FILES + 1);
+        CHECK(used_blocks[g] - blocks[g] >= FILES * FILE_BLOCKS);
+        CHECK(used_blocks[g] - blocks[g] == used_blocks[0] - blocks[0]);
+    }
+
+    // The groups are read back when mounting.
+    remount(IMAGE, NBLOCKS, flags);
+    CHECK(stat_value("Block Groups") == GROUPS);
+    CHECK(stat_value("Free Blocks") == written_blocks);
+    CHECK(stat_value("Free Inodes") == free_inodes - GROUPS * (FILES + 1));
+    for (int d = 0; d < GROUPS; d++)
+    {
+        for (int i = 0; i < FILES; i++)
+        {
+            sprintf(path, "/d%d/f%d", d, i);
+            fill_file(buf, d, i);
+            CHECK(fs_read(path, out, sizeof(out), 0) == (int)sizeof(out));
+            CHECK(memcmp(out, buf, sizeof(out)) == 0);
+        }
+    }
+
+    // A file larger than the free space of its group carries on in the next ones.
+    int free_before = stat_value("Free Blocks");
+    int large_blocks = BLOCKS_PER_GROUP + 1000;
+    CHECK(fs_create("/large", 0) != -1);
+    int fd = fs_open("/large", 0);
+    CHECK(fd != -1);
+    for (int i = 0; i < large_blocks; i += FILE_BLOCKS)
+    {
+        fill_file(buf, GROUPS, i);
+        CHECK(fs_pwrite(fd, buf, sizeof(buf), (off_t)i * BLOCK_SIZE) == (int)sizeof(buf));
+    }
+    CHECK(fs_close(fd) != -1);
+    CHECK(stat_value("Free Blocks") <= free_before - large_blocks);
+    remount(IMAGE, NBLOCKS, flags);
+    for (int i = 0; i < large_blocks; i += 997)
+    {
+        fill_file(buf, GROUPS, i - i % FILE_BLOCKS);
+        CHECK(fs_read("/large", out, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE);
+        CHECK(memcmp(out, buf + (i % FILE_BLOCKS) * BLOCK_SIZE, BLOCK_SIZE) == 0);
+    }
+
+    // Everything removed, every group is as it was.
+    CHECK(fs_remove("/large") != -1);
+    for (int d = 0; d < GROUPS; d++)
+    {
+        for (int i = 0; i < FILES; i++)
+        {
+            sprintf(path, "/d%d/f%d", d, i);
+            CHECK(fs_remove(path) != -1);
+        }
+        sprintf(path, "/d%d", d);
+        CHECK(fs_remove(path) != -1);
+    }
+    CHECK(stat_value("Free Blocks") == free_blocks);
+    CHECK(stat_value("Free Inodes") == free_inodes);
+    fs_unmount();
+    count_bits(1, used_blocks);
+    count_bits(2, used_inodes);
+    for (int g = 0; g < GROUPS; g++)
+    {
+        CHECK(used_blocks[g] == blocks[g]);
+        CHECK(used_inodes[g] == inodes[g]);
+    }
+    disk_close();
+    remove(IMAGE);
+}
+
+int main()
+{
+    // A disk of less than a group has one.
+    remove(IMAGE);
+    CHECK(disk_open(IMAGE, 4096, 0) != -1);
+    CHECK(fs_format(0) != -1);
+    CHECK(fs_mount() != -1);
+    CHECK(stat_value("Block Groups") == 1);
+    fs_unmount();
+    disk_close();
+
+    // Larger disks are created as sparse files, only what is written takes room.
+    test_groups(DISK_SPARSE);
+    test_groups(DISK_SPARSE | DISK_MMAP);
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,124 @@
+/**
+ * @file test_indirect.c
+ * @author agent (agent@local)
+ * @brief Tests files mapped by block pointers through their single and double indirect blocks.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * Files are only mapped by pointers on disks from before extents, so the test turns a new, empty file into one by
+ * clearing the flags of its inode on the disk.
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_indirect.img"
+#define NBLOCKS 8192
+#define POINTERS INODE_INDIRECT_POINTERS_PER_BLOCK
+#define DOUBLE_START (INODE_DIRECT_POINTERS + POINTERS) // the first block mapped through the double indirect block
+#define FILE_BLOCKS (DOUBLE_START + 3 * POINTERS)
+
+static unsigned char model[FILE_BLOCKS * BLOCK_SIZE];
+static unsigned char out[FILE_BLOCKS * BLOCK_SIZE];
+
+/**
+ * Writes bytes to the file and to its copy in memory.
+ */
+static void put(size_t count, off_t offset, int seed)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        model[offset + i] = (unsigned char)(i * 13 + seed);
+    }
+    CHECK(fs_write("/legacy", model + offset, count, offset) == (int)count);
+}
+
+/**
+ * Checks the file against its copy in memory, up to the given size.
+ */
+static void check_file(size_t size)
+{
+    CHECK(fs_read("/legacy", out, sizeof(out), 0) == (int)size);
+    CHECK(memcmp(out, model, size) == 0);
+}
+
+/**
+ * Creates an empty file /legacy mapped by block pointers, with the file system unmounted and mounted again.
+ */
+static void create_legacy_file(int flags)
+{
+    CHECK(fs_create("/legacy", 0) != -1);
+    fs_unmount();
+    disk_close();
+    CHECK(disk_open(IMAGE, NBLOCKS, flags) != -1);
+
+    // The root directory is inode 0 and starts with its first direct block.
+    union block superblock, block;
+    CHECK(disk_read(0, &superblock) != -1);
+    CHECK(disk_read(superblock.superblock.s_inode_table_block_start, &block) != -1);
+    CHECK(disk_read(block.inodes[0].i_direct_pointers[0], &block) != -1);
+    uint32_t inode_number = 0;
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    {
+        if (block.directory_block.entries[i].inode_number != 0 &&
+            strcmp(block.directory_block.entries[i].name, "legacy") == 0)
+            inode_number = block.directory_block.entries[i].inode_number;
+    }
+    CHECK(inode_number != 0);
+
+    uint32_t table_block = superblock.superblock.s_inode_table_block_start + inode_number / INODES_PER_BLOCK;
+    CHECK(disk_read(table_block, &block) != -1);
+    struct inode *inode = &block.inodes[inode_number % INODES_PER_BLOCK];
+    CHECK(inode->i_size == 0 && inode->i_flags == INODE_FLAG_INLINE);
+    inode->i_flags = 0;
+    CHECK(disk_write(table_block, &block) != -1);
+    CHECK(fs_mount() != -1);
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_indirect(int flags)
+{
+    memset(model, 0, sizeof(model));
+    create_legacy_file(flags);
+    int base = stat_value("Free Blocks");
+
+    // One write from the direct blocks across both indirect boundaries loads and writes each indirect block once.
+    size_t size = (size_t)(DOUBLE_START + 10) * BLOCK_SIZE;
+    put(size, 0, 1);
+    CHECK(stat_value("Free Blocks") == base - (int)(DOUBLE_START + 10) - 3);
+    check_file(size);
+
+    // Far past the boundary, in the third block of pointers, with a hole before it.
+    put(100, (off_t)(FILE_BLOCKS - 1) * BLOCK_SIZE + 7, 2);
+    size = (size_t)(FILE_BLOCKS - 1) * BLOCK_SIZE + 107;
+    CHECK(stat_value("Free Blocks") == base - (int)(DOUBLE_START + 10) - 3 - 2);
+    check_file(size);
+
+    // Writes straddling the boundaries, at unaligned offsets.
+    put(3 * BLOCK_SIZE, (off_t)(INODE_DIRECT_POINTERS - 1) * BLOCK_SIZE + 100, 3);
+    put(3 * BLOCK_SIZE, (off_t)(DOUBLE_START - 1) * BLOCK_SIZE + 2000, 4);
+    put(2 * BLOCK_SIZE, (off_t)(DOUBLE_START + POINTERS - 1) * BLOCK_SIZE + 5, 5);
+    srand(10);
+    for (int k = 0; k < 100; k++)
+    {
+        size_t count = rand() % (2 * BLOCK_SIZE) + 1;
+        put(count, rand() % (size - count), k);
+    }
+    check_file(size);
+
+    remount(IMAGE, NBLOCKS, flags);
+    check_file(size);
+    CHECK(fs_remove("/legacy") != -1);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_indirect);
+
+    printf("PASSED\n");
+    return 0;
+}
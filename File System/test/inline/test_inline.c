@@ -0,0 +1,108 @@
+/**
+ * @file test_inline.c
+ * @author agent (agent@local)
+ * @brief Tests that small files live in their inode and move to a block when they outgrow it.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "test.h"
+
+#define IMAGE "build/test_inline.img"
+#define NBLOCKS 4096
+#define FILES 100
+
+static unsigned char expected[FILES][200];
+static int sizes[FILES];
+
+/**
+ * Writes bytes to a file and to its copy in memory.
+ */
+static void put(int i, const void *data, int count, int offset)
+{
+    char path[32];
+    sprintf(path, "/f%d", i);
+    CHECK(fs_write(path, (void *)data, count, offset) == count);
+    memcpy(expected[i] + offset, data, count);
+    if (offset + count > sizes[i])
+    {
+        sizes[i] = offset + count;
+    }
+}
+
+/**
+ * Checks every file against its copy in memory.
+ */
+static void check_files()
+{
+    char path[32];
+    unsigned char out[200];
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/f%d", i);
+        CHECK(fs_read(path, out, sizeof(out), 0) == sizes[i]);
+        CHECK(memcmp(out, expected[i], sizes[i]) == 0);
+    }
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_inline(int flags)
+{
+    char path[32];
+    unsigned char data[INODE_INLINE_SIZE];
+    memset(expected, 0, sizeof(expected));
+    memset(sizes, 0, sizeof(sizes));
+
+    // Files of up to INODE_INLINE_SIZE bytes take no data block.
+    int base = stat_value("Free Blocks");
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/f%d", i);
+        CHECK(fs_create(path, 0) != -1);
+        int count = i % (INODE_INLINE_SIZE + 1);
+        for (int j = 0; j < count; j++)
+        {
+            data[j] = 'a' + (i + j) % 26;
+        }
+        if (count > 0)
+        {
+            put(i, data, count, 0);
+        }
+    }
+    CHECK(stat_value("Free Blocks") == base);
+
+    // A write past the end that still fits leaves a hole of zeros in the inode.
+    put(5, "XYZ", 3, 40);
+    CHECK(stat_value("Free Blocks") == base);
+
+    // Growing past the inode moves the bytes to a block.
+    put(7, "0123456789", 10, INODE_INLINE_SIZE - 2);
+    CHECK(stat_value("Free Blocks") == base - 1);
+    check_files();
+
+    remount(IMAGE, NBLOCKS, flags);
+    check_files();
+    put(7, "abc", 3, 0);
+    remount(IMAGE, NBLOCKS, flags);
+    check_files();
+
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/f%d", i);
+        CHECK(fs_remove(path) != -1);
+    }
+    CHECK(stat_value("Free Blocks") == base);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_inline);
+
+    printf("PASSED\n");
+    return 0;
+}
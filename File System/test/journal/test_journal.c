@@ -0,0 +1,139 @@
+/**
+ * @file test_journal.c
+ * @author agent (agent@local)
+ * @brief Tests that a file system killed mid-work comes back from the journal with exactly its committed operations.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "journal.h"
+#include "test.h"
+
+#define IMAGE "build/test_journal.img"
+#define NBLOCKS 4096
+#define FILES 100
+
+static char data[20000];
+
+/**
+ * Returns the size written to the i-th file.
+ */
+static int file_size(int i)
+{
+    return 5000 + i * 100;
+}
+
+/**
+ * Creates the files and removes every third one, commits, starts one more operation and kills the process.
+ */
+static void crash()
+{
+    char path[64];
+    CHECK(disk_open(IMAGE, NBLOCKS, 0) != -1);
+    CHECK(fs_mount() != -1);
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/dir%d/f%d", i % 7, i);
+        CHECK(fs_create(path, 0) != -1);
+        CHECK(fs_write(path, data, file_size(i), 0) == file_size(i));
+    }
+    for (int i = 0; i < FILES; i += 3)
+    {
+        sprintf(path, "/dir%d/f%d", i % 7, i);
+        CHECK(fs_remove(path) != -1);
+    }
+    CHECK(journal_commit() != -1);
+
+    CHECK(fs_create("/uncommitted", 0) != -1);
+    CHECK(fs_write("/uncommitted", data, sizeof(data), 0) == sizeof(data));
+    fflush(stdout);
+    raise(SIGKILL);
+}
+
+/**
+ * Runs the test on a disk formatted with the given fs_format flags.
+ */
+static void test_replay(int format_flags)
+{
+    char path[64];
+    static char out[sizeof(data)];
+
+    CHECK(disk_open(IMAGE, NBLOCKS, 0) != -1);
+    CHECK(fs_format(format_flags) != -1);
+    CHECK(fs_mount() != -1);
+    int base = stat_value("Free Blocks");
+    fs_unmount();
+    disk_close();
+
+    fflush(stdout);
+    pid_t child = fork();
+    CHECK(child != -1);
+    if (child == 0)
+    {
+        crash();
+    }
+    int status;
+    CHECK(waitpid(child, &status, 0) == child);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+    // Mounting replays the committed transactions and drops the rest.
+    CHECK(disk_open(IMAGE, NBLOCKS, 0) != -1);
+    CHECK(fs_mount() != -1);
+    for (int i = 0; i < FILES; i++)
+    {
+        sprintf(path, "/dir%d/f%d", i % 7, i);
+        int n = fs_read(path, out, sizeof(out), 0);
+        if (i % 3 == 0)
+        {
+            CHECK(n == -1);
+            continue;
+        }
+        CHECK(n == file_size(i));
+        CHECK(memcmp(out, data, n) == 0);
+    }
+    CHECK(fs_read("/uncommitted", out, sizeof(out), 0) == -1);
+    CHECK(stat_value("Checksum Failures") <= 0);
+
+    // The bitmaps came back with the files: removing them all frees every block they held.
+    for (int d = 0; d < 7; d++)
+    {
+        sprintf(path, "/dir%d", d);
+        CHECK(fs_remove(path) != -1);
+    }
+    remount(IMAGE, NBLOCKS, 0);
+    CHECK(stat_value("Free Blocks") == base);
+    fs_unmount();
+    disk_close();
+
+    // The kernel could write a mapped block back before its transaction commits, so the journal is never used mapped.
+    CHECK(disk_open(IMAGE, NBLOCKS, DISK_MMAP) != -1);
+    CHECK(fs_mount() == -1);
+    CHECK(fs_format(format_flags) != -1);
+    CHECK(fs_mount() != -1);
+    CHECK(stat_value("Journal Blocks") == 0);
+    fs_unmount();
+    disk_close();
+}
+
+int main()
+{
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (char)(i * 7);
+    }
+
+    remove(IMAGE);
+    test_replay(0);
+    remove(IMAGE);
+    test_replay(FS_FORMAT_CHECKSUMS);
+    remove(IMAGE);
+
+    printf("PASSED\n");
+    return 0;
+}
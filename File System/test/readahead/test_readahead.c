@@ -0,0 +1,140 @@
+/**
+ * @file test_readahead.c
+ * @author agent (agent@local)
+ * @brief Tests the read-ahead of files read sequentially through a descriptor: the data read, reads that stop being
+ * sequential and files written while windows are read ahead.
+ * @version 0.1
+ * @date 2026-10-18
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+
+#include "cache.h"
+#include "test.h"
+
+#define IMAGE "build/test_readahead.img"
+#define NBLOCKS 8192
+#define FILE_BLOCKS 1024
+
+static char buf[BLOCK_SIZE];
+static char out[BLOCK_SIZE];
+
+/**
+ * Fills a buffer with the contents expected in a block of the file, tagged with a generation.
+ */
+static void fill_block(char *block, int index, int generation)
+{
+    for (int i = 0; i < BLOCK_SIZE; i++)
+    {
+        block[i] = (char)(index * 7 + i + generation * 13);
+    }
+}
+
+/**
+ * Reads a block of the file through a descriptor and checks its contents.
+ */
+static void check_block(int fd, int index, int generation)
+{
+    fill_block(buf, index, generation);
+    CHECK(fs_pread(fd, out, BLOCK_SIZE, (off_t)index * BLOCK_SIZE) == BLOCK_SIZE);
+    CHECK(memcmp(out, buf, BLOCK_SIZE) == 0);
+}
+
+/**
+ * Runs the test on a disk opened with the given flags.
+ */
+static void test_readahead(int flags)
+{
+    CHECK(fs_create("/d", 1) != -1);
+    int fd = fs_open("/d/seq", FS_O_CREATE);
+    CHECK(fd != -1);
+    for (int i = 0; i < FILE_BLOCKS; i++)
+    {
+        fill_block(buf, i, 0);
+        CHECK(fs_pwrite(fd, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    CHECK(fs_close(fd) != -1);
+    remount(IMAGE, NBLOCKS, flags);
+
+    // A sequential read sees every block, and with the pread backend most of them come from the windows read ahead
+    // rather than through the cache.
+    fd = fs_open("/d/seq", 0);
+    CHECK(fd != -1);
+    int misses = cache_misses();
+    for (int i = 0; i < FILE_BLOCKS; i++)
+    {
+        check_block(fd, i, 0);
+    }
+    if (!(flags & DISK_MMAP))
+        CHECK(cache_misses() - misses < FILE_BLOCKS / 4);
+
+    // Reads in small pieces that end in the middle of a block still count as sequential.
+    for (off_t offset = 0; offset < 64 * BLOCK_SIZE; offset += 1000)
+    {
+        fill_block(buf, (int)(offset / BLOCK_SIZE), 0);
+        size_t length = BLOCK_SIZE - offset % BLOCK_SIZE < 1000 ? BLOCK_SIZE - offset % BLOCK_SIZE : 1000;
+        CHECK(fs_pread(fd, out, length, offset) == (int)length);
+        CHECK(memcmp(out, buf + offset % BLOCK_SIZE, length) == 0);
+    }
+
+    // Reads that jump around drop the windows and still see the right data.
+    for (int i = 0; i < 200; i++)
+    {
+        check_block(fd, (i * 389) % FILE_BLOCKS, 0);
+    }
+    for (int i = FILE_BLOCKS - 1; i >= FILE_BLOCKS - 100; i--)
+    {
+        check_block(fd, i, 0);
+    }
+
+    // Blocks written while they are read ahead are read again, whether written through the reading descriptor or
+    // another one.
+    int writer = fs_open("/d/seq", 0);
+    CHECK(writer != -1);
+    for (int i = 0; i < 300; i++)
+    {
+        check_block(fd, i, 0);
+    }
+    for (int i = 300; i < 400; i++)
+    {
+        fill_block(buf, i, 1);
+        CHECK(fs_pwrite(writer, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    for (int i = 300; i < 500; i++)
+    {
+        check_block(fd, i, i < 400 ? 1 : 0);
+    }
+    for (int i = 500; i < 600; i++)
+    {
+        fill_block(buf, i, 1);
+        CHECK(fs_pwrite(fd, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE) == BLOCK_SIZE);
+        check_block(fd, i, 1);
+    }
+    CHECK(fs_close(writer) != -1);
+
+    // A read past the end of the file returns what is left of it.
+    CHECK(fs_pread(fd, out, BLOCK_SIZE, (off_t)FILE_BLOCKS * BLOCK_SIZE - 10) == 10);
+    CHECK(fs_pread(fd, out, BLOCK_SIZE, (off_t)FILE_BLOCKS * BLOCK_SIZE) == 0);
+    CHECK(fs_close(fd) != -1);
+
+    // The data written is on the disk.
+    remount(IMAGE, NBLOCKS, flags);
+    fd = fs_open("/d/seq", 0);
+    CHECK(fd != -1);
+    for (int i = 0; i < FILE_BLOCKS; i++)
+    {
+        check_block(fd, i, i >= 300 && i < 400 ? 1 : i >= 500 && i < 600 ? 1 : 0);
+    }
+    CHECK(fs_close(fd) != -1);
+
+    CHECK(fs_remove("/d/seq") != -1);
+    CHECK(fs_remove("/d") != -1);
+}
+
+int main()
+{
+    run_on_backends(IMAGE, NBLOCKS, 0, test_readahead);
+    printf("PASSED\n");
+    return 0;
+}
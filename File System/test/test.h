@@ -0,0 +1,115 @@
+/**
+ * @file test.h
+ * @brief This header file contains the helpers shared by the file system tests.
+ *
+ * Every test is a program of its own, test/<name>/test_<name>.c, run by `make test` from the project directory. It
+ * works on a disk image of its own under build/, usually once per backend through run_on_backends(), and exits with 0
+ * when every check passed. A failed check prints where it failed and exits with 1.
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+
+/**
+ * @brief Fails the test if a condition does not hold.
+ */
+#define CHECK(condition)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(condition))                                                                                              \
+        {                                                                                                              \
+            printf("FAILED: %s:%d: %s\n", __FILE__, __LINE__, #condition);                                           \
+            exit(1);                                                                                                   \
+        }                                                                                                              \
+    } while (0)
+
+/**
+ * @brief Returns a value printed by fs_stat, e.g. stat_value("Free Blocks").
+ *
+ * @param key The name of the value, as fs_stat prints it.
+ * @return int The value, or -1 if fs_stat did not print it.
+ */
+static inline int stat_value(const char *key)
+{
+    // fs_stat prints to the standard output, which is sent to a temporary file while it runs.
+    FILE *capture = tmpfile();
+    CHECK(capture != NULL);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(capture), STDOUT_FILENO);
+    fs_stat();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    rewind(capture);
+    char line[256];
+    size_t length = strlen(key);
+    int value = -1;
+    while (fgets(line, sizeof(line), capture) != NULL)
+    {
+        char *name = line + strspn(line, " ");
+        if (strncmp(name, key, length) == 0 && name[length] == ':')
+            value = atoi(name + length + 1);
+    }
+    fclose(capture);
+    return value;
+}
+
+/**
+ * @brief Unmounts the file system and mounts it again from the disk image, dropping everything held in memory.
+ *
+ * @param image The disk image.
+ * @param nblocks The number of blocks of the disk.
+ * @param flags The disk_open flags.
+ */
+static inline void remount(char *image, int nblocks, int flags)
+{
+    fs_unmount();
+    disk_close();
+    CHECK(disk_open(image, nblocks, flags) != -1);
+    CHECK(fs_mount() != -1);
+}
+
+/**
+ * @brief Runs a test on a freshly formatted disk with each backend, pread/pwrite first and then mmap.
+ *
+ * Once the test returns, the file system is mounted again and must have as many free blocks as it started with and
+ * none shared, so a test removes what it created.
+ *
+ * @param image The disk image, created anew for each backend and removed at the end.
+ * @param nblocks The number of blocks of the disk.
+ * @param format_flags The fs_format flags.
+ * @param test The test, given the disk_open flags of the backend (for remount()).
+ */
+static inline void run_on_backends(char *image, int nblocks, int format_flags, void (*test)(int flags))
+{
+    int backends[] = {0, DISK_MMAP};
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    {
+        remove(image);
+        CHECK(disk_open(image, nblocks, backends[i]) != -1);
+        CHECK(fs_format(format_flags) != -1);
+        CHECK(fs_mount() != -1);
+        int free_blocks = stat_value("Free Blocks");
+
+        test(backends[i]);
+
+        remount(image, nblocks, backends[i]);
+        CHECK(stat_value("Free Blocks") == free_blocks);
+        CHECK(stat_value("Shared Blocks") == 0);
+        fs_unmount();
+        disk_close();
+    }
+    remove(image);
+}
+
+#endif